@@ -0,0 +1,205 @@
+#include "balloon.h"
+
+/**
+ * Construct a new balloon device and start listening for control connections.
+ * @param bus The bus.
+ * @param plic The interrupt controller.
+ * @param ram The RAM whose pages are given back to the host.
+ * @param io The I/O thread serving the control socket.
+ * @param control_path The path of the Unix control socket, replaced if it exists.
+ * @param irq The PLIC interrupt source of the device.
+ * @param base The base address of the device.
+ * @param size The size of the device.
+ */
+VirtioBalloon::VirtioBalloon(Bus *bus, Plic *plic, Ram *ram, IoThread *io, const char *control_path, uint32_t irq, uint32_t base, size_t size)
+    : VirtioMmio(bus, plic, VIRTIO_ID_BALLOON, 3, irq, base, size) {
+    this->ram = ram;
+    this->io = io;
+    this->control_path = control_path;
+    ram_pages = ram->getPageCount();
+    target_pages.store(0);
+    actual_pages.store(0);
+    inflated_pages.store(0);
+    released_bytes.store(0);
+
+    sockaddr_un addr;
+    memset(&addr, 0, sizeof(addr));
+    addr.sun_family = AF_UNIX;
+    if (this->control_path.size() >= sizeof(addr.sun_path)) {
+        fprintf(stderr, "Error: Balloon control socket path %s is too long\n", control_path);
+        exit(1);
+    }
+    strcpy(addr.sun_path, control_path);
+    unlink(control_path);
+    listen_fd = socket(AF_UNIX, SOCK_STREAM | SOCK_NONBLOCK | SOCK_CLOEXEC, 0);
+    if (listen_fd < 0 || bind(listen_fd, (sockaddr*)&addr, sizeof(addr)) < 0 || listen(listen_fd, 4) < 0) {
+        fprintf(stderr, "Error: Could not listen on balloon control socket %s\n", control_path);
+        exit(1);
+    }
+    io->watch(listen_fd, EPOLLIN, this);
+}
+
+/**
+ * Destroy the balloon device and close the control socket.
+ */
+VirtioBalloon::~VirtioBalloon() {
+    io->unwatch(listen_fd);
+    close(listen_fd);
+    std::vector<int> fds;
+    {
+        std::lock_guard<std::mutex> guard(clients_lock);
+        for (auto& client : clients) fds.push_back(client.first);
+    }
+    for (int fd : fds) {
+        io->unwatch(fd);  // Waits for a running callback, which may have closed it already
+        std::lock_guard<std::mutex> guard(clients_lock);
+        if (clients.erase(fd)) close(fd);
+    }
+    unlink(control_path.c_str());
+}
+
+/**
+ * Get the features offered by the device.
+ * @return The feature bits.
+ */
+uint64_t VirtioBalloon::getFeatures() {
+    return VIRTIO_F_VERSION_1 | VIRTIO_BALLOON_F_DEFLATE_ON_OOM | VIRTIO_BALLOON_F_REPORTING;
+}
+
+/**
+ * Read a byte of the configuration: num_pages followed by actual, little endian.
+ * @param offset The offset into the configuration space.
+ * @return The byte read.
+ */
+uint8_t VirtioBalloon::readConfig(uint32_t offset) {
+    if (offset < 4) return target_pages.load() >> (offset * 8);
+    if (offset < 8) return actual_pages.load() >> ((offset - 4) * 8);
+    return 0;
+}
+
+/**
+ * Write a byte of the configuration, only actual is writable.
+ * @param offset The offset into the configuration space.
+ * @param data The byte to write.
+ */
+void VirtioBalloon::writeConfig(uint32_t offset, uint8_t data) {
+    if (offset < 4 || offset >= 8) return;
+    uint32_t shift = (offset - 4) * 8;
+    actual_pages.store((actual_pages.load() & ~(0xffu << shift)) | ((uint32_t)data << shift));
+}
+
+/**
+ * Handle a descriptor chain: page numbers to inflate or deflate the balloon
+ * with, or free memory reported by the guest.
+ * @param queue The queue the chain was taken from.
+ * @param chain The chain mapped to host memory.
+ * @return 0, the device writes nothing.
+ */
+uint32_t VirtioBalloon::handleChain(uint32_t queue, VirtioChain &chain) {
+    if (queue == BALLOON_QUEUE_INFLATE) {
+        inflate(chain);
+    } else if (queue == BALLOON_QUEUE_DEFLATE) {  // The pages fault back in when the guest touches them
+        uint32_t pages = chain.out_len / 4;
+        inflated_pages.store((pages < inflated_pages.load()) ? inflated_pages.load() - pages : 0);
+    } else if (queue == BALLOON_QUEUE_REPORTING) {  // Free memory, described by the buffers themselves
+        for (auto& buffer : chain.in) released_bytes += ram->discard((uint8_t*)buffer.iov_base, buffer.iov_len);
+    }
+    return 0;
+}
+
+/**
+ * Give the pages of an inflate request back to the host, merging runs of
+ * contiguous pages into one discard.
+ * @param chain The chain holding 32 bit page numbers.
+ */
+void VirtioBalloon::inflate(VirtioChain &chain) {
+    uint32_t pfns[BALLOON_PFN_BATCH];
+    uint8_t *run = NULL;
+    size_t run_len = 0;
+    size_t offset = 0;
+    size_t count;
+    while ((count = chainRead(chain.out, offset, pfns, sizeof(pfns)) / 4) > 0) {
+        offset += count * 4;
+        for (size_t i = 0; i < count; i++) {
+            uint8_t *page = ram->getHostPointer((uint64_t)pfns[i] << VIRTIO_BALLOON_PFN_SHIFT, 1 << VIRTIO_BALLOON_PFN_SHIFT, true);
+            if (page == NULL) continue;
+            inflated_pages++;
+            if (run && page == run + run_len) {
+                run_len += 1 << VIRTIO_BALLOON_PFN_SHIFT;
+                continue;
+            }
+            if (run) released_bytes += ram->discard(run, run_len);
+            run = page;
+            run_len = 1 << VIRTIO_BALLOON_PFN_SHIFT;
+        }
+    }
+    if (run) released_bytes += ram->discard(run, run_len);
+}
+
+/**
+ * Reset the device specific state. A reset driver owns all its memory again.
+ */
+void VirtioBalloon::resetDevice() {
+    actual_pages.store(0);
+    inflated_pages.store(0);
+}
+
+/**
+ * Handle a ready descriptor on the I/O thread: a new control connection or a
+ * command from one.
+ * @param fd The descriptor.
+ * @param events The epoll events that occurred.
+ */
+void VirtioBalloon::ioReady(int fd, uint32_t events) {
+    if (fd == listen_fd) {
+        int client;
+        while ((client = accept4(listen_fd, NULL, NULL, SOCK_NONBLOCK | SOCK_CLOEXEC)) >= 0) {
+            std::lock_guard<std::mutex> guard(clients_lock);
+            clients[client] = "";
+            io->watch(client, EPOLLIN, this);
+        }
+        return;
+    }
+
+    char buffer[BALLOON_CONTROL_LINE];
+    ssize_t n = ::read(fd, buffer, sizeof(buffer));
+    std::lock_guard<std::mutex> guard(clients_lock);
+    if (n == 0 || (n < 0 && errno != EINTR && errno != EAGAIN)) {
+        io->unwatch(fd);
+        if (clients.erase(fd)) close(fd);
+        return;
+    }
+    if (n < 0) return;
+    std::string &pending = clients[fd];
+    pending.append(buffer, n);
+    size_t newline;
+    while ((newline = pending.find('\n')) != std::string::npos) {
+        std::string line = pending.substr(0, newline);
+        pending.erase(0, newline + 1);
+        handleCommand(fd, line);
+    }
+    if (pending.size() > BALLOON_CONTROL_LINE) pending.clear();  // Not a command
+}
+
+/**
+ * Execute a control command and write the reply.
+ * @param fd The connection of the command.
+ * @param line The command without the newline.
+ */
+void VirtioBalloon::handleCommand(int fd, const std::string &line) {
+    char reply[BALLOON_CONTROL_LINE];
+    unsigned long mib;
+    if (sscanf(line.c_str(), "target %lu", &mib) == 1) {  // Memory the guest should keep, like QEMU's balloon command
+        uint64_t keep = (uint64_t)mib << (20 - VIRTIO_BALLOON_PFN_SHIFT);
+        target_pages.store((keep < ram_pages) ? ram_pages - keep : 0);
+        notifyConfigChangeAsync();
+        snprintf(reply, sizeof(reply), "ok\n");
+    } else if (line == "info") {
+        snprintf(reply, sizeof(reply), "ram %u MiB, target %u MiB, balloon %u MiB, released %llu MiB\n",
+                 ram_pages >> 8, (ram_pages - target_pages.load()) >> 8, actual_pages.load() >> 8,
+                 (unsigned long long)(released_bytes.load() >> 20));
+    } else {
+        snprintf(reply, sizeof(reply), "error: commands are 'target MIB' and 'info'\n");
+    }
+    if (::write(fd, reply, strlen(reply)) < 0) return;  // The client went away, its hangup closes it
+}
@@ -0,0 +1,72 @@
+#ifndef BALLOON_H
+#define BALLOON_H
+
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <errno.h>
+#include <sys/socket.h>
+#include <sys/un.h>
+#include <atomic>
+#include <string>
+#include <mutex>
+#include <vector>
+#include <unordered_map>
+#include "virtio.h"
+#include "ram.h"
+#include "iothread.h"
+
+// The second virtio-mmio slot of yarve.dts
+#define DEFAULT_BALLOON_BASE 0x10002000
+#define DEFAULT_BALLOON_IRQ 3
+
+#define VIRTIO_ID_BALLOON 5
+#define VIRTIO_BALLOON_F_DEFLATE_ON_OOM (1ULL << 2)
+#define VIRTIO_BALLOON_F_REPORTING (1ULL << 5)
+#define VIRTIO_BALLOON_PFN_SHIFT 12  // Balloon pages are 4 KiB, whatever the guest page size
+
+#define BALLOON_QUEUE_INFLATE 0
+#define BALLOON_QUEUE_DEFLATE 1
+#define BALLOON_QUEUE_REPORTING 2  // The stats and free page hint queues are not offered, so reporting follows deflate
+#define BALLOON_PFN_BATCH 256
+#define BALLOON_CONTROL_LINE 256
+
+/**
+ * virtio-balloon with free page reporting. Pages the guest inflates the
+ * balloon with or reports as free are given back to the host with
+ * Ram::discard. The target is set at runtime through a Unix socket served by
+ * the I/O thread, see README.
+ */
+class VirtioBalloon : public VirtioMmio, public IoHandler {
+    public:
+        VirtioBalloon(Bus *bus, Plic *plic, Ram *ram, IoThread *io, const char *control_path, uint32_t irq = DEFAULT_BALLOON_IRQ, uint32_t base = DEFAULT_BALLOON_BASE, size_t size = DEFAULT_VIRTIO_SIZE);
+        ~VirtioBalloon();
+        void ioReady(int fd, uint32_t events);
+
+    protected:
+        uint64_t getFeatures();
+        uint8_t readConfig(uint32_t offset);
+        void writeConfig(uint32_t offset, uint8_t data);
+        uint32_t handleChain(uint32_t queue, VirtioChain &chain);
+        void resetDevice();
+
+    private:
+        void inflate(VirtioChain &chain);
+        void handleCommand(int fd, const std::string &line);
+
+        Ram *ram;
+        IoThread *io;
+        std::string control_path;
+        int listen_fd;
+        std::unordered_map<int, std::string> clients;  // Partial command lines of the control connections
+        std::mutex clients_lock;                        // The destructor closes the connections the I/O thread serves
+        uint32_t ram_pages;
+        std::atomic<uint32_t> target_pages;   // num_pages of the configuration, the balloon size the guest should reach
+        std::atomic<uint32_t> actual_pages;   // actual of the configuration, written by the guest
+        std::atomic<uint32_t> inflated_pages;
+        std::atomic<uint64_t> released_bytes;  // Given back to the host by inflating and reporting
+};
+
+#endif
@@ -5,6 +5,10 @@
 */
 Bus::Bus() {
     devices.clear();
+    observer = NULL;
+    count_mmio = false;
+    mmio_accesses = 0;
+    poll_detector = NULL;
 }
 
 /**
@@ -18,10 +22,56 @@ void Bus::attach(BusDevice* device) {
     devices.push_back(info);
 }
 
-uint32_t Bus::read(uint32_t addr, uint32_t *exception) {
+/**
+ * Set the plugin that observes accesses to devices that are not memory.
+ * @param observer The plugin or NULL to disable observation.
+ */
+void Bus::setObserver(YarvePlugin *observer) {
+    this->observer = (observer && observer->mmio) ? observer : NULL;
+}
+
+/**
+ * Count accesses to devices that are not memory, for the MMIO performance counter event.
+ * @param enabled true to count.
+ */
+void Bus::setCountMmio(bool enabled) {
+    count_mmio = enabled;
+}
+
+/**
+ * Get the number of device accesses counted while counting was enabled.
+ * @return The number of accesses.
+ */
+uint64_t Bus::getMmioAccesses() {
+    return mmio_accesses;
+}
+
+/**
+ * Report device reads and stores to a poll detector, for --warp.
+ * @param detector The detector or NULL to stop reporting.
+ */
+void Bus::setPollDetector(PollDetector *detector) {
+    poll_detector = detector;
+}
+
+/**
+ * Read a word from the bus.
+ * @param addr The address to read from.
+ * @param exception Set to a defined status in bus.h.
+ * @param width The width of the load, the caller extracts it from the word. Reported to the observer.
+ * @return The word read.
+*/
+uint32_t Bus::read(uint64_t addr, uint32_t *exception, uint8_t width) {
     for (auto& device : devices) {
         if (addr >= device.base && addr < device.base + device.size) {
             *exception = BUS_READ_OK;
+            if (count_mmio && !device.device->isMemory()) mmio_accesses++;
+            if ((observer || poll_detector) && !device.device->isMemory()) {
+                uint32_t data = device.device->read(addr);
+                if (observer) observer->mmio(observer->ctx, addr, width, (width < 4) ? data & ((1u << (width * 8)) - 1) : data, 0);
+                if (poll_detector) poll_detector->read(addr, data);
+                return data;
+            }
             return device.device->read(addr);
         }
     }
@@ -35,12 +85,148 @@ uint32_t Bus::read(uint32_t addr, uint32_t *exception) {
  * @param data The data to write.
  * @return A defined status in bus.h.
 */
-uint32_t Bus::write(uint32_t addr, uint32_t data, uint8_t width) {
+uint32_t Bus::write(uint64_t addr, uint32_t data, uint8_t width) {
+    if (poll_detector) poll_detector->write();
     for (auto& device : devices) {
         if (addr >= device.base && addr < device.base + device.size) {
+            if (count_mmio && !device.device->isMemory()) mmio_accesses++;
+            if (observer && !device.device->isMemory()) observer->mmio(observer->ctx, addr, width, data, 1);
             device.device->write(addr, data, width);
             return BUS_WRITE_OK;
         }
     }
     return BUS_WRITE_ERROR;
+}
+
+/**
+ * Check whether a device answers at an address, without accessing it.
+ * @param addr The address to check.
+ * @return true if a read or write of addr reaches a device.
+ */
+bool Bus::isMapped(uint64_t addr) {
+    for (auto& device : devices) {
+        if (addr >= device.base && addr < device.base + device.size) return true;
+    }
+    return false;
+}
+
+/**
+ * Map the start of a guest physical range to host memory.
+ * @param addr The guest physical start address.
+ * @param len The length of the range.
+ * @param write true if the caller may write to the range.
+ * @param span_len Set to the number of bytes mapped, which ends at the end of the device.
+ * @return The host pointer or NULL if addr is not backed by host memory.
+ */
+uint8_t *Bus::mapSpan(uint64_t addr, size_t len, bool write, size_t *span_len) {
+    for (auto& device : devices) {
+        if (addr >= device.base && addr < device.base + device.size) {
+            size_t available = device.size - (addr - device.base);
+            *span_len = (len < available) ? len : available;
+            return device.device->getHostPointer(addr, *span_len, write);
+        }
+    }
+    return NULL;
+}
+
+/**
+ * Get a host pointer to a guest physical range that is contiguous in host memory.
+ * @param addr The guest physical start address.
+ * @param len The length of the range.
+ * @param write true if the caller may write to the range.
+ * @return The host pointer or NULL if the range is not backed by a single memory device.
+ */
+uint8_t *Bus::getHostPointer(uint64_t addr, size_t len, bool write) {
+    size_t span_len;
+    uint8_t *host = mapSpan(addr, len, write, &span_len);
+    return (host && span_len == len) ? host : NULL;
+}
+
+/**
+ * Translate a guest physical range into host memory spans, one per memory device
+ * it crosses. The spans can be passed to readv/writev and friends directly.
+ * @param addr The guest physical start address.
+ * @param len The length of the range.
+ * @param write true if the caller may write to the range.
+ * @param spans The spans are appended to this vector.
+ * @return false if part of the range is not backed by host memory, spans may then be partially filled.
+ */
+bool Bus::translate(uint64_t addr, size_t len, bool write, std::vector<iovec> &spans) {
+    if (addr + len < addr) return false;
+    while (len) {
+        size_t span_len;
+        uint8_t *host = mapSpan(addr, len, write, &span_len);
+        if (host == NULL) return false;
+        spans.push_back({host, span_len});
+        addr += span_len;
+        len -= span_len;
+    }
+    return true;
+}
+
+/**
+ * Translate a guest physical range into a fixed array of host memory spans.
+ * @param addr The guest physical start address.
+ * @param len The length of the range.
+ * @param write true if the caller may write to the range.
+ * @param spans The spans to fill.
+ * @param max_spans The capacity of spans.
+ * @return The number of spans, or -1 if part of the range is not backed by host memory or does not fit.
+ */
+int Bus::translate(uint64_t addr, size_t len, bool write, iovec *spans, int max_spans) {
+    if (addr + len < addr) return -1;
+    int count = 0;
+    while (len) {
+        size_t span_len;
+        uint8_t *host = mapSpan(addr, len, write, &span_len);
+        if (host == NULL || count == max_spans) return -1;
+        spans[count++] = {host, span_len};
+        addr += span_len;
+        len -= span_len;
+    }
+    return count;
+}
+
+/**
+ * Copy a guest physical range to a host buffer.
+ * @param addr The guest physical start address.
+ * @param dst The destination.
+ * @param len The number of bytes to copy.
+ * @return false if part of the range is not backed by host memory, dst is then partially filled.
+ */
+bool Bus::readBytes(uint64_t addr, void *dst, size_t len) {
+    if (addr + len < addr) return false;
+    uint8_t *out = (uint8_t*)dst;
+    while (len) {
+        size_t span_len;
+        uint8_t *host = mapSpan(addr, len, false, &span_len);
+        if (host == NULL) return false;
+        memcpy(out, host, span_len);
+        out += span_len;
+        addr += span_len;
+        len -= span_len;
+    }
+    return true;
+}
+
+/**
+ * Copy a host buffer to a guest physical range.
+ * @param addr The guest physical start address.
+ * @param src The source.
+ * @param len The number of bytes to copy.
+ * @return false if part of the range is not backed by host memory, the range is then partially written.
+ */
+bool Bus::writeBytes(uint64_t addr, const void *src, size_t len) {
+    if (addr + len < addr) return false;
+    const uint8_t *in = (const uint8_t*)src;
+    while (len) {
+        size_t span_len;
+        uint8_t *host = mapSpan(addr, len, true, &span_len);
+        if (host == NULL) return false;
+        memcpy(host, in, span_len);
+        in += span_len;
+        addr += span_len;
+        len -= span_len;
+    }
+    return true;
 }
\ No newline at end of file
@@ -2,7 +2,12 @@
 #define BUS_H
 
 #include <stdint.h>
+#include <stddef.h>
+#include <string.h>
+#include <sys/uio.h>
 #include <vector>
+#include "plugin.h"
+#include "warp.h"
 
 #define BUS_READ_OK 0
 #define BUS_READ_ERROR 5
@@ -13,26 +18,46 @@ class BusDevice;
 
 typedef struct {
     BusDevice* device;
-    uint32_t base;
+    uint64_t base;
     size_t size;
 } DeviceInfo;
 
 class BusDevice {
     public:
+        virtual ~BusDevice() {}
         virtual DeviceInfo getDeviceInfo() = 0;
-        virtual uint32_t read(uint32_t addr) = 0;
-        virtual void write(uint32_t addr, uint32_t data, uint8_t width) = 0;
+        virtual uint32_t read(uint64_t addr) = 0;
+        virtual void write(uint64_t addr, uint32_t data, uint8_t width) = 0;
+        virtual bool isMemory() { return false; }
+        virtual uint8_t *getHostPointer(uint64_t addr, size_t len, bool write) { return NULL; }
 };
 
 class Bus {
     public:
         Bus();
         void attach(BusDevice* device);
-        uint32_t read(uint32_t addr, uint32_t *exception);
-        uint32_t write(uint32_t addr, uint32_t data, uint8_t width);
+        uint32_t read(uint64_t addr, uint32_t *exception, uint8_t width = 4);
+        uint32_t write(uint64_t addr, uint32_t data, uint8_t width);
+        bool isMapped(uint64_t addr);
+        void setObserver(YarvePlugin *observer);
+        void setCountMmio(bool enabled);
+        uint64_t getMmioAccesses();
+        void setPollDetector(PollDetector *detector);
+
+        uint8_t *getHostPointer(uint64_t addr, size_t len, bool write);
+        bool translate(uint64_t addr, size_t len, bool write, std::vector<iovec> &spans);
+        int translate(uint64_t addr, size_t len, bool write, iovec *spans, int max_spans);
+        bool readBytes(uint64_t addr, void *dst, size_t len);
+        bool writeBytes(uint64_t addr, const void *src, size_t len);
 
     private:
+        uint8_t *mapSpan(uint64_t addr, size_t len, bool write, size_t *span_len);
+
         std::vector<DeviceInfo> devices;
+        YarvePlugin *observer;
+        bool count_mmio;
+        uint64_t mmio_accesses;
+        PollDetector *poll_detector;
 };
 
 #endif
\ No newline at end of file
@@ -0,0 +1,506 @@
+#include <stdlib.h>
+#include <string.h>
+#include <algorithm>
+#include "cachesim.h"
+
+#define DEFAULT_CACHESIM_TOP 20
+
+/**
+ * Set up an empty cache. The caller has checked that the geometry is valid.
+ * @param name The name used in the report.
+ * @param size The capacity in bytes.
+ * @param ways The associativity.
+ * @param line The line size in bytes.
+ * @param policy CACHE_POLICY_LRU, CACHE_POLICY_FIFO or CACHE_POLICY_RANDOM.
+ */
+void CacheModel::configure(const char *name, uint32_t size, uint32_t ways, uint32_t line, int policy) {
+    this->name = name;
+    this->size = size;
+    this->ways = ways;
+    this->line = line;
+    this->policy = policy;
+    line_shift = __builtin_ctz(line);
+    set_mask = size / (ways * line) - 1;
+    clock = 0;
+    random_state = 0x9E3779B9;
+    accesses = 0;
+    misses = 0;
+    writebacks = 0;
+    tags.assign(size / line, 0);
+    stamps.assign(size / line, 0);
+    dirty.assign(size / line, 0);
+}
+
+/**
+ * Look up an address and fill its line on a miss.
+ * @param addr The accessed address.
+ * @param write true for stores, the line becomes dirty.
+ * @param writeback Set to the address of an evicted dirty line.
+ * @param dirty_evicted Set to true if a dirty line was evicted.
+ * @return true on a hit.
+ */
+bool CacheModel::access(uint32_t addr, bool write, uint32_t *writeback, bool *dirty_evicted) {
+    uint32_t tag = (addr >> line_shift) + 1;
+    uint32_t base = ((tag - 1) & set_mask) * ways;
+    accesses++;
+    clock++;
+    *dirty_evicted = false;
+    for (uint32_t way = base; way < base + ways; way++) {
+        if (tags[way] == tag) {
+            if (policy == CACHE_POLICY_LRU) stamps[way] = clock;
+            dirty[way] |= write;
+            return true;
+        }
+    }
+
+    misses++;
+    uint32_t victim = base;
+    for (uint32_t way = base; way < base + ways; way++) {  // Free ways first
+        if (tags[way] == 0) {
+            victim = way;
+            goto fill;
+        }
+    }
+    if (policy == CACHE_POLICY_RANDOM) {
+        random_state ^= random_state << 13;
+        random_state ^= random_state >> 17;
+        random_state ^= random_state << 5;
+        victim = base + random_state % ways;
+    } else {  // LRU and FIFO evict the oldest stamp, they only differ in when it is updated
+        for (uint32_t way = base + 1; way < base + ways; way++) {
+            if (stamps[way] < stamps[victim]) victim = way;
+        }
+    }
+    if (dirty[victim]) {
+        writebacks++;
+        *writeback = (tags[victim] - 1) << line_shift;
+        *dirty_evicted = true;
+    }
+
+fill:
+    tags[victim] = tag;
+    stamps[victim] = clock;
+    dirty[victim] = write;
+    return false;
+}
+
+/**
+ * Set up a predictor with all counters weakly not taken.
+ * @param type PREDICTOR_BIMODAL or PREDICTOR_GSHARE.
+ * @param entries The number of counters, a power of two.
+ */
+void BranchPredictor::configure(int type, uint32_t entries) {
+    this->type = type;
+    this->entries = entries;
+    branches = 0;
+    mispredicts = 0;
+    history = 0;
+    counters.assign(entries, 1);
+}
+
+/**
+ * Predict a conditional branch and train the predictor with its outcome.
+ * @param pc The address of the branch.
+ * @param taken true if the branch was taken.
+ * @return true if the prediction was correct.
+ */
+bool BranchPredictor::predict(uint32_t pc, bool taken) {
+    uint32_t index = pc >> 2;
+    if (type == PREDICTOR_GSHARE) index ^= history;
+    index &= entries - 1;
+    uint8_t &counter = counters[index];
+    bool correct = (counter >= 2) == taken;
+    if (taken && counter < 3) counter++;
+    if (!taken && counter > 0) counter--;
+    history = ((history << 1) | taken) & (entries - 1);
+    branches++;
+    mispredicts += !correct;
+    return correct;
+}
+
+/**
+ * Parse a size with an optional k or m suffix.
+ * @param text The size.
+ * @return The size in bytes, 0 if invalid.
+ */
+static uint32_t parseSize(const std::string &text) {
+    char *end;
+    unsigned long value = strtoul(text.c_str(), &end, 10);
+    if (end == text.c_str()) return 0;
+    if (*end == 'k' || *end == 'K') {
+        value *= 1024;
+        end++;
+    } else if (*end == 'm' || *end == 'M') {
+        value *= 1024 * 1024;
+        end++;
+    }
+    if (*end != '\0' || value > 0x80000000) return 0;
+    return value;
+}
+
+/**
+ * Split a string at a separator.
+ * @param text The string.
+ * @param separator The separator.
+ * @return The fields, at least one.
+ */
+static std::vector<std::string> split(const std::string &text, char separator) {
+    std::vector<std::string> fields;
+    size_t start = 0;
+    while (true) {
+        size_t end = text.find(separator, start);
+        fields.push_back(text.substr(start, end - start));
+        if (end == std::string::npos) return fields;
+        start = end + 1;
+    }
+}
+
+static inline bool isPowerOfTwo(uint32_t value) {
+    return value && !(value & (value - 1));
+}
+
+/**
+ * Configure a cache from SIZE:WAYS:LINE[:POLICY].
+ * @param cache The cache to configure.
+ * @param name The name of the cache.
+ * @param value The configuration.
+ */
+static void configureCache(CacheModel &cache, const char *name, const std::string &value) {
+    std::vector<std::string> fields = split(value, ':');
+    uint32_t size = parseSize(fields[0]);
+    uint32_t ways = (fields.size() > 1) ? parseSize(fields[1]) : 0;
+    uint32_t line = (fields.size() > 2) ? parseSize(fields[2]) : 0;
+    int policy = CACHE_POLICY_LRU;
+    if (fields.size() > 3) {
+        if (fields[3] == "fifo")
+            policy = CACHE_POLICY_FIFO;
+        else if (fields[3] == "random")
+            policy = CACHE_POLICY_RANDOM;
+        else if (fields[3] != "lru")
+            policy = -1;
+    }
+    if (fields.size() < 3 || fields.size() > 4 || policy < 0 || !isPowerOfTwo(size) || !isPowerOfTwo(ways) || !isPowerOfTwo(line) ||
+        line < 4 || (uint64_t)ways * line > size) {
+        fprintf(stderr, "Error: Invalid %s cache %s, expected SIZE:WAYS:LINE[:lru|fifo|random] with power of two values\n", name, value.c_str());
+        exit(1);
+    }
+    cache.configure(name, size, ways, line, policy);
+}
+
+/**
+ * Create the simulation and start the worker thread.
+ * @param spec Comma separated KEY=VALUE settings, or "default".
+ * @param ram_base The base address of RAM, other data accesses are uncached device accesses.
+ * @param ram_size The size of RAM.
+ */
+CacheSim::CacheSim(const char *spec, uint32_t ram_base, uint32_t ram_size) {
+    l1i.configure("L1I", 32 * 1024, 8, 64, CACHE_POLICY_LRU);
+    l1d.configure("L1D", 32 * 1024, 8, 64, CACHE_POLICY_LRU);
+    l2.configure("L2", 512 * 1024, 8, 64, CACHE_POLICY_LRU);
+    predictor.configure(PREDICTOR_BIMODAL, 4096);
+    top = DEFAULT_CACHESIM_TOP;
+    parse(spec);
+
+    buffers[0] = new CacheSimEntry[CACHESIM_BATCH_ENTRIES];
+    buffers[1] = new CacheSimEntry[CACHESIM_BATCH_ENTRIES];
+    active = 0;
+    cur = buffers[0];
+    limit = buffers[0] + CACHESIM_BATCH_ENTRIES - CACHESIM_SLACK;
+    branch = NULL;
+    branch_pc = 0;
+
+    instructions = 0;
+    uncached = 0;
+    this->ram_base = ram_base;
+    this->ram_size = ram_size;
+    last_fetch_line = 0xFFFFFFFF;
+    for (int i = 0; i < CACHESIM_STATS_CACHE; i++) {
+        stats_pcs[i] = 0xFFFFFFFF;  // Never a PC, the low bits are masked
+        stats_entries[i] = NULL;
+    }
+
+    open = true;
+    full_buffer = NULL;
+    full_count = 0;
+    stopping = false;
+    worker = std::thread(&CacheSim::workerLoop, this);
+}
+
+/**
+ * Finish the simulation.
+ */
+CacheSim::~CacheSim() {
+    close();
+    delete[] buffers[0];
+    delete[] buffers[1];
+}
+
+/**
+ * Parse the settings: l1i, l1d and l2 take SIZE:WAYS:LINE[:POLICY], bp takes
+ * bimodal|gshare[:ENTRIES], top the number of report lines, symbols an nm
+ * style symbol file and out the report file.
+ * @param spec The settings.
+ */
+void CacheSim::parse(const char *spec) {
+    if (strcmp(spec, "default") == 0) return;
+    for (const std::string &setting : split(spec, ',')) {
+        size_t equals = setting.find('=');
+        std::string key = setting.substr(0, equals);
+        std::string value = (equals == std::string::npos) ? "" : setting.substr(equals + 1);
+        if (value == "") {
+            fprintf(stderr, "Error: Invalid cachesim setting '%s', expected KEY=VALUE\n", setting.c_str());
+            exit(1);
+        }
+        if (key == "l1i") {
+            configureCache(l1i, "L1I", value);
+        } else if (key == "l1d") {
+            configureCache(l1d, "L1D", value);
+        } else if (key == "l2") {
+            configureCache(l2, "L2", value);
+        } else if (key == "bp") {
+            std::vector<std::string> fields = split(value, ':');
+            uint32_t entries = (fields.size() > 1) ? parseSize(fields[1]) : 4096;
+            int type = (fields[0] == "gshare") ? PREDICTOR_GSHARE : PREDICTOR_BIMODAL;
+            if ((fields[0] != "gshare" && fields[0] != "bimodal") || fields.size() > 2 || !isPowerOfTwo(entries)) {
+                fprintf(stderr, "Error: Invalid branch predictor %s, expected bimodal|gshare[:ENTRIES]\n", value.c_str());
+                exit(1);
+            }
+            predictor.configure(type, entries);
+        } else if (key == "top") {
+            top = atoi(value.c_str());
+        } else if (key == "symbols") {
+            loadSymbols(value.c_str());
+        } else if (key == "out") {
+            out_file = value;
+        } else {
+            fprintf(stderr, "Error: Unknown cachesim setting '%s'\n", key.c_str());
+            exit(1);
+        }
+    }
+}
+
+/**
+ * Load symbols in the format printed by nm and found in System.map.
+ * @param filename The symbol file.
+ */
+void CacheSim::loadSymbols(const char *filename) {
+    FILE *file = fopen(filename, "r");
+    if (file == NULL) {
+        fprintf(stderr, "Error: Could not open symbol file %s\n", filename);
+        exit(1);
+    }
+    char line[512];
+    char name[256];
+    char type;
+    unsigned long addr;
+    while (fgets(line, sizeof(line), file)) {
+        if (sscanf(line, "%lx %c %255s", &addr, &type, name) == 3) symbols.push_back(std::make_pair((uint32_t)addr, std::string(name)));
+    }
+    fclose(file);
+    std::sort(symbols.begin(), symbols.end());
+}
+
+/**
+ * Feed the remaining events through the models, stop the worker thread and write the report.
+ */
+void CacheSim::close() {
+    if (!open) return;
+    open = false;
+    trap();  // The successor of a pending branch is unknown
+    flip();
+    {
+        std::unique_lock<std::mutex> guard(lock);
+        stopping = true;
+    }
+    cond.notify_all();
+    worker.join();
+
+    FILE *out = stderr;
+    if (out_file != "") {
+        out = fopen(out_file.c_str(), "w");
+        if (out == NULL) {
+            fprintf(stderr, "Error: Could not open cachesim report %s\n", out_file.c_str());
+            return;
+        }
+    }
+    report(out);
+    if (out != stderr) fclose(out);
+}
+
+/**
+ * Hand the active buffer to the worker thread and continue in the other one.
+ * Only waits if the worker has not finished the previous buffer yet.
+ */
+void CacheSim::flip() {
+    CacheSimEntry *buffer = buffers[active];
+    {
+        std::unique_lock<std::mutex> guard(lock);
+        cond.wait(guard, [this] { return full_buffer == NULL; });
+        full_buffer = buffer;
+        full_count = cur - buffer;
+    }
+    cond.notify_all();
+    active ^= 1;
+    cur = buffers[active];
+    limit = buffers[active] + CACHESIM_BATCH_ENTRIES - CACHESIM_SLACK;
+}
+
+/**
+ * Body of the worker thread.
+ */
+void CacheSim::workerLoop() {
+    std::unique_lock<std::mutex> guard(lock);
+    while (true) {
+        cond.wait(guard, [this] { return full_buffer != NULL || stopping; });
+        if (full_buffer == NULL) break;
+
+        CacheSimEntry *buffer = full_buffer;
+        size_t count = full_count;
+        guard.unlock();
+        simulate(buffer, count);
+        guard.lock();
+        full_buffer = NULL;
+        cond.notify_all();
+    }
+}
+
+/**
+ * Run a batch of events through the caches and the branch predictor.
+ * @param entries The events.
+ * @param count The number of events.
+ */
+void CacheSim::simulate(const CacheSimEntry *entries, size_t count) {
+    uint32_t writeback;
+    bool dirty_evicted;
+    for (size_t i = 0; i < count; i++) {
+        uint32_t kind = entries[i].pc_kind & 3;
+        uint32_t pc = entries[i].pc_kind & ~3;
+        uint32_t slot = (pc >> 2) & (CACHESIM_STATS_CACHE - 1);
+        if (stats_pcs[slot] != pc) {  // Map entries never move, so the pointers stay valid
+            stats_pcs[slot] = pc;
+            stats_entries[slot] = &stats[pc];
+        }
+        CacheSimStats *s = stats_entries[slot];
+
+        if (kind == CACHESIM_LOAD || kind == CACHESIM_STORE) {
+            if (entries[i].addr - ram_base >= ram_size) {
+                uncached++;
+                continue;
+            }
+            bool write = (kind == CACHESIM_STORE);
+            s->l1d_accesses++;
+            if (!l1d.access(entries[i].addr, write, &writeback, &dirty_evicted)) {
+                s->l1d_misses++;
+                if (dirty_evicted) l2.access(writeback, true, &writeback, &dirty_evicted);
+                if (!l2.access(entries[i].addr, false, &writeback, &dirty_evicted)) s->l2_misses++;
+            }
+            continue;
+        }
+
+        instructions++;
+        s->instructions++;
+        uint32_t line = pc >> __builtin_ctz(l1i.line);
+        if (line != last_fetch_line) {  // Sequential fetches from the same line hit without changing its state
+            last_fetch_line = line;
+            if (!l1i.access(pc, false, &writeback, &dirty_evicted)) {
+                s->l1i_misses++;
+                if (!l2.access(pc, false, &writeback, &dirty_evicted)) s->l2_misses++;
+            }
+        } else {
+            l1i.accesses++;
+        }
+        if (kind == CACHESIM_BRANCH) {
+            s->branches++;
+            if (!predictor.predict(pc, entries[i].addr)) s->mispredicts++;
+        }
+    }
+}
+
+/**
+ * Misses per thousand instructions.
+ */
+static inline double mpki(uint64_t misses, uint64_t instructions) {
+    return instructions ? misses * 1000.0 / instructions : 0;
+}
+
+static inline double rate(uint64_t misses, uint64_t accesses) {
+    return accesses ? misses * 100.0 / accesses : 0;
+}
+
+/**
+ * Weight used to rank PCs and symbols in the report.
+ */
+static inline uint64_t weight(const CacheSimStats &s) {
+    return s.l1i_misses + s.l1d_misses + s.l2_misses + s.mispredicts;
+}
+
+/**
+ * Print a table of the heaviest entries.
+ */
+static void printTable(FILE *out, const char *title, std::vector<std::pair<std::string, CacheSimStats>> &rows, uint32_t top, uint64_t instructions) {
+    std::sort(rows.begin(), rows.end(), [](const std::pair<std::string, CacheSimStats> &a, const std::pair<std::string, CacheSimStats> &b) {
+        return weight(a.second) > weight(b.second);
+    });
+    fprintf(out, "\n%s, by L1 and L2 misses plus mispredictions (MPKI relative to all instructions):\n", title);
+    fprintf(out, "%-32s %12s %10s %7s %12s %10s %7s %7s %10s %7s %10s %7s %7s\n", "location", "insns", "L1I miss", "MPKI", "L1D access", "L1D miss",
+            "rate%", "MPKI", "L2 miss", "MPKI", "mispred", "rate%", "MPKI");
+    for (size_t i = 0; i < rows.size() && i < top; i++) {
+        const CacheSimStats &s = rows[i].second;
+        if (weight(s) == 0) break;
+        fprintf(out, "%-32s %12lu %10lu %7.3f %12lu %10lu %7.2f %7.3f %10lu %7.3f %10lu %7.2f %7.3f\n", rows[i].first.c_str(), s.instructions,
+                s.l1i_misses, mpki(s.l1i_misses, instructions), s.l1d_accesses, s.l1d_misses, rate(s.l1d_misses, s.l1d_accesses),
+                mpki(s.l1d_misses, instructions), s.l2_misses, mpki(s.l2_misses, instructions), s.mispredicts, rate(s.mispredicts, s.branches),
+                mpki(s.mispredicts, instructions));
+    }
+}
+
+/**
+ * Write the totals and the per PC and per symbol tables.
+ * @param out The report file.
+ */
+void CacheSim::report(FILE *out) {
+    static const char *policies[] = {"lru", "fifo", "random"};
+    fprintf(out, "\ncachesim: %lu instructions, %lu uncached device accesses\n", instructions, uncached);
+    fprintf(out, "%-6s %-22s %14s %12s %8s %8s %12s\n", "cache", "geometry", "accesses", "misses", "rate%", "MPKI", "writebacks");
+    for (CacheModel *cache : {&l1i, &l1d, &l2}) {
+        char geometry[64];
+        snprintf(geometry, sizeof(geometry), "%uK %u-way %uB %s", cache->size / 1024, cache->ways, cache->line, policies[cache->policy]);
+        fprintf(out, "%-6s %-22s %14lu %12lu %8.2f %8.3f %12lu\n", cache->name.c_str(), geometry, cache->accesses, cache->misses,
+                rate(cache->misses, cache->accesses), mpki(cache->misses, instructions), cache->writebacks);
+    }
+    fprintf(out, "branch %-22s %14lu %12lu %8.2f %8.3f\n", (predictor.type == PREDICTOR_GSHARE) ? "gshare" : "bimodal", predictor.branches,
+            predictor.mispredicts, rate(predictor.mispredicts, predictor.branches), mpki(predictor.mispredicts, instructions));
+
+    std::vector<std::pair<std::string, CacheSimStats>> rows;
+    std::unordered_map<std::string, CacheSimStats> by_symbol;
+    for (const std::pair<const uint32_t, CacheSimStats> &entry : stats) {
+        char location[96];
+        snprintf(location, sizeof(location), "0x%08x", entry.first);
+        std::string name = location;
+        if (!symbols.empty()) {
+            auto symbol = std::upper_bound(symbols.begin(), symbols.end(), std::make_pair(entry.first, std::string("\xff")));
+            if (symbol != symbols.begin()) {
+                --symbol;
+                snprintf(location, sizeof(location), "0x%08x %s+0x%x", entry.first, symbol->second.c_str(), entry.first - symbol->first);
+                name = symbol->second;
+            } else {
+                name = "?";
+            }
+            CacheSimStats &sum = by_symbol[name];
+            sum.instructions += entry.second.instructions;
+            sum.l1i_misses += entry.second.l1i_misses;
+            sum.l1d_accesses += entry.second.l1d_accesses;
+            sum.l1d_misses += entry.second.l1d_misses;
+            sum.l2_misses += entry.second.l2_misses;
+            sum.branches += entry.second.branches;
+            sum.mispredicts += entry.second.mispredicts;
+        }
+        rows.push_back(std::make_pair(std::string(location), entry.second));
+    }
+    printTable(out, "Guest PCs", rows, top, instructions);
+    if (!symbols.empty()) {
+        rows.assign(by_symbol.begin(), by_symbol.end());
+        printTable(out, "Symbols", rows, top, instructions);
+    }
+    fflush(out);
+}
@@ -0,0 +1,216 @@
+#ifndef CACHESIM_H
+#define CACHESIM_H
+
+#include <stdint.h>
+#include <stdio.h>
+#include <string>
+#include <vector>
+#include <unordered_map>
+#include <thread>
+#include <mutex>
+#include <condition_variable>
+
+#define CACHESIM_BATCH_ENTRIES (64 * 1024)  // 512 KiB, small enough to stay in the host caches between the threads
+#define CACHESIM_SLACK 16  // Entries a single instruction can add after the batch check
+#define CACHESIM_STATS_CACHE 4096  // Direct mapped lookup of recent PCs in front of the statistics map
+
+// Kinds of events, stored in the low bits of the always aligned PC
+#define CACHESIM_INSN 0
+#define CACHESIM_BRANCH 1
+#define CACHESIM_LOAD 2
+#define CACHESIM_STORE 3
+
+#define CACHE_POLICY_LRU 0
+#define CACHE_POLICY_FIFO 1
+#define CACHE_POLICY_RANDOM 2
+
+#define PREDICTOR_BIMODAL 0
+#define PREDICTOR_GSHARE 1
+
+/**
+ * An event recorded on the CPU thread. For branches addr is set to 1 once the
+ * next instruction shows that the branch was taken.
+ */
+typedef struct {
+    uint32_t pc_kind;
+    uint32_t addr;
+} CacheSimEntry;
+
+/**
+ * A set associative write-back, write-allocate cache.
+ */
+class CacheModel {
+    public:
+        void configure(const char *name, uint32_t size, uint32_t ways, uint32_t line, int policy);
+        bool access(uint32_t addr, bool write, uint32_t *writeback, bool *dirty_evicted);
+
+        std::string name;
+        uint32_t size;
+        uint32_t ways;
+        uint32_t line;
+        int policy;
+        uint64_t accesses;
+        uint64_t misses;
+        uint64_t writebacks;
+
+    private:
+        uint32_t line_shift;
+        uint32_t set_mask;
+        uint64_t clock;
+        uint32_t random_state;
+        std::vector<uint32_t> tags;  // Line number + 1, 0 if invalid
+        std::vector<uint64_t> stamps;  // Last use for LRU, fill time for FIFO
+        std::vector<uint8_t> dirty;
+};
+
+/**
+ * Table of 2 bit saturating counters, indexed by the PC or by the PC xor the global history.
+ */
+class BranchPredictor {
+    public:
+        void configure(int type, uint32_t entries);
+        bool predict(uint32_t pc, bool taken);
+
+        int type;
+        uint32_t entries;
+        uint64_t branches;
+        uint64_t mispredicts;
+
+    private:
+        uint32_t history;
+        std::vector<uint8_t> counters;
+};
+
+/**
+ * Events attributed to a single guest PC.
+ */
+typedef struct {
+    uint64_t instructions;
+    uint64_t l1i_misses;
+    uint64_t l1d_accesses;
+    uint64_t l1d_misses;
+    uint64_t l2_misses;
+    uint64_t branches;
+    uint64_t mispredicts;
+} CacheSimStats;
+
+/**
+ * Cache and branch predictor simulation (--cachesim). The execute loop records
+ * fetches, branches and data accesses into one of two buffers while a
+ * background thread feeds the other one through the models. The report is
+ * written when the simulation is closed.
+ */
+class CacheSim {
+    public:
+        CacheSim(const char *spec, uint32_t ram_base, uint32_t ram_size);
+        ~CacheSim();
+        void close();
+
+        /**
+         * Record a retired instruction and resolve the previous branch.
+         * @param pc The address of the instruction.
+         * @param ir The instruction.
+         */
+        inline void fetch(uint32_t pc, uint32_t ir) {
+            if (branch) {
+                branch->addr = (pc != branch_pc + 4);
+                branch = NULL;
+            }
+            if (__builtin_expect(cur > limit, 0)) flip();  // After resolving, no entry of the old buffer is pending
+            CacheSimEntry *entry = cur++;
+            entry->addr = 0;
+            if ((ir & 0x7f) == 0x63) {  // Conditional branch
+                entry->pc_kind = pc | CACHESIM_BRANCH;
+                branch = entry;
+                branch_pc = pc;
+            } else {
+                entry->pc_kind = pc;
+            }
+        }
+
+        /**
+         * Record a data access, it precedes the entry of its instruction.
+         * @param pc The address of the instruction.
+         * @param addr The accessed address.
+         * @param kind CACHESIM_LOAD or CACHESIM_STORE.
+         */
+        inline void access(uint32_t pc, uint32_t addr, uint32_t kind) {
+            CacheSimEntry *entry = cur++;
+            entry->pc_kind = pc | kind;
+            entry->addr = addr;
+        }
+
+        /**
+         * Record a trap, the instruction after a pending branch is not its successor.
+         */
+        inline void trap() {
+            if (branch) {
+                branch->pc_kind &= ~3;
+                branch = NULL;
+            }
+        }
+
+    private:
+        void parse(const char *spec);
+        void loadSymbols(const char *filename);
+        void flip();
+        void workerLoop();
+        void simulate(const CacheSimEntry *entries, size_t count);
+        void report(FILE *out);
+
+        CacheSimEntry *buffers[2];
+        int active;
+        CacheSimEntry *cur;
+        CacheSimEntry *limit;
+        CacheSimEntry *branch;
+        uint32_t branch_pc;
+
+        CacheModel l1i;
+        CacheModel l1d;
+        CacheModel l2;
+        BranchPredictor predictor;
+        uint64_t instructions;
+        uint64_t uncached;
+        uint32_t ram_base;
+        uint32_t ram_size;
+        uint32_t last_fetch_line;
+        uint32_t stats_pcs[CACHESIM_STATS_CACHE];
+        CacheSimStats *stats_entries[CACHESIM_STATS_CACHE];
+        std::unordered_map<uint32_t, CacheSimStats> stats;
+        std::vector<std::pair<uint32_t, std::string>> symbols;  // Sorted by address
+        std::string out_file;
+        uint32_t top;
+
+        bool open;
+        std::thread worker;
+        std::mutex lock;
+        std::condition_variable cond;
+        CacheSimEntry *full_buffer;
+        size_t full_count;
+        bool stopping;
+};
+
+/**
+ * Hook policy feeding a CacheSim, inlined into Cpu::step.
+ */
+struct CacheSimHooks {
+    CacheSim *sim;
+
+    CacheSimHooks(CacheSim *sim) : sim(sim) {}
+
+    inline void retire(uint32_t pc, uint32_t ir, uint32_t rd, uint32_t value) {
+        sim->fetch(pc, ir);
+    }
+    inline void load(uint32_t pc, uint32_t addr, uint8_t width, uint32_t value) {
+        sim->access(pc, addr, CACHESIM_LOAD);
+    }
+    inline void store(uint32_t pc, uint32_t addr, uint8_t width, uint32_t value) {
+        sim->access(pc, addr, CACHESIM_STORE);
+    }
+    inline void trapEnter(uint32_t cause, uint32_t epc, uint32_t tval) {
+        sim->trap();
+    }
+    inline void trapExit(uint32_t pc) {}
+};
+
+#endif
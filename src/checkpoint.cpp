@@ -0,0 +1,271 @@
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <unistd.h>
+#include <sys/stat.h>
+#include <algorithm>
+#include "checkpoint.h"
+
+/**
+ * Open a checkpoint directory and start the writer thread. The chain continues
+ * after the checkpoints already in the directory, starting with a full one.
+ * @param dir The checkpoint directory, created if missing.
+ */
+Checkpointer::Checkpointer(const char *dir) {
+    this->dir = dir;
+    if (mkdir(dir, 0755) < 0 && errno != EEXIST) {
+        fprintf(stderr, "Error: Could not create checkpoint directory %s\n", dir);
+        exit(1);
+    }
+    std::vector<uint64_t> existing = checkpointList(this->dir);
+    sequence = existing.empty() ? 1 : existing.back() + 1;
+    failed = false;
+    pending = false;
+    stopping = false;
+    writer = std::thread(&Checkpointer::writerLoop, this);
+}
+
+/**
+ * Finish the checkpoint being written and stop the writer thread.
+ */
+Checkpointer::~Checkpointer() {
+    {
+        std::unique_lock<std::mutex> guard(lock);
+        stopping = true;
+    }
+    cond.notify_all();
+    writer.join();
+}
+
+/**
+ * Check if the previous checkpoint is still being written.
+ * @return true if take() would have to wait.
+ */
+bool Checkpointer::isBusy() {
+    std::unique_lock<std::mutex> guard(lock);
+    return pending;
+}
+
+/**
+ * Get the host pointer to one page of a memory device.
+ * @param memory The Ram or Framebuffer.
+ * @param page The page index.
+ * @param len Receives the length of the page, less than RAM_PAGE_SIZE for a partial last page.
+ * @param write true if the page is written, which marks it dirty.
+ * @return The host pointer.
+ */
+template <typename Memory>
+static uint8_t *pagePointer(Memory *memory, uint32_t page, size_t *len, bool write) {
+    DeviceInfo info = memory->getDeviceInfo();
+    uint64_t offset = (uint64_t)page << RAM_PAGE_SHIFT;
+    *len = std::min((uint64_t)RAM_PAGE_SIZE, info.size - offset);
+    return memory->getHostPointer(info.base + offset, *len, write);
+}
+
+/**
+ * Copy the pages of a memory device that go into a checkpoint.
+ * @param memory The Ram or Framebuffer.
+ * @param full true for a full checkpoint, which holds all non-zero pages.
+ * @param pages The dirty pages, replaced by the non-zero ones for a full checkpoint.
+ * @param page_data Receives RAM_PAGE_SIZE bytes per page, a partial last page is padded with zeros.
+ */
+template <typename Memory>
+static void copyPages(Memory *memory, bool full, std::vector<uint32_t> &pages, std::vector<uint8_t> &page_data) {
+    static const uint8_t zero_page[RAM_PAGE_SIZE] = {0};
+    size_t len;
+    if (full) {  // Leave out zero pages, restoring starts from zeroed memory
+        pages.clear();
+        for (uint32_t page = 0; page < memory->getPageCount(); page++) {
+            const uint8_t *host = pagePointer(memory, page, &len, false);
+            if (memcmp(host, zero_page, len) != 0) pages.push_back(page);
+        }
+    }
+    page_data.assign(pages.size() * RAM_PAGE_SIZE, 0);
+    for (size_t i = 0; i < pages.size(); i++) {
+        const uint8_t *host = pagePointer(memory, pages[i], &len, false);
+        memcpy(&page_data[i * RAM_PAGE_SIZE], host, len);
+    }
+}
+
+/**
+ * Take a checkpoint. Must be called between execute batches, waits if the
+ * previous checkpoint is still being written.
+ * @param ram The guest RAM.
+ * @param framebuffer The framebuffer, saved like RAM.
+ * @param cpu The CPU.
+ * @param plic The interrupt controller.
+ */
+void Checkpointer::take(Ram *ram, Framebuffer *framebuffer, Cpu *cpu, Plic *plic) {
+    std::unique_lock<std::mutex> guard(lock);
+    cond.wait(guard, [this] { return !pending; });
+
+    DeviceInfo info = ram->getDeviceInfo();
+    pages.clear();
+    ram->takeDirtyPages(pages);
+    bool full = failed || pages.size() == ram->getPageCount();
+    copyPages(ram, full, pages, page_data);
+    fb_pages.clear();
+    framebuffer->takeDirtyPages(fb_pages);
+    copyPages(framebuffer, full, fb_pages, fb_page_data);
+    cpu->saveState(&cpu_state);
+    plic->saveState(&plic_state);
+
+    memset(&header, 0, sizeof(header));
+    memcpy(header.magic, CHECKPOINT_MAGIC, CHECKPOINT_MAGIC_SIZE);
+    header.flags = full ? CHECKPOINT_FULL : 0;
+    header.page_size = RAM_PAGE_SIZE;
+    header.sequence = sequence++;
+    header.ram_base = info.base;
+    header.ram_size = info.size;
+    header.num_pages = pages.size();
+    header.cpu_state_size = sizeof(CpuState);
+    header.plic_state_size = sizeof(PlicState);
+    header.fb_size = framebuffer->getDeviceInfo().size;
+    header.num_fb_pages = fb_pages.size();
+    failed = false;
+    pending = true;
+    guard.unlock();
+    cond.notify_all();
+}
+
+/**
+ * Body of the writer thread.
+ */
+void Checkpointer::writerLoop() {
+    std::unique_lock<std::mutex> guard(lock);
+    while (true) {
+        cond.wait(guard, [this] { return pending || stopping; });
+        if (!pending) break;
+
+        guard.unlock();
+        bool ok = writeFile();
+        guard.lock();
+        if (!ok) failed = true;
+        pending = false;
+        cond.notify_all();
+    }
+}
+
+/**
+ * Write the pending checkpoint. The file appears under its final name only
+ * once it is complete and synced, a crash leaves at most a temporary file.
+ * @return false if the checkpoint could not be written.
+ */
+bool Checkpointer::writeFile() {
+    std::string path = checkpointPath(dir, header.sequence);
+    std::string temp = path + ".tmp";
+    FILE *file = fopen(temp.c_str(), "wb");
+    if (file == NULL) {
+        fprintf(stderr, "Error: Could not create checkpoint %s\n", temp.c_str());
+        return false;
+    }
+
+    bool ok = fwrite(&header, sizeof(header), 1, file) == 1;
+    ok = ok && fwrite(&cpu_state, sizeof(cpu_state), 1, file) == 1;
+    ok = ok && fwrite(&plic_state, sizeof(plic_state), 1, file) == 1;
+    for (size_t i = 0; ok && i < pages.size(); i++) {
+        ok = fwrite(&pages[i], sizeof(uint32_t), 1, file) == 1;
+        ok = ok && fwrite(&page_data[i * RAM_PAGE_SIZE], RAM_PAGE_SIZE, 1, file) == 1;
+    }
+    for (size_t i = 0; ok && i < fb_pages.size(); i++) {
+        ok = fwrite(&fb_pages[i], sizeof(uint32_t), 1, file) == 1;
+        ok = ok && fwrite(&fb_page_data[i * RAM_PAGE_SIZE], RAM_PAGE_SIZE, 1, file) == 1;
+    }
+    ok = ok && fflush(file) == 0 && fsync(fileno(file)) == 0;
+    ok = (fclose(file) == 0) && ok;
+    ok = ok && rename(temp.c_str(), path.c_str()) == 0;
+    if (!ok) {
+        fprintf(stderr, "Error: Could not write checkpoint %s\n", path.c_str());
+        unlink(temp.c_str());
+    }
+    return ok;
+}
+
+/**
+ * Read page records of a checkpoint into a memory device.
+ * @param file The checkpoint file, positioned at the first record.
+ * @param memory The Ram or Framebuffer.
+ * @param num_pages The number of records.
+ * @return false if the file is truncated or a page is outside the device.
+ */
+template <typename Memory>
+static bool readPages(FILE *file, Memory *memory, uint32_t num_pages) {
+    std::vector<uint8_t> buffer(RAM_PAGE_SIZE);
+    for (uint32_t i = 0; i < num_pages; i++) {
+        uint32_t page;
+        size_t len;
+        if (fread(&page, sizeof(page), 1, file) != 1 || page >= memory->getPageCount()) return false;
+        if (fread(buffer.data(), RAM_PAGE_SIZE, 1, file) != 1) return false;
+        uint8_t *host = pagePointer(memory, page, &len, true);
+        memcpy(host, buffer.data(), len);
+    }
+    return true;
+}
+
+/**
+ * Apply one checkpoint file.
+ * @param path The checkpoint file.
+ * @param ram The guest RAM to write the pages to.
+ * @param framebuffer The framebuffer to write its pages to.
+ * @param cpu_state Receives the CPU state.
+ * @param plic_state Receives the PLIC state.
+ * @param require_full true if the file has to be a full checkpoint.
+ */
+static void applyCheckpoint(const std::string &path, Ram *ram, Framebuffer *framebuffer, CpuState *cpu_state, PlicState *plic_state, bool require_full) {
+    FILE *file = fopen(path.c_str(), "rb");
+    CheckpointHeader header;
+    if (file == NULL || !checkpointReadHeader(file, &header)) {
+        fprintf(stderr, "Error: %s is not a yarve checkpoint\n", path.c_str());
+        exit(1);
+    }
+    DeviceInfo info = ram->getDeviceInfo();
+    if (header.ram_base != info.base || header.ram_size != info.size || header.page_size != RAM_PAGE_SIZE) {
+        fprintf(stderr, "Error: Checkpoint %s was taken with a different RAM configuration\n", path.c_str());
+        exit(1);
+    }
+    if (header.cpu_state_size != sizeof(CpuState) || header.plic_state_size != sizeof(PlicState) ||
+        header.fb_size != framebuffer->getDeviceInfo().size) {
+        fprintf(stderr, "Error: Checkpoint %s was written by a different yarve build\n", path.c_str());
+        exit(1);
+    }
+    if (require_full && !(header.flags & CHECKPOINT_FULL)) {
+        fprintf(stderr, "Error: %s is an incremental checkpoint, restore its directory or collapse it with yarve-ckpt\n", path.c_str());
+        exit(1);
+    }
+
+    bool ok = fread(cpu_state, sizeof(CpuState), 1, file) == 1 && fread(plic_state, sizeof(PlicState), 1, file) == 1;
+    ok = ok && readPages(file, ram, header.num_pages);
+    ok = ok && readPages(file, framebuffer, header.num_fb_pages);
+    fclose(file);
+    if (!ok) {
+        fprintf(stderr, "Error: Checkpoint %s is truncated or corrupt\n", path.c_str());
+        exit(1);
+    }
+}
+
+/**
+ * Restore a checkpoint into freshly created, zeroed RAM and framebuffer.
+ * @param path A checkpoint directory, restored to its newest checkpoint, or a full checkpoint file.
+ * @param ram The guest RAM.
+ * @param framebuffer The framebuffer.
+ * @param cpu_state Receives the CPU state to load after the CPU has been reset.
+ * @param plic_state Receives the PLIC state.
+ */
+void restoreCheckpoint(const char *path, Ram *ram, Framebuffer *framebuffer, CpuState *cpu_state, PlicState *plic_state) {
+    struct stat st;
+    if (stat(path, &st) < 0) {
+        fprintf(stderr, "Error: Could not open checkpoint %s\n", path);
+        exit(1);
+    }
+    if (!S_ISDIR(st.st_mode)) {
+        applyCheckpoint(path, ram, framebuffer, cpu_state, plic_state, true);
+        return;
+    }
+
+    std::vector<std::string> chain = checkpointChain(path);
+    if (chain.empty()) {
+        fprintf(stderr, "Error: No full checkpoint in %s\n", path);
+        exit(1);
+    }
+    for (auto& file : chain) applyCheckpoint(file, ram, framebuffer, cpu_state, plic_state, false);
+}
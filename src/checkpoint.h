@@ -0,0 +1,55 @@
+#ifndef CHECKPOINT_H
+#define CHECKPOINT_H
+
+#include <stdint.h>
+#include <stdio.h>
+#include <string>
+#include <vector>
+#include <thread>
+#include <mutex>
+#include <condition_variable>
+#include "checkpointformat.h"
+#include "cpu.h"
+#include "ram.h"
+#include "plic.h"
+#include "framebuffer.h"
+
+/**
+ * Writes incremental checkpoints of a running machine. take() copies the CPU
+ * and PLIC state and the RAM and framebuffer pages written since the previous checkpoint at a
+ * batch boundary, so the snapshot is consistent while the guest runs on; a
+ * background thread writes it to the checkpoint directory.
+ */
+class Checkpointer {
+    public:
+        Checkpointer(const char *dir);
+        ~Checkpointer();
+        bool isBusy();
+        void take(Ram *ram, Framebuffer *framebuffer, Cpu *cpu, Plic *plic);
+
+    private:
+        void writerLoop();
+        bool writeFile();
+
+        std::string dir;
+        uint64_t sequence;
+        bool failed;  // The previous file was not written, the next one has to be full
+
+        CheckpointHeader header;
+        CpuState cpu_state;
+        PlicState plic_state;
+        std::vector<uint32_t> pages;
+        std::vector<uint8_t> page_data;
+        std::vector<uint32_t> fb_pages;
+        std::vector<uint8_t> fb_page_data;
+
+        std::thread writer;
+        std::mutex lock;
+        std::condition_variable cond;
+        bool pending;
+        bool stopping;
+};
+
+void restoreCheckpoint(const char *path, Ram *ram, Framebuffer *framebuffer, CpuState *cpu_state, PlicState *plic_state);
+
+#endif
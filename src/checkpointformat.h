@@ -0,0 +1,117 @@
+#ifndef CHECKPOINT_FORMAT_H
+#define CHECKPOINT_FORMAT_H
+
+#include <stdint.h>
+#include <stdio.h>
+#include <string.h>
+#include <dirent.h>
+#include <string>
+#include <vector>
+#include <algorithm>
+
+/**
+ * Checkpoint files written by --checkpoint-dir, read by --restore and yarve-ckpt.
+ *
+ * A checkpoint directory holds a chain of files named checkpoint-SEQUENCE.yck.
+ * Each file starts with a CheckpointHeader, followed by the CPU state, the PLIC
+ * state, num_pages RAM page records and num_fb_pages framebuffer page records.
+ * A page record is the 4 byte page index followed by the page contents, a
+ * partial last page is padded with zeros. A full checkpoint (CHECKPOINT_FULL) restores
+ * the machine on its own, zero pages are left out of it. Every later file only
+ * holds the pages written since its predecessor, so a machine is restored by
+ * applying the last full checkpoint and all files after it in order.
+ * The state blobs are plain structs and only valid for the same yarve build.
+ */
+
+#define CHECKPOINT_MAGIC "YRVCKP02"
+#define CHECKPOINT_MAGIC_SIZE 8
+#define CHECKPOINT_PREFIX "checkpoint-"
+#define CHECKPOINT_SUFFIX ".yck"
+
+#define CHECKPOINT_FULL 0x1
+
+typedef struct {
+    char magic[CHECKPOINT_MAGIC_SIZE];
+    uint32_t flags;
+    uint32_t page_size;
+    uint64_t sequence;
+    uint32_t ram_base;
+    uint32_t ram_size;
+    uint32_t num_pages;
+    uint32_t cpu_state_size;
+    uint32_t plic_state_size;
+    uint32_t fb_size;
+    uint32_t num_fb_pages;
+    uint32_t reserved;
+} CheckpointHeader;
+
+/**
+ * Read and validate the header of a checkpoint file.
+ * @param file The file, positioned at its start.
+ * @param header The header to fill.
+ * @return false if the file is not a checkpoint.
+ */
+static inline bool checkpointReadHeader(FILE *file, CheckpointHeader *header) {
+    if (fread(header, sizeof(CheckpointHeader), 1, file) != 1) return false;
+    return memcmp(header->magic, CHECKPOINT_MAGIC, CHECKPOINT_MAGIC_SIZE) == 0 && header->page_size != 0;
+}
+
+/**
+ * Get the file name of a checkpoint.
+ * @param dir The checkpoint directory.
+ * @param sequence The sequence number.
+ * @return The path of the checkpoint file.
+ */
+static inline std::string checkpointPath(const std::string &dir, uint64_t sequence) {
+    char name[64];
+    snprintf(name, sizeof(name), CHECKPOINT_PREFIX "%08llu" CHECKPOINT_SUFFIX, (unsigned long long)sequence);
+    return dir + "/" + name;
+}
+
+/**
+ * List the sequence numbers of the checkpoints in a directory.
+ * @param dir The checkpoint directory.
+ * @return The sequence numbers in ascending order, empty if there are none.
+ */
+static inline std::vector<uint64_t> checkpointList(const std::string &dir) {
+    std::vector<uint64_t> sequences;
+    DIR *d = opendir(dir.c_str());
+    if (d == NULL) return sequences;
+    size_t prefix_len = strlen(CHECKPOINT_PREFIX);
+    size_t suffix_len = strlen(CHECKPOINT_SUFFIX);
+    while (dirent *entry = readdir(d)) {
+        std::string name = entry->d_name;
+        if (name.size() <= prefix_len + suffix_len || name.compare(0, prefix_len, CHECKPOINT_PREFIX) != 0) continue;
+        if (name.compare(name.size() - suffix_len, suffix_len, CHECKPOINT_SUFFIX) != 0) continue;
+        std::string number = name.substr(prefix_len, name.size() - prefix_len - suffix_len);
+        if (number.find_first_not_of("0123456789") != std::string::npos) continue;
+        sequences.push_back(std::stoull(number));
+    }
+    closedir(d);
+    std::sort(sequences.begin(), sequences.end());
+    return sequences;
+}
+
+/**
+ * Get the files needed to restore the newest checkpoint of a directory: the
+ * last full checkpoint and everything after it.
+ * @param dir The checkpoint directory.
+ * @return The paths in the order they have to be applied, empty if there is no full checkpoint.
+ */
+static inline std::vector<std::string> checkpointChain(const std::string &dir) {
+    std::vector<uint64_t> sequences = checkpointList(dir);
+    std::vector<std::string> chain;
+    for (size_t i = sequences.size(); i-- > 0;) {
+        std::string path = checkpointPath(dir, sequences[i]);
+        chain.insert(chain.begin(), path);
+        FILE *file = fopen(path.c_str(), "rb");
+        CheckpointHeader header;
+        bool full = file && checkpointReadHeader(file, &header) && (header.flags & CHECKPOINT_FULL);
+        if (file) fclose(file);
+        if (full) return chain;
+    }
+    chain.clear();
+    return chain;
+}
+
+#endif
@@ -29,7 +29,7 @@ DeviceInfo Clint::getDeviceInfo() {
  * @param addr The address to read from.
  * @return The word read from the CLINT device.
  */
-uint32_t Clint::read(uint32_t addr) {
+uint32_t Clint::read(uint64_t addr) {
     if (addr == (base + 0xbff8)) {
         return cpu->getTimerL();
     } else if (addr == (base + 0xbffc)) {
@@ -44,7 +44,7 @@ uint32_t Clint::read(uint32_t addr) {
  * @param data The data to write.
  * @param width The width of the data to write.
  */
-void Clint::write(uint32_t addr, uint32_t data, uint8_t width) {
+void Clint::write(uint64_t addr, uint32_t data, uint8_t width) {
     if (addr == (base + 0x4000)) {
         cpu->setTimerTriggerL(data);
     } else if (addr == (base + 0x4004)) {
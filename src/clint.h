@@ -13,8 +13,8 @@ class Clint : public BusDevice {
     public:
         Clint(ICpuInterface *cpu, uint32_t base = DEFAULT_CLINT_BASE, size_t size = DEFAULT_CLINT_SIZE);
         DeviceInfo getDeviceInfo();
-        uint32_t read(uint32_t addr);
-        void write(uint32_t addr, uint32_t data, uint8_t width);
+        uint32_t read(uint64_t addr);
+        void write(uint64_t addr, uint32_t data, uint8_t width);
 
     private:
         uint32_t base;
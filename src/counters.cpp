@@ -0,0 +1,165 @@
+#include "cpu.h"
+
+/**
+ * Zicntr, Zihpm and Sscofpmf counters. Nothing is counted per instruction:
+ * instret is brought up to date from the batch start when a CSR is accessed
+ * and when a batch ends, mcycle counts one cycle per retired instruction.
+ * mhpmcounter3-31 count the HPM_EVENT_* events of hooks.h. While one of them
+ * is running the execute loop is instantiated with CounterHooks, otherwise the
+ * events cost nothing. A counter is stored as an offset to its event count, or
+ * as a frozen value while mcountinhibit stops it. Overflows are detected at the
+ * end of each batch. The privilege mode filters of mhpmeventh are not
+ * implemented, the bits read as zero.
+ */
+
+/**
+ * Check the counter enables for reading cycle, time, instret or an hpmcounter below M-mode.
+ * @param csr_num The CSR number.
+ * @return false if the access is illegal.
+ */
+bool Cpu::counterAccessible(uint32_t csr_num) {
+    uint32_t bit = 1 << (csr_num & 0x1f);
+    if (csr_num == SCOUNTOVF) return op_mode == OPMODE_MACHINE || op_mode == OPMODE_SUPERVISOR;
+    if (op_mode < OPMODE_MACHINE && !(csr[MCOUNTEREN] & bit)) return false;
+    if (op_mode < OPMODE_SUPERVISOR && !(csr[SCOUNTEREN] & bit)) return false;
+    return true;
+}
+
+/**
+ * Get the count of the event a counter follows.
+ * @param n The counter number.
+ * @return The event count.
+ */
+uint64_t Cpu::counterSource(uint32_t n) {
+    if (n == 0 || n == 2) return instret;  // One cycle per instruction
+    if (n < 3) return 0;
+    uint32_t event = csr[MHPMEVENT3 + n - 3];
+    if (event == HPM_EVENT_MMIO) return bus->getMmioAccesses();
+    return events.count[event];
+}
+
+/**
+ * Read a counter.
+ * @param n The counter number.
+ * @return The 64 bit value.
+ */
+uint64_t Cpu::readCounter(uint32_t n) {
+    if (csr[MCOUNTINHIBIT] & (1 << n)) return counter_frozen[n];
+    return counterSource(n) + counter_offset[n];
+}
+
+/**
+ * Set a counter, it continues to count from the value.
+ * @param n The counter number.
+ * @param value The 64 bit value.
+ */
+void Cpu::writeCounter(uint32_t n, uint64_t value) {
+    if (csr[MCOUNTINHIBIT] & (1 << n))
+        counter_frozen[n] = value;
+    else
+        counter_offset[n] = value - counterSource(n);
+    counter_last[n] = value;
+}
+
+/**
+ * Read a counter CSR: mcycle, minstret, an mhpmcounter or their unprivileged shadows, their high halves, or scountovf.
+ * RV64 reads the whole counter.
+ * @param csr_num The CSR number, accessible in the current mode.
+ * @return The value of the CSR.
+ */
+uint64_t Cpu::readCounterCsr(uint32_t csr_num) {
+    if (csr_num == SCOUNTOVF) {
+        uint32_t overflow = 0;
+        for (uint32_t n = 3; n < COUNTERS; n++) {
+            if (csr[MHPMEVENTH3 + n - 3] & MHPMEVENTH_OF) overflow |= 1 << n;
+        }
+        return (op_mode == OPMODE_MACHINE) ? overflow : (overflow & csr[MCOUNTEREN]);
+    }
+    uint32_t n = csr_num & 0x1f;
+    if (n == 1 && (csr_num & 0xF00) == (MCYCLE & 0xF00)) return 0;  // No mtime CSR
+    uint64_t value = (n == 1) ? (((uint64_t)timer_h << 32) | timer_l) : readCounter(n);
+    if (xlen == 32) value = (csr_num & 0x80) ? (value >> 32) : (uint32_t)value;
+    if (n == 1 && warp) polls.read(csr_num, value);  // Delay loops spin on time
+    return value;
+}
+
+/**
+ * Write a counter CSR: mcycle, minstret, an mhpmcounter or their high halves,
+ * mcountinhibit, mhpmevent or mhpmeventh. RV64 writes the whole counter, and
+ * the overflow flag with mhpmevent.
+ * @param csr_num The CSR number, accessible in the current mode.
+ * @param value The value to write, read-only bits are kept.
+ */
+void Cpu::writeCounterCsr(uint32_t csr_num, uint64_t value) {
+    if (csr_num == MCOUNTINHIBIT) {
+        value &= ~0x2;  // There is no time counter to inhibit
+        for (uint32_t n = 0; n < COUNTERS; n++) {
+            if (((csr[MCOUNTINHIBIT] ^ value) >> n) & 1) {
+                uint64_t current = readCounter(n);
+                csr[MCOUNTINHIBIT] ^= 1 << n;
+                writeCounter(n, current);
+            }
+        }
+        updateCounting();
+        return;
+    }
+    if (csr_num >= MHPMEVENT3 && csr_num < MHPMEVENT3 + COUNTERS - 3) {
+        uint32_t n = csr_num - MHPMEVENT3 + 3;
+        uint64_t current = readCounter(n);
+        if (xlen == 64) {
+            csr[csr_num - MHPMEVENT3 + MHPMEVENTH3] = (value >> 32) & MHPMEVENTH_OF;
+            value &= ~((uint64_t)MHPMEVENTH_OF << 32);
+        }
+        csr[csr_num] = (value < HPM_EVENTS) ? value : HPM_EVENT_NONE;
+        writeCounter(n, current);
+        updateCounting();
+        return;
+    }
+    if (csr_num >= MHPMEVENTH3 && csr_num < MHPMEVENTH3 + COUNTERS - 3) {
+        csr[csr_num] = value & MHPMEVENTH_OF;
+        return;
+    }
+    uint32_t n = csr_num & 0x1f;
+    if (n == 1) return;  // Not a counter
+    uint64_t current = readCounter(n);
+    if (xlen == 64)
+        writeCounter(n, value);
+    else if (csr_num & 0x80)
+        writeCounter(n, (current & 0xFFFFFFFF) | ((uint64_t)value << 32));
+    else
+        writeCounter(n, (current & ~0xFFFFFFFFULL) | (uint32_t)value);
+}
+
+/**
+ * Select the execute loop with CounterHooks if an mhpmcounter counts an event,
+ * and let the bus count device accesses if one counts those.
+ */
+void Cpu::updateCounting() {
+    bool any = false;
+    bool mmio = false;
+    for (uint32_t n = 3; n < COUNTERS; n++) {
+        uint32_t event = csr[MHPMEVENT3 + n - 3];
+        if (event == HPM_EVENT_NONE || (csr[MCOUNTINHIBIT] & (1 << n))) continue;
+        any = true;
+        mmio |= (event == HPM_EVENT_MMIO);
+    }
+    if (!any) events.branch_pending = false;  // The next batch does not resolve it
+    counting = any;
+    bus->setCountMmio(mmio);
+}
+
+/**
+ * Set the overflow flag and raise the local counter overflow interrupt for
+ * every mhpmcounter that wrapped around since the last check.
+ */
+void Cpu::checkCounterOverflow() {
+    for (uint32_t n = 3; n < COUNTERS; n++) {
+        if (csr[MCOUNTINHIBIT] & (1 << n)) continue;
+        uint64_t value = readCounter(n);
+        if (value < counter_last[n] && !(csr[MHPMEVENTH3 + n - 3] & MHPMEVENTH_OF)) {
+            csr[MHPMEVENTH3 + n - 3] |= MHPMEVENTH_OF;
+            csr[MIP] |= MIP_LCOFIP;
+        }
+        counter_last[n] = value;
+    }
+}
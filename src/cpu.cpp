@@ -6,23 +6,53 @@
  */
 Cpu::Cpu(Bus *bus) {
     this->bus = bus;
+    this->fetch_host = NULL;
+    this->fetch_base = 0;
+    this->plugin = NULL;
+    this->trace = NULL;
+    this->cachesim = NULL;
+    this->sbi = false;
+    this->warp = false;
+    this->xlen = 32;
+    this->warp_stride = WARP_MIN_STRIDE;
 }
 
 /**
  * Reset the CPU.
+ * @param program_counter The address to start at.
+ * @param dtb_base The address of the device tree, passed in a1.
  */
-void Cpu::reset(uint32_t program_counter, uint32_t dtb_base) {
+void Cpu::reset(uint64_t program_counter, uint64_t dtb_base) {
     memset(x, 0, sizeof(x));
+    memset(f, 0, sizeof(f));
+    memset(v, 0, sizeof(v));
     memset(csr, 0, sizeof(csr));
 
     x[11] = dtb_base;
-    csr[MISA] = 0x40401101;
+    csr[MISA] = (xlen == 64) ? MISA_RV64 : MISA_RV32;
     csr[MVENDORID] = 0x12345678;
+    csr[CSR_VTYPE] = VTYPE_VILL;
     timer_h = 0;
     timer_l = 0;
     timer_trigger_h = 0;
     timer_trigger_l = 0;
+    instret = 0;
+    memset(counter_offset, 0, sizeof(counter_offset));
+    memset(counter_frozen, 0, sizeof(counter_frozen));
+    memset(counter_last, 0, sizeof(counter_last));
+    memset(&events, 0, sizeof(events));
+    counting = false;
+    counters_in_use = 0;
+    bus->setCountMmio(false);
+    csr[MCOUNTEREN] = 0x7;  // cycle, time and instret stay readable from user mode
+    csr[SCOUNTEREN] = 0x7;
     op_mode = OPMODE_MACHINE;
+    if (sbi) {  // Start like a firmware would hand over: hart 0 in S-mode, traps delegated, counters readable
+        csr[MEDELEG] = MEDELEG_MASK & ~(1 << EXC_ECALL_S_MODE);
+        csr[MIDELEG] = MIP_SUPERVISOR;
+        csr[MCOUNTEREN] = 0xFFFFFFFF;
+        op_mode = OPMODE_SUPERVISOR;
+    }
     wfi_bit = false;
     pc = program_counter;
 }
@@ -31,26 +61,288 @@ void Cpu::reset(uint32_t program_counter, uint32_t dtb_base) {
  * Trigger a reset.
  */
 void Cpu::triggerReset() {
-    reset_triggered = true;
+    stop_reason = CPU_STOP_RESET;
+}
+
+/**
+ * Trigger a power off. The current execute call returns and the machine shuts
+ * down cleanly, flushing pending device output.
+ */
+void Cpu::triggerPoweroff() {
+    stop_reason = CPU_STOP_POWEROFF;
+}
+
+/**
+ * Attach an instrumentation plugin to the CPU.
+ * @param plugin The plugin or NULL to run uninstrumented.
+ */
+void Cpu::setPlugin(YarvePlugin *plugin) {
+    this->plugin = plugin;
+}
+
+/**
+ * Attach a binary trace writer to the CPU.
+ * @param trace The trace writer or NULL to disable tracing.
+ */
+void Cpu::setTrace(TraceWriter *trace) {
+    this->trace = trace;
+}
+
+/**
+ * Attach a cache and branch predictor simulation to the CPU.
+ * @param cachesim The simulation or NULL to disable it.
+ */
+void Cpu::setCacheSim(CacheSim *cachesim) {
+    this->cachesim = cachesim;
+}
+
+/**
+ * Boot in S-mode with the SBI implemented by the emulator instead of in M-mode.
+ * Takes effect at the next reset.
+ * @param enabled true to boot in S-mode.
+ */
+void Cpu::setSbi(bool enabled) {
+    this->sbi = enabled;
+}
+
+/**
+ * Select the base ISA, RV32 or RV64. Takes effect at the next reset.
+ * @param xlen 32 or 64.
+ */
+void Cpu::setXlen(uint32_t xlen) {
+    this->xlen = xlen;
+}
+
+/**
+ * Fetch an instruction. Code in memory devices is read through a host pointer
+ * to its page, which stays valid as devices are never detached, so only a
+ * jump to another page goes through the bus. Stores reach the same host
+ * memory, self-modifying code needs no invalidation.
+ * @param addr The address of the instruction.
+ * @param exception Set to a defined status in bus.h.
+ * @return The instruction.
+ */
+inline uint32_t Cpu::fetch(uint64_t addr, uint32_t *exception) {
+    if (fetch_host && addr - fetch_base <= FETCH_PAGE_SIZE - 4) {
+        uint32_t ir;
+        memcpy(&ir, fetch_host + (addr - fetch_base), 4);
+        return ir;
+    }
+    uint64_t page = addr & ~(uint64_t)(FETCH_PAGE_SIZE - 1);
+    uint8_t *host = bus->getHostPointer(page, FETCH_PAGE_SIZE, false);
+    if (host) {
+        fetch_host = host;
+        fetch_base = page;
+    }
+    return bus->read(addr, exception);
 }
 
 /**
  * Execute a number of instructions.
  * @param num_instructions The number of instructions to execute.
  * @param elapsed_micros The number of microseconds elapsed.
- * @return 1 if return reason is reset, 0 otherwise.
+ * @return CPU_STOP_RESET or CPU_STOP_POWEROFF if a device requested it, 0 otherwise.
+ */
+uint32_t Cpu::execute(uint32_t num_instructions, uint32_t elapsed_micros) {
+    if (warp) elapsed_micros = warpTime(elapsed_micros);
+    if (xlen == 64) {  // Tracing, cache simulation and plugins have 32 bit interfaces
+        NullHooks hooks;
+        return dispatch<64>(num_instructions, elapsed_micros, hooks);
+    }
+    if (trace) {
+        TraceHooks hooks(trace);
+        return dispatch<32>(num_instructions, elapsed_micros, hooks);
+    }
+    if (cachesim) {
+        CacheSimHooks hooks(cachesim);
+        return dispatch<32>(num_instructions, elapsed_micros, hooks);
+    }
+    if (plugin) {
+        PluginHooks hooks(plugin);
+        return dispatch<32>(num_instructions, elapsed_micros, hooks);
+    }
+    NullHooks hooks;
+    return dispatch<32>(num_instructions, elapsed_micros, hooks);
+}
+
+/**
+ * Execute a number of instructions, counting performance events on top of a
+ * hook policy while an mhpmcounter is running.
+ * @param num_instructions The number of instructions to execute.
+ * @param elapsed_micros The number of microseconds elapsed.
+ * @param hooks The hook policy.
+ * @return CPU_STOP_RESET or CPU_STOP_POWEROFF if a device requested it, 0 otherwise.
+ */
+template <uint32_t XLEN, typename Hooks>
+uint32_t Cpu::dispatch(uint32_t num_instructions, uint32_t elapsed_micros, Hooks &hooks) {
+    if (!counting) return step<XLEN>(num_instructions, elapsed_micros, hooks);
+    CounterHooks<Hooks> counter_hooks(hooks, &events);
+    uint32_t stop_reason = step<XLEN>(num_instructions, elapsed_micros, counter_hooks);
+    checkCounterOverflow();
+    return stop_reason;
+}
+
+/**
+ * Execute a Zba, Zbb or Zbs instruction of the OP or OP-IMM major opcodes.
+ * The builtins compile to single host instructions where the host has them.
+ * @param ir The instruction.
+ * @param rs1 The value of rs1.
+ * @param rs2 The value of rs2, or the sign extended immediate for OP-IMM.
+ * @param rval Set to the result.
+ * @return false if the instruction is not defined.
  */
-bool Cpu::execute(uint32_t num_instructions, uint32_t elapsed_micros) {
-    reset_triggered = false;
+static inline bool executeBitmanip(uint32_t ir, uint32_t rs1, uint32_t rs2, uint32_t *rval) {
+    uint32_t funct3 = (ir >> 12) & 7;
+    uint32_t shamt = rs2 & 0x1f;
+    if (!(ir & 0x20)) {  // OP-IMM, funct3 is 1 or 5
+        switch (ir >> 20) {
+            case 0x287:  // ORC.B
+                if (funct3 != 5) break;
+                *rval = ((((rs1 & 0x7f7f7f7f) + 0x7f7f7f7f) | rs1) & 0x80808080) >> 7;
+                *rval *= 0xff;
+                return true;
+            case 0x698:  // REV8
+                if (funct3 != 5) break;
+                *rval = __builtin_bswap32(rs1);
+                return true;
+            case 0x600:  // CLZ
+                if (funct3 != 1) break;
+                *rval = rs1 ? __builtin_clz(rs1) : 32;
+                return true;
+            case 0x601:  // CTZ
+                if (funct3 != 1) break;
+                *rval = rs1 ? __builtin_ctz(rs1) : 32;
+                return true;
+            case 0x602:  // CPOP
+                if (funct3 != 1) break;
+                *rval = __builtin_popcount(rs1);
+                return true;
+            case 0x604:  // SEXT.B
+                if (funct3 != 1) break;
+                *rval = (int8_t)rs1;
+                return true;
+            case 0x605:  // SEXT.H
+                if (funct3 != 1) break;
+                *rval = (int16_t)rs1;
+                return true;
+        }
+    }
+
+    switch (((ir >> 25) << 3) | funct3) {
+        case (0x10 << 3) | 2:  // SH1ADD
+            *rval = (rs1 << 1) + rs2;
+            return ir & 0x20;
+        case (0x10 << 3) | 4:  // SH2ADD
+            *rval = (rs1 << 2) + rs2;
+            return ir & 0x20;
+        case (0x10 << 3) | 6:  // SH3ADD
+            *rval = (rs1 << 3) + rs2;
+            return ir & 0x20;
+        case (0x20 << 3) | 7:  // ANDN
+            *rval = rs1 & ~rs2;
+            return ir & 0x20;
+        case (0x20 << 3) | 6:  // ORN
+            *rval = rs1 | ~rs2;
+            return ir & 0x20;
+        case (0x20 << 3) | 4:  // XNOR
+            *rval = ~(rs1 ^ rs2);
+            return ir & 0x20;
+        case (0x05 << 3) | 4:  // MIN
+            *rval = ((int32_t)rs1 < (int32_t)rs2) ? rs1 : rs2;
+            return ir & 0x20;
+        case (0x05 << 3) | 5:  // MINU
+            *rval = (rs1 < rs2) ? rs1 : rs2;
+            return ir & 0x20;
+        case (0x05 << 3) | 6:  // MAX
+            *rval = ((int32_t)rs1 > (int32_t)rs2) ? rs1 : rs2;
+            return ir & 0x20;
+        case (0x05 << 3) | 7:  // MAXU
+            *rval = (rs1 > rs2) ? rs1 : rs2;
+            return ir & 0x20;
+        case (0x04 << 3) | 4:  // ZEXT.H
+            *rval = rs1 & 0xffff;
+            return (ir & 0x20) && ((ir >> 20) & 0x1f) == 0;
+        case (0x30 << 3) | 1:  // ROL
+            *rval = (rs1 << shamt) | (rs1 >> ((32 - shamt) & 0x1f));
+            return ir & 0x20;
+        case (0x30 << 3) | 5:  // ROR & RORI
+            *rval = (rs1 >> shamt) | (rs1 << ((32 - shamt) & 0x1f));
+            return true;
+        case (0x24 << 3) | 1:  // BCLR & BCLRI
+            *rval = rs1 & ~(1u << shamt);
+            return true;
+        case (0x24 << 3) | 5:  // BEXT & BEXTI
+            *rval = (rs1 >> shamt) & 1;
+            return true;
+        case (0x34 << 3) | 1:  // BINV & BINVI
+            *rval = rs1 ^ (1u << shamt);
+            return true;
+        case (0x14 << 3) | 1:  // BSET & BSETI
+            *rval = rs1 | (1u << shamt);
+            return true;
+    }
+    return false;
+}
+
+/**
+ * Select the interrupt to take.
+ * @param pending The pending and enabled interrupts, MIP & MIE.
+ * @param mideleg The interrupts delegated to S-mode.
+ * @param op_mode The current privilege mode.
+ * @param mstatus The status register.
+ * @return The cause of the interrupt or 0 if none can be taken.
+ */
+static inline uint32_t selectInterrupt(uint32_t pending, uint32_t mideleg, uint32_t op_mode, uint32_t mstatus) {
+    static const uint32_t priority[7] = {11, 3, 7, 9, 1, 5, 13};  // MEI, MSI, MTI, SEI, SSI, STI, LCOFI
+    uint32_t machine = pending & ~mideleg;
+    uint32_t supervisor = pending & mideleg;
+    if (!(op_mode < OPMODE_MACHINE || (mstatus & MSTATUS_MIE))) machine = 0;
+    if (!(op_mode < OPMODE_SUPERVISOR || (op_mode == OPMODE_SUPERVISOR && (mstatus & MSTATUS_SIE)))) supervisor = 0;
+    uint32_t take = machine ? machine : supervisor;
+    for (uint32_t cause : priority) {
+        if (take & (1 << cause)) return EXC_INTERRUPT | cause;
+    }
+    return 0;
+}
+
+/**
+ * Check for the CSRs that only exist in RV32: the high halves of the counters and mhpmeventh.
+ * @param csr_num The CSR number.
+ * @return true if the CSR is the high half of a 64 bit register.
+ */
+static inline bool isHighHalfCsr(uint32_t csr_num) {
+    if ((csr_num & 0xF60) == CYCLE || (csr_num & 0xF60) == MCYCLE) return csr_num & 0x80;
+    return csr_num >= MHPMEVENTH3 && csr_num <= MHPMEVENTH3 + COUNTERS - 4;
+}
+
+/**
+ * Execute a number of instructions, reporting events to a hook policy.
+ * Instantiated once per base ISA width, RV32 keeps the registers zero extended.
+ * @param num_instructions The number of instructions to execute.
+ * @param elapsed_micros The number of microseconds elapsed.
+ * @param hooks The hook policy, see hooks.h.
+ * @return CPU_STOP_RESET or CPU_STOP_POWEROFF if a device requested it, 0 otherwise.
+ */
+template <uint32_t XLEN, typename Hooks>
+uint32_t Cpu::step(uint32_t num_instructions, uint32_t elapsed_micros, Hooks &hooks) {
+    typedef typename Xlen<XLEN>::u uxlen;
+    typedef typename Xlen<XLEN>::s sxlen;
+    typedef typename Xlen<XLEN>::wide wide;
+    typedef typename Xlen<XLEN>::swide swide;
+
+    stop_reason = 0;
     timer_h += (timer_l + elapsed_micros) < timer_l;
     timer_l += elapsed_micros;
 
-    // Fire Timer interrupt if timer is enabled and has triggered
+    // Fire Timer interrupt if timer is enabled and has triggered, in S-mode boots the SBI timer is forwarded to STIP
+    uint32_t timer_bit = sbi ? MIP_STIP : MIP_MTIP;
     if ((timer_trigger_h || timer_trigger_l) && (timer_h >= timer_trigger_h) && (timer_l >= timer_trigger_l)) {
         wfi_bit = false;
-        csr[MIP] |= 0x80;
+        csr[MIP] |= timer_bit;
     } else
-        csr[MIP] &= ~0x80;
+        csr[MIP] &= ~timer_bit;
+
+    if (csr[MIP] & (MIP_MEIP | MIP_SEIP | MIP_SSIP)) wfi_bit = false;  // Wake up on external and software interrupts
 
     if (wfi_bit) {
         usleep(500);
@@ -58,68 +350,70 @@ bool Cpu::execute(uint32_t num_instructions, uint32_t elapsed_micros) {
     }
 
     uint32_t exception = 0;
-    uint32_t rval = 0;
-    uint32_t cycle = csr[CYCLE_L];
+    uxlen rval = 0;
+    uint64_t batch_start = instret;
+    bool was_counting = counting;  // The hook policy this batch was dispatched with
+    int icount = 0;
 
-    if ((csr[MIP] & 0x80) && (csr[MIE] & 0x80) && (csr[MSTATUS] & 0x8)) {
-        exception = EXC_TIMER_INTERRUPT;
-    } else {
-        for (int icount = 0; icount < num_instructions; icount++) {
+    uint32_t pending = csr[MIP] & csr[MIE];
+    if (pending) exception = selectInterrupt(pending, csr[MIDELEG], op_mode, csr[MSTATUS]);
+    if (!exception) {
+        for (; icount < num_instructions; icount++) {
             rval = 0;
-            cycle++;
 
-            uint32_t ir = bus->read(pc, &exception);
+            uint32_t ir = fetch(pc, &exception);
             if (exception) break;
 
+            uxlen ir_pc = pc;
+
             uint32_t rd = (ir >> 7) & 0x1f;
 
             switch (ir & 0x7f) {
                 case 0x37:  // LUI (0b0110111)
-                    rval = (ir & 0xfffff000);
+                    rval = (sxlen)(int32_t)(ir & 0xfffff000);
                     break;
                 case 0x17:  // AUIPC (0b0010111)
-                    rval = pc + (ir & 0xfffff000);
+                    rval = pc + (sxlen)(int32_t)(ir & 0xfffff000);
                     break;
                 case 0x6F: {  // JAL (0b1101111)
                     int32_t addr = ((ir & 0x80000000) >> 11) | ((ir & 0x7fe00000) >> 20) | ((ir & 0x00100000) >> 9) | ((ir & 0x000ff000));
                     if (addr & 0x00100000) addr |= 0xffe00000;  // Sign extension.
                     rval = pc + 4;
-                    pc = pc + addr - 4;
+                    pc = (uxlen)(pc + (sxlen)addr) - 4;
                     break;
                 }
                 case 0x67: {  // JALR (0b1100111)
-                    uint32_t imm = ir >> 20;
-                    int32_t imm_se = imm | ((imm & 0x800) ? 0xfffff000 : 0);
+                    sxlen imm_se = (int32_t)ir >> 20;
                     rval = pc + 4;
-                    pc = ((x[(ir >> 15) & 0x1f] + imm_se) & ~1) - 4;
+                    pc = (((uxlen)x[(ir >> 15) & 0x1f] + imm_se) & ~(uxlen)1) - 4;
                     break;
                 }
                 case 0x63: {  // Branch (0b1100011)
                     uint32_t imm = ((ir & 0xf00) >> 7) | ((ir & 0x7e000000) >> 20) | ((ir & 0x80) << 4) | ((ir >> 31) << 12);
                     if (imm & 0x1000) imm |= 0xffffe000;
-                    int32_t rs1 = x[(ir >> 15) & 0x1f];
-                    int32_t rs2 = x[(ir >> 20) & 0x1f];
-                    imm = pc + imm - 4;
+                    sxlen rs1 = x[(ir >> 15) & 0x1f];
+                    sxlen rs2 = x[(ir >> 20) & 0x1f];
+                    uxlen target = (uxlen)(pc + (sxlen)(int32_t)imm) - 4;
                     rd = 0;
 
                     switch ((ir >> 12) & 0x7) {
                         case 0:  // BEQ
-                            if (rs1 == rs2) pc = imm;
+                            if (rs1 == rs2) pc = target;
                             break;
                         case 1:  // BNE
-                            if (rs1 != rs2) pc = imm;
+                            if (rs1 != rs2) pc = target;
                             break;
                         case 4:  // BLT
-                            if (rs1 < rs2) pc = imm;
+                            if (rs1 < rs2) pc = target;
                             break;
                         case 5:  // BGE
-                            if (rs1 >= rs2) pc = imm;
+                            if (rs1 >= rs2) pc = target;
                             break;  // BGE
                         case 6:
-                            if ((uint32_t)rs1 < (uint32_t)rs2) pc = imm;
+                            if ((uxlen)rs1 < (uxlen)rs2) pc = target;
                             break;  // BLTU
                         case 7:
-                            if ((uint32_t)rs1 >= (uint32_t)rs2) pc = imm;
+                            if ((uxlen)rs1 >= (uxlen)rs2) pc = target;
                             break;  // BGEU
                         default:
                             exception = 2;  // Invalid opcode
@@ -127,39 +421,54 @@ bool Cpu::execute(uint32_t num_instructions, uint32_t elapsed_micros) {
                     break;
                 }
                 case 0x03: {  // Load (0b0000011)
-                    uint32_t rs1 = x[(ir >> 15) & 0x1f];
-                    uint32_t imm = ir >> 20;
-                    int32_t imm_se = imm | ((imm & 0x800) ? 0xfffff000 : 0);
-                    uint32_t addr = rs1 + imm_se;
+                    uxlen rs1 = x[(ir >> 15) & 0x1f];
+                    sxlen imm_se = (int32_t)ir >> 20;
+                    uxlen addr = rs1 + imm_se;
 
                     switch ((ir >> 12) & 0x7) {
                         case 0:  // LB
-                            rval = (int8_t)bus->read(addr, &exception);
+                            rval = (int8_t)bus->read(addr, &exception, 1);
                             break;
                         case 1:  // LH
-                            rval = (int16_t)bus->read(addr, &exception);
+                            rval = (int16_t)bus->read(addr, &exception, 2);
                             break;
                         case 2:  // LW
-                            rval = bus->read(addr, &exception);
+                            rval = (int32_t)bus->read(addr, &exception);
+                            break;
+                        case 3: {  // LD
+                            if (XLEN == 32) {
+                                exception = 2;
+                                break;
+                            }
+                            uint64_t lo = bus->read(addr, &exception);
+                            if (!exception) rval = lo | ((uint64_t)bus->read(addr + 4, &exception) << 32);
                             break;
+                        }
                         case 4:  // LBU
-                            rval = (uint8_t)bus->read(addr, &exception);
+                            rval = (uint8_t)bus->read(addr, &exception, 1);
                             break;
                         case 5:  // LHU
-                            rval = (uint16_t)bus->read(addr, &exception);
+                            rval = (uint16_t)bus->read(addr, &exception, 2);
+                            break;
+                        case 6:  // LWU
+                            if (XLEN == 32) {
+                                exception = 2;
+                                break;
+                            }
+                            rval = bus->read(addr, &exception);
                             break;
                         default:
                             exception = 2;  // Invalid opcode
                     }
+                    if (!exception) hooks.load(pc, addr, 1 << ((ir >> 12) & 0x3), rval);
                     break;
                 }
                 case 0x23: {  // Store 0b0100011
-                    uint32_t rs1 = x[(ir >> 15) & 0x1f];
-                    uint32_t rs2 = x[(ir >> 20) & 0x1f];
-                    uint32_t addr = ((ir >> 7) & 0x1f) | ((ir & 0xfe000000) >> 20);
-
-                    if (addr & 0x800) addr |= 0xfffff000;
-                    addr += rs1;
+                    uxlen rs1 = x[(ir >> 15) & 0x1f];
+                    uxlen rs2 = x[(ir >> 20) & 0x1f];
+                    uint32_t imm = ((ir >> 7) & 0x1f) | ((ir & 0xfe000000) >> 20);
+                    if (imm & 0x800) imm |= 0xfffff000;
+                    uxlen addr = rs1 + (sxlen)(int32_t)imm;
                     rd = 0;
 
                     switch ((ir >> 12) & 0x7) {
@@ -172,42 +481,163 @@ bool Cpu::execute(uint32_t num_instructions, uint32_t elapsed_micros) {
                         case 2:  // SW
                             exception = bus->write(addr, rs2, 4);
                             break;
+                        case 3:  // SD
+                            if (XLEN == 32) {
+                                exception = 2;
+                                break;
+                            }
+                            if (!bus->isMapped(addr + 4)) {  // Fault before writing anything, not half a doubleword
+                                exception = EXC_STORE_ACCESS_FAULT;
+                                rval = addr;
+                                break;
+                            }
+                            exception = bus->write(addr, rs2, 4);
+                            if (!exception) exception = bus->write(addr + 4, (uint64_t)rs2 >> 32, 4);
+                            break;
                         default:
                             exception = 2;  // Invalid opcode
                     }
+                    if (!exception) {
+                        uint8_t width = 1 << ((ir >> 12) & 0x3);
+                        hooks.store(pc, addr, width, (width >= 4) ? (uint32_t)rs2 : (rs2 & ((1 << (width * 8)) - 1)));
+                    }
+                    break;
+                }
+                case 0x07: {  // FLW & FLD & vector loads (0b0000111)
+                    if (XLEN == 64) {  // F, D and V are RV32 only
+                        exception = 2;
+                        break;
+                    }
+                    uint32_t imm = ir >> 20;
+                    int32_t imm_se = imm | ((imm & 0x800) ? 0xfffff000 : 0);
+                    uint32_t addr = x[(ir >> 15) & 0x1f] + imm_se;
+                    uint32_t width = (ir >> 12) & 0x7;
+
+                    if (width == 0 || width >= 5) {
+                        uint32_t result = 0;
+                        exception = executeVector(ir, &result, &rd);
+                        rval = result;
+                        break;
+                    }
+                    if (!(csr[MSTATUS] & MSTATUS_FS) || (width != 2 && width != 3)) {
+                        exception = 2;  // Invalid opcode
+                        break;
+                    }
+                    uint32_t lo = bus->read(addr, &exception);
+                    uint32_t hi = 0xffffffff;  // NaN-boxing for FLW
+                    if (!exception && width == 3) hi = bus->read(addr + 4, &exception);
+                    if (exception) {
+                        rval = addr;
+                        break;
+                    }
+                    f[rd] = ((uint64_t)hi << 32) | lo;
+                    csr[MSTATUS] |= MSTATUS_FS | MSTATUS_SD;
+                    hooks.load(pc, addr, 1 << width, lo);  // One access, FLD reports its low word
+                    rd = 0;
+                    break;
+                }
+                case 0x27: {  // FSW & FSD & vector stores (0b0100111)
+                    if (XLEN == 64) {
+                        exception = 2;
+                        break;
+                    }
+                    uint32_t addr = ((ir >> 7) & 0x1f) | ((ir & 0xfe000000) >> 20);
+                    if (addr & 0x800) addr |= 0xfffff000;
+                    addr += x[(ir >> 15) & 0x1f];
+                    uint64_t value = f[(ir >> 20) & 0x1f];
+                    uint32_t width = (ir >> 12) & 0x7;
+                    rd = 0;
+
+                    if (width == 0 || width >= 5) {
+                        uint32_t result = 0;
+                        exception = executeVector(ir, &result, &rd);
+                        rval = result;
+                        break;
+                    }
+                    if (!(csr[MSTATUS] & MSTATUS_FS) || (width != 2 && width != 3)) {
+                        exception = 2;  // Invalid opcode
+                        break;
+                    }
+                    if (width == 3 && !bus->isMapped(addr + 4)) {  // Fault before writing anything, not half a double
+                        exception = EXC_STORE_ACCESS_FAULT;
+                        rval = addr;
+                        break;
+                    }
+                    exception = bus->write(addr, (uint32_t)value, 4);
+                    if (!exception && width == 3) exception = bus->write(addr + 4, value >> 32, 4);
+                    if (exception) {
+                        rval = addr;
+                        break;
+                    }
+                    hooks.store(pc, addr, 1 << width, (uint32_t)value);  // One access, FSD reports its low word
+                    break;
+                }
+                case 0x43:  // FMADD (0b1000011)
+                case 0x47:  // FMSUB (0b1000111)
+                case 0x4B:  // FNMSUB (0b1001011)
+                case 0x4F:  // FNMADD (0b1001111)
+                case 0x53: {  // OP-FP (0b1010011)
+                    if (XLEN == 64 || !(csr[MSTATUS] & MSTATUS_FS)) {
+                        exception = 2;  // Invalid opcode
+                        break;
+                    }
+                    uint32_t result = 0;
+                    exception = executeFp(ir, &result, &rd);
+                    rval = result;
+                    break;
+                }
+                case 0x57: {  // OP-V (0b1010111)
+                    if (XLEN == 64) {
+                        exception = 2;
+                        break;
+                    }
+                    uint32_t result = 0;
+                    exception = executeVector(ir, &result, &rd);
+                    rval = result;
                     break;
                 }
                 case 0x13:    // Op-immediate 0b0010011
                 case 0x33: {  // Op           0b0110011
-                    uint32_t imm = ir >> 20;
-                    imm = imm | ((imm & 0x800) ? 0xfffff000 : 0);
-                    uint32_t rs1 = x[(ir >> 15) & 0x1f];
+                    uxlen imm = (sxlen)((int32_t)ir >> 20);
+                    uxlen rs1 = x[(ir >> 15) & 0x1f];
                     uint32_t is_reg = !!(ir & 0x20);
-                    uint32_t rs2 = is_reg ? x[imm & 0x1f] : imm;
+                    uxlen rs2 = is_reg ? (uxlen)x[imm & 0x1f] : imm;
 
-                    if (is_reg && (ir & 0x02000000)) {
-                        switch ((ir >> 12) & 7) {  // 0x02000000 = RV32M
+                    uint32_t funct3 = (ir >> 12) & 7;
+                    uint32_t funct7 = ir >> 25;
+                    if (XLEN == 64 && !is_reg) funct7 &= ~1;  // Bit 5 of the shift amount
+                    bool is_base = is_reg ? (funct7 == 0x00 || (funct7 == 0x20 && (funct3 == 0 || funct3 == 5)))
+                                          : ((funct3 != 1 && funct3 != 5) || funct7 == 0x00 || (funct7 == 0x20 && funct3 == 5));
+
+                    if (!is_base && !(is_reg && funct7 == 0x01)) {
+                        uint32_t result;
+                        if (XLEN == 64 || !executeBitmanip(ir, rs1, rs2, &result))
+                            exception = 2;  // Invalid opcode, bit manipulation is RV32 only
+                        else
+                            rval = result;
+                    } else if (is_reg && funct7 == 0x01) {
+                        switch ((ir >> 12) & 7) {  // funct7 0x01 = M extension
                             case 0:
                                 rval = rs1 * rs2;
                                 break;  // MUL
                             case 1:
-                                rval = ((int64_t)((int32_t)rs1) * (int64_t)((int32_t)rs2)) >> 32;
+                                rval = ((swide)(sxlen)rs1 * (swide)(sxlen)rs2) >> XLEN;
                                 break;  // MULH
                             case 2:
-                                rval = ((int64_t)((int32_t)rs1) * (uint64_t)rs2) >> 32;
+                                rval = ((swide)(sxlen)rs1 * (wide)rs2) >> XLEN;
                                 break;  // MULHSU
                             case 3:
-                                rval = ((uint64_t)rs1 * (uint64_t)rs2) >> 32;
+                                rval = ((wide)rs1 * (wide)rs2) >> XLEN;
                                 break;  // MULHU
                             case 4:
                                 if (rs2 == 0)
                                     rval = -1;
                                 else
-                                    rval = ((int32_t)rs1 == INT32_MIN && (int32_t)rs2 == -1) ? rs1 : ((int32_t)rs1 / (int32_t)rs2);
+                                    rval = (rs1 == (uxlen)1 << (XLEN - 1) && (sxlen)rs2 == -1) ? rs1 : ((sxlen)rs1 / (sxlen)rs2);
                                 break;  // DIV
                             case 5:
                                 if (rs2 == 0)
-                                    rval = 0xffffffff;
+                                    rval = -1;
                                 else
                                     rval = rs1 / rs2;
                                 break;  // DIVU
@@ -215,7 +645,7 @@ bool Cpu::execute(uint32_t num_instructions, uint32_t elapsed_micros) {
                                 if (rs2 == 0)
                                     rval = rs1;
                                 else
-                                    rval = ((int32_t)rs1 == INT32_MIN && (int32_t)rs2 == -1) ? 0 : ((uint32_t)((int32_t)rs1 % (int32_t)rs2));
+                                    rval = (rs1 == (uxlen)1 << (XLEN - 1) && (sxlen)rs2 == -1) ? 0 : ((uxlen)((sxlen)rs1 % (sxlen)rs2));
                                 break;  // REM
                             case 7:
                                 if (rs2 == 0)
@@ -230,10 +660,10 @@ bool Cpu::execute(uint32_t num_instructions, uint32_t elapsed_micros) {
                                 rval = (is_reg && (ir & 0x40000000)) ? (rs1 - rs2) : (rs1 + rs2);
                                 break;
                             case 1:  // SLL
-                                rval = rs1 << (rs2 & 0x1F);
+                                rval = rs1 << (rs2 & (XLEN - 1));
                                 break;
                             case 2:  // SLT
-                                rval = (int32_t)rs1 < (int32_t)rs2;
+                                rval = (sxlen)rs1 < (sxlen)rs2;
                                 break;
                             case 3:  // SLTU
                                 rval = rs1 < rs2;
@@ -242,7 +672,7 @@ bool Cpu::execute(uint32_t num_instructions, uint32_t elapsed_micros) {
                                 rval = rs1 ^ rs2;
                                 break;
                             case 5:  // SRL & SRA
-                                rval = (ir & 0x40000000) ? (((int32_t)rs1) >> (rs2 & 0x1F)) : (rs1 >> (rs2 & 0x1F));
+                                rval = (ir & 0x40000000) ? (((sxlen)rs1) >> (rs2 & (XLEN - 1))) : (rs1 >> (rs2 & (XLEN - 1)));
                                 break;
                             case 6:  // OR
                                 rval = rs1 | rs2;
@@ -254,6 +684,58 @@ bool Cpu::execute(uint32_t num_instructions, uint32_t elapsed_micros) {
                     }
                     break;
                 }
+                case 0x1b:    // Op-immediate-32 0b0011011, RV64 only
+                case 0x3b: {  // Op-32           0b0111011
+                    if (XLEN == 32) {
+                        exception = 2;
+                        break;
+                    }
+                    uint32_t rs1 = x[(ir >> 15) & 0x1f];
+                    uint32_t is_reg = !!(ir & 0x20);
+                    uint32_t rs2 = is_reg ? (uint32_t)x[(ir >> 20) & 0x1f] : (uint32_t)((int32_t)ir >> 20);
+                    uint32_t funct3 = (ir >> 12) & 7;
+                    uint32_t funct7 = ir >> 25;
+                    int32_t result = 0;
+
+                    if (is_reg && funct7 == 0x01) {
+                        switch (funct3) {
+                            case 0:  // MULW
+                                result = rs1 * rs2;
+                                break;
+                            case 4:  // DIVW
+                                if (rs2 == 0)
+                                    result = -1;
+                                else
+                                    result = ((int32_t)rs1 == INT32_MIN && (int32_t)rs2 == -1) ? rs1 : ((int32_t)rs1 / (int32_t)rs2);
+                                break;
+                            case 5:  // DIVUW
+                                result = (rs2 == 0) ? 0xffffffff : rs1 / rs2;
+                                break;
+                            case 6:  // REMW
+                                if (rs2 == 0)
+                                    result = rs1;
+                                else
+                                    result = ((int32_t)rs1 == INT32_MIN && (int32_t)rs2 == -1) ? 0 : ((int32_t)rs1 % (int32_t)rs2);
+                                break;
+                            case 7:  // REMUW
+                                result = (rs2 == 0) ? rs1 : rs1 % rs2;
+                                break;
+                            default:
+                                exception = 2;
+                        }
+                    } else if (funct3 == 0 && (!is_reg || funct7 == 0x00 || funct7 == 0x20)) {  // ADDIW & ADDW & SUBW
+                        result = (is_reg && funct7 == 0x20) ? (rs1 - rs2) : (rs1 + rs2);
+                    } else if (funct3 == 1 && funct7 == 0x00) {  // SLLIW & SLLW
+                        result = rs1 << (rs2 & 0x1f);
+                    } else if (funct3 == 5 && funct7 == 0x00) {  // SRLIW & SRLW
+                        result = rs1 >> (rs2 & 0x1f);
+                    } else if (funct3 == 5 && funct7 == 0x20) {  // SRAIW & SRAW
+                        result = (int32_t)rs1 >> (rs2 & 0x1f);
+                    } else
+                        exception = 2;  // Invalid opcode
+                    rval = (sxlen)result;
+                    break;
+                }
                 case 0x0f:  // Fence 0b0001111
                     rd = 0;
                     break;
@@ -263,9 +745,18 @@ bool Cpu::execute(uint32_t num_instructions, uint32_t elapsed_micros) {
 
                     if ((micro_op & 3)) {  // Zicsr
                         int rs1imm = (ir >> 15) & 0x1f;
-                        uint32_t rs1 = x[rs1imm];
-                        uint32_t writeval = rs1;
-                        rval = csr[csr_num];
+                        uxlen rs1 = x[rs1imm];
+                        uxlen writeval = rs1;
+                        bool fp_csr = (csr_num >= FFLAGS && csr_num <= FCSR);
+                        bool vector_csr = (csr_num >= CSR_VSTART && csr_num <= CSR_VCSR) || (csr_num >= CSR_VL && csr_num <= CSR_VLENB);
+                        bool counter_csr = ((csr_num & 0xF60) == CYCLE) || csr_num == SCOUNTOVF;
+                        if (op_mode < ((csr_num >> 8) & 3) || (fp_csr && !(csr[MSTATUS] & MSTATUS_FS)) || (vector_csr && !(csr[MSTATUS] & MSTATUS_VS)) ||
+                            (counter_csr && !counterAccessible(csr_num)) || (XLEN == 64 && isHighHalfCsr(csr_num))) {
+                            exception = 2;  // Too privileged, floating point or vector unit is off, counter not enabled, or RV32 only
+                            break;
+                        }
+                        instret = batch_start + icount;  // Counters are read from the retired instructions before this one
+                        rval = readCsr(csr_num);
 
                         switch (micro_op) {
                             case 1:
@@ -284,29 +775,62 @@ bool Cpu::execute(uint32_t num_instructions, uint32_t elapsed_micros) {
                                 writeval = rval | rs1imm;
                                 break;  // CSRRSI
                             case 7:
-                                writeval = rval & ~rs1imm;
+                                writeval = rval & ~(uxlen)rs1imm;
                                 break;  // CSRRCI
                         }
-                        csr[csr_num] = writeval;
+                        writeCsr(csr_num, writeval);
+                        if (counting != was_counting) num_instructions = icount + 1;  // Switch the hook policy after this instruction
                     } else if (micro_op == 0x0)  // System instruction
                     {
                         rd = 0;
                         if (csr_num == 0x105) {   // WFI
                             csr[MSTATUS] |= 0x8;  // Enable interrupts
                             wfi_bit = true;
-                            pc += 4;
+                            hooks.retire(pc, ir, 0, 0);
+                            pc = (uxlen)(pc + 4);
+                            instret = batch_start + icount + 1;
                             return 0;
-                        } else if (((csr_num & 0xff) == 0x02)) {  // MRET & URET & SRET
-                            uint32_t old_mstatus = csr[MSTATUS];
+                        } else if ((ir >> 25) == 0x09) {  // SFENCE.VMA, there is no address translation to flush
+                            if (op_mode == OPMODE_USER) exception = 2;
+                        } else if (csr_num == 0x102) {  // SRET
+                            if (op_mode == OPMODE_USER) {
+                                exception = 2;
+                                break;
+                            }
+                            uint64_t old_mstatus = csr[MSTATUS];
+                            csr[MSTATUS] = (old_mstatus & ~(MSTATUS_SIE | MSTATUS_SPIE | MSTATUS_SPP)) | ((old_mstatus & MSTATUS_SPIE) >> 4) | MSTATUS_SPIE;
+                            op_mode = (old_mstatus & MSTATUS_SPP) ? OPMODE_SUPERVISOR : OPMODE_USER;
+                            pc = (uxlen)csr[SEPC] - 4;
+                            hooks.trapExit(csr[SEPC]);
+                        } else if (csr_num == 0x302) {  // MRET
+                            if (op_mode != OPMODE_MACHINE) {
+                                exception = 2;
+                                break;
+                            }
+                            uint64_t old_mstatus = csr[MSTATUS];
                             uint32_t old_op_mode = op_mode;
-                            csr[MSTATUS] = ((old_mstatus & 0x80) >> 4) | (old_op_mode << 11) | 0x80;
+                            csr[MSTATUS] = (old_mstatus & (MSTATUS_FS | MSTATUS_VS | MSTATUS_SD | MSTATUS_SIE | MSTATUS_SPIE | MSTATUS_SPP)) | ((old_mstatus & 0x80) >> 4) | (old_op_mode << 11) | 0x80;
                             op_mode = (old_mstatus >> 11) & 3;
-                            pc = csr[MEPC] - 4;
+                            pc = (uxlen)csr[MEPC] - 4;
+                            hooks.trapExit(csr[MEPC]);
                         } else {
                             switch (csr_num) {
-                                case 0:
-                                    exception = (op_mode) ? 11 : 8;
-                                    break;  // ECALL
+                                case 0:  // ECALL
+                                    if (sbi && op_mode == OPMODE_SUPERVISOR) {  // SBI call, handled without firmware
+                                        instret = batch_start + icount;  // The PMU extension reads the counters
+                                        bool suspend = handleSbiCall();
+                                        if (counting != was_counting) num_instructions = icount + 1;
+                                        if (suspend) {  // Suspended until the next interrupt
+                                            wfi_bit = true;
+                                            hooks.retire(pc, ir, 0, 0);
+                                            pc = (uxlen)(pc + 4);
+                                            instret = batch_start + icount + 1;
+                                            return stop_reason;
+                                        }
+                                        break;
+                                    }
+                                    exception = EXC_ECALL_U_MODE + op_mode;
+                                    break;
                                 case 1:
                                     exception = 3;
                                     break;  // EBREAK 3
@@ -319,85 +843,127 @@ bool Cpu::execute(uint32_t num_instructions, uint32_t elapsed_micros) {
                         exception = 2;  // Invalid opcode
                     break;
                 }
-                case 0x2f: {  // RV32A (0b00101111)
-                    uint32_t rs1 = x[(ir >> 15) & 0x1f];
-                    uint32_t rs2 = x[(ir >> 20) & 0x1f];
+                case 0x2f: {  // A extension (0b00101111)
+                    uxlen rs1 = x[(ir >> 15) & 0x1f];
+                    uxlen rs2 = x[(ir >> 20) & 0x1f];
                     uint32_t irmid = (ir >> 27) & 0x1f;
+                    bool is_double = ((ir >> 12) & 7) == 3;
 
-                    rval = bus->read(rs1, &exception);
+                    if (((ir >> 12) & 7) != 2 && (XLEN == 32 || !is_double)) {
+                        exception = 2;  // Only .W, and .D in RV64
+                        break;
+                    }
+                    if (is_double && !bus->isMapped(rs1 + 4)) {  // Fault before touching anything, not half a doubleword
+                        exception = EXC_STORE_ACCESS_FAULT;
+                        rval = rs1;
+                        break;
+                    }
+                    if (is_double) {
+                        uint64_t lo = bus->read(rs1, &exception);
+                        if (!exception) rval = lo | ((uint64_t)bus->read(rs1 + 4, &exception) << 32);
+                    } else {
+                        rval = (int32_t)bus->read(rs1, &exception);
+                        rs2 = (int32_t)rs2;  // Compare the low words in RV64
+                    }
                     if (exception) break;
+                    if (irmid != 3) hooks.load(pc, rs1, is_double ? 8 : 4, rval);
 
                     uint32_t dowrite = 1;
                     switch (irmid) {
-                        case 2:  // LR.W
+                        case 2:  // LR
                             dowrite = 0;
                             reservation_addr = rs1;  // Set reservation address
                             break;
-                        case 3:                                // SC.W
+                        case 3:                                // SC
                             rval = (reservation_addr != rs1);  // Check reservation address and only write if it matches
                             dowrite = !rval;
                             break;
                         case 1:
-                            break;  // AMOSWAP.W
+                            break;  // AMOSWAP
                         case 0:
                             rs2 += rval;
-                            break;  // AMOADD.W
+                            break;  // AMOADD
                         case 4:
                             rs2 ^= rval;
-                            break;  // AMOXOR.W
+                            break;  // AMOXOR
                         case 12:
                             rs2 &= rval;
-                            break;  // AMOAND.W
+                            break;  // AMOAND
                         case 8:
                             rs2 |= rval;
-                            break;  // AMOOR.W
+                            break;  // AMOOR
                         case 16:
-                            rs2 = ((int32_t)rs2 < (int32_t)rval) ? rs2 : rval;
-                            break;  // AMOMIN.W
+                            rs2 = ((sxlen)rs2 < (sxlen)rval) ? rs2 : rval;
+                            break;  // AMOMIN
                         case 20:
-                            rs2 = ((int32_t)rs2 > (int32_t)rval) ? rs2 : rval;
-                            break;  // AMOMAX.W
+                            rs2 = ((sxlen)rs2 > (sxlen)rval) ? rs2 : rval;
+                            break;  // AMOMAX
                         case 24:
                             rs2 = (rs2 < rval) ? rs2 : rval;
-                            break;  // AMOMINU.W
+                            break;  // AMOMINU
                         case 28:
                             rs2 = (rs2 > rval) ? rs2 : rval;
-                            break;  // AMOMAXU.W
+                            break;  // AMOMAXU
                         default:
                             exception = 2;
                             dowrite = 0;
                             break;
                     }
-                    if (dowrite) bus->write(rs1, rs2, 4);
+                    if (dowrite) {
+                        exception = bus->write(rs1, rs2, 4);
+                        if (!exception && is_double) exception = bus->write(rs1 + 4, (uint64_t)rs2 >> 32, 4);
+                        if (exception) {
+                            rval = rs1;
+                            break;
+                        }
+                        hooks.store(pc, rs1, is_double ? 8 : 4, rs2);
+                    }
                     break;
                 }
                 default:
                     exception = 2;  // Invalid opcode
             }
 
-            if (reset_triggered) return 1;  // If reset triggered, break out of loop
-            if (exception) break;           // If exception, break out of loop
-            if (rd) x[rd] = rval;           // If rd is set, write the return value to the register
-            pc += 4;                        // Increment the program counter
+            if (stop_reason) {  // If reset or power off triggered, break out of loop
+                instret = batch_start + icount;
+                return stop_reason;
+            }
+            if (exception) break;                 // If exception, break out of loop
+            if (rd) x[rd] = rval;                 // If rd is set, write the return value to the register
+            hooks.retire(ir_pc, ir, rd, rval);
+            pc = (uxlen)(pc + 4);                 // Increment the program counter
         }
     }
 
-    if (exception) {                   // Handle exceptions
-        if (exception & 0x80000000) {  // Handle an Interrupt (MSB set)
-            csr[MTVAL] = 0;
+    if (exception) {  // Handle exceptions
+        uxlen tval;
+        if (exception & EXC_INTERRUPT) {  // Handle an Interrupt (MSB set)
+            tval = 0;
         } else {
-            csr[MTVAL] = (exception > 4 && exception <= 7) ? rval : pc;
+            tval = (exception > 4 && exception <= 7) ? rval : (uxlen)pc;
         }
+        uxlen cause = (exception & ~EXC_INTERRUPT) | ((uxlen)(exception & EXC_INTERRUPT) << (XLEN - 32));  // The interrupt bit is the MSB
 
-        csr[MCAUSE] = exception;                                        // Store the exception cause
-        csr[MEPC] = pc;                                                 // Store the program counter
-        csr[MSTATUS] = ((csr[MSTATUS] & 0x08) << 4) | (op_mode << 11);  // Store the status register
-        pc = csr[MTVEC];                                                // Set the program counter to the exception handler address
-        op_mode = OPMODE_MACHINE;                                       // Set the operation mode to machine mode
+        hooks.trapEnter(exception, pc, tval);
+        uint32_t delegated = (exception & EXC_INTERRUPT) ? csr[MIDELEG] : csr[MEDELEG];
+        if (op_mode != OPMODE_MACHINE && (delegated & (1 << (exception & 0x1f)))) {  // Trap to S-mode
+            csr[SCAUSE] = cause;
+            csr[SEPC] = pc;
+            csr[STVAL] = tval;
+            csr[MSTATUS] = (csr[MSTATUS] & ~(MSTATUS_SIE | MSTATUS_SPIE | MSTATUS_SPP)) | ((csr[MSTATUS] & MSTATUS_SIE) << 4) | (op_mode << 8);
+            pc = (uxlen)csr[STVEC] & ~(uxlen)3;
+            op_mode = OPMODE_SUPERVISOR;
+        } else {
+            csr[MTVAL] = tval;
+            csr[MCAUSE] = cause;      // Store the exception cause
+            csr[MEPC] = pc;           // Store the program counter
+            csr[MSTATUS] = (csr[MSTATUS] & (MSTATUS_FS | MSTATUS_VS | MSTATUS_SD | MSTATUS_SIE | MSTATUS_SPIE | MSTATUS_SPP)) | ((csr[MSTATUS] & 0x08) << 4) | (op_mode << 11);  // Store the status register
+            pc = (uxlen)csr[MTVEC];    // Set the program counter to the exception handler address
+            op_mode = OPMODE_MACHINE;  // Set the operation mode to machine mode
+        }
     }
 
-    if (csr[CYCLE_L] > cycle) csr[CYCLE_H]++;  // Increment the cycle high register if the low register has overflowed
-    csr[CYCLE_L] = cycle;                      // Set the cycle low register to the current cycle count
+    instret = batch_start + icount;  // The trapping instruction did not retire
     return 0;
 }
 
@@ -431,4 +997,167 @@ void Cpu::setTimerTriggerH(uint32_t value) {
  */
 void Cpu::setTimerTriggerL(uint32_t value) {
     timer_trigger_l = value;
+}
+
+/**
+ * Set the state of the external interrupt line, which goes to S-mode in S-mode boots.
+ * @param pending true if an external interrupt is pending.
+ */
+void Cpu::setExternalInterrupt(bool pending) {
+    uint32_t bit = sbi ? MIP_SEIP : MIP_MEIP;
+    if (pending)
+        csr[MIP] |= bit;
+    else
+        csr[MIP] &= ~bit;
+}
+
+/**
+ * Read a CSR, including the S-mode views of the M-mode registers.
+ * @param csr_num The CSR number, accessible in the current mode.
+ * @return The value of the CSR.
+ */
+uint64_t Cpu::readCsr(uint32_t csr_num) {
+    switch (csr_num) {
+        case FFLAGS:
+        case FRM:
+        case FCSR:
+            return readFpCsr(csr_num);
+        case MSTATUS:  // UXL and SXL are fixed to the base ISA
+            return csr[MSTATUS] | ((xlen == 64) ? MSTATUS_XL64 : 0);
+        case SSTATUS:
+            return (csr[MSTATUS] & SSTATUS_MASK) | ((xlen == 64) ? SSTATUS_UXL64 : 0);
+        case SIE:
+            return csr[MIE] & csr[MIDELEG];
+        case SIP:
+            return csr[MIP] & csr[MIDELEG];
+        case SCOUNTOVF:
+            return readCounterCsr(csr_num);
+        default:
+            if ((csr_num & 0xF60) == MCYCLE || (csr_num & 0xF60) == CYCLE) return readCounterCsr(csr_num);
+            if ((csr_num >= CSR_VSTART && csr_num <= CSR_VCSR) || (csr_num >= CSR_VL && csr_num <= CSR_VLENB)) return readVectorCsr(csr_num);
+            if (xlen == 64 && csr_num >= MHPMEVENT3 && csr_num <= MHPMEVENT3 + COUNTERS - 4)  // RV64 holds mhpmeventh in the upper half
+                return csr[csr_num] | (csr[csr_num - MHPMEVENT3 + MHPMEVENTH3] << 32);
+            return csr[csr_num];
+    }
+}
+
+/**
+ * Write a CSR, including the S-mode views of the M-mode registers.
+ * @param csr_num The CSR number, accessible in the current mode.
+ * @param value The value to write, read-only bits are kept.
+ */
+void Cpu::writeCsr(uint32_t csr_num, uint64_t value) {
+    switch (csr_num) {
+        case FFLAGS:
+        case FRM:
+        case FCSR:
+            writeFpCsr(csr_num, value);
+            return;
+        case SSTATUS:
+            csr_num = MSTATUS;
+            value = (csr[MSTATUS] & ~SSTATUS_MASK) | (value & SSTATUS_MASK);
+            break;
+        case SIE:
+            csr[MIE] = (csr[MIE] & ~csr[MIDELEG]) | (value & csr[MIDELEG]);
+            return;
+        case SIP:  // Only the software and counter overflow interrupts can be set or cleared
+            csr[MIP] = (csr[MIP] & ~(csr[MIDELEG] & (MIP_SSIP | MIP_LCOFIP))) | (value & csr[MIDELEG] & (MIP_SSIP | MIP_LCOFIP));
+            return;
+        case MIP:
+            csr[MIP] = (csr[MIP] & ~MIP_SUPERVISOR) | (value & MIP_SUPERVISOR);
+            return;
+        case MIDELEG:
+            csr[MIDELEG] = value & MIP_SUPERVISOR;
+            return;
+        case MEDELEG:
+            csr[MEDELEG] = value & MEDELEG_MASK;
+            return;
+        case SATP:
+            if ((xlen == 64) ? (value >> 60) : (value & 0x80000000)) return;  // Only bare addressing, other modes leave satp unchanged
+            break;
+        case MCOUNTINHIBIT:
+            writeCounterCsr(csr_num, value);
+            return;
+        default:
+            if ((csr_num >= CSR_VSTART && csr_num <= CSR_VCSR) || (csr_num >= CSR_VL && csr_num <= CSR_VLENB)) {
+                writeVectorCsr(csr_num, value);
+                return;
+            }
+            if ((csr_num & 0xF60) == MCYCLE || (csr_num >= MHPMEVENT3 && csr_num <= MHPMEVENT3 + COUNTERS - 4) ||
+                (csr_num >= MHPMEVENTH3 && csr_num <= MHPMEVENTH3 + COUNTERS - 4)) {
+                writeCounterCsr(csr_num, value);
+                return;
+            }
+            if ((csr_num >> 10) == 3) return;  // Read-only
+            break;
+    }
+    if (csr_num == MSTATUS && xlen == 64)  // There is no F, D or V in RV64, the upper half is read-only
+        value = (uint32_t)value & ~(MSTATUS_FS | MSTATUS_VS);
+    if (csr_num == MSTATUS)  // SD summarizes FS and VS and cannot be written
+        value = (value & ~MSTATUS_SD) | (((value & MSTATUS_FS) == MSTATUS_FS || (value & MSTATUS_VS) == MSTATUS_VS) ? MSTATUS_SD : 0);
+    csr[csr_num] = value;
+}
+
+/**
+ * Get the number of retired instructions. The count is updated once per
+ * execute batch, so devices see the value at the start of the current batch.
+ * @return The 64 bit instruction count.
+ */
+uint64_t Cpu::getInstructionCount() {
+    return instret;
+}
+
+/**
+ * Check if the hart waits in WFI (or an SBI suspend) for an interrupt.
+ * @return true until the next interrupt is taken.
+ */
+bool Cpu::isWaiting() {
+    return wfi_bit;
+}
+
+/**
+ * Save the architectural state. Only valid between execute calls.
+ * @param state The state to fill.
+ */
+void Cpu::saveState(CpuState *state) {
+    memset(state, 0, sizeof(CpuState));
+    state->pc = pc;
+    memcpy(state->x, x, sizeof(x));
+    memcpy(state->f, f, sizeof(f));
+    memcpy(state->v, v, sizeof(v));
+    memcpy(state->csr, csr, sizeof(csr));
+    for (uint32_t n = 0; n < COUNTERS; n++) state->counters[n] = readCounter(n);
+    state->instret = instret;
+    state->counters_in_use = counters_in_use;
+    state->reservation_addr = reservation_addr;
+    state->timer_l = timer_l;
+    state->timer_h = timer_h;
+    state->timer_trigger_l = timer_trigger_l;
+    state->timer_trigger_h = timer_trigger_h;
+    state->op_mode = op_mode;
+    state->wfi_bit = wfi_bit;
+}
+
+/**
+ * Restore the architectural state saved by saveState.
+ * @param state The saved state.
+ */
+void Cpu::loadState(const CpuState *state) {
+    pc = state->pc;
+    memcpy(x, state->x, sizeof(x));
+    memcpy(f, state->f, sizeof(f));
+    memcpy(v, state->v, sizeof(v));
+    memcpy(csr, state->csr, sizeof(csr));
+    instret = state->instret;
+    memset(&events, 0, sizeof(events));  // Counters are restored as values, the event counts start over
+    for (uint32_t n = 0; n < COUNTERS; n++) writeCounter(n, state->counters[n]);
+    counters_in_use = state->counters_in_use;
+    updateCounting();
+    reservation_addr = state->reservation_addr;
+    timer_l = state->timer_l;
+    timer_h = state->timer_h;
+    timer_trigger_l = state->timer_trigger_l;
+    timer_trigger_h = state->timer_trigger_h;
+    op_mode = state->op_mode;
+    wfi_bit = state->wfi_bit;
 }
\ No newline at end of file
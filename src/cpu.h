@@ -6,6 +6,9 @@
 #include <stdio.h>
 #include <unistd.h>
 #include "bus.h"
+#include "hooks.h"
+#include "trace.h"
+#include "cachesim.h"
 
 #define DEFAULT_CPU_PC 0x80000000
 #define DEFAULT_DTB_BASE 0x87F00000
@@ -16,12 +19,41 @@
 #define EXC_LOAD_ACCESS_FAULT 5
 #define EXC_STORE_ACCESS_FAULT 7
 #define EXC_ECALL_U_MODE 8
+#define EXC_ECALL_S_MODE 9
 #define EXC_ECALL_M_MODE 11
+#define EXC_INTERRUPT 0x80000000  // Set in the cause of interrupts, the low bits are the MIP bit
 #define EXC_TIMER_INTERRUPT 0x80000007
+#define EXC_EXTERNAL_INTERRUPT 0x8000000B
 
+#define FFLAGS 0x001
+#define FRM 0x002
+#define FCSR 0x003
+#define CSR_VSTART 0x008
+#define CSR_VXSAT 0x009
+#define CSR_VXRM 0x00A
+#define CSR_VCSR 0x00F
+#define SSTATUS 0x100
+#define SIE 0x104
+#define STVEC 0x105
+#define SCOUNTEREN 0x106
+#define SSCRATCH 0x140
+#define SEPC 0x141
+#define SCAUSE 0x142
+#define STVAL 0x143
+#define SIP 0x144
+#define SATP 0x180
 #define MSTATUS 0x300
-#define CYCLE_L 0xC00
-#define CYCLE_H 0xC80
+#define MEDELEG 0x302
+#define MIDELEG 0x303
+#define MCOUNTEREN 0x306
+#define MCOUNTINHIBIT 0x320
+#define MHPMEVENT3 0x323   // Up to MHPMEVENT31 0x33F
+#define MHPMEVENTH3 0x723  // Up to MHPMEVENTH31 0x73F, holds the Sscofpmf bits
+#define MCYCLE 0xB00       // MINSTRET 0xB02 and the MHPMCOUNTERs follow, the high halves are at 0xB80
+#define MCYCLEH 0xB80
+#define CYCLE 0xC00        // TIME 0xC01, INSTRET 0xC02 and the HPMCOUNTERs follow, the high halves are at 0xC80
+#define CYCLEH 0xC80
+#define SCOUNTOVF 0xDA0
 #define MSCRATCH 0x340
 #define MTVEC 0x305
 #define MEPC 0x341
@@ -31,45 +63,190 @@
 #define MIE 0x304
 #define MISA 0x301
 #define MVENDORID 0xF11
+#define CSR_VL 0xC20
+#define CSR_VTYPE 0xC21
+#define CSR_VLENB 0xC22
+
+#define MSTATUS_SIE 0x2
+#define MSTATUS_MIE 0x8
+#define MSTATUS_SPIE 0x20
+#define MSTATUS_MPIE 0x80
+#define MSTATUS_SPP 0x100
+#define MSTATUS_FS 0x6000  // Floating point state, dirty when both bits are set
+#define MSTATUS_VS 0x0600  // Vector state, dirty when both bits are set
+#define MSTATUS_SD 0x80000000
+#define MSTATUS_XL64 0xA00000000ULL  // UXL and SXL of RV64, read-only
+#define SSTATUS_UXL64 0x200000000ULL
+#define SSTATUS_MASK (MSTATUS_SIE | MSTATUS_SPIE | MSTATUS_SPP | MSTATUS_FS | MSTATUS_VS | 0xC0000 | MSTATUS_SD)  // With SUM and MXR
+
+#define MIP_SSIP 0x2
+#define MIP_STIP 0x20
+#define MIP_MTIP 0x80
+#define MIP_SEIP 0x200
+#define MIP_MEIP 0x800
+#define MIP_LCOFIP 0x2000  // Local counter overflow
+#define MIP_SUPERVISOR (MIP_SSIP | MIP_STIP | MIP_SEIP | MIP_LCOFIP)
+#define MEDELEG_MASK 0xB3FF  // Everything but ECALL from M-mode
+
+#define MHPMEVENTH_OF 0x80000000  // Overflow of the counter, set on wrap around and raises LCOFIP
+#define COUNTERS 32                // mcycle, time (not a counter), minstret and mhpmcounter3-31
+
+#define FETCH_PAGE_SIZE 4096  // Instructions are fetched through a host pointer to the current page of code
+
+#define MISA_RV32 0x40541129  // RV32IMAFD with S and U mode
+#define MISA_RV64 0x8000000000141101ULL  // RV64IMA with S and U mode
+
+#define VLEN_BYTES 16  // VLEN = 128
+#define VTYPE_VILL 0x80000000
+
+#define CPU_STOP_RESET 1
+#define CPU_STOP_POWEROFF 2
 
 #define OPMODE_USER 0
+#define OPMODE_SUPERVISOR 1
 #define OPMODE_MACHINE 3
 
+/**
+ * Register types of a base ISA width, the execute loop is instantiated for each.
+ */
+template <uint32_t XLEN> struct Xlen;
+template <> struct Xlen<32> {
+    typedef uint32_t u;
+    typedef int32_t s;
+    typedef uint64_t wide;  // Holds a full product, for MULH and friends
+    typedef int64_t swide;
+};
+template <> struct Xlen<64> {
+    typedef uint64_t u;
+    typedef int64_t s;
+    typedef unsigned __int128 wide;
+    typedef __int128 swide;
+};
+
+/**
+ * Architectural state of the CPU, saved in checkpoints. RV32 values are zero extended.
+ */
+typedef struct {
+    uint64_t pc;
+    uint64_t x[32];
+    uint64_t f[32];
+    uint8_t v[32 * VLEN_BYTES];
+    uint64_t csr[4096];
+    uint64_t counters[COUNTERS];
+    uint64_t instret;
+    uint32_t counters_in_use;
+    uint64_t reservation_addr;
+    uint32_t timer_l;
+    uint32_t timer_h;
+    uint32_t timer_trigger_l;
+    uint32_t timer_trigger_h;
+    uint8_t op_mode;
+    bool wfi_bit;
+} CpuState;
+
 class ICpuInterface {
     public:
+        virtual ~ICpuInterface() {}
         virtual uint32_t getTimerL() = 0;
         virtual uint32_t getTimerH() = 0;
         virtual void setTimerTriggerH(uint32_t value) = 0;
         virtual void setTimerTriggerL(uint32_t value) = 0;
         virtual void triggerReset() = 0;
+        virtual void triggerPoweroff() = 0;
+        virtual void setExternalInterrupt(bool pending) = 0;
+        virtual uint64_t getInstructionCount() = 0;
 };
 
 class Cpu : public ICpuInterface {
     public:
         Cpu(Bus* bus);
-        void reset(uint32_t program_counter = DEFAULT_CPU_PC, uint32_t dtb_base = DEFAULT_DTB_BASE);
+        void reset(uint64_t program_counter = DEFAULT_CPU_PC, uint64_t dtb_base = DEFAULT_DTB_BASE);
         void triggerReset();
-        bool execute(uint32_t num_instructions, uint32_t elapsed_micros);
+        void triggerPoweroff();
+        uint32_t execute(uint32_t num_instructions, uint32_t elapsed_micros);
         uint32_t getTimerL();
         uint32_t getTimerH();
         void setTimerTriggerH(uint32_t value);
         void setTimerTriggerL(uint32_t value);
+        void setExternalInterrupt(bool pending);
+        uint64_t getInstructionCount();
+        bool isWaiting();
+        void setPlugin(YarvePlugin *plugin);
+        void setTrace(TraceWriter *trace);
+        void setCacheSim(CacheSim *cachesim);
+        void setSbi(bool enabled);
+        void setWarp(bool enabled);
+        void setXlen(uint32_t xlen);
+        void saveState(CpuState *state);
+        void loadState(const CpuState *state);
 
     private:
-        uint32_t pc;
-        uint32_t x[32];
-        uint32_t csr[4096];
+        template <uint32_t XLEN, typename Hooks>
+        uint32_t dispatch(uint32_t num_instructions, uint32_t elapsed_micros, Hooks &hooks);
+        template <uint32_t XLEN, typename Hooks>
+        uint32_t step(uint32_t num_instructions, uint32_t elapsed_micros, Hooks &hooks);
+        uint64_t readCsr(uint32_t csr_num);
+        void writeCsr(uint32_t csr_num, uint64_t value);
+        void setX(uint32_t n, int64_t value);
+        bool handleSbiCall();
+        uint64_t sbiArg64(uint32_t n);
+        void handleSbiPmuCall(uint32_t fid, int32_t *error, uint32_t *value);
+        bool counterAccessible(uint32_t csr_num);
+        uint64_t counterSource(uint32_t n);
+        uint64_t readCounter(uint32_t n);
+        void writeCounter(uint32_t n, uint64_t value);
+        uint64_t readCounterCsr(uint32_t csr_num);
+        void writeCounterCsr(uint32_t csr_num, uint64_t value);
+        void updateCounting();
+        void checkCounterOverflow();
+        uint32_t warpTime(uint32_t elapsed_micros);
+        inline uint32_t fetch(uint64_t addr, uint32_t *exception);
+        uint32_t executeFp(uint32_t ir, uint32_t *rval, uint32_t *rd);
+        uint32_t readFpCsr(uint32_t csr_num);
+        void writeFpCsr(uint32_t csr_num, uint32_t value);
+        uint32_t executeVector(uint32_t ir, uint32_t *rval, uint32_t *rd);
+        uint32_t executeVectorMemory(uint32_t ir, uint32_t *rval);
+        uint32_t executeVectorConfig(uint32_t ir, uint32_t *rval);
+        uint32_t readVectorCsr(uint32_t csr_num);
+        void writeVectorCsr(uint32_t csr_num, uint32_t value);
+
+        uint64_t pc;
+        uint64_t x[32];  // RV32 values are kept zero extended, the execute loop reads the low half
+        uint64_t f[32];  // Single precision values are NaN-boxed
+        uint8_t v[32 * VLEN_BYTES] __attribute__((aligned(16)));  // Register n at n * VLEN_BYTES, so groups are contiguous
+        uint64_t csr[4096];
         uint32_t load_reservation;
         uint8_t operation_mode;
         uint32_t timer_l;
         uint32_t timer_h;
         uint32_t timer_trigger_l;
         uint32_t timer_trigger_h;
-        uint32_t reservation_addr;
+        uint64_t reservation_addr;
         uint8_t op_mode;
         bool wfi_bit;
-        bool reset_triggered;
+        uint32_t stop_reason;
         Bus* bus;
+        uint8_t *fetch_host;  // Host memory of the code page at fetch_base, NULL if code runs from a device
+        uint64_t fetch_base;
+        YarvePlugin *plugin;
+        TraceWriter *trace;
+        CacheSim *cachesim;
+        bool sbi;  // S-mode boot with the SBI implemented in sbi.cpp
+        uint32_t xlen;  // 32 or 64, selects the instantiation of the execute loop
+
+        // Counters, see counters.cpp
+        uint64_t instret;                    // Retired instructions, exact at batch ends and CSR accesses
+        uint64_t counter_offset[COUNTERS];   // A running counter is its event count plus the offset
+        uint64_t counter_frozen[COUNTERS];   // The value of an inhibited counter
+        uint64_t counter_last[COUNTERS];     // Value seen by the last overflow check
+        PerfEvents events;
+        bool counting;                       // An mhpmcounter counts an event, selects CounterHooks
+        uint32_t counters_in_use;            // Counters handed out by the SBI PMU extension
+
+        // Time warp, see warp.cpp
+        bool warp;
+        PollDetector polls;
+        uint32_t warp_stride;                // Microseconds skipped for the next polling batch
 };
 
 #endif
\ No newline at end of file
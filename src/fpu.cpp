@@ -0,0 +1,247 @@
+#include "cpu.h"
+#include "fpu.h"
+
+/**
+ * RV32F and RV32D arithmetic. This file is built without -Ofast (see the
+ * Makefile): the operations run on the host FPU with the guest rounding mode
+ * and collect the exception flags the host raises, so they need strict IEEE
+ * semantics. Comparisons, min/max, conversions to integers and classification
+ * are done by hand, their RISC-V results differ from what the host does.
+ * Every instruction runs in a HostFpEnv, as -Ofast binaries start with
+ * subnormals flushed to zero.
+ */
+
+/**
+ * Execute an instruction of the OP-FP or fused multiply-add major opcodes in format T.
+ * @param ir The instruction.
+ * @param f The floating point registers.
+ * @param x The integer registers.
+ * @param rm The resolved rounding mode, RM_DYN if invalid.
+ * @param env The host environment, set up with the rounding mode.
+ * @param rval Set to the result for integer destinations.
+ * @param rd Cleared if the result went to a floating point register.
+ * @param flags The raised flags are ORed into this.
+ * @return 0 or EXC_ILLEGAL_INSTRUCTION.
+ */
+template <typename T>
+static uint32_t executeFormat(uint32_t ir, uint64_t *f, const uint64_t *x, uint32_t rm, HostFpEnv &env, uint32_t *rval, uint32_t *rd, uint32_t *flags) {
+    typedef typename FpFormat<T>::Bits Bits;
+    uint32_t rs1 = (ir >> 15) & 0x1f;
+    uint32_t rs2 = (ir >> 20) & 0x1f;
+    uint32_t funct3 = (ir >> 12) & 0x7;
+    uint32_t opcode = ir & 0x7f;
+    T a = getF<T>(f[rs1]);
+    T b = getF<T>(f[rs2]);
+
+    if (opcode != 0x53) {  // FMADD, FMSUB, FNMSUB, FNMADD
+        if (rm == RM_DYN) return EXC_ILLEGAL_INSTRUCTION;
+        T c = getF<T>(f[ir >> 27]);
+        if (opcode == 0x4B || opcode == 0x4F) a = -a;
+        if (opcode == 0x47 || opcode == 0x4F) c = -c;
+        if ((isinf(a) && b == 0) || (a == 0 && isinf(b))) *flags |= FFLAG_NV;  // Even if c is a quiet NaN
+        env.clearFlags();
+        fpBarrier(a);
+        fpBarrier(b);
+        fpBarrier(c);
+        T result = fma(a, b, c);
+        fpBarrier(result);
+        *flags |= env.flags();
+        f[*rd] = setF<T>(result);
+        *rd = 0;
+        return 0;
+    }
+
+    switch (ir >> 27) {
+        case 0x00:    // FADD
+        case 0x01:    // FSUB
+        case 0x02:    // FMUL
+        case 0x03:    // FDIV
+        case 0x0B: {  // FSQRT
+            if (rm == RM_DYN || ((ir >> 27) == 0x0B && rs2 != 0)) return EXC_ILLEGAL_INSTRUCTION;
+            env.clearFlags();
+            fpBarrier(a);
+            fpBarrier(b);
+            T result;
+            switch (ir >> 27) {
+                case 0x00:
+                    result = a + b;
+                    break;
+                case 0x01:
+                    result = a - b;
+                    break;
+                case 0x02:
+                    result = a * b;
+                    break;
+                case 0x03:
+                    result = a / b;
+                    break;
+                default:
+                    result = sqrt(a);
+                    break;
+            }
+            fpBarrier(result);
+            *flags |= env.flags();
+            f[*rd] = setF<T>(result);
+            *rd = 0;
+            return 0;
+        }
+        case 0x04: {  // FSGNJ, FSGNJN, FSGNJX
+            Bits bits1 = FpFormat<T>::raw(f[rs1]);
+            Bits bits2 = FpFormat<T>::raw(f[rs2]);
+            Bits sign = bits2 & FpFormat<T>::sign_bit;
+            if (funct3 == 1)
+                sign ^= FpFormat<T>::sign_bit;
+            else if (funct3 == 2)
+                sign ^= bits1 & FpFormat<T>::sign_bit;
+            else if (funct3 != 0)
+                return EXC_ILLEGAL_INSTRUCTION;
+            f[*rd] = FpFormat<T>::box((bits1 & ~FpFormat<T>::sign_bit) | sign);
+            *rd = 0;
+            return 0;
+        }
+        case 0x05: {  // FMIN, FMAX
+            if (funct3 > 1) return EXC_ILLEGAL_INSTRUCTION;
+            if (isSignaling<T>(f[rs1]) || isSignaling<T>(f[rs2])) *flags |= FFLAG_NV;
+            T result;
+            if (isnan(a) || isnan(b))
+                result = isnan(a) ? b : a;  // NaN only if both are
+            else if (a == b)
+                result = (signbit(a) == (funct3 == 0)) ? a : b;  // -0 is smaller than +0
+            else
+                result = ((a < b) == (funct3 == 0)) ? a : b;
+            f[*rd] = setF<T>(result);
+            *rd = 0;
+            return 0;
+        }
+        case 0x08: {  // FCVT.S.D, FCVT.D.S
+            if (rm == RM_DYN || rs2 != (sizeof(T) == sizeof(float) ? 1u : 0u)) return EXC_ILLEGAL_INSTRUCTION;
+            env.clearFlags();
+            if (sizeof(T) == sizeof(float)) {
+                double value = getF<double>(f[rs1]);
+                fpBarrier(value);
+                float result = (float)value;
+                fpBarrier(result);
+                *flags |= env.flags();
+                f[*rd] = setF<float>(result);
+            } else {
+                float value = getF<float>(f[rs1]);
+                fpBarrier(value);
+                double result = (double)value;
+                fpBarrier(result);
+                *flags |= env.flags();
+                f[*rd] = setF<double>(result);
+            }
+            *rd = 0;
+            return 0;
+        }
+        case 0x14:  // FLE, FLT, FEQ
+            if (funct3 == 2) {
+                if (isSignaling<T>(f[rs1]) || isSignaling<T>(f[rs2])) *flags |= FFLAG_NV;
+                *rval = (a == b);
+            } else if (funct3 < 2) {
+                if (isnan(a) || isnan(b)) *flags |= FFLAG_NV;
+                *rval = (funct3 == 0) ? (a <= b) : (a < b);
+            } else
+                return EXC_ILLEGAL_INSTRUCTION;
+            return 0;
+        case 0x18:  // FCVT.W, FCVT.WU
+            if (rm == RM_DYN || rs2 > 1) return EXC_ILLEGAL_INSTRUCTION;
+            *rval = toInteger(a, rm, rs2 == 1, flags);
+            return 0;
+        case 0x1A: {  // FCVT from W, WU
+            if (rm == RM_DYN || rs2 > 1) return EXC_ILLEGAL_INSTRUCTION;
+            env.clearFlags();
+            uint32_t value = x[rs1];
+            fpBarrier(value);
+            T result = (rs2 == 1) ? (T)value : (T)(int32_t)value;
+            fpBarrier(result);
+            *flags |= env.flags();
+            f[*rd] = setF<T>(result);
+            *rd = 0;
+            return 0;
+        }
+        case 0x1C:  // FMV.X.W, FCLASS
+            if (funct3 == 1 && rs2 == 0)
+                *rval = classify<T>(f[rs1]);
+            else if (funct3 == 0 && rs2 == 0 && sizeof(T) == sizeof(float))
+                *rval = (uint32_t)f[rs1];  // The raw low bits, even if not NaN-boxed
+            else
+                return EXC_ILLEGAL_INSTRUCTION;
+            return 0;
+        case 0x1E:  // FMV.W.X
+            if (funct3 != 0 || rs2 != 0 || sizeof(T) != sizeof(float)) return EXC_ILLEGAL_INSTRUCTION;
+            f[*rd] = FpFormat<float>::box(x[rs1]);
+            *rd = 0;
+            return 0;
+        default:
+            return EXC_ILLEGAL_INSTRUCTION;
+    }
+}
+
+/**
+ * Execute an instruction of the OP-FP or fused multiply-add major opcodes.
+ * The caller has checked that mstatus.FS is not off.
+ * @param ir The instruction.
+ * @param rval Set to the result for integer destinations.
+ * @param rd The destination register, cleared if the result went to a floating point register.
+ * @return 0 or EXC_ILLEGAL_INSTRUCTION.
+ */
+uint32_t Cpu::executeFp(uint32_t ir, uint32_t *rval, uint32_t *rd) {
+    uint32_t rm = (ir >> 12) & 0x7;
+    if (rm == RM_DYN) rm = (csr[FCSR] >> 5) & 0x7;
+    if (rm > RM_RMM) rm = RM_DYN;  // Reserved, only instructions that round trap on it
+
+    HostFpEnv env((rm == RM_DYN) ? RM_RNE : rm);
+    uint32_t flags = 0;
+    uint32_t exception;
+    switch ((ir >> 25) & 0x3) {
+        case 0:
+            exception = executeFormat<float>(ir, f, x, rm, env, rval, rd, &flags);
+            break;
+        case 1:
+            exception = executeFormat<double>(ir, f, x, rm, env, rval, rd, &flags);
+            break;
+        default:
+            return EXC_ILLEGAL_INSTRUCTION;
+    }
+    if (exception) return exception;
+    csr[FCSR] |= flags;
+    csr[MSTATUS] |= MSTATUS_FS | MSTATUS_SD;
+    return 0;
+}
+
+/**
+ * Read fflags, frm or fcsr. The caller has checked that mstatus.FS is not off.
+ * @param csr_num The CSR number.
+ * @return The value of the CSR.
+ */
+uint32_t Cpu::readFpCsr(uint32_t csr_num) {
+    switch (csr_num) {
+        case FFLAGS:
+            return csr[FCSR] & 0x1f;
+        case FRM:
+            return (csr[FCSR] >> 5) & 0x7;
+        default:
+            return csr[FCSR] & 0xff;
+    }
+}
+
+/**
+ * Write fflags, frm or fcsr. The caller has checked that mstatus.FS is not off.
+ * @param csr_num The CSR number.
+ * @param value The value to write.
+ */
+void Cpu::writeFpCsr(uint32_t csr_num, uint32_t value) {
+    switch (csr_num) {
+        case FFLAGS:
+            csr[FCSR] = (csr[FCSR] & ~0x1f) | (value & 0x1f);
+            break;
+        case FRM:
+            csr[FCSR] = (csr[FCSR] & ~0xe0) | ((value & 0x7) << 5);
+            break;
+        default:
+            csr[FCSR] = value & 0xff;
+            break;
+    }
+    csr[MSTATUS] |= MSTATUS_FS | MSTATUS_SD;
+}
@@ -0,0 +1,256 @@
+#ifndef FPU_H
+#define FPU_H
+
+#include <math.h>
+#include <fenv.h>
+#include <stdint.h>
+#include <string.h>
+#if defined(__SSE2_MATH__)
+#include <xmmintrin.h>
+#endif
+
+/**
+ * Helpers for running guest floating point operations on the host FPU, shared
+ * by the scalar (fpu.cpp) and vector (vector.cpp) units. Only include this
+ * from files built without -Ofast (see the Makefile).
+ */
+
+#define FFLAG_NX 0x01
+#define FFLAG_UF 0x02
+#define FFLAG_OF 0x04
+#define FFLAG_DZ 0x08
+#define FFLAG_NV 0x10
+
+#define RM_RNE 0
+#define RM_RTZ 1
+#define RM_RDN 2
+#define RM_RUP 3
+#define RM_RMM 4
+#define RM_DYN 7
+
+/**
+ * Register encoding of a floating point format.
+ */
+template <typename T>
+struct FpFormat;
+
+template <>
+struct FpFormat<float> {
+    typedef uint32_t Bits;
+    static const Bits quiet_bit = 0x00400000;
+    static const Bits sign_bit = 0x80000000;
+    static const Bits canonical_nan = 0x7fc00000;
+
+    static inline Bits raw(uint64_t reg) {
+        return ((reg >> 32) == 0xffffffff) ? (Bits)reg : canonical_nan;  // Not NaN-boxed values read as NaN
+    }
+    static inline uint64_t box(Bits bits) {
+        return 0xffffffff00000000ULL | bits;
+    }
+};
+
+template <>
+struct FpFormat<double> {
+    typedef uint64_t Bits;
+    static const Bits quiet_bit = 0x0008000000000000ULL;
+    static const Bits sign_bit = 0x8000000000000000ULL;
+    static const Bits canonical_nan = 0x7ff8000000000000ULL;
+
+    static inline Bits raw(uint64_t reg) {
+        return reg;
+    }
+    static inline uint64_t box(Bits bits) {
+        return bits;
+    }
+};
+
+/**
+ * Read a register as a value of format T.
+ */
+template <typename T>
+static inline T getF(uint64_t reg) {
+    typename FpFormat<T>::Bits bits = FpFormat<T>::raw(reg);
+    T value;
+    memcpy(&value, &bits, sizeof(T));
+    return value;
+}
+
+/**
+ * Get the register contents for a result of format T, NaN results become the canonical NaN.
+ */
+template <typename T>
+static inline uint64_t setF(T value) {
+    typename FpFormat<T>::Bits bits = FpFormat<T>::canonical_nan;
+    if (!isnan(value)) memcpy(&bits, &value, sizeof(T));
+    return FpFormat<T>::box(bits);
+}
+
+/**
+ * Check if a register holds a signaling NaN of format T.
+ */
+template <typename T>
+static inline bool isSignaling(uint64_t reg) {
+    return isnan(getF<T>(reg)) && !(FpFormat<T>::raw(reg) & FpFormat<T>::quiet_bit);
+}
+
+/**
+ * Keep the compiler from moving a value across the host rounding mode and flag accesses.
+ */
+template <typename T>
+static inline void fpBarrier(T &value) {
+    __asm__ __volatile__("" : "+m"(value));
+}
+
+/**
+ * Keep the compiler from moving accesses to an array across the host rounding mode and flag accesses.
+ */
+static inline void fpBarrierArray(void *array) {
+    __asm__ __volatile__("" : : "r"(array) : "memory");
+}
+
+/**
+ * Host floating point environment set up for one guest operation.
+ * SSE hosts program MXCSR directly, which costs a few cycles instead of the
+ * x87 and SSE round trip of fesetround and fetestexcept.
+ */
+class HostFpEnv {
+    public:
+        /**
+         * Switch to the guest rounding mode with all flags cleared and subnormals enabled.
+         * @param rm A valid RISC-V rounding mode, RMM rounds to nearest even.
+         */
+        inline HostFpEnv(uint32_t rm) {
+#if defined(__SSE2_MATH__)
+            static const uint32_t rounding[5] = {0x0000, 0x6000, 0x2000, 0x4000, 0x0000};
+            saved = _mm_getcsr();
+            _mm_setcsr(0x1f80 | rounding[rm]);  // All exceptions masked, no flush to zero
+#else
+            static const int rounding[5] = {FE_TONEAREST, FE_TOWARDZERO, FE_DOWNWARD, FE_UPWARD, FE_TONEAREST};
+            fegetenv(&saved);
+            fesetround(rounding[rm]);
+            feclearexcept(FE_ALL_EXCEPT);
+#endif
+        }
+
+        /**
+         * Restore the host environment.
+         */
+        inline ~HostFpEnv() {
+#if defined(__SSE2_MATH__)
+            _mm_setcsr(saved);
+#else
+            fesetenv(&saved);
+#endif
+        }
+
+        /**
+         * Clear the host flags, before the operation whose flags are wanted.
+         */
+        inline void clearFlags() {
+#if defined(__SSE2_MATH__)
+            _mm_setcsr(_mm_getcsr() & ~0x3f);
+#else
+            feclearexcept(FE_ALL_EXCEPT);
+#endif
+        }
+
+        /**
+         * Get the flags raised since the last clearFlags.
+         * @return The flags in fflags layout.
+         */
+        inline uint32_t flags() {
+#if defined(__SSE2_MATH__)
+            uint32_t mxcsr = _mm_getcsr();
+            return ((mxcsr & 0x01) ? FFLAG_NV : 0) | ((mxcsr & 0x04) ? FFLAG_DZ : 0) | ((mxcsr & 0x08) ? FFLAG_OF : 0) |
+                   ((mxcsr & 0x10) ? FFLAG_UF : 0) | ((mxcsr & 0x20) ? FFLAG_NX : 0);
+#else
+            int raised = fetestexcept(FE_ALL_EXCEPT);
+            return ((raised & FE_INVALID) ? FFLAG_NV : 0) | ((raised & FE_DIVBYZERO) ? FFLAG_DZ : 0) | ((raised & FE_OVERFLOW) ? FFLAG_OF : 0) |
+                   ((raised & FE_UNDERFLOW) ? FFLAG_UF : 0) | ((raised & FE_INEXACT) ? FFLAG_NX : 0);
+#endif
+        }
+
+    private:
+#if defined(__SSE2_MATH__)
+        uint32_t saved;
+#else
+        fenv_t saved;
+#endif
+};
+
+/**
+ * Round to an integral value without touching the host environment.
+ * @param value The value, not NaN.
+ * @param rm A valid RISC-V rounding mode.
+ * @return The rounded value.
+ */
+static inline double roundIntegral(double value, uint32_t rm) {
+    switch (rm) {
+        case RM_RTZ:
+            return trunc(value);
+        case RM_RDN:
+            return floor(value);
+        case RM_RUP:
+            return ceil(value);
+        case RM_RMM:
+            return round(value);
+        default: {
+            double rounded = round(value);
+            if (fabs(rounded - value) == 0.5) rounded = 2.0 * round(value / 2.0);  // Ties to even
+            return rounded;
+        }
+    }
+}
+
+/**
+ * Convert to a 32 bit integer, saturating like RISC-V does.
+ * @param value The value to convert.
+ * @param rm A valid RISC-V rounding mode.
+ * @param is_unsigned true for FCVT.WU.
+ * @param flags The raised flags are ORed into this.
+ * @return The integer.
+ */
+static inline uint32_t toInteger(double value, uint32_t rm, bool is_unsigned, uint32_t *flags) {
+    double min = is_unsigned ? 0.0 : -2147483648.0;
+    double max = is_unsigned ? 4294967295.0 : 2147483647.0;
+    if (isnan(value)) {
+        *flags |= FFLAG_NV;
+        return is_unsigned ? 0xffffffff : 0x7fffffff;
+    }
+    double rounded = roundIntegral(value, rm);
+    if (rounded < min) {
+        *flags |= FFLAG_NV;
+        return is_unsigned ? 0 : 0x80000000;
+    }
+    if (rounded > max) {
+        *flags |= FFLAG_NV;
+        return is_unsigned ? 0xffffffff : 0x7fffffff;
+    }
+    if (rounded != value) *flags |= FFLAG_NX;
+    return is_unsigned ? (uint32_t)rounded : (uint32_t)(int32_t)rounded;
+}
+
+/**
+ * Classify a value for FCLASS.
+ * @param reg The register holding the value.
+ * @return The class mask.
+ */
+template <typename T>
+static inline uint32_t classify(uint64_t reg) {
+    T value = getF<T>(reg);
+    bool negative = signbit(value);
+    switch (fpclassify(value)) {
+        case FP_INFINITE:
+            return negative ? 0x001 : 0x080;
+        case FP_NORMAL:
+            return negative ? 0x002 : 0x040;
+        case FP_SUBNORMAL:
+            return negative ? 0x004 : 0x020;
+        case FP_ZERO:
+            return negative ? 0x008 : 0x010;
+        default:
+            return isSignaling<T>(reg) ? 0x100 : 0x200;
+    }
+}
+
+#endif
@@ -0,0 +1,336 @@
+#include <errno.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include "framebuffer.h"
+
+/**
+ * Construct a new framebuffer device.
+ * @param base The base address of the framebuffer.
+ * @param width The width in pixels.
+ * @param height The height in pixels.
+ */
+Framebuffer::Framebuffer(uint32_t base, uint32_t width, uint32_t height) {
+    this->base = base;
+    this->width = width;
+    this->height = height;
+    stride = width * FB_BYTES_PER_PIXEL;
+    size = (size_t)stride * height;
+    tiles_x = (width + FB_TILE_SIZE - 1) >> FB_TILE_SHIFT;
+    tiles_y = (height + FB_TILE_SIZE - 1) >> FB_TILE_SHIFT;
+    data = new uint8_t[size + 4];  // Word reads at the last bytes stay inside
+    memset(data, 0, size + 4);
+    dirty = new uint8_t[tiles_x * tiles_y];
+    memset(dirty, 1, tiles_x * tiles_y);  // A new device replaces whatever was exported before
+    any_dirty = true;
+    dirty_pages = new uint8_t[getPageCount()];
+    memset(dirty_pages, 1, getPageCount());  // Everything differs from a previous checkpoint
+}
+
+/**
+ * Destroy the framebuffer device.
+ */
+Framebuffer::~Framebuffer() {
+    delete[] data;
+    delete[] dirty;
+    delete[] dirty_pages;
+}
+
+/**
+ * Get the device information.
+ * @return The device information.
+ */
+DeviceInfo Framebuffer::getDeviceInfo() {
+    DeviceInfo info;
+    info.base = base;
+    info.size = size;
+    info.device = this;
+    return info;
+}
+
+/**
+ * Tell the bus that this device is plain memory.
+ * @return Always true.
+ */
+bool Framebuffer::isMemory() {
+    return true;
+}
+
+/**
+ * Mark the tiles and pages covering a byte range dirty.
+ * @param offset The offset of the range in the framebuffer.
+ * @param len The length of the range, not 0.
+ */
+void Framebuffer::markDirty(uint32_t offset, size_t len) {
+    uint32_t first_line = offset / stride;
+    uint32_t last_line = (offset + len - 1) / stride;
+    uint32_t first_tile = 0;
+    uint32_t last_tile = tiles_x - 1;
+    if (first_line == last_line) {  // Only the columns written, otherwise whole tile rows
+        first_tile = (offset % stride) / FB_BYTES_PER_PIXEL >> FB_TILE_SHIFT;
+        last_tile = ((offset + len - 1) % stride) / FB_BYTES_PER_PIXEL >> FB_TILE_SHIFT;
+    }
+    for (uint32_t row = first_line >> FB_TILE_SHIFT; row <= last_line >> FB_TILE_SHIFT; row++) {
+        memset(dirty + row * tiles_x + first_tile, 1, last_tile - first_tile + 1);
+    }
+    any_dirty = true;
+    memset(dirty_pages + (offset >> RAM_PAGE_SHIFT), 1, ((offset + len - 1) >> RAM_PAGE_SHIFT) - (offset >> RAM_PAGE_SHIFT) + 1);
+}
+
+/**
+ * Read a word from the framebuffer.
+ * @param addr The address to read from.
+ * @return The word read.
+ */
+uint32_t Framebuffer::read(uint64_t addr) {
+    return *(uint32_t*)(data + addr - base);
+}
+
+/**
+ * Write a word of varying width to the framebuffer.
+ * @param addr The address to write to.
+ * @param data The data to write.
+ * @param width The width of the data to write.
+ */
+void Framebuffer::write(uint64_t addr, uint32_t data, uint8_t width) {
+    uint32_t offset = addr - base;
+    if (offset + width > size) return;
+    markDirty(offset, width);
+    switch (width) {
+        case 1:
+            *(uint8_t*)(this->data + offset) = data;
+            break;
+        case 2:
+            *(uint16_t*)(this->data + offset) = data;
+            break;
+        case 4:
+            *(uint32_t*)(this->data + offset) = data;
+            break;
+    }
+}
+
+/**
+ * Get a host pointer to a range of the framebuffer.
+ * @param addr The guest physical start address.
+ * @param len The length of the range.
+ * @param write true if the caller may write to the range, which marks its tiles dirty.
+ * @return The host pointer or NULL if the range is not completely inside the framebuffer.
+ */
+uint8_t *Framebuffer::getHostPointer(uint64_t addr, size_t len, bool write) {
+    if (addr < base || addr - base > size || len > size - (addr - base)) return NULL;
+    if (write && len) markDirty(addr - base, len);
+    return data + addr - base;
+}
+
+/**
+ * Collect the tiles written since the previous call and clear their dirty state.
+ * @param tiles The tile indices, row major, are appended to this vector.
+ * @return The number of dirty tiles.
+ */
+size_t Framebuffer::takeDirtyTiles(std::vector<uint32_t> &tiles) {
+    if (!any_dirty) return 0;
+    size_t count = 0;
+    for (uint32_t tile = 0; tile < tiles_x * tiles_y; tile++) {
+        if (!dirty[tile]) continue;
+        dirty[tile] = 0;
+        tiles.push_back(tile);
+        count++;
+    }
+    any_dirty = false;
+    return count;
+}
+
+/**
+ * Get the number of pages used for dirty tracking.
+ * @return The framebuffer size in pages, rounded up.
+ */
+size_t Framebuffer::getPageCount() {
+    return (size + RAM_PAGE_SIZE - 1) >> RAM_PAGE_SHIFT;
+}
+
+/**
+ * Collect the pages written since the previous call and clear their dirty state.
+ * @param pages The page indices are appended to this vector.
+ * @return The number of dirty pages.
+ */
+size_t Framebuffer::takeDirtyPages(std::vector<uint32_t> &pages) {
+    size_t count = 0;
+    size_t num_pages = getPageCount();
+    for (size_t page = 0; page < num_pages; page++) {
+        if (!dirty_pages[page]) continue;
+        dirty_pages[page] = 0;
+        pages.push_back(page);
+        count++;
+    }
+    return count;
+}
+
+/**
+ * Get the pixels of the framebuffer.
+ * @return The first pixel, stride bytes per line.
+ */
+const uint8_t *Framebuffer::getPixels() {
+    return data;
+}
+
+/**
+ * Set up the exports of the framebuffer.
+ * @param shm_name The name of the shared memory segment or NULL.
+ * @param dump_dir The directory for PPM dumps or NULL.
+ * @param width The width of the framebuffer in pixels.
+ * @param height The height of the framebuffer in pixels.
+ */
+FramebufferExport::FramebufferExport(const char *shm_name, const char *dump_dir, uint32_t width, uint32_t height) {
+    this->width = width;
+    this->height = height;
+    stride = width * FB_BYTES_PER_PIXEL;
+    uint32_t tiles_x = (width + FB_TILE_SIZE - 1) >> FB_TILE_SHIFT;
+    uint32_t tiles_y = (height + FB_TILE_SIZE - 1) >> FB_TILE_SHIFT;
+    size_t frame_size = (size_t)stride * height;
+    changed = false;
+    shm = NULL;
+    tile_sequence = NULL;
+    shm_size = 0;
+
+    if (shm_name) {
+        this->shm_name = (shm_name[0] == '/') ? shm_name : std::string("/") + shm_name;
+        size_t page = sysconf(_SC_PAGESIZE);
+        size_t data_offset = (sizeof(FramebufferShmHeader) + tiles_x * tiles_y * sizeof(uint64_t) + page - 1) / page * page;
+        shm_size = data_offset + frame_size;
+        int fd = shm_open(this->shm_name.c_str(), O_CREAT | O_RDWR, 0644);
+        if (fd < 0 || ftruncate(fd, shm_size) < 0) {
+            fprintf(stderr, "Error: Could not create shared memory segment %s\n", this->shm_name.c_str());
+            exit(1);
+        }
+        void *map = mmap(NULL, shm_size, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+        close(fd);
+        if (map == MAP_FAILED) {
+            fprintf(stderr, "Error: Could not map shared memory segment %s\n", this->shm_name.c_str());
+            exit(1);
+        }
+        shm = (FramebufferShmHeader*)map;
+        memset(map, 0, shm_size);
+        shm->width = width;
+        shm->height = height;
+        shm->stride = stride;
+        shm->format = FB_FORMAT_X8R8G8B8;
+        shm->tile_size = FB_TILE_SIZE;
+        shm->tiles_x = tiles_x;
+        shm->tiles_y = tiles_y;
+        shm->data_offset = data_offset;
+        tile_sequence = (uint64_t*)(shm + 1);
+        frame = (uint8_t*)map + data_offset;
+        __atomic_thread_fence(__ATOMIC_RELEASE);
+        memcpy(shm->magic, FB_SHM_MAGIC, FB_SHM_MAGIC_SIZE);  // Clients check the magic last
+    } else {
+        frame = new uint8_t[frame_size];
+        memset(frame, 0, frame_size);
+    }
+
+    pending = false;
+    stopping = false;
+    dump_sequence = 0;
+    if (dump_dir) {
+        this->dump_dir = dump_dir;
+        if (mkdir(dump_dir, 0755) < 0 && errno != EEXIST) {
+            fprintf(stderr, "Error: Could not create framebuffer dump directory %s\n", dump_dir);
+            exit(1);
+        }
+        dump_frame.resize(frame_size);
+        writer = std::thread(&FramebufferExport::writerLoop, this);
+    }
+}
+
+/**
+ * Write the last dump, stop the writer thread and remove the shared memory segment.
+ * Clients that still map the segment keep the last frame.
+ */
+FramebufferExport::~FramebufferExport() {
+    if (writer.joinable()) {
+        {
+            std::unique_lock<std::mutex> guard(lock);
+            cond.wait(guard, [this] { return !pending; });
+            if (changed) {
+                memcpy(dump_frame.data(), frame, dump_frame.size());
+                dump_sequence++;
+                pending = true;
+            }
+            stopping = true;
+        }
+        cond.notify_all();
+        writer.join();
+    }
+    if (shm) {
+        munmap(shm, shm_size);
+        shm_unlink(shm_name.c_str());
+    } else {
+        delete[] frame;
+    }
+}
+
+/**
+ * Export the tiles the guest changed since the previous update. Must be called
+ * between execute batches. A dump is started if the frame changed and the
+ * previous dump has been written, otherwise it is left for a later update.
+ * @param fb The framebuffer device.
+ */
+void FramebufferExport::update(Framebuffer *fb) {
+    std::vector<uint32_t> tiles;
+    if (fb->takeDirtyTiles(tiles)) {
+        uint64_t sequence = 0;
+        if (shm) {
+            sequence = shm->sequence + 2;
+            __atomic_store_n(&shm->sequence, shm->sequence + 1, __ATOMIC_RELAXED);
+            __atomic_thread_fence(__ATOMIC_RELEASE);
+        }
+        const uint8_t *pixels = fb->getPixels();
+        for (uint32_t tile : tiles) {
+            uint32_t x = (tile % fb->tiles_x) << FB_TILE_SHIFT;
+            uint32_t y = (tile / fb->tiles_x) << FB_TILE_SHIFT;
+            uint32_t columns = (x + FB_TILE_SIZE <= width) ? FB_TILE_SIZE : width - x;
+            uint32_t lines = (y + FB_TILE_SIZE <= height) ? FB_TILE_SIZE : height - y;
+            for (uint32_t line = y; line < y + lines; line++) {
+                size_t offset = (size_t)line * stride + x * FB_BYTES_PER_PIXEL;
+                memcpy(frame + offset, pixels + offset, columns * FB_BYTES_PER_PIXEL);
+            }
+            if (shm) tile_sequence[tile] = sequence;
+        }
+        if (shm) __atomic_store_n(&shm->sequence, sequence, __ATOMIC_RELEASE);
+        changed = true;
+    }
+
+    if (!changed || dump_dir == "") return;
+    std::unique_lock<std::mutex> guard(lock);
+    if (pending) return;
+    memcpy(dump_frame.data(), frame, dump_frame.size());
+    dump_sequence++;
+    pending = true;
+    changed = false;
+    cond.notify_all();
+}
+
+/**
+ * The writer thread body, writing each frame handed over by update() as a PPM file.
+ */
+void FramebufferExport::writerLoop() {
+    std::unique_lock<std::mutex> guard(lock);
+    while (true) {
+        cond.wait(guard, [this] { return pending || stopping; });
+        if (!pending) return;
+        char name[64];
+        snprintf(name, sizeof(name), "/frame-%08llu.ppm", (unsigned long long)dump_sequence);
+        std::string path = dump_dir + name;
+        guard.unlock();
+
+        // The CPU thread does not touch dump_frame while pending is set
+        FILE *file = fopen(path.c_str(), "wb");
+        bool ok = file && fbWritePpm(file, dump_frame.data(), width, height, stride);
+        if (file) ok = (fclose(file) == 0) && ok;
+        if (!ok) fprintf(stderr, "Warning: Could not write framebuffer dump %s\n", path.c_str());
+
+        guard.lock();
+        pending = false;
+        cond.notify_all();
+    }
+}
@@ -0,0 +1,97 @@
+#ifndef FRAMEBUFFER_H
+#define FRAMEBUFFER_H
+
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <string>
+#include <vector>
+#include <thread>
+#include <mutex>
+#include <condition_variable>
+#include "bus.h"
+#include "ram.h"
+#include "framebufferformat.h"
+
+// Geometry of the simple-framebuffer node in yarve.dts
+#define DEFAULT_FB_BASE 0x30000000
+#define DEFAULT_FB_WIDTH 640
+#define DEFAULT_FB_HEIGHT 480
+#define DEFAULT_FB_INTERVAL 100
+#define FB_BYTES_PER_PIXEL 4
+#define FB_TILE_SHIFT 5
+#define FB_TILE_SIZE (1 << FB_TILE_SHIFT)
+
+/**
+ * Memory behind a simple-framebuffer node. Writes mark the tiles they touch
+ * dirty, so exports only copy what the guest changed, and the pages they touch
+ * for checkpoints, like Ram.
+ */
+class Framebuffer : public BusDevice {
+    public:
+        Framebuffer(uint32_t base = DEFAULT_FB_BASE, uint32_t width = DEFAULT_FB_WIDTH, uint32_t height = DEFAULT_FB_HEIGHT);
+        ~Framebuffer();
+        DeviceInfo getDeviceInfo();
+        uint32_t read(uint64_t addr);
+        void write(uint64_t addr, uint32_t data, uint8_t width);
+        bool isMemory();
+        uint8_t *getHostPointer(uint64_t addr, size_t len, bool write);
+        size_t takeDirtyTiles(std::vector<uint32_t> &tiles);
+        size_t getPageCount();
+        size_t takeDirtyPages(std::vector<uint32_t> &pages);
+        const uint8_t *getPixels();
+
+        uint32_t width;
+        uint32_t height;
+        uint32_t stride;
+        uint32_t tiles_x;
+        uint32_t tiles_y;
+
+    private:
+        void markDirty(uint32_t offset, size_t len);
+
+        uint32_t base;
+        size_t size;
+        uint8_t *data;
+        uint8_t *dirty;  // One byte per tile, set by writes since the last takeDirtyTiles
+        bool any_dirty;
+        uint8_t *dirty_pages;  // One byte per RAM_PAGE_SIZE page, set by writes since the last takeDirtyPages
+};
+
+/**
+ * Exports the framebuffer to a POSIX shared memory segment and/or as PPM
+ * dumps. update() copies the dirty tiles on the CPU thread; dumps are encoded
+ * and written by a background thread. Outlives the device across reboots.
+ */
+class FramebufferExport {
+    public:
+        FramebufferExport(const char *shm_name, const char *dump_dir, uint32_t width = DEFAULT_FB_WIDTH, uint32_t height = DEFAULT_FB_HEIGHT);
+        ~FramebufferExport();
+        void update(Framebuffer *fb);
+
+    private:
+        void writerLoop();
+
+        uint32_t width;
+        uint32_t height;
+        uint32_t stride;
+        uint8_t *frame;  // The exported pixels, inside the segment when there is one
+        bool changed;  // The frame changed since the last dump
+
+        std::string shm_name;
+        FramebufferShmHeader *shm;
+        uint64_t *tile_sequence;
+        size_t shm_size;
+
+        std::string dump_dir;
+        uint64_t dump_sequence;
+        std::vector<uint8_t> dump_frame;
+        std::thread writer;
+        std::mutex lock;
+        std::condition_variable cond;
+        bool pending;
+        bool stopping;
+};
+
+#endif
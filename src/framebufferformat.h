@@ -0,0 +1,65 @@
+#ifndef FRAMEBUFFER_FORMAT_H
+#define FRAMEBUFFER_FORMAT_H
+
+#include <stdint.h>
+#include <stdio.h>
+#include <vector>
+
+/**
+ * Shared memory segment written by --fb-shm, read by viewers and yarve-fbgrab.
+ *
+ * The segment starts with a FramebufferShmHeader, followed by one uint64_t per
+ * tile (row major, tiles_x * tiles_y entries) and the pixels at data_offset.
+ * Pixels are x8r8g8b8, little endian, stride bytes per line.
+ *
+ * sequence works as a seqlock: it is odd while yarve updates the segment and
+ * even when the segment is consistent. Each tile entry holds the sequence
+ * value of the update that last changed the tile, so a client that remembers
+ * the last sequence it saw only has to copy the tiles with a larger value.
+ * A client copies consistently by reading sequence (acquire), retrying while
+ * it is odd, copying and checking that sequence did not change.
+ */
+
+#define FB_SHM_MAGIC "YRVFB001"
+#define FB_SHM_MAGIC_SIZE 8
+
+#define FB_FORMAT_X8R8G8B8 0
+
+typedef struct {
+    char magic[FB_SHM_MAGIC_SIZE];
+    uint32_t width;
+    uint32_t height;
+    uint32_t stride;
+    uint32_t format;
+    uint32_t tile_size;
+    uint32_t tiles_x;
+    uint32_t tiles_y;
+    uint32_t data_offset;
+    uint64_t sequence;
+} FramebufferShmHeader;
+
+/**
+ * Write x8r8g8b8 pixels as a binary PPM image.
+ * @param file The output file.
+ * @param pixels The first pixel.
+ * @param width The width in pixels.
+ * @param height The height in pixels.
+ * @param stride The number of bytes per line.
+ * @return false if the file could not be written.
+ */
+static inline bool fbWritePpm(FILE *file, const uint8_t *pixels, uint32_t width, uint32_t height, uint32_t stride) {
+    std::vector<uint8_t> line(width * 3);
+    fprintf(file, "P6\n%u %u\n255\n", width, height);
+    for (uint32_t y = 0; y < height; y++) {
+        const uint8_t *src = pixels + (size_t)y * stride;
+        for (uint32_t x = 0; x < width; x++) {
+            line[x * 3] = src[x * 4 + 2];
+            line[x * 3 + 1] = src[x * 4 + 1];
+            line[x * 3 + 2] = src[x * 4];
+        }
+        if (fwrite(line.data(), 1, width * 3, file) != width * 3) return false;
+    }
+    return true;
+}
+
+#endif
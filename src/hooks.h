@@ -0,0 +1,108 @@
+#ifndef HOOKS_H
+#define HOOKS_H
+
+#include <stdint.h>
+#include "plugin.h"
+
+/**
+ * Hook policies for Cpu::step. A policy is a class with the inline member
+ * functions below; the execute loop is instantiated once per policy, so the
+ * callbacks are inlined and empty ones vanish entirely.
+ */
+
+/**
+ * Policy that observes nothing, the execute loop compiles to the plain interpreter.
+ */
+struct NullHooks {
+    inline void retire(uint32_t pc, uint32_t ir, uint32_t rd, uint32_t value) {}
+    inline void load(uint32_t pc, uint32_t addr, uint8_t width, uint32_t value) {}
+    inline void store(uint32_t pc, uint32_t addr, uint8_t width, uint32_t value) {}
+    inline void trapEnter(uint32_t cause, uint32_t epc, uint32_t tval) {}
+    inline void trapExit(uint32_t pc) {}
+};
+
+/**
+ * Policy that forwards every event to a loaded plugin.
+ */
+struct PluginHooks {
+    YarvePlugin *plugin;
+
+    PluginHooks(YarvePlugin *plugin) : plugin(plugin) {}
+
+    inline void retire(uint32_t pc, uint32_t ir, uint32_t rd, uint32_t value) {
+        if (plugin->retire) plugin->retire(plugin->ctx, pc, ir);
+    }
+    inline void load(uint32_t pc, uint32_t addr, uint8_t width, uint32_t value) {
+        if (plugin->load) plugin->load(plugin->ctx, pc, addr, width, value);
+    }
+    inline void store(uint32_t pc, uint32_t addr, uint8_t width, uint32_t value) {
+        if (plugin->store) plugin->store(plugin->ctx, pc, addr, width, value);
+    }
+    inline void trapEnter(uint32_t cause, uint32_t epc, uint32_t tval) {
+        if (plugin->trap_enter) plugin->trap_enter(plugin->ctx, cause, epc, tval);
+    }
+    inline void trapExit(uint32_t pc) {
+        if (plugin->trap_exit) plugin->trap_exit(plugin->ctx, pc);
+    }
+};
+
+#define HPM_EVENT_NONE 0
+#define HPM_EVENT_LOADS 1
+#define HPM_EVENT_STORES 2
+#define HPM_EVENT_BRANCHES 3        // Conditional branches
+#define HPM_EVENT_TAKEN_BRANCHES 4
+#define HPM_EVENT_TRAPS 5           // Exceptions and interrupts
+#define HPM_EVENT_MMIO 6            // Device accesses, counted by the bus
+#define HPM_EVENTS 7
+
+/**
+ * Counts of the events selectable in mhpmevent, kept across execute batches.
+ */
+typedef struct {
+    uint64_t count[HPM_EVENTS];
+    uint32_t branch_pc;
+    bool branch_pending;  // A branch retired, the next instruction shows whether it was taken
+} PerfEvents;
+
+/**
+ * Policy that counts performance events and forwards everything to another
+ * policy. Only used while an mhpmcounter counts, the plain loop pays nothing.
+ */
+template <typename Inner>
+struct CounterHooks {
+    Inner &inner;
+    PerfEvents *events;
+
+    CounterHooks(Inner &inner, PerfEvents *events) : inner(inner), events(events) {}
+
+    inline void retire(uint32_t pc, uint32_t ir, uint32_t rd, uint32_t value) {
+        if (events->branch_pending) {
+            events->count[HPM_EVENT_TAKEN_BRANCHES] += (pc != events->branch_pc + 4);
+            events->branch_pending = false;
+        }
+        if ((ir & 0x7f) == 0x63) {
+            events->count[HPM_EVENT_BRANCHES]++;
+            events->branch_pc = pc;
+            events->branch_pending = true;
+        }
+        inner.retire(pc, ir, rd, value);
+    }
+    inline void load(uint32_t pc, uint32_t addr, uint8_t width, uint32_t value) {
+        events->count[HPM_EVENT_LOADS]++;
+        inner.load(pc, addr, width, value);
+    }
+    inline void store(uint32_t pc, uint32_t addr, uint8_t width, uint32_t value) {
+        events->count[HPM_EVENT_STORES]++;
+        inner.store(pc, addr, width, value);
+    }
+    inline void trapEnter(uint32_t cause, uint32_t epc, uint32_t tval) {
+        events->count[HPM_EVENT_TRAPS]++;
+        events->branch_pending = false;
+        inner.trapEnter(cause, epc, tval);
+    }
+    inline void trapExit(uint32_t pc) {
+        inner.trapExit(pc);
+    }
+};
+
+#endif
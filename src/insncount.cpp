@@ -0,0 +1,60 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include "plugin.h"
+
+/**
+ * Builtin example plugin counting instructions, memory accesses, traps and MMIO.
+ * Select it with --plugin insncount.
+ */
+typedef struct {
+    uint64_t instructions;
+    uint64_t loads;
+    uint64_t stores;
+    uint64_t traps;
+    uint64_t mmio_reads;
+    uint64_t mmio_writes;
+} InsnCount;
+
+static void insncountRetire(void *ctx, uint32_t pc, uint32_t ir) {
+    ((InsnCount*)ctx)->instructions++;
+}
+
+static void insncountLoad(void *ctx, uint32_t pc, uint32_t addr, uint8_t width, uint32_t value) {
+    ((InsnCount*)ctx)->loads++;
+}
+
+static void insncountStore(void *ctx, uint32_t pc, uint32_t addr, uint8_t width, uint32_t value) {
+    ((InsnCount*)ctx)->stores++;
+}
+
+static void insncountTrapEnter(void *ctx, uint32_t cause, uint32_t epc, uint32_t tval) {
+    ((InsnCount*)ctx)->traps++;
+}
+
+static void insncountMmio(void *ctx, uint32_t addr, uint8_t width, uint32_t value, int is_write) {
+    if (is_write)
+        ((InsnCount*)ctx)->mmio_writes++;
+    else
+        ((InsnCount*)ctx)->mmio_reads++;
+}
+
+static void insncountFinish(void *ctx) {
+    InsnCount *count = (InsnCount*)ctx;
+    fprintf(stderr, "\ninsncount: %lu instructions, %lu loads, %lu stores, %lu traps, %lu mmio reads, %lu mmio writes\n",
+            count->instructions, count->loads, count->stores, count->traps, count->mmio_reads, count->mmio_writes);
+}
+
+static YarvePlugin *insncountInit(const char *args) {
+    YarvePlugin *plugin = (YarvePlugin*)calloc(1, sizeof(YarvePlugin));
+    plugin->name = "insncount";
+    plugin->ctx = calloc(1, sizeof(InsnCount));
+    plugin->retire = insncountRetire;
+    plugin->load = insncountLoad;
+    plugin->store = insncountStore;
+    plugin->trap_enter = insncountTrapEnter;
+    plugin->mmio = insncountMmio;
+    plugin->finish = insncountFinish;
+    return plugin;
+}
+
+static PluginRegistrar registrar("insncount", insncountInit);
@@ -0,0 +1,122 @@
+#include "iothread.h"
+
+/**
+ * Construct a new wakeup event.
+ */
+IoEvent::IoEvent() {
+    event_fd = eventfd(0, EFD_CLOEXEC | EFD_NONBLOCK);
+    if (event_fd < 0) {
+        fprintf(stderr, "Error: Could not create eventfd\n");
+        exit(1);
+    }
+    pending.store(false);
+}
+
+IoEvent::~IoEvent() {
+    close(event_fd);
+}
+
+/**
+ * Get the descriptor to watch for the event.
+ * @return The eventfd.
+ */
+int IoEvent::getFd() {
+    return event_fd;
+}
+
+/**
+ * Signal the event, unless it is already pending.
+ */
+void IoEvent::signal() {
+    if (pending.exchange(true, std::memory_order_acq_rel)) return;
+    uint64_t one = 1;
+    ssize_t result = write(event_fd, &one, sizeof(one));
+    (void)result;  // Only fails if the counter would overflow, then it is signaled anyway
+}
+
+/**
+ * Acknowledge the event on the I/O thread. Must be called before looking at
+ * the state the event announces, so a signal racing with the handler is never lost.
+ */
+void IoEvent::clear() {
+    uint64_t value;
+    ssize_t result = read(event_fd, &value, sizeof(value));
+    (void)result;
+    pending.exchange(false, std::memory_order_acq_rel);
+}
+
+/**
+ * Construct the I/O thread and start it.
+ */
+IoThread::IoThread() {
+    epoll_fd = epoll_create1(EPOLL_CLOEXEC);
+    if (epoll_fd < 0) {
+        fprintf(stderr, "Error: Could not create epoll instance\n");
+        exit(1);
+    }
+    epoll_event event = {};
+    event.events = EPOLLIN;
+    event.data.fd = stop_event.getFd();
+    epoll_ctl(epoll_fd, EPOLL_CTL_ADD, stop_event.getFd(), &event);
+    running.store(true);
+    thread = std::thread(&IoThread::loop, this);
+}
+
+/**
+ * Stop the I/O thread. Devices must have unwatched their descriptors.
+ */
+IoThread::~IoThread() {
+    running.store(false);
+    stop_event.signal();
+    thread.join();
+    close(epoll_fd);
+}
+
+/**
+ * Watch a descriptor. Regular files cannot be watched, they never block.
+ * @param fd The descriptor.
+ * @param events The epoll events to wait for, level triggered.
+ * @param handler The device called when the descriptor is ready.
+ * @return false if the descriptor cannot be watched.
+ */
+bool IoThread::watch(int fd, uint32_t events, IoHandler *handler) {
+    std::lock_guard<std::recursive_mutex> lock(mutex);
+    epoll_event event = {};
+    event.events = events;
+    event.data.fd = fd;
+    if (epoll_ctl(epoll_fd, EPOLL_CTL_ADD, fd, &event) < 0) return false;
+    handlers[fd] = handler;
+    return true;
+}
+
+/**
+ * Stop watching a descriptor. When this returns, no callback for it is running
+ * or will be made, so the handler may be destroyed.
+ * @param fd The descriptor.
+ */
+void IoThread::unwatch(int fd) {
+    std::lock_guard<std::recursive_mutex> lock(mutex);
+    epoll_ctl(epoll_fd, EPOLL_CTL_DEL, fd, NULL);
+    handlers.erase(fd);
+}
+
+/**
+ * The thread body, dispatching ready descriptors until stopped.
+ */
+void IoThread::loop() {
+    epoll_event events[IO_MAX_EVENTS];
+    while (running.load()) {
+        int count = epoll_wait(epoll_fd, events, IO_MAX_EVENTS, -1);
+        std::lock_guard<std::recursive_mutex> lock(mutex);
+        for (int i = 0; i < count; i++) {
+            int fd = events[i].data.fd;
+            if (fd == stop_event.getFd()) {
+                stop_event.clear();
+                continue;
+            }
+            // The descriptor may have been unwatched after epoll_wait returned
+            auto handler = handlers.find(fd);
+            if (handler != handlers.end()) handler->second->ioReady(fd, events[i].events);
+        }
+    }
+}
@@ -0,0 +1,72 @@
+#ifndef IO_THREAD_H
+#define IO_THREAD_H
+
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <unistd.h>
+#include <sys/epoll.h>
+#include <sys/eventfd.h>
+#include <atomic>
+#include <mutex>
+#include <thread>
+#include <unordered_map>
+#include "ring.h"
+
+#define IO_MAX_EVENTS 16
+
+/**
+ * Callback interface for devices served by the I/O thread.
+ */
+class IoHandler {
+    public:
+        /**
+         * Called on the I/O thread when a watched descriptor is ready.
+         * @param fd The descriptor.
+         * @param events The epoll events that occurred.
+         */
+        virtual void ioReady(int fd, uint32_t events) = 0;
+};
+
+/**
+ * Wakeup from the CPU thread to the I/O thread. Signals coalesce while one is
+ * pending, so a device can signal after every ring push and still make at most
+ * one system call per burst.
+ */
+class IoEvent {
+    public:
+        IoEvent();
+        ~IoEvent();
+        int getFd();
+        void signal();
+        void clear();
+
+    private:
+        int event_fd;
+        std::atomic<bool> pending;
+};
+
+/**
+ * Service thread that waits on host descriptors with epoll and calls the
+ * owning device. Devices exchange data with it through SpscRing buffers, so
+ * their MMIO handlers never block on the host.
+ */
+class IoThread {
+    public:
+        IoThread();
+        ~IoThread();
+        bool watch(int fd, uint32_t events, IoHandler *handler);
+        void unwatch(int fd);
+
+    private:
+        void loop();
+
+        int epoll_fd;
+        IoEvent stop_event;
+        std::atomic<bool> running;
+        std::recursive_mutex mutex;  // Guards handlers, held while a callback runs
+        std::unordered_map<int, IoHandler*> handlers;
+        std::thread thread;
+};
+
+#endif
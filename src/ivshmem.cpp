@@ -0,0 +1,231 @@
+#include "ivshmem.h"
+
+/**
+ * Construct a new shared memory device and map its shared memory object,
+ * creating it if this is the first instance.
+ * @param plic The interrupt controller.
+ * @param io The I/O thread sending and receiving doorbells.
+ * @param name The name of the POSIX shared memory object, without the leading slash.
+ * @param peer The peer ID of this instance, unique among the instances sharing the object.
+ * @param shm_size The size of the shared memory, a multiple of the page size.
+ * @param irq The interrupt source raised by doorbells.
+ * @param base The base address of the registers, the shared memory starts a page later.
+ */
+Ivshmem::Ivshmem(Plic *plic, IoThread *io, const char *name, uint32_t peer, size_t shm_size, uint32_t irq, uint32_t base) : doorbells(IVSHMEM_DOORBELL_RING) {
+    this->plic = plic;
+    this->io = io;
+    this->name = name;
+    this->peer = peer;
+    this->irq = irq;
+    this->base = base;
+    this->shm_size = shm_size;
+    mask.store(0);
+    status.store(0);
+
+    std::string path = "/" + this->name;
+    int fd = shm_open(path.c_str(), O_RDWR | O_CREAT | O_CLOEXEC, 0600);
+    struct stat st;
+    if (fd < 0 || fstat(fd, &st) < 0 || ((size_t)st.st_size < shm_size && ftruncate(fd, shm_size) < 0)) {
+        fprintf(stderr, "Error: Could not open shared memory object %s\n", path.c_str());
+        exit(1);
+    }
+    shm = (uint8_t*)mmap(NULL, shm_size, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+    close(fd);
+    if (shm == MAP_FAILED) {
+        fprintf(stderr, "Error: Could not map shared memory object %s\n", path.c_str());
+        exit(1);
+    }
+
+    sock = socket(AF_UNIX, SOCK_DGRAM | SOCK_NONBLOCK | SOCK_CLOEXEC, 0);
+    sockaddr_un addr;
+    socklen_t addr_len;
+    socketAddress(peer, &addr, &addr_len);
+    int pass_cred = 1;  // Abstract sockets have no permissions, the sender of each doorbell is checked instead
+    if (sock < 0 || setsockopt(sock, SOL_SOCKET, SO_PASSCRED, &pass_cred, sizeof(pass_cred)) < 0 || bind(sock, (sockaddr*)&addr, addr_len) < 0) {
+        fprintf(stderr, "Error: Could not bind the doorbell of peer %u on %s, is the ID in use?\n", peer, path.c_str());
+        exit(1);
+    }
+    io->watch(sock, EPOLLIN, this);
+    io->watch(doorbell_event.getFd(), EPOLLIN, this);
+}
+
+/**
+ * Destroy the shared memory device. The shared memory object stays, so peers
+ * and a rebooted guest find its contents.
+ */
+Ivshmem::~Ivshmem() {
+    io->unwatch(doorbell_event.getFd());
+    io->unwatch(sock);
+    close(sock);
+    munmap(shm, shm_size);
+}
+
+/**
+ * Get the device information.
+ * @return The device information.
+ */
+DeviceInfo Ivshmem::getDeviceInfo() {
+    DeviceInfo info;
+    info.base = base;
+    info.size = IVSHMEM_SHM_OFFSET + shm_size;
+    info.device = this;
+    return info;
+}
+
+/**
+ * Read a register or a word of the shared memory.
+ * @param addr The address to read from.
+ * @return The word read.
+ */
+uint32_t Ivshmem::read(uint64_t addr) {
+    uint32_t offset = addr - base;
+    if (offset >= IVSHMEM_SHM_OFFSET) {
+        offset -= IVSHMEM_SHM_OFFSET;
+        uint32_t value = 0;
+        memcpy(&value, shm + offset, (shm_size - offset < 4) ? shm_size - offset : 4);
+        return value;
+    }
+    switch (offset) {
+        case IVSHMEM_INTR_MASK:
+            return mask.load();
+        case IVSHMEM_INTR_STATUS: {
+            uint32_t value = status.exchange(0);
+            updateInterrupt();
+            return value;
+        }
+        case IVSHMEM_IV_POSITION:
+            return peer;
+    }
+    return 0;
+}
+
+/**
+ * Write a register or the shared memory.
+ * @param addr The address to write to.
+ * @param data The data to write.
+ * @param width The width of the data to write.
+ */
+void Ivshmem::write(uint64_t addr, uint32_t data, uint8_t width) {
+    uint32_t offset = addr - base;
+    if (offset >= IVSHMEM_SHM_OFFSET) {
+        offset -= IVSHMEM_SHM_OFFSET;
+        if (offset + width > shm_size) return;
+        memcpy(shm + offset, &data, width);
+        return;
+    }
+    switch (offset) {
+        case IVSHMEM_INTR_MASK:
+            mask.store(data);
+            updateInterrupt();
+            break;
+        case IVSHMEM_DOORBELL:
+            if ((data >> 16) >= IVSHMEM_MAX_PEERS) break;
+            if (doorbells.push(data)) doorbell_event.signal();  // A full ring drops the doorbell, like a busy peer would
+            break;
+    }
+}
+
+/**
+ * Get a host pointer to a range of the shared memory.
+ * @param addr The guest physical start address.
+ * @param len The length of the range.
+ * @param write true if the caller may write to the range.
+ * @return The host pointer or NULL if the range is not completely inside the shared memory.
+ */
+uint8_t *Ivshmem::getHostPointer(uint64_t addr, size_t len, bool write) {
+    uint32_t start = base + IVSHMEM_SHM_OFFSET;
+    if (addr < start || addr - start > shm_size || len > shm_size - (addr - start)) return NULL;
+    return shm + (addr - start);
+}
+
+/**
+ * Handle a ready descriptor on the I/O thread.
+ * @param fd The descriptor.
+ * @param events The epoll events that occurred.
+ */
+void Ivshmem::ioReady(int fd, uint32_t events) {
+    if (fd == doorbell_event.getFd()) {
+        doorbell_event.clear();
+        sendDoorbells();
+        return;
+    }
+    uint32_t vector;
+    bool rung = false;
+    while (receiveDoorbell(&vector)) {
+        status.fetch_or(1 << (vector & 0x1f));
+        rung = true;
+    }
+    if (rung) updateInterrupt();
+}
+
+/**
+ * Receive the next doorbell, dropping datagrams that are not from a process of
+ * the same user.
+ * @param vector Set to the vector of the doorbell.
+ * @return True if a doorbell was received, false if none is pending.
+ */
+bool Ivshmem::receiveDoorbell(uint32_t *vector) {
+    while (true) {
+        union {
+            cmsghdr header;
+            uint8_t buffer[CMSG_SPACE(sizeof(ucred))];
+        } control;
+        iovec iov = {vector, sizeof(uint32_t)};
+        msghdr msg;
+        memset(&msg, 0, sizeof(msg));
+        msg.msg_iov = &iov;
+        msg.msg_iovlen = 1;
+        msg.msg_control = control.buffer;
+        msg.msg_controllen = sizeof(control.buffer);
+        ssize_t len = recvmsg(sock, &msg, 0);
+        if (len < 0) return false;
+
+        cmsghdr *cmsg = CMSG_FIRSTHDR(&msg);
+        if (len != sizeof(uint32_t) || cmsg == NULL || cmsg->cmsg_level != SOL_SOCKET || cmsg->cmsg_type != SCM_CREDENTIALS) continue;
+        ucred cred;
+        memcpy(&cred, CMSG_DATA(cmsg), sizeof(cred));
+        if (cred.uid == getuid()) return true;
+    }
+}
+
+/**
+ * Get the doorbell socket address of a peer, in the abstract namespace.
+ * @param peer The peer ID.
+ * @param addr The address to fill.
+ * @param len Set to the length of the address.
+ */
+void Ivshmem::socketAddress(uint32_t peer, sockaddr_un *addr, socklen_t *len) {
+    memset(addr, 0, sizeof(sockaddr_un));
+    addr->sun_family = AF_UNIX;
+    int n = snprintf(addr->sun_path + 1, sizeof(addr->sun_path) - 1, "yarve-ivshmem/%s/%u", name.c_str(), peer);
+    if (n > (int)sizeof(addr->sun_path) - 2) n = sizeof(addr->sun_path) - 2;
+    *len = offsetof(sockaddr_un, sun_path) + 1 + n;
+}
+
+/**
+ * Set the interrupt level from the status and mask registers. Called on the CPU
+ * and the I/O thread, a doorbell arriving while the level is lowered raises it again.
+ */
+void Ivshmem::updateInterrupt() {
+    if (status.load() & mask.load()) {
+        plic->raiseAsync(irq);
+        return;
+    }
+    plic->lowerAsync(irq);
+    if (status.load() & mask.load()) plic->raiseAsync(irq);
+}
+
+/**
+ * Send the doorbells written by the guest. Runs on the I/O thread, a doorbell
+ * to a peer that is not running is lost.
+ */
+void Ivshmem::sendDoorbells() {
+    uint32_t data;
+    while (doorbells.pop(data)) {
+        sockaddr_un addr;
+        socklen_t addr_len;
+        socketAddress(data >> 16, &addr, &addr_len);
+        uint32_t vector = data & 0x1f;
+        sendto(sock, &vector, sizeof(vector), MSG_DONTWAIT, (sockaddr*)&addr, addr_len);
+    }
+}
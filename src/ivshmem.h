@@ -0,0 +1,74 @@
+#ifndef IVSHMEM_H
+#define IVSHMEM_H
+
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <errno.h>
+#include <sys/mman.h>
+#include <sys/socket.h>
+#include <sys/stat.h>
+#include <sys/un.h>
+#include <atomic>
+#include <string>
+#include "bus.h"
+#include "plic.h"
+#include "ring.h"
+#include "iothread.h"
+
+// Layout of the yarve,ivshmem node in yarve.dts
+#define DEFAULT_IVSHMEM_BASE 0x40000000
+#define DEFAULT_IVSHMEM_SIZE (16 * 1024 * 1024)
+#define DEFAULT_IVSHMEM_IRQ 2
+#define IVSHMEM_SHM_OFFSET 0x1000  // The registers take the first page, the shared memory follows
+#define IVSHMEM_MAX_PEERS 256
+#define IVSHMEM_DOORBELL_RING 256
+
+// Registers
+#define IVSHMEM_INTR_MASK 0x00    // Vectors that raise the interrupt
+#define IVSHMEM_INTR_STATUS 0x04  // Vectors rung since the last read, reading clears them
+#define IVSHMEM_IV_POSITION 0x08  // The peer ID of this instance
+#define IVSHMEM_DOORBELL 0x0C     // Write peer << 16 | vector to ring a peer
+
+/**
+ * Shared memory between yarve instances, after QEMU's ivshmem. Every instance
+ * maps the same POSIX shared memory object into its guest and gets a peer ID.
+ * Doorbells are datagrams on abstract Unix sockets named after the object and
+ * the peer, sent and received on the I/O thread. A received doorbell sets its
+ * vector in the status register and raises the interrupt.
+ */
+class Ivshmem : public BusDevice, public IoHandler {
+    public:
+        Ivshmem(Plic *plic, IoThread *io, const char *name, uint32_t peer, size_t shm_size = DEFAULT_IVSHMEM_SIZE, uint32_t irq = DEFAULT_IVSHMEM_IRQ, uint32_t base = DEFAULT_IVSHMEM_BASE);
+        ~Ivshmem();
+        DeviceInfo getDeviceInfo();
+        uint32_t read(uint64_t addr);
+        void write(uint64_t addr, uint32_t data, uint8_t width);
+        uint8_t *getHostPointer(uint64_t addr, size_t len, bool write);
+        void ioReady(int fd, uint32_t events);
+
+    private:
+        bool receiveDoorbell(uint32_t *vector);
+        void socketAddress(uint32_t peer, sockaddr_un *addr, socklen_t *len);
+        void updateInterrupt();
+        void sendDoorbells();
+
+        Plic *plic;
+        IoThread *io;
+        std::string name;
+        uint32_t peer;
+        uint32_t irq;
+        uint32_t base;
+        size_t shm_size;
+        uint8_t *shm;
+        int sock;
+        std::atomic<uint32_t> mask;
+        std::atomic<uint32_t> status;
+        SpscRing<uint32_t> doorbells;  // Written doorbell registers, sent by the I/O thread
+        IoEvent doorbell_event;
+};
+
+#endif
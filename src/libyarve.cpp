@@ -0,0 +1,307 @@
+#include <stddef.h>
+#include <string.h>
+#include <atomic>
+#include <algorithm>
+#include <sys/time.h>
+#include "yarve.h"
+#include "cpu.h"
+#include "bus.h"
+#include "ram.h"
+#include "uart.h"
+#include "clint.h"
+#include "syscon.h"
+#include "plic.h"
+#include "virtio.h"
+#include "framebuffer.h"
+
+#define LIB_BATCH_INSTRUCTIONS 1024  // Same batch size as RiscV::run
+// Sizes of the first versions of the caller allocated structs, fields added later are optional
+#define LIB_CONFIG_MIN_SIZE (offsetof(yarve_config, sbi) + sizeof(int))
+#define LIB_DEVICE_MIN_SIZE (offsetof(yarve_device, write) + sizeof(void*))
+
+/**
+ * A device whose accesses are forwarded to the callbacks of a yarve_device.
+ */
+class CallbackDevice : public BusDevice {
+    public:
+        CallbackDevice(const yarve_device *device) : device(*device) {}
+
+        DeviceInfo getDeviceInfo() {
+            DeviceInfo info;
+            info.base = device.base;
+            info.size = device.size;
+            info.device = this;
+            return info;
+        }
+
+        uint32_t read(uint64_t addr) {
+            return device.read(device.context, addr - device.base);
+        }
+
+        void write(uint64_t addr, uint32_t data, uint8_t width) {
+            device.write(device.context, addr - device.base, data, width);
+        }
+
+    private:
+        yarve_device device;
+};
+
+/**
+ * A machine of the C API. It mirrors RiscV::initialize, except that the UART
+ * is attached to callbacks and a reset is left to the embedder.
+ */
+struct yarve_machine {
+    Bus *bus;
+    Ram *ram;
+    Cpu *cpu;
+    Uart *uart;
+    Clint *clint;
+    Syscon *syscon;
+    Plic *plic;
+    VirtioMmio *virtio;
+    Framebuffer *framebuffer;
+    std::vector<CallbackDevice*> devices;
+    yarve_console_output output;
+    void *output_context;
+    std::atomic<bool> stop;
+    uint64_t last_update;  // Host time of the previous batch in microseconds
+    CpuState state;        // Scratch for register access
+};
+
+/**
+ * Forward a byte from the UART to the current console callback of a machine.
+ * @param context The machine.
+ * @param byte The byte.
+ */
+static void consoleOutput(void *context, uint8_t byte) {
+    yarve_machine *machine = (yarve_machine*)context;
+    if (machine->output) machine->output(machine->output_context, byte);
+}
+
+/**
+ * Get the host time.
+ * @return The time in microseconds.
+ */
+static uint64_t hostMicros() {
+    timeval tv;
+    gettimeofday(&tv, NULL);
+    return (uint64_t)tv.tv_sec * 1000000 + tv.tv_usec;
+}
+
+/**
+ * Copy the fields of a versioned struct, the ones both versions have. The
+ * leading struct_size of the destination is left alone.
+ * @param dest The destination struct.
+ * @param dest_size The size of the destination version.
+ * @param src The source struct.
+ * @param src_size The size of the source version.
+ */
+static void copyFields(void *dest, size_t dest_size, const void *src, size_t src_size) {
+    memcpy((uint8_t*)dest + sizeof(size_t), (const uint8_t*)src + sizeof(size_t), std::min(dest_size, src_size) - sizeof(size_t));
+}
+
+void yarve_default_config(yarve_config *config) {
+    if (config->struct_size < LIB_CONFIG_MIN_SIZE) return;
+    yarve_config defaults;
+    defaults.ram_base = DEFAULT_RAM_BASE;
+    defaults.ram_size = DEFAULT_RAM_SIZE;
+    defaults.entry = DEFAULT_CPU_PC;
+    defaults.dtb_base = DEFAULT_DTB_BASE;
+    defaults.sbi = 0;
+    copyFields(config, config->struct_size, &defaults, sizeof(defaults));
+}
+
+yarve_machine *yarve_create(const yarve_config *caller_config) {
+    yarve_config config;
+    config.struct_size = sizeof(config);
+    yarve_default_config(&config);
+    if (caller_config != NULL) {  // Fields added after the caller's version keep their defaults
+        if (caller_config->struct_size < LIB_CONFIG_MIN_SIZE) return NULL;
+        copyFields(&config, sizeof(config), caller_config, caller_config->struct_size);
+    }
+    if (config.ram_size == 0 || config.ram_size % RAM_PAGE_SIZE || config.ram_size > 0x100000000ULL - config.ram_base) return NULL;
+
+    yarve_machine *machine = new yarve_machine();
+    machine->bus = new Bus();
+    machine->ram = new Ram(config.ram_base, config.ram_size);
+    machine->cpu = new Cpu(machine->bus);
+    machine->uart = new Uart(machine->cpu, consoleOutput, machine);
+    machine->clint = new Clint(machine->cpu);
+    machine->syscon = new Syscon(machine->cpu);
+    machine->plic = new Plic(machine->cpu);
+    machine->virtio = new VirtioMmio(machine->bus, machine->plic);  // Empty slot, the guest skips it
+    machine->framebuffer = new Framebuffer();
+    machine->bus->attach(machine->ram);
+    machine->bus->attach(machine->uart);
+    machine->bus->attach(machine->clint);
+    machine->bus->attach(machine->syscon);
+    machine->bus->attach(machine->plic);
+    machine->bus->attach(machine->virtio);
+    machine->bus->attach(machine->framebuffer);
+    machine->output = NULL;
+    machine->output_context = NULL;
+    machine->stop.store(false);
+    machine->cpu->setSbi(config.sbi != 0);
+    yarve_reset(machine, config.entry, config.dtb_base);
+    return machine;
+}
+
+void yarve_destroy(yarve_machine *machine) {
+    if (machine == NULL) return;
+    delete machine->bus;
+    delete machine->ram;
+    delete machine->cpu;
+    delete machine->uart;
+    delete machine->clint;
+    delete machine->syscon;
+    delete machine->plic;
+    delete machine->virtio;
+    delete machine->framebuffer;
+    for (CallbackDevice *device : machine->devices) delete device;
+    delete machine;
+}
+
+void yarve_reset(yarve_machine *machine, uint32_t entry, uint32_t dtb_base) {
+    machine->cpu->reset(entry, dtb_base);
+    machine->last_update = hostMicros();
+}
+
+int yarve_load_image(yarve_machine *machine, const void *data, size_t len, uint32_t addr) {
+    return machine->bus->writeBytes(addr, data, len) ? 0 : -1;
+}
+
+int yarve_load_file(yarve_machine *machine, const char *filename, uint32_t addr) {
+    FILE *file = fopen(filename, "rb");
+    if (!file) return -1;
+    std::vector<uint8_t> image;
+    uint8_t chunk[65536];
+    size_t n;
+    while ((n = fread(chunk, 1, sizeof(chunk), file)) > 0) image.insert(image.end(), chunk, chunk + n);
+    bool failed = ferror(file);
+    fclose(file);
+    if (failed) return -1;
+    return yarve_load_image(machine, image.data(), image.size(), addr);
+}
+
+int yarve_run(yarve_machine *machine, uint64_t max_instructions, uint64_t *executed) {
+    uint64_t start = machine->cpu->getInstructionCount();
+    int event = YARVE_EVENT_LIMIT;
+    while (true) {
+        uint64_t done = machine->cpu->getInstructionCount() - start;
+        if (machine->stop.exchange(false)) {
+            event = YARVE_EVENT_STOP;
+            break;
+        }
+        if (done >= max_instructions) break;
+
+        uint64_t batch = max_instructions - done;
+        if (batch > LIB_BATCH_INSTRUCTIONS) batch = LIB_BATCH_INSTRUCTIONS;
+        uint64_t now = hostMicros();
+        uint64_t elapsed = now - machine->last_update;
+        machine->last_update = now;
+        machine->plic->sync();  // Apply interrupts set with yarve_set_irq
+        uint32_t stop_reason = machine->cpu->execute(batch, elapsed > UINT32_MAX ? UINT32_MAX : elapsed);
+        if (stop_reason == CPU_STOP_POWEROFF) {
+            event = YARVE_EVENT_POWEROFF;
+            break;
+        }
+        if (stop_reason == CPU_STOP_RESET) {
+            event = YARVE_EVENT_RESET;
+            break;
+        }
+        if (machine->cpu->isWaiting()) {
+            event = YARVE_EVENT_IDLE;
+            break;
+        }
+    }
+    if (executed) *executed = machine->cpu->getInstructionCount() - start;
+    return event;
+}
+
+void yarve_stop(yarve_machine *machine) {
+    machine->stop.store(true);
+}
+
+uint64_t yarve_instruction_count(yarve_machine *machine) {
+    return machine->cpu->getInstructionCount();
+}
+
+uint32_t yarve_get_reg(yarve_machine *machine, int reg) {
+    if (reg < 0 || reg > YARVE_REG_PC) return 0;
+    machine->cpu->saveState(&machine->state);
+    return (reg == YARVE_REG_PC) ? machine->state.pc : machine->state.x[reg];
+}
+
+void yarve_set_reg(yarve_machine *machine, int reg, uint32_t value) {
+    if (reg <= 0 || reg > YARVE_REG_PC) return;
+    machine->cpu->saveState(&machine->state);
+    if (reg == YARVE_REG_PC)
+        machine->state.pc = value;
+    else
+        machine->state.x[reg] = value;
+    machine->cpu->loadState(&machine->state);
+}
+
+uint64_t yarve_get_freg(yarve_machine *machine, int reg) {
+    if (reg < 0 || reg > 31) return 0;
+    machine->cpu->saveState(&machine->state);
+    return machine->state.f[reg];
+}
+
+void yarve_set_freg(yarve_machine *machine, int reg, uint64_t value) {
+    if (reg < 0 || reg > 31) return;
+    machine->cpu->saveState(&machine->state);
+    machine->state.f[reg] = value;
+    machine->cpu->loadState(&machine->state);
+}
+
+uint32_t yarve_get_csr(yarve_machine *machine, uint32_t csr) {
+    if (csr > 0xFFF) return 0;
+    machine->cpu->saveState(&machine->state);
+    return machine->state.csr[csr];
+}
+
+void yarve_set_csr(yarve_machine *machine, uint32_t csr, uint32_t value) {
+    if (csr > 0xFFF) return;
+    machine->cpu->saveState(&machine->state);
+    machine->state.csr[csr] = value;
+    machine->cpu->loadState(&machine->state);
+}
+
+int yarve_read_memory(yarve_machine *machine, uint32_t addr, void *buffer, size_t len) {
+    return machine->bus->readBytes(addr, buffer, len) ? 0 : -1;
+}
+
+int yarve_write_memory(yarve_machine *machine, uint32_t addr, const void *buffer, size_t len) {
+    return machine->bus->writeBytes(addr, buffer, len) ? 0 : -1;
+}
+
+int yarve_attach_device(yarve_machine *machine, const yarve_device *caller_device) {
+    if (caller_device->struct_size < LIB_DEVICE_MIN_SIZE) return -1;
+    yarve_device device;
+    memset(&device, 0, sizeof(device));
+    device.struct_size = sizeof(device);
+    copyFields(&device, sizeof(device), caller_device, caller_device->struct_size);
+    if (device.read == NULL || device.write == NULL || device.size == 0) return -1;
+    CallbackDevice *callback_device = new CallbackDevice(&device);
+    machine->devices.push_back(callback_device);
+    machine->bus->attach(callback_device);
+    return 0;
+}
+
+void yarve_set_irq(yarve_machine *machine, uint32_t irq, int level) {
+    if (irq == 0 || irq >= PLIC_NUM_SOURCES) return;
+    if (level)
+        machine->plic->raiseAsync(irq);
+    else
+        machine->plic->lowerAsync(irq);
+}
+
+void yarve_set_console_output(yarve_machine *machine, yarve_console_output output, void *context) {
+    machine->output = output;
+    machine->output_context = context;
+}
+
+size_t yarve_console_input(yarve_machine *machine, const void *data, size_t len) {
+    return machine->uart->receive((const uint8_t*)data, len);
+}
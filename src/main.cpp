@@ -1,7 +1,24 @@
 #include <iostream>
 #include <string>
+#include <stdexcept>
 #include "riscv.h"
 
+/**
+ * Parse a size in bytes with an optional K, M or G suffix.
+ * @param text The size, e.g. 134217728, 128M or 4G.
+ * @return The size in bytes.
+ */
+static uint64_t parseSize(const std::string &text) {
+    size_t end;
+    uint64_t size = std::stoull(text, &end);
+    std::string suffix = text.substr(end);
+    if (suffix == "K" || suffix == "k") return size << 10;
+    if (suffix == "M" || suffix == "m") return size << 20;
+    if (suffix == "G" || suffix == "g") return size << 30;
+    if (suffix != "") throw std::invalid_argument(text);
+    return size;
+}
+
 void printHelp(std::string exec_name) {
     std::cout << "Usage: " << exec_name << " [OPTION]... -b [KERNEL]" << std::endl;
     std::cout << "Emulates a RiscV machine." << std::endl;
@@ -9,13 +26,29 @@ void printHelp(std::string exec_name) {
     std::cout << std::endl;
     std::cout << "  -h, --help        display this help and exit" << std::endl;
     std::cout << "  -v, --version     display version information and exit" << std::endl;
-    std::cout << "  -r, --ram         specify the RAM size in bytes" << std::endl;
+    std::cout << "  -r, --ram         specify the RAM size in bytes, or with a K, M or G suffix" << std::endl;
     std::cout << "  -R, --ram-base    specify the base address of the RAM" << std::endl;
     std::cout << "  -d, --dtb         specify the device tree blob file" << std::endl;
     std::cout << "  -D, --dtb-base    specify the base address of the device tree blob" << std::endl;
     std::cout << "  -k, --kernel      specify the kernel to load" << std::endl;
     std::cout << "  -K, --kernel-base specify the base address of the kernel" << std::endl;
     std::cout << "  -e, --entry       specify the entry point of the kernel" << std::endl;
+    std::cout << "  -p, --plugin      load an instrumentation plugin, NAME[:ARGS] or PATH.so[:ARGS]" << std::endl;
+    std::cout << "  -t, --trace       write a binary execution trace to FILE, see yarve-trace" << std::endl;
+    std::cout << "  -s, --share       share a host directory with the guest over virtio-9p, HOST_DIR:TAG" << std::endl;
+    std::cout << "      --balloon     return guest memory to the host, the target is set through the control SOCKET" << std::endl;
+    std::cout << "      --ivshmem     map the POSIX shared memory object NAME as peer ID, NAME:ID[:SIZE]" << std::endl;
+    std::cout << "      --console-stamps  write every console byte with its guest instruction count to FILE" << std::endl;
+    std::cout << "      --checkpoint-dir  write incremental checkpoints of the machine to DIR" << std::endl;
+    std::cout << "      --checkpoint-interval  seconds between checkpoints, default 60" << std::endl;
+    std::cout << "      --restore     resume from a checkpoint DIR or a collapsed checkpoint FILE" << std::endl;
+    std::cout << "      --fb-shm      export the framebuffer to the POSIX shared memory segment NAME" << std::endl;
+    std::cout << "      --fb-dump     write the framebuffer to DIR as a PPM image whenever it changed" << std::endl;
+    std::cout << "      --fb-interval milliseconds between framebuffer exports, default 100" << std::endl;
+    std::cout << "      --cachesim    simulate caches and a branch predictor, SETTINGS or 'default', see README" << std::endl;
+    std::cout << "      --sbi         boot the kernel in S-mode with the SBI provided by the emulator" << std::endl;
+    std::cout << "      --warp        skip guest time spent in WFI and polling loops instead of waiting for it" << std::endl;
+    std::cout << "      --xlen        run an RV32 or RV64 hart, 32 or 64, default 32" << std::endl;
     std::cout << std::endl << std::flush;
 }
 
@@ -38,19 +71,75 @@ int main(int argc, char* argv[]) {
             std::cout << "License GPLv3+: GNU GPL version 3 or later <http://gnu.org/licenses/gpl.html>." << std::endl << std::flush;
             return 0;
         } else if ((arg == "-r") || (arg == "--ram")) {
-            riscv.ram_size = std::stoul(argv[++i]);
+            riscv.ram_size = parseSize(argv[++i]);
         } else if ((arg == "-R") || (arg == "--ram-base")) {
-            riscv.ram_base = std::stoul(argv[++i], nullptr, 16);
+            riscv.ram_base = std::stoull(argv[++i], nullptr, 16);
         } else if ((arg == "-d") || (arg == "--dtb")) {
             riscv.dtb_file = argv[++i];
         } else if ((arg == "-D") || (arg == "--dtb-base")) {
-            riscv.dtb_base = std::stoul(argv[++i], nullptr, 16);
+            riscv.dtb_base = std::stoull(argv[++i], nullptr, 16);
         } else if ((arg == "-k") || (arg == "--kernel")) {
             riscv.kernel_file = argv[++i];
         } else if ((arg == "-K") || (arg == "--kernel-base")) {
-            riscv.kernel_base = std::stoul(argv[++i], nullptr, 16);
+            riscv.kernel_base = std::stoull(argv[++i], nullptr, 16);
         } else if ((arg == "-e") || (arg == "--entry")) {
-            riscv.kernel_entry = std::stoul(argv[++i], nullptr, 16);
+            riscv.kernel_entry = std::stoull(argv[++i], nullptr, 16);
+        } else if ((arg == "-p") || (arg == "--plugin")) {
+            riscv.plugin_spec = argv[++i];
+        } else if ((arg == "-t") || (arg == "--trace")) {
+            riscv.trace_file = argv[++i];
+        } else if ((arg == "-s") || (arg == "--share")) {
+            std::string share = argv[++i];
+            size_t colon = share.rfind(':');
+            if (colon == std::string::npos || colon == 0 || colon == share.size() - 1) {
+                std::cout << "yarve: --share expects HOST_DIR:TAG" << std::endl << std::flush;
+                return 1;
+            }
+            riscv.share_dir = share.substr(0, colon);
+            riscv.share_tag = share.substr(colon + 1);
+        } else if (arg == "--balloon") {
+            riscv.balloon_socket = argv[++i];
+        } else if (arg == "--ivshmem") {
+            std::string spec = argv[++i];
+            size_t colon = spec.find(':');
+            size_t size_colon = (colon == std::string::npos) ? std::string::npos : spec.find(':', colon + 1);
+            if (colon == std::string::npos || colon == 0 || colon == spec.size() - 1 || spec.find('/') != std::string::npos) {
+                std::cout << "yarve: --ivshmem expects NAME:ID[:SIZE]" << std::endl << std::flush;
+                return 1;
+            }
+            riscv.ivshmem_name = spec.substr(0, colon);
+            riscv.ivshmem_peer = std::stoi(spec.substr(colon + 1, size_colon - colon - 1));
+            if (size_colon != std::string::npos) riscv.ivshmem_size = parseSize(spec.substr(size_colon + 1));
+            if (riscv.ivshmem_peer < 0 || riscv.ivshmem_peer >= IVSHMEM_MAX_PEERS) {
+                std::cout << "yarve: --ivshmem peer IDs range from 0 to " << IVSHMEM_MAX_PEERS - 1 << std::endl << std::flush;
+                return 1;
+            }
+        } else if (arg == "--console-stamps") {
+            riscv.console_stamps = argv[++i];
+        } else if (arg == "--checkpoint-dir") {
+            riscv.checkpoint_dir = argv[++i];
+        } else if (arg == "--checkpoint-interval") {
+            riscv.checkpoint_interval = std::stoi(argv[++i]);
+        } else if (arg == "--restore") {
+            riscv.restore_path = argv[++i];
+        } else if (arg == "--fb-shm") {
+            riscv.fb_shm = argv[++i];
+        } else if (arg == "--fb-dump") {
+            riscv.fb_dump = argv[++i];
+        } else if (arg == "--fb-interval") {
+            riscv.fb_interval = std::stoi(argv[++i]);
+        } else if (arg == "--cachesim") {
+            riscv.cachesim_spec = argv[++i];
+        } else if (arg == "--sbi") {
+            riscv.sbi = true;
+        } else if (arg == "--warp") {
+            riscv.warp = true;
+        } else if (arg == "--xlen") {
+            riscv.xlen = std::stoi(argv[++i]);
+            if (riscv.xlen != 32 && riscv.xlen != 64) {
+                std::cout << "yarve: --xlen must be 32 or 64" << std::endl << std::flush;
+                return 1;
+            }
         } else {
             std::cout << "yarve: unrecognized option '" << arg << "'" << std::endl;
             std::cout << "Try 'yarve --help' for more information." << std::endl << std::flush;
@@ -58,13 +147,71 @@ int main(int argc, char* argv[]) {
         }
     }
 
-    if (riscv.kernel_file == "") {
+    if (riscv.kernel_file == "" && riscv.restore_path == "") {
         std::cout << "yarve: no kernel file specified" << std::endl;
         std::cout << "Try 'yarve --help' for more information." << std::endl << std::flush;
         return 1;
     }
 
-    if (riscv.dtb_file == "") {
+    if ((riscv.trace_file != "") + (riscv.plugin_spec != "") + (riscv.cachesim_spec != "") > 1) {
+        std::cout << "yarve: --trace, --plugin and --cachesim cannot be used together" << std::endl << std::flush;
+        return 1;
+    }
+
+    if ((riscv.checkpoint_dir != "" || riscv.restore_path != "") && riscv.share_dir != "") {
+        std::cout << "yarve: checkpoints cannot be combined with --share, open host files are not saved" << std::endl << std::flush;
+        return 1;
+    }
+
+    if ((riscv.checkpoint_dir != "" || riscv.restore_path != "") && riscv.ivshmem_name != "") {
+        std::cout << "yarve: checkpoints cannot be combined with --ivshmem, the shared memory is not saved" << std::endl << std::flush;
+        return 1;
+    }
+
+    if ((riscv.checkpoint_dir != "" || riscv.restore_path != "") && riscv.balloon_socket != "") {
+        std::cout << "yarve: checkpoints cannot be combined with --balloon, the virtqueues are not saved" << std::endl << std::flush;
+        return 1;
+    }
+
+    if (riscv.xlen == 64 && (riscv.trace_file != "" || riscv.plugin_spec != "" || riscv.cachesim_spec != "")) {
+        std::cout << "yarve: --trace, --plugin and --cachesim are not supported with --xlen 64" << std::endl << std::flush;
+        return 1;
+    }
+
+    if (riscv.xlen == 64 && (riscv.checkpoint_dir != "" || riscv.restore_path != "")) {
+        std::cout << "yarve: checkpoints are not supported with --xlen 64" << std::endl << std::flush;
+        return 1;
+    }
+
+    if (riscv.ram_size == 0 || riscv.ram_size % RAM_PAGE_SIZE || riscv.ram_base + riscv.ram_size < riscv.ram_base) {
+        std::cout << "yarve: --ram must be a non-zero multiple of " << RAM_PAGE_SIZE << " bytes" << std::endl << std::flush;
+        return 1;
+    }
+
+    if (riscv.xlen == 32 && riscv.ram_base + riscv.ram_size > 0x100000000ULL) {
+        std::cout << "yarve: the RAM of an RV32 machine has to end below 4 GiB, use --xlen 64 for more" << std::endl << std::flush;
+        return 1;
+    }
+
+    // Checked once -R is known, the shared memory must not reach into the RAM
+    uint64_t ivshmem_end = (uint64_t)DEFAULT_IVSHMEM_BASE + IVSHMEM_SHM_OFFSET + riscv.ivshmem_size;
+    if (riscv.ivshmem_name != "" && (riscv.ivshmem_size == 0 || riscv.ivshmem_size % 4096 || riscv.ivshmem_size > 0x100000000ULL - DEFAULT_IVSHMEM_BASE - IVSHMEM_SHM_OFFSET ||
+                                     (riscv.ram_base < ivshmem_end && DEFAULT_IVSHMEM_BASE < riscv.ram_base + riscv.ram_size))) {
+        std::cout << "yarve: --ivshmem size must be a multiple of 4096 that ends below 4 GiB and does not overlap the RAM" << std::endl << std::flush;
+        return 1;
+    }
+
+    if (riscv.checkpoint_interval <= 0) {
+        std::cout << "yarve: --checkpoint-interval must be positive" << std::endl << std::flush;
+        return 1;
+    }
+
+    if (riscv.fb_interval <= 0) {
+        std::cout << "yarve: --fb-interval must be positive" << std::endl << std::flush;
+        return 1;
+    }
+
+    if (riscv.dtb_file == "" && riscv.restore_path == "") {
         std::cout << "Warning: no device tree blob file specified" << std::endl << std::flush;
     }
 
@@ -0,0 +1,192 @@
+#include "plic.h"
+
+/**
+ * Construct a new PLIC device with a single context for the machine mode of hart 0.
+ * @param cpu The CPU interface.
+ * @param base The base address of the PLIC device.
+ * @param size The size of the PLIC device.
+ */
+Plic::Plic(ICpuInterface *cpu, uint32_t base, size_t size) {
+    this->cpu = cpu;
+    this->base = base;
+    this->size = size;
+    memset(priority, 0, sizeof(priority));
+    level = 0;
+    pending = 0;
+    claimed = 0;
+    enable = 0;
+    threshold = 0;
+    async_level.store(0);
+    async_dirty.store(0);
+}
+
+/**
+ * Get the device information.
+ * @return The device information.
+ */
+DeviceInfo Plic::getDeviceInfo() {
+    DeviceInfo info;
+    info.base = base;
+    info.size = size;
+    info.device = this;
+    return info;
+}
+
+/**
+ * Read a word from the PLIC device.
+ * @param addr The address to read from.
+ * @return The word read from the PLIC device.
+ */
+uint32_t Plic::read(uint64_t addr) {
+    uint32_t offset = addr - base;
+    if (offset < PLIC_NUM_SOURCES * 4) {
+        return priority[offset >> 2];
+    } else if (offset == PLIC_PENDING) {
+        return pending;
+    } else if (offset == PLIC_ENABLE) {
+        return enable;
+    } else if (offset == PLIC_THRESHOLD) {
+        return threshold;
+    } else if (offset == PLIC_CLAIM) {
+        return claim();
+    }
+    return 0;
+}
+
+/**
+ * Write a word to the PLIC device.
+ * @param addr The address to write to.
+ * @param data The data to write.
+ * @param width The width of the data to write.
+ */
+void Plic::write(uint64_t addr, uint32_t data, uint8_t width) {
+    uint32_t offset = addr - base;
+    if (offset < PLIC_NUM_SOURCES * 4) {
+        if (offset) priority[offset >> 2] = data & 7;  // Source 0 does not exist
+    } else if (offset == PLIC_ENABLE) {
+        enable = data & ~1;
+    } else if (offset == PLIC_THRESHOLD) {
+        threshold = data & 7;
+    } else if (offset == PLIC_CLAIM) {  // Complete
+        if (data < PLIC_NUM_SOURCES) {
+            claimed &= ~(1 << data);
+            if (level & (1 << data)) pending |= 1 << data;
+        }
+    }
+    update();
+}
+
+/**
+ * Raise the level of an interrupt source.
+ * @param irq The interrupt source.
+ */
+void Plic::raise(uint32_t irq) {
+    level |= 1 << irq;
+    if (!(claimed & (1 << irq))) pending |= 1 << irq;
+    update();
+}
+
+/**
+ * Lower the level of an interrupt source.
+ * @param irq The interrupt source.
+ */
+void Plic::lower(uint32_t irq) {
+    level &= ~(1 << irq);
+    pending &= ~(1 << irq);
+    update();
+}
+
+/**
+ * Claim the pending interrupt with the highest priority.
+ * @return The claimed interrupt source, 0 if none.
+ */
+uint32_t Plic::claim() {
+    uint32_t best = 0;
+    uint32_t best_priority = threshold;
+    for (uint32_t irq = 1; irq < PLIC_NUM_SOURCES; irq++) {
+        if ((pending & enable & (1 << irq)) && priority[irq] > best_priority) {
+            best = irq;
+            best_priority = priority[irq];
+        }
+    }
+    if (best) {
+        pending &= ~(1 << best);
+        claimed |= 1 << best;
+        update();
+    }
+    return best;
+}
+
+/**
+ * Update the external interrupt line of the CPU.
+ */
+void Plic::update() {
+    bool active = false;
+    for (uint32_t irq = 1; irq < PLIC_NUM_SOURCES; irq++) {
+        if ((pending & enable & (1 << irq)) && priority[irq] > threshold) active = true;
+    }
+    cpu->setExternalInterrupt(active);
+}
+
+/**
+ * Raise the level of an interrupt source from a thread other than the CPU
+ * thread, e.g. the I/O thread. Takes effect at the next sync().
+ * @param irq The interrupt source.
+ */
+void Plic::raiseAsync(uint32_t irq) {
+    async_level.fetch_or(1 << irq, std::memory_order_relaxed);
+    async_dirty.fetch_or(1 << irq, std::memory_order_release);
+}
+
+/**
+ * Lower the level of an interrupt source from a thread other than the CPU thread.
+ * @param irq The interrupt source.
+ */
+void Plic::lowerAsync(uint32_t irq) {
+    async_level.fetch_and(~(1 << irq), std::memory_order_relaxed);
+    async_dirty.fetch_or(1 << irq, std::memory_order_release);
+}
+
+/**
+ * Apply the levels set by raiseAsync and lowerAsync. Called on the CPU thread
+ * between execute batches; only the last level of a source counts.
+ */
+void Plic::sync() {
+    if (!async_dirty.load(std::memory_order_relaxed)) return;
+    uint32_t dirty = async_dirty.exchange(0, std::memory_order_acquire);
+    uint32_t levels = async_level.load(std::memory_order_relaxed);
+    for (uint32_t irq = 1; irq < PLIC_NUM_SOURCES; irq++) {
+        if (!(dirty & (1 << irq))) continue;
+        if (levels & (1 << irq))
+            raise(irq);
+        else
+            lower(irq);
+    }
+}
+
+/**
+ * Save the state of the PLIC.
+ * @param state The state to fill.
+ */
+void Plic::saveState(PlicState *state) {
+    memcpy(state->priority, priority, sizeof(priority));
+    state->level = level;
+    state->pending = pending;
+    state->claimed = claimed;
+    state->enable = enable;
+    state->threshold = threshold;
+}
+
+/**
+ * Restore the state saved by saveState and update the interrupt line.
+ * @param state The saved state.
+ */
+void Plic::loadState(const PlicState *state) {
+    memcpy(priority, state->priority, sizeof(priority));
+    level = state->level;
+    pending = state->pending;
+    claimed = state->claimed;
+    enable = state->enable;
+    threshold = state->threshold;
+    update();
+}
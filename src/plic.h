@@ -0,0 +1,62 @@
+#ifndef PLIC_H
+#define PLIC_H
+
+#include <stdint.h>
+#include <stdio.h>
+#include <atomic>
+#include "cpu.h"
+#include "bus.h"
+
+#define DEFAULT_PLIC_BASE 0x0C000000
+#define DEFAULT_PLIC_SIZE 0x4000000
+#define PLIC_NUM_SOURCES 32
+
+#define PLIC_PENDING 0x1000
+#define PLIC_ENABLE 0x2000
+#define PLIC_THRESHOLD 0x200000
+#define PLIC_CLAIM 0x200004
+
+/**
+ * State of the PLIC, saved in checkpoints.
+ */
+typedef struct {
+    uint32_t priority[PLIC_NUM_SOURCES];
+    uint32_t level;
+    uint32_t pending;
+    uint32_t claimed;
+    uint32_t enable;
+    uint32_t threshold;
+} PlicState;
+
+class Plic : public BusDevice {
+    public:
+        Plic(ICpuInterface *cpu, uint32_t base = DEFAULT_PLIC_BASE, size_t size = DEFAULT_PLIC_SIZE);
+        DeviceInfo getDeviceInfo();
+        uint32_t read(uint64_t addr);
+        void write(uint64_t addr, uint32_t data, uint8_t width);
+        void raise(uint32_t irq);
+        void lower(uint32_t irq);
+        void raiseAsync(uint32_t irq);
+        void lowerAsync(uint32_t irq);
+        void sync();
+        void saveState(PlicState *state);
+        void loadState(const PlicState *state);
+
+    private:
+        void update();
+        uint32_t claim();
+
+        uint32_t base;
+        size_t size;
+        ICpuInterface *cpu;
+        uint32_t priority[PLIC_NUM_SOURCES];
+        uint32_t level;
+        uint32_t pending;
+        uint32_t claimed;
+        uint32_t enable;
+        uint32_t threshold;
+        std::atomic<uint32_t> async_level;  // Levels set by other threads, applied by sync()
+        std::atomic<uint32_t> async_dirty;
+};
+
+#endif
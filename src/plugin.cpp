@@ -0,0 +1,81 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <dlfcn.h>
+#include <string>
+#include <vector>
+#include "plugin.h"
+
+typedef struct {
+    const char *name;
+    YarvePluginInit init;
+} PluginEntry;
+
+static std::vector<YarvePlugin*> loaded_plugins;
+
+/**
+ * Call the finish callback of every loaded plugin, registered with atexit.
+ */
+static void finishPlugins() {
+    for (auto plugin : loaded_plugins) {
+        if (plugin->finish) plugin->finish(plugin->ctx);
+    }
+}
+
+/**
+ * Get the list of builtin plugins. Wrapped in a function so registration from
+ * static constructors of other translation units does not depend on init order.
+ * @return The list of builtin plugins.
+ */
+static std::vector<PluginEntry> &builtinPlugins() {
+    static std::vector<PluginEntry> plugins;
+    return plugins;
+}
+
+void registerPlugin(const char *name, YarvePluginInit init) {
+    PluginEntry entry;
+    entry.name = name;
+    entry.init = init;
+    builtinPlugins().push_back(entry);
+}
+
+YarvePlugin *loadPlugin(const char *spec) {
+    std::string name = spec;
+    std::string args;
+    size_t colon = name.find(':');
+    if (colon != std::string::npos) {
+        args = name.substr(colon + 1);
+        name = name.substr(0, colon);
+    }
+
+    YarvePluginInit init = NULL;
+    if (name.find('/') != std::string::npos || name.find(".so") != std::string::npos) {
+        void *handle = dlopen(name.c_str(), RTLD_NOW | RTLD_LOCAL);
+        if (handle == NULL) {
+            fprintf(stderr, "Error: Could not load plugin %s: %s\n", name.c_str(), dlerror());
+            exit(1);
+        }
+        init = (YarvePluginInit)dlsym(handle, YARVE_PLUGIN_INIT_SYMBOL);
+        if (init == NULL) {
+            fprintf(stderr, "Error: Plugin %s does not export %s\n", name.c_str(), YARVE_PLUGIN_INIT_SYMBOL);
+            exit(1);
+        }
+    } else {
+        for (auto& entry : builtinPlugins()) {
+            if (name == entry.name) init = entry.init;
+        }
+        if (init == NULL) {
+            fprintf(stderr, "Error: Unknown plugin %s\n", name.c_str());
+            exit(1);
+        }
+    }
+
+    YarvePlugin *plugin = init(args.c_str());
+    if (plugin == NULL) {
+        fprintf(stderr, "Error: Plugin %s failed to initialize\n", name.c_str());
+        exit(1);
+    }
+    if (loaded_plugins.empty()) atexit(finishPlugins);
+    loaded_plugins.push_back(plugin);
+    return plugin;
+}
@@ -0,0 +1,63 @@
+#ifndef PLUGIN_H
+#define PLUGIN_H
+
+#include <stdint.h>
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+/**
+ * Callback table of an instrumentation plugin. Every callback is optional and
+ * receives the plugin's ctx pointer as its first argument. Loads and stores of
+ * 8 bytes (FLD, FSD) are reported once with the low word as value.
+ */
+typedef struct YarvePlugin {
+    const char *name;
+    void *ctx;
+    void (*retire)(void *ctx, uint32_t pc, uint32_t ir);
+    void (*load)(void *ctx, uint32_t pc, uint32_t addr, uint8_t width, uint32_t value);
+    void (*store)(void *ctx, uint32_t pc, uint32_t addr, uint8_t width, uint32_t value);
+    void (*trap_enter)(void *ctx, uint32_t cause, uint32_t epc, uint32_t tval);
+    void (*trap_exit)(void *ctx, uint32_t pc);
+    void (*mmio)(void *ctx, uint32_t addr, uint8_t width, uint32_t value, int is_write);
+    void (*finish)(void *ctx);
+} YarvePlugin;
+
+/**
+ * Entry point of a plugin. Shared object plugins export it as yarve_plugin_init.
+ * @param args The argument string given after the colon in --plugin NAME:ARGS, never NULL.
+ * @return The plugin's callback table or NULL on failure.
+ */
+typedef YarvePlugin *(*YarvePluginInit)(const char *args);
+
+#define YARVE_PLUGIN_INIT_SYMBOL "yarve_plugin_init"
+
+#ifdef __cplusplus
+}
+
+/**
+ * Register a plugin that is linked into the emulator.
+ * @param name The name used to select the plugin with --plugin.
+ * @param init The entry point of the plugin.
+ */
+void registerPlugin(const char *name, YarvePluginInit init);
+
+/**
+ * Load a plugin by name or from a shared object.
+ * @param spec NAME[:ARGS] for a builtin plugin or PATH.so[:ARGS] for a shared object.
+ * @return The plugin's callback table, exits on failure.
+ */
+YarvePlugin *loadPlugin(const char *spec);
+
+/**
+ * Helper to register a builtin plugin from its translation unit.
+ */
+struct PluginRegistrar {
+    PluginRegistrar(const char *name, YarvePluginInit init) {
+        registerPlugin(name, init);
+    }
+};
+#endif
+
+#endif
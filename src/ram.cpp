@@ -1,15 +1,30 @@
 #include "ram.h"
 
 /**
- * Construct a new RAM device.
+ * Construct a new RAM device. The memory is an anonymous mapping, so the host
+ * only backs pages the guest touched and discarded pages can be given back.
  * @param base The base address of the RAM device.
  * @param size The size of the RAM device.
  */
-Ram::Ram(uint32_t base, size_t size) {
+Ram::Ram(uint64_t base, size_t size) {
     this->base = base;
     this->size = size;
-    data = new uint8_t[size];
-    memset(data, 0, size);
+    // One spare page, word reads of the last bytes overrun the end by up to 3 bytes
+    data = (uint8_t*)mmap(NULL, size + RAM_PAGE_SIZE, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS | MAP_NORESERVE, -1, 0);
+    if (data == MAP_FAILED) {
+        fprintf(stderr, "Error: Could not allocate %zu bytes of RAM\n", size);
+        exit(1);
+    }
+    dirty = new uint8_t[getPageCount()];
+    memset(dirty, 1, getPageCount());  // Everything differs from a previous checkpoint
+}
+
+/**
+ * Destroy the RAM device.
+ */
+Ram::~Ram() {
+    munmap(data, size + RAM_PAGE_SIZE);
+    delete[] dirty;
 }
 
 /**
@@ -24,12 +39,82 @@ DeviceInfo Ram::getDeviceInfo() {
     return info;
 }
 
+/**
+ * Tell the bus that this device is plain memory.
+ * @return Always true.
+ */
+bool Ram::isMemory() {
+    return true;
+}
+
+/**
+ * Get a host pointer to a range of guest memory.
+ * @param addr The guest physical start address.
+ * @param len The length of the range.
+ * @param write true if the caller may write to the range, which marks its pages dirty.
+ * @return The host pointer or NULL if the range is not completely inside the RAM.
+ */
+uint8_t *Ram::getHostPointer(uint64_t addr, size_t len, bool write) {
+    if (addr < base || addr - base > size || len > size - (addr - base)) return NULL;
+    if (write && len) {
+        size_t first = (addr - base) >> RAM_PAGE_SHIFT;
+        size_t last = (addr - base + len - 1) >> RAM_PAGE_SHIFT;
+        memset(dirty + first, 1, last - first + 1);
+    }
+    return data + addr - base;
+}
+
+/**
+ * Get the number of pages used for dirty tracking.
+ * @return The RAM size in pages, rounded up.
+ */
+size_t Ram::getPageCount() {
+    return (size + RAM_PAGE_SIZE - 1) >> RAM_PAGE_SHIFT;
+}
+
+/**
+ * Collect the pages written since the previous call and clear their dirty state.
+ * @param pages The page indices are appended to this vector.
+ * @return The number of dirty pages.
+ */
+size_t Ram::takeDirtyPages(std::vector<uint32_t> &pages) {
+    size_t count = 0;
+    size_t num_pages = getPageCount();
+    for (size_t page = 0; page < num_pages; page++) {
+        if (!dirty[page]) continue;
+        dirty[page] = 0;
+        pages.push_back(page);
+        count++;
+    }
+    return count;
+}
+
+/**
+ * Give the host pages of a range back, the guest reads them as zero afterwards.
+ * Only host pages completely inside the range are released.
+ * @param host A range of the RAM, e.g. from getHostPointer.
+ * @param len The length of the range.
+ * @return The number of bytes released.
+ */
+size_t Ram::discard(uint8_t *host, size_t len) {
+    if (host < data || host > data + size || len > (size_t)(data + size - host)) return 0;
+    uintptr_t host_page = sysconf(_SC_PAGESIZE);
+    uintptr_t start = ((uintptr_t)host + host_page - 1) & ~(host_page - 1);
+    uintptr_t end = ((uintptr_t)host + len) & ~(host_page - 1);
+    if (end <= start) return 0;
+    if (madvise((void*)start, end - start, MADV_DONTNEED) < 0) return 0;
+    size_t first = (start - (uintptr_t)data) >> RAM_PAGE_SHIFT;
+    size_t last = (end - 1 - (uintptr_t)data) >> RAM_PAGE_SHIFT;
+    memset(dirty + first, 1, last - first + 1);  // The contents changed to zero
+    return end - start;
+}
+
 /**
  * Load a binary file into memory.
  * @param filename The name of the file to load.
  * @param address The address to load the file at.
  */
-void Ram::loadBinary(const char* filename, uint32_t address) {
+void Ram::loadBinary(const char* filename, uint64_t address) {
     FILE* file = fopen(filename, "rb");
     if (file == NULL) {
         fprintf(stderr, "Error: Could not open file %s\n", filename);
@@ -39,11 +124,11 @@ void Ram::loadBinary(const char* filename, uint32_t address) {
     size_t file_size = ftell(file);
     fseek(file, 0, SEEK_SET);
 
-    if ((int32_t)(address - base) < 0) {
-        fprintf(stderr, "Error: Address %08X is out of bounds\n", address);
+    if (address < base) {
+        fprintf(stderr, "Error: Address %08" PRIX64 " is out of bounds\n", address);
         exit(1);
     }
-    if ((address - base + file_size) > size) {
+    if (address - base > size || file_size > size - (address - base)) {
         fprintf(stderr, "Error: File %s is too large to fit in RAM or was attempted to be loaded at an unsufficient address\n", filename);
         exit(1);
     }
@@ -57,7 +142,7 @@ void Ram::loadBinary(const char* filename, uint32_t address) {
  * @param addr The address to read from.
  * @return The word read from the RAM device.
  */
-uint32_t Ram::read(uint32_t addr) {
+uint32_t Ram::read(uint64_t addr) {
     return *(uint32_t*)(data + addr - base);
 }
 
@@ -67,7 +152,10 @@ uint32_t Ram::read(uint32_t addr) {
  * @param data The data to write.
  * @param width The width of the data to write.
  */
-void Ram::write(uint32_t addr, uint32_t data, uint8_t width) {
+void Ram::write(uint64_t addr, uint32_t data, uint8_t width) {
+    dirty[(addr - base) >> RAM_PAGE_SHIFT] = 1;
+    size_t last = (addr - base + width - 1) >> RAM_PAGE_SHIFT;  // A misaligned store may cross into the next page
+    if (last < getPageCount()) dirty[last] = 1;
     switch (width) {
         case 1:
             *(uint8_t*)(this->data + addr - base) = data;
@@ -3,25 +3,38 @@
 
 #define DEFAULT_RAM_BASE 0x80000000
 #define DEFAULT_RAM_SIZE 128 * 1024 * 1024
+#define RAM_PAGE_SHIFT 12
+#define RAM_PAGE_SIZE (1 << RAM_PAGE_SHIFT)
 
 #include <stdint.h>
 #include <string.h>
 #include <stdio.h>
+#include <inttypes.h>
 #include <stdlib.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <vector>
 #include "bus.h"
 
 class Ram : public BusDevice {
     public:
-        Ram(uint32_t base = DEFAULT_RAM_BASE, size_t size = DEFAULT_RAM_SIZE);
-        void loadBinary(const char* filename, uint32_t address);
+        Ram(uint64_t base = DEFAULT_RAM_BASE, size_t size = DEFAULT_RAM_SIZE);
+        ~Ram();
+        void loadBinary(const char* filename, uint64_t address);
         DeviceInfo getDeviceInfo();
-        uint32_t read(uint32_t addr);
-        void write(uint32_t addr, uint32_t data, uint8_t width);
+        uint32_t read(uint64_t addr);
+        void write(uint64_t addr, uint32_t data, uint8_t width);
+        bool isMemory();
+        uint8_t *getHostPointer(uint64_t addr, size_t len, bool write);
+        size_t getPageCount();
+        size_t takeDirtyPages(std::vector<uint32_t> &pages);
+        size_t discard(uint8_t *host, size_t len);
 
     private:
-        uint32_t base;
+        uint64_t base;
         size_t size;
         uint8_t *data;
+        uint8_t *dirty;  // One byte per page, set by writes since the last takeDirtyPages
 };  
 
 #endif
\ No newline at end of file
@@ -0,0 +1,101 @@
+#ifndef RING_H
+#define RING_H
+
+#include <stdint.h>
+#include <stddef.h>
+#include <atomic>
+
+/**
+ * Lock-free ring buffer for exactly one producer and one consumer thread. The
+ * producer only writes tail and the consumer only writes head, so neither side
+ * ever blocks or makes a system call.
+ */
+template <typename T>
+class SpscRing {
+    public:
+        /**
+         * Construct a new ring.
+         * @param capacity The capacity in elements, rounded up to a power of two.
+         */
+        SpscRing(size_t capacity) {
+            size_t size = 1;
+            while (size < capacity) size <<= 1;
+            buffer = new T[size];
+            mask = size - 1;
+            head.store(0, std::memory_order_relaxed);
+            tail.store(0, std::memory_order_relaxed);
+        }
+
+        ~SpscRing() {
+            delete[] buffer;
+        }
+
+        /**
+         * Append an element. Producer only.
+         * @param value The element.
+         * @return false if the ring is full.
+         */
+        bool push(const T &value) {
+            size_t t = tail.load(std::memory_order_relaxed);
+            if (t - head.load(std::memory_order_acquire) > mask) return false;
+            buffer[t & mask] = value;
+            tail.store(t + 1, std::memory_order_release);
+            return true;
+        }
+
+        /**
+         * Remove the oldest element. Consumer only.
+         * @param value Set to the element.
+         * @return false if the ring is empty.
+         */
+        bool pop(T &value) {
+            size_t h = head.load(std::memory_order_relaxed);
+            if (h == tail.load(std::memory_order_acquire)) return false;
+            value = buffer[h & mask];
+            head.store(h + 1, std::memory_order_release);
+            return true;
+        }
+
+        /**
+         * Copy the oldest elements without removing them, so the consumer can
+         * finish with them before the producer sees the space. Consumer only.
+         * @param values The destination.
+         * @param max The capacity of values.
+         * @return The number of elements copied.
+         */
+        size_t peek(T *values, size_t max) {
+            size_t h = head.load(std::memory_order_relaxed);
+            size_t count = tail.load(std::memory_order_acquire) - h;
+            if (count > max) count = max;
+            for (size_t i = 0; i < count; i++) values[i] = buffer[(h + i) & mask];
+            return count;
+        }
+
+        /**
+         * Remove elements returned by peek. Consumer only.
+         * @param count The number of elements to remove.
+         */
+        void consume(size_t count) {
+            head.store(head.load(std::memory_order_relaxed) + count, std::memory_order_release);
+        }
+
+        /**
+         * Get the number of free slots. Exact for the producer, a lower bound otherwise.
+         * @return The number of elements that can be pushed.
+         */
+        size_t space() const {
+            return mask + 1 - (tail.load(std::memory_order_acquire) - head.load(std::memory_order_acquire));
+        }
+
+        bool empty() const {
+            return head.load(std::memory_order_acquire) == tail.load(std::memory_order_acquire);
+        }
+
+    private:
+        T *buffer;
+        size_t mask;
+        alignas(64) std::atomic<size_t> head;  // Next element to consume
+        alignas(64) std::atomic<size_t> tail;  // Next slot to produce
+};
+
+#endif
@@ -1,5 +1,23 @@
 #include "riscv.h"
 
+static TraceWriter *open_trace = NULL;
+
+/**
+ * Flush the trace on exit, the guest may power off from within a device.
+ */
+static void closeTrace() {
+    if (open_trace) open_trace->close();
+}
+
+static CacheSim *open_cachesim = NULL;
+
+/**
+ * Write the cache simulation report on exit.
+ */
+static void closeCacheSim() {
+    if (open_cachesim) open_cachesim->close();
+}
+
 /**
  * Construct a new RiscV machine.
  */
@@ -10,46 +28,137 @@ RiscV::RiscV() {
  * Initialize the RiscV machine.
  */
 void RiscV::initialize() {
+    if (io == NULL) io = new IoThread();
     bus = new Bus();
     ram = new Ram(ram_base, ram_size);
     cpu = new Cpu(bus);
-    uart = new Uart();
+    uart = new Uart(cpu, io);
     clint = new Clint(cpu);
     syscon = new Syscon(cpu);
+    plic = new Plic(cpu);
+    if (share_dir != "")
+        virtio = new Virtio9p(bus, plic, share_dir.c_str(), share_tag.c_str());
+    else
+        virtio = new VirtioMmio(bus, plic);  // Empty slot, the guest skips it
+    if (balloon_socket != "")
+        balloon = new VirtioBalloon(bus, plic, ram, io, balloon_socket.c_str());
+    else
+        balloon = new VirtioMmio(bus, plic, 0, 0, DEFAULT_BALLOON_IRQ, DEFAULT_BALLOON_BASE);
+    framebuffer = new Framebuffer();
+    ivshmem = (ivshmem_name != "") ? new Ivshmem(plic, io, ivshmem_name.c_str(), ivshmem_peer, ivshmem_size) : NULL;
     bus->attach(ram);
     bus->attach(uart);
     bus->attach(clint);
     bus->attach(syscon);
+    bus->attach(plic);
+    bus->attach(virtio);
+    bus->attach(balloon);
+    bus->attach(framebuffer);
+    if (ivshmem) bus->attach(ivshmem);
 
+    if (plugin_spec != "" && plugin == NULL) plugin = loadPlugin(plugin_spec.c_str());
+    cpu->setPlugin(plugin);
+    if (trace_file != "" && trace == NULL) {
+        trace = new TraceWriter(trace_file.c_str());
+        open_trace = trace;
+        atexit(closeTrace);
+    }
+    cpu->setTrace(trace);
+    if (cachesim_spec != "" && cachesim == NULL) {
+        cachesim = new CacheSim(cachesim_spec.c_str(), ram_base, ram_size);
+        open_cachesim = cachesim;
+        atexit(closeCacheSim);
+    }
+    cpu->setCacheSim(cachesim);
+    cpu->setSbi(sbi);
+    cpu->setWarp(warp);
+    cpu->setXlen(xlen);
+    if (console_stamps != "" && stamp_file == NULL) {
+        stamp_file = fopen(console_stamps.c_str(), "wb");
+        if (!stamp_file) {
+            fprintf(stderr, "Error: Could not open console stamp file %s\n", console_stamps.c_str());
+            exit(1);
+        }
+    }
+    uart->setStampFile(stamp_file);
+    bus->setObserver(plugin);
+    if ((fb_shm != "" || fb_dump != "") && fb_export == NULL)
+        fb_export = new FramebufferExport(fb_shm != "" ? fb_shm.c_str() : NULL, fb_dump != "" ? fb_dump.c_str() : NULL);
+    if (checkpoint_dir != "" && checkpointer == NULL) checkpointer = new Checkpointer(checkpoint_dir.c_str());
+
+    if (restore_path != "") {  // Only the first boot is restored, a reboot loads the kernel again
+        restoreCheckpoint(restore_path.c_str(), ram, framebuffer, &restored_cpu, &restored_plic);
+        restore_path = "";
+        restore_pending = true;
+        return;
+    }
     ram->loadBinary(kernel_file.c_str(), kernel_base);
     if (dtb_file != "") ram->loadBinary(dtb_file.c_str(), dtb_base);
 }
 
 /**
- * Run the RiscV machine.
+ * Run the RiscV machine until the guest powers it off.
  */
 void RiscV::run() {
     while (true) {
         cpu->reset(kernel_entry, dtb_base);
+        if (restore_pending) {
+            cpu->loadState(&restored_cpu);
+            plic->loadState(&restored_plic);
+            restore_pending = false;
+        }
 
         timeval tv;
         gettimeofday(&tv, NULL);
         uint64_t last_update = tv.tv_usec;
+        time_t next_checkpoint = tv.tv_sec + checkpoint_interval;
+        uint64_t next_fb_update = 0;
 
+        uint32_t stop_reason;
         while (true) {
             gettimeofday(&tv, NULL);
             uint32_t elapsed = tv.tv_usec - last_update;
             if ((int32_t)elapsed < 0) elapsed = 0;
             last_update = tv.tv_usec;
-            if (cpu->execute(1024, elapsed) == 1) break;  // Reset triggered
+            plic->sync();  // Apply interrupts raised on the I/O thread
+            stop_reason = cpu->execute(1024, elapsed);
+            if (stop_reason) break;  // Reset or power off triggered
+
+            // Checkpoints are taken between batches; if the previous one is still being written, try again later
+            if (checkpointer && tv.tv_sec >= next_checkpoint && !checkpointer->isBusy()) {
+                checkpointer->take(ram, framebuffer, cpu, plic);
+                next_checkpoint = tv.tv_sec + checkpoint_interval;
+            }
+
+            uint64_t now = (uint64_t)tv.tv_sec * 1000000 + tv.tv_usec;
+            if (fb_export && now >= next_fb_update) {
+                fb_export->update(framebuffer);
+                next_fb_update = now + (uint64_t)fb_interval * 1000;
+            }
         }
-        // Delete all created objects
+        if (fb_export) fb_export->update(framebuffer);  // Export the last frame before the device goes away
+        // Delete all created objects, devices flush their pending output
         delete bus;
         delete ram;
         delete cpu;
         delete uart;
         delete clint;
         delete syscon;
+        delete plic;
+        delete virtio;
+        delete balloon;
+        delete framebuffer;
+        delete ivshmem;
+
+        if (stop_reason == CPU_STOP_POWEROFF) {
+            delete checkpointer;
+            checkpointer = NULL;
+            delete fb_export;
+            fb_export = NULL;
+            delete io;
+            io = NULL;
+            return;
+        }
 
         // Reinitialize the RISCV machine
         initialize();
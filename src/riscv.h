@@ -11,6 +11,16 @@
 #include "uart.h"
 #include "clint.h"
 #include "syscon.h"
+#include "plic.h"
+#include "virtio9p.h"
+#include "plugin.h"
+#include "iothread.h"
+#include "checkpoint.h"
+#include "framebuffer.h"
+#include "ivshmem.h"
+#include "balloon.h"
+
+#define DEFAULT_CHECKPOINT_INTERVAL 60
 
 class RiscV {
     public:
@@ -18,13 +28,32 @@ class RiscV {
         void initialize();
         void run();
         
-        int ram_size = DEFAULT_RAM_SIZE;
-        int ram_base = DEFAULT_RAM_BASE;
-        int kernel_base = DEFAULT_CPU_PC;
-        int kernel_entry = DEFAULT_CPU_PC;
-        int dtb_base = DEFAULT_DTB_BASE;
+        uint64_t ram_size = DEFAULT_RAM_SIZE;
+        uint64_t ram_base = DEFAULT_RAM_BASE;
+        uint64_t kernel_base = DEFAULT_CPU_PC;
+        uint64_t kernel_entry = DEFAULT_CPU_PC;
+        uint64_t dtb_base = DEFAULT_DTB_BASE;
+        uint32_t xlen = 32;
         std::string kernel_file;
         std::string dtb_file;
+        std::string plugin_spec;
+        std::string trace_file;
+        std::string share_dir;
+        std::string share_tag;
+        std::string console_stamps;
+        std::string checkpoint_dir;
+        int checkpoint_interval = DEFAULT_CHECKPOINT_INTERVAL;
+        std::string restore_path;
+        std::string fb_shm;
+        std::string fb_dump;
+        int fb_interval = DEFAULT_FB_INTERVAL;
+        bool sbi = false;
+        bool warp = false;
+        std::string ivshmem_name;
+        int ivshmem_peer = 0;
+        uint64_t ivshmem_size = DEFAULT_IVSHMEM_SIZE;
+        std::string balloon_socket;
+        std::string cachesim_spec;
 
     private:
         Bus *bus;
@@ -33,6 +62,21 @@ class RiscV {
         Uart *uart;
         Clint *clint;
         Syscon *syscon;
+        Plic *plic;
+        VirtioMmio *virtio;
+        VirtioMmio *balloon;
+        Framebuffer *framebuffer;
+        Ivshmem *ivshmem;
+        IoThread *io = NULL;
+        YarvePlugin *plugin = NULL;
+        TraceWriter *trace = NULL;
+        CacheSim *cachesim = NULL;
+        FILE *stamp_file = NULL;
+        Checkpointer *checkpointer = NULL;
+        FramebufferExport *fb_export = NULL;
+        bool restore_pending = false;
+        CpuState restored_cpu;
+        PlicState restored_plic;
 };
 
 #endif
\ No newline at end of file
@@ -0,0 +1,344 @@
+#include "cpu.h"
+#include "uart.h"
+
+/**
+ * Supervisor Binary Interface for S-mode boots (--sbi). An ecall from S-mode
+ * is handled here on the host instead of trapping to M-mode firmware. There is
+ * a single hart, so hart masks only select hart 0 and remote fences have
+ * nothing to flush.
+ */
+
+#define SBI_SUCCESS 0
+#define SBI_ERR_FAILED -1
+#define SBI_ERR_NOT_SUPPORTED -2
+#define SBI_ERR_INVALID_PARAM -3
+#define SBI_ERR_ALREADY_AVAILABLE -6
+#define SBI_ERR_ALREADY_STARTED -7
+#define SBI_ERR_ALREADY_STOPPED -8
+
+#define SBI_SPEC_VERSION 0x01000000  // 1.0
+#define SBI_IMPL_ID 0x59415256       // "YARV", not a registered implementation ID
+#define SBI_IMPL_VERSION 0x00000100
+
+#define SBI_EXT_BASE 0x10
+#define SBI_EXT_TIME 0x54494D45
+#define SBI_EXT_IPI 0x735049
+#define SBI_EXT_RFENCE 0x52464E43
+#define SBI_EXT_HSM 0x48534D
+#define SBI_EXT_SRST 0x53525354
+#define SBI_EXT_PMU 0x504D55
+#define SBI_LEGACY_SET_TIMER 0x00
+#define SBI_LEGACY_CONSOLE_PUTCHAR 0x01
+#define SBI_LEGACY_CONSOLE_GETCHAR 0x02
+#define SBI_LEGACY_CLEAR_IPI 0x03
+#define SBI_LEGACY_SEND_IPI 0x04
+#define SBI_LEGACY_REMOTE_SFENCE_VMA_ASID 0x07
+#define SBI_LEGACY_SHUTDOWN 0x08
+
+#define SBI_HSM_STARTED 0
+
+#define SBI_PMU_EVENT_HW 0
+#define SBI_PMU_EVENT_RAW 2
+#define SBI_PMU_HW_CPU_CYCLES 1
+#define SBI_PMU_HW_INSTRUCTIONS 2
+#define SBI_PMU_HW_BRANCH_INSTRUCTIONS 5
+#define SBI_PMU_CFG_SKIP_MATCH 0x1
+#define SBI_PMU_CFG_CLEAR_VALUE 0x2
+#define SBI_PMU_CFG_AUTO_START 0x4
+#define SBI_PMU_START_SET_INIT_VALUE 0x1
+#define SBI_PMU_STOP_RESET 0x1
+
+/**
+ * Check whether a hart mask selects hart 0, the only hart.
+ * @param mask The hart mask.
+ * @param base The hart number of bit 0, -1 for all harts.
+ * @return true if hart 0 is selected.
+ */
+static inline bool selectsHart0(uint32_t mask, uint32_t base) {
+    return base == 0xFFFFFFFF || (base == 0 && (mask & 1));
+}
+
+/**
+ * Get a 64 bit argument, which RV32 passes in two registers.
+ * @param n The register of the argument, or of its low half in RV32.
+ * @return The argument.
+ */
+uint64_t Cpu::sbiArg64(uint32_t n) {
+    if (xlen == 64) return x[n];
+    return x[n] | ((uint64_t)x[n + 1] << 32);
+}
+
+/**
+ * Set a register to a signed value, sign extended to XLEN.
+ * @param n The register.
+ * @param value The value.
+ */
+void Cpu::setX(uint32_t n, int64_t value) {
+    x[n] = (xlen == 64) ? (uint64_t)value : (uint32_t)value;
+}
+
+/**
+ * Handle an ecall from S-mode. The arguments are in a0-a5, the function in a6
+ * and the extension in a7, the error is returned in a0 and the value in a1.
+ * Legacy extensions return their result in a0 only.
+ * @return true if the hart is suspended until the next interrupt.
+ */
+bool Cpu::handleSbiCall() {
+    uint32_t eid = x[17];
+    uint32_t fid = x[16];
+    int32_t error = SBI_SUCCESS;
+    uint32_t value = 0;
+
+    switch (eid) {
+        case SBI_LEGACY_SET_TIMER:
+            timer_trigger_l = sbiArg64(10);
+            timer_trigger_h = sbiArg64(10) >> 32;
+            csr[MIP] &= ~MIP_STIP;
+            x[10] = 0;
+            return false;
+        case SBI_LEGACY_CONSOLE_PUTCHAR:
+            bus->write(DEFAULT_UART_BASE, x[10] & 0xff, 1);
+            x[10] = 0;
+            return false;
+        case SBI_LEGACY_CONSOLE_GETCHAR: {
+            uint32_t exc = 0;
+            if (bus->read(DEFAULT_UART_BASE + 5, &exc) & 0x1)  // Data ready
+                x[10] = bus->read(DEFAULT_UART_BASE, &exc) & 0xff;
+            else
+                setX(10, -1);
+            return false;
+        }
+        case SBI_LEGACY_CLEAR_IPI:
+            csr[MIP] &= ~MIP_SSIP;
+            x[10] = 0;
+            return false;
+        case SBI_LEGACY_SEND_IPI: {
+            uint32_t exc = 0;
+            uint32_t mask = x[10] ? bus->read(x[10], &exc) : 1;  // Pointer to the hart mask, NULL for all harts
+            if (!exc && (mask & 1)) csr[MIP] |= MIP_SSIP;
+            x[10] = 0;
+            return false;
+        }
+        case 0x05:  // REMOTE_FENCE_I
+        case 0x06:  // REMOTE_SFENCE_VMA
+        case SBI_LEGACY_REMOTE_SFENCE_VMA_ASID:
+            x[10] = 0;
+            return false;
+        case SBI_LEGACY_SHUTDOWN:
+            triggerPoweroff();
+            return false;
+
+        case SBI_EXT_BASE:
+            switch (fid) {
+                case 0:  // get_spec_version
+                    value = SBI_SPEC_VERSION;
+                    break;
+                case 1:  // get_impl_id
+                    value = SBI_IMPL_ID;
+                    break;
+                case 2:  // get_impl_version
+                    value = SBI_IMPL_VERSION;
+                    break;
+                case 3:  // probe_extension
+                    switch (x[10]) {
+                        case SBI_EXT_BASE:
+                        case SBI_EXT_TIME:
+                        case SBI_EXT_IPI:
+                        case SBI_EXT_RFENCE:
+                        case SBI_EXT_HSM:
+                        case SBI_EXT_SRST:
+                        case SBI_EXT_PMU:
+                            value = 1;
+                            break;
+                        default:
+                            value = (x[10] <= SBI_LEGACY_SHUTDOWN);
+                            break;
+                    }
+                    break;
+                case 4:  // get_mvendorid
+                    value = csr[MVENDORID];
+                    break;
+                case 5:  // get_marchid
+                case 6:  // get_mimpid
+                    value = 0;
+                    break;
+                default:
+                    error = SBI_ERR_NOT_SUPPORTED;
+                    break;
+            }
+            break;
+        case SBI_EXT_TIME:
+            if (fid == 0) {  // set_timer
+                timer_trigger_l = sbiArg64(10);
+                timer_trigger_h = sbiArg64(10) >> 32;
+                csr[MIP] &= ~MIP_STIP;
+            } else
+                error = SBI_ERR_NOT_SUPPORTED;
+            break;
+        case SBI_EXT_IPI:
+            if (fid == 0) {  // send_ipi
+                if (selectsHart0(x[10], x[11]))
+                    csr[MIP] |= MIP_SSIP;
+                else
+                    error = SBI_ERR_INVALID_PARAM;
+            } else
+                error = SBI_ERR_NOT_SUPPORTED;
+            break;
+        case SBI_EXT_RFENCE:  // Nothing is cached across harts or translations
+            if (fid > 6)
+                error = SBI_ERR_NOT_SUPPORTED;
+            else if (!selectsHart0(x[10], x[11]))
+                error = SBI_ERR_INVALID_PARAM;
+            break;
+        case SBI_EXT_HSM:
+            switch (fid) {
+                case 0:  // hart_start
+                    error = (x[10] == 0) ? SBI_ERR_ALREADY_AVAILABLE : SBI_ERR_INVALID_PARAM;
+                    break;
+                case 1:  // hart_stop, the last hart cannot stop
+                    error = SBI_ERR_FAILED;
+                    break;
+                case 2:  // hart_get_status
+                    if (x[10] == 0)
+                        value = SBI_HSM_STARTED;
+                    else
+                        error = SBI_ERR_INVALID_PARAM;
+                    break;
+                case 3:  // hart_suspend
+                    if (x[10] == 0) {  // Default retentive suspend, behaves like WFI
+                        x[10] = SBI_SUCCESS;
+                        return true;
+                    }
+                    error = (x[10] == 0x80000000) ? SBI_ERR_NOT_SUPPORTED : SBI_ERR_INVALID_PARAM;
+                    break;
+                default:
+                    error = SBI_ERR_NOT_SUPPORTED;
+                    break;
+            }
+            break;
+        case SBI_EXT_SRST:
+            if (fid != 0) {
+                error = SBI_ERR_NOT_SUPPORTED;
+            } else if (x[10] == 0) {  // Shutdown
+                triggerPoweroff();
+            } else if (x[10] == 1 || x[10] == 2) {  // Cold and warm reboot
+                triggerReset();
+            } else
+                error = SBI_ERR_INVALID_PARAM;
+            break;
+        case SBI_EXT_PMU:
+            handleSbiPmuCall(fid, &error, &value);
+            break;
+        default:
+            error = SBI_ERR_NOT_SUPPORTED;
+            break;
+    }
+
+    setX(10, error);
+    x[11] = value;
+    return false;
+}
+
+/**
+ * Handle a call of the PMU extension. Counter n is mcycle, minstret or
+ * mhpmcounter n, S-mode reads them directly. Hardware events are mapped to
+ * cycles, instructions and branches, raw events select an HPM_EVENT_* code.
+ * @param fid The function.
+ * @param error Set to the SBI error.
+ * @param value Set to the returned value.
+ */
+void Cpu::handleSbiPmuCall(uint32_t fid, int32_t *error, uint32_t *value) {
+    uint32_t base = x[10];
+    uint32_t mask = x[11];
+    uint32_t flags = x[12];
+    switch (fid) {
+        case 0:  // num_counters
+            *value = COUNTERS;
+            return;
+        case 1:  // counter_get_info
+            if (base >= COUNTERS || base == 1) {
+                *error = SBI_ERR_INVALID_PARAM;
+                return;
+            }
+            *value = (CYCLE + base) | (63 << 12);  // CSR number and width - 1, hardware counter
+            return;
+        case 2: {  // counter_config_matching
+            uint32_t type = x[13] >> 16;
+            uint32_t code = x[13] & 0xffff;
+            int32_t fixed = -1;  // The only counter that can count the event, -1 for any mhpmcounter
+            uint32_t event = HPM_EVENT_NONE;
+            if (type == SBI_PMU_EVENT_HW && code == SBI_PMU_HW_CPU_CYCLES)
+                fixed = 0;
+            else if (type == SBI_PMU_EVENT_HW && code == SBI_PMU_HW_INSTRUCTIONS)
+                fixed = 2;
+            else if (type == SBI_PMU_EVENT_HW && code == SBI_PMU_HW_BRANCH_INSTRUCTIONS)
+                event = HPM_EVENT_BRANCHES;
+            else if (type == SBI_PMU_EVENT_RAW && sbiArg64(14) > HPM_EVENT_NONE && sbiArg64(14) < HPM_EVENTS)
+                event = x[14];
+            else {
+                *error = SBI_ERR_NOT_SUPPORTED;
+                return;
+            }
+
+            uint32_t n = COUNTERS;
+            if (flags & SBI_PMU_CFG_SKIP_MATCH) {
+                n = base;  // Already configured by an earlier call
+            } else {
+                for (uint32_t i = 0; i < 32 && n == COUNTERS; i++) {
+                    uint32_t candidate = base + i;
+                    if (!((mask >> i) & 1) || candidate >= COUNTERS || (counters_in_use & (1 << candidate))) continue;
+                    if ((fixed >= 0) ? (candidate == (uint32_t)fixed) : (candidate >= 3)) n = candidate;
+                }
+            }
+            if (n >= COUNTERS || n == 1) {
+                *error = SBI_ERR_NOT_SUPPORTED;
+                return;
+            }
+            counters_in_use |= 1 << n;
+            writeCounterCsr(MCOUNTINHIBIT, csr[MCOUNTINHIBIT] | (1 << n));
+            if (n >= 3) {
+                writeCounterCsr(MHPMEVENT3 + n - 3, event);
+                csr[MHPMEVENTH3 + n - 3] = 0;
+            }
+            if (flags & SBI_PMU_CFG_CLEAR_VALUE) writeCounter(n, 0);
+            if (flags & SBI_PMU_CFG_AUTO_START) writeCounterCsr(MCOUNTINHIBIT, csr[MCOUNTINHIBIT] & ~(1 << n));
+            *value = n;
+            return;
+        }
+        case 3:    // counter_start
+        case 4: {  // counter_stop
+            for (uint32_t i = 0; i < 32; i++) {
+                uint32_t n = base + i;
+                if (!((mask >> i) & 1)) continue;
+                if (n >= COUNTERS || !(counters_in_use & (1 << n))) {
+                    *error = SBI_ERR_INVALID_PARAM;
+                    return;
+                }
+                bool stopped = csr[MCOUNTINHIBIT] & (1 << n);
+                if (fid == 3) {
+                    if (!stopped) {
+                        *error = SBI_ERR_ALREADY_STARTED;
+                        continue;
+                    }
+                    if (flags & SBI_PMU_START_SET_INIT_VALUE) writeCounter(n, sbiArg64(13));
+                    if (n >= 3) csr[MHPMEVENTH3 + n - 3] &= ~MHPMEVENTH_OF;
+                    writeCounterCsr(MCOUNTINHIBIT, csr[MCOUNTINHIBIT] & ~(1 << n));
+                } else {
+                    if (stopped && !(flags & SBI_PMU_STOP_RESET)) {
+                        *error = SBI_ERR_ALREADY_STOPPED;
+                        continue;
+                    }
+                    writeCounterCsr(MCOUNTINHIBIT, csr[MCOUNTINHIBIT] | (1 << n));
+                    if (flags & SBI_PMU_STOP_RESET) {
+                        counters_in_use &= ~(1 << n);
+                        if (n >= 3) writeCounterCsr(MHPMEVENT3 + n - 3, HPM_EVENT_NONE);
+                    }
+                }
+            }
+            return;
+        }
+        default:  // No firmware counters and no snapshot memory
+            *error = (fid == 5 || fid == 6) ? SBI_ERR_INVALID_PARAM : SBI_ERR_NOT_SUPPORTED;
+            return;
+    }
+}
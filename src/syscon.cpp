@@ -29,7 +29,7 @@ DeviceInfo Syscon::getDeviceInfo() {
  * @param addr The address to read from.
  * @return The word read from the Syscon device.
  */
-uint32_t Syscon::read(uint32_t addr) {
+uint32_t Syscon::read(uint64_t addr) {
     return 0;
 }
 
@@ -39,10 +39,10 @@ uint32_t Syscon::read(uint32_t addr) {
  * @param data The data to write.
  * @param width The width of the data to write.
  */
-void Syscon::write(uint32_t addr, uint32_t data, uint8_t width) {
+void Syscon::write(uint64_t addr, uint32_t data, uint8_t width) {
     if (addr == base) {
         if (data == SYSCON_POWEROFF) {
-            exit(0);
+            cpu->triggerPoweroff();
         } else if (data == SYSCON_REBOOT) {
             cpu->triggerReset();
         }
@@ -16,8 +16,8 @@ class Syscon : public BusDevice {
     public:
         Syscon(ICpuInterface *cpu, uint32_t base = DEFAULT_SYSCON_BASE, size_t size = DEFAULT_SYSCON_SIZE);
         DeviceInfo getDeviceInfo();
-        uint32_t read(uint32_t addr);
-        void write(uint32_t addr, uint32_t data, uint8_t width);
+        uint32_t read(uint64_t addr);
+        void write(uint64_t addr, uint32_t data, uint8_t width);
 
     private:
         uint32_t base;
@@ -0,0 +1,95 @@
+#include <stdlib.h>
+#include <string.h>
+#include "trace.h"
+
+/**
+ * Open a trace file and start the writer thread.
+ * @param filename The file to write the trace to.
+ */
+TraceWriter::TraceWriter(const char *filename) {
+    file = fopen(filename, "wb");
+    if (file == NULL) {
+        fprintf(stderr, "Error: Could not open trace file %s\n", filename);
+        exit(1);
+    }
+    fwrite(TRACE_MAGIC, 1, TRACE_MAGIC_SIZE, file);
+
+    buffers[0] = new uint8_t[TRACE_BUFFER_SIZE];
+    buffers[1] = new uint8_t[TRACE_BUFFER_SIZE];
+    active = 0;
+    cur = buffers[0];
+    limit = buffers[0] + TRACE_BUFFER_SIZE - TRACE_MAX_ENTRY_SIZE;
+
+    next_pc = 0;
+    memset(regs, 0, sizeof(regs));
+    last_addr = 0;
+    mem_flags = 0;
+
+    full_buffer = NULL;
+    full_size = 0;
+    stopping = false;
+    writer = std::thread(&TraceWriter::writerLoop, this);
+}
+
+/**
+ * Flush and close the trace.
+ */
+TraceWriter::~TraceWriter() {
+    close();
+    delete[] buffers[0];
+    delete[] buffers[1];
+}
+
+/**
+ * Write out the remaining entries and stop the writer thread.
+ */
+void TraceWriter::close() {
+    if (file == NULL) return;
+    flip();
+    {
+        std::unique_lock<std::mutex> guard(lock);
+        stopping = true;
+    }
+    cond.notify_all();
+    writer.join();
+    fclose(file);
+    file = NULL;
+}
+
+/**
+ * Hand the active buffer to the writer thread and continue in the other one.
+ * Only waits if the writer has not finished the previous buffer yet.
+ */
+void TraceWriter::flip() {
+    uint8_t *buffer = buffers[active];
+    {
+        std::unique_lock<std::mutex> guard(lock);
+        cond.wait(guard, [this] { return full_buffer == NULL; });
+        full_buffer = buffer;
+        full_size = cur - buffer;
+    }
+    cond.notify_all();
+    active ^= 1;
+    cur = buffers[active];
+    limit = buffers[active] + TRACE_BUFFER_SIZE - TRACE_MAX_ENTRY_SIZE;
+}
+
+/**
+ * Body of the writer thread.
+ */
+void TraceWriter::writerLoop() {
+    std::unique_lock<std::mutex> guard(lock);
+    while (true) {
+        cond.wait(guard, [this] { return full_buffer != NULL || stopping; });
+        if (full_buffer == NULL) break;
+
+        uint8_t *buffer = full_buffer;
+        size_t size = full_size;
+        guard.unlock();
+        if (fwrite(buffer, 1, size, file) != size) fprintf(stderr, "Error: Could not write trace\n");
+        guard.lock();
+        full_buffer = NULL;
+        cond.notify_all();
+    }
+    fflush(file);
+}
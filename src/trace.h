@@ -0,0 +1,166 @@
+#ifndef TRACE_H
+#define TRACE_H
+
+#include <stdint.h>
+#include <stdio.h>
+#include <thread>
+#include <mutex>
+#include <condition_variable>
+#include "traceformat.h"
+
+#define TRACE_BUFFER_SIZE (8 * 1024 * 1024)
+
+/**
+ * Streaming writer for the binary trace format in traceformat.h. Entries are
+ * encoded into one of two buffers while a background thread writes the other.
+ */
+class TraceWriter {
+    public:
+        TraceWriter(const char *filename);
+        ~TraceWriter();
+        void close();
+
+        /**
+         * Record a retired instruction together with the pending memory access.
+         * @param pc The address of the instruction.
+         * @param rd The destination register, 0 if none was written.
+         * @param value The value written to rd.
+         */
+        inline void retire(uint32_t pc, uint32_t rd, uint32_t value) {
+            // Byte stores may alias every member, so read and update the state before encoding.
+            uint8_t *start = cur;
+            uint8_t flags = mem_flags;
+            uint32_t pc_delta = pc - next_pc;
+            uint32_t reg_delta = value - regs[rd];
+            uint32_t addr_delta = mem_addr - last_addr;
+            uint32_t loaded = load_value;
+            uint32_t stored = store_value;
+            next_pc = pc + 4;
+            regs[rd] = value;
+            if (flags) {
+                last_addr = mem_addr;
+                mem_flags = 0;
+            }
+
+            uint8_t *p = start + 1;
+            uint8_t *sizes = NULL;
+            if (pc_delta || (flags & (TRACE_LOAD | TRACE_STORE))) {
+                sizes = p++;
+                if (pc_delta) flags |= TRACE_PC_JUMP;
+            }
+            if (rd) {
+                uint32_t reg_zz = traceZigzag(reg_delta);
+                uint32_t reg_size = traceSize(reg_zz);
+                flags |= TRACE_REG;
+                *p++ = rd | ((reg_size - 1) << 5);
+                p = tracePut(p, reg_zz, reg_size);
+            }
+            if (sizes) {
+                uint32_t pc_zz = traceZigzag(pc_delta);
+                uint32_t pc_size = traceSize(pc_zz);
+                uint8_t size_bits = pc_size - 1;
+                if (pc_delta) p = tracePut(p, pc_zz, pc_size);
+                if (flags & (TRACE_LOAD | TRACE_STORE)) {
+                    uint32_t addr_zz = traceZigzag(addr_delta);
+                    uint32_t addr_size = traceSize(addr_zz);
+                    size_bits |= (addr_size - 1) << 2;
+                    p = tracePut(p, addr_zz, addr_size);
+                    if (flags & TRACE_LOAD) {
+                        if (rd && loaded == value) {
+                            flags |= TRACE_LOAD_IN_REG;
+                        } else {
+                            uint32_t load_size = traceSize(loaded);
+                            size_bits |= (load_size - 1) << 4;
+                            p = tracePut(p, loaded, load_size);
+                        }
+                    }
+                    if (flags & TRACE_STORE) {
+                        uint32_t store_size = traceSize(stored);
+                        size_bits |= (store_size - 1) << 6;
+                        p = tracePut(p, stored, store_size);
+                    }
+                }
+                *sizes = size_bits;
+            }
+            *start = flags;
+            cur = p;
+            if (__builtin_expect(p > limit, 0)) flip();
+        }
+
+        inline void load(uint32_t addr, uint8_t width, uint32_t value) {
+            mem_flags |= TRACE_LOAD | (__builtin_ctz(width) << TRACE_WIDTH_SHIFT);
+            mem_addr = addr;
+            load_value = value;
+        }
+
+        inline void store(uint32_t addr, uint8_t width, uint32_t value) {
+            mem_flags = (mem_flags & TRACE_LOAD) | TRACE_STORE | (__builtin_ctz(width) << TRACE_WIDTH_SHIFT);
+            mem_addr = addr;
+            store_value = value;
+        }
+
+        /**
+         * Record a trap. The trapping instruction did not retire.
+         * @param cause The trap cause.
+         * @param tval The trap value.
+         */
+        inline void trap(uint32_t cause, uint32_t tval) {
+            uint8_t *p = cur;
+            mem_flags = 0;
+            *p = TRACE_TRAP;
+            memcpy(p + 1, &cause, 4);
+            memcpy(p + 5, &tval, 4);
+            cur = p + TRACE_TRAP_SIZE;
+            if (cur > limit) flip();
+        }
+
+    private:
+        void flip();
+        void writerLoop();
+
+        uint8_t *buffers[2];
+        int active;
+        uint8_t *cur;
+        uint8_t *limit;
+
+        uint32_t next_pc;
+        uint32_t regs[32];
+        uint32_t last_addr;
+        uint8_t mem_flags;
+        uint32_t mem_addr;
+        uint32_t load_value;
+        uint32_t store_value;
+
+        FILE *file;
+        std::thread writer;
+        std::mutex lock;
+        std::condition_variable cond;
+        uint8_t *full_buffer;
+        size_t full_size;
+        bool stopping;
+};
+
+/**
+ * Hook policy feeding a TraceWriter, inlined into Cpu::step.
+ */
+struct TraceHooks {
+    TraceWriter *trace;
+
+    TraceHooks(TraceWriter *trace) : trace(trace) {}
+
+    inline void retire(uint32_t pc, uint32_t ir, uint32_t rd, uint32_t value) {
+        trace->retire(pc, rd, value);
+    }
+    inline void load(uint32_t pc, uint32_t addr, uint8_t width, uint32_t value) {
+        trace->load(addr, width, value);
+    }
+    inline void store(uint32_t pc, uint32_t addr, uint8_t width, uint32_t value) {
+        trace->store(addr, width, value);
+    }
+    inline void trapEnter(uint32_t cause, uint32_t epc, uint32_t tval) {
+        trace->trap(cause, tval);
+    }
+    inline void trapExit(uint32_t pc) {}
+};
+
+#endif
@@ -0,0 +1,98 @@
+#ifndef TRACE_FORMAT_H
+#define TRACE_FORMAT_H
+
+#include <stdint.h>
+#include <stddef.h>
+#include <string.h>
+
+/**
+ * Binary trace format written by --trace and read by yarve-trace.
+ *
+ * The file starts with the 8 byte magic followed by a stream of entries. Each
+ * entry starts with a flags byte. A trap entry (TRACE_TRAP) is followed by the
+ * cause and tval as 4 byte little endian words. An instruction entry continues with:
+ *   [sizes]             if TRACE_PC_JUMP, TRACE_LOAD or TRACE_STORE, two bits per field
+ *                       below holding its length - 1 (pc, addr, load, store from bit 0)
+ *   [rd | (len - 1) << 5, zigzag delta]  if TRACE_REG, relative to the previous value of rd
+ *   [zigzag pc delta]   if TRACE_PC_JUMP, relative to the previous pc + 4
+ *   [zigzag addr delta] if TRACE_LOAD or TRACE_STORE, relative to the previous address
+ *   [load value]        if TRACE_LOAD and not TRACE_LOAD_IN_REG
+ *   [store value]       if TRACE_STORE
+ * Fields are little endian with their leading zero bytes stripped, which lets
+ * the writer store them without a loop. Bits TRACE_WIDTH_SHIFT hold log2 of the
+ * access width. AMOs set both TRACE_LOAD and TRACE_STORE. 8 byte accesses (FLD,
+ * FSD) are one entry holding the low word.
+ */
+
+#define TRACE_MAGIC "YRVTRC01"
+#define TRACE_MAGIC_SIZE 8
+
+#define TRACE_PC_JUMP 0x01
+#define TRACE_REG 0x02
+#define TRACE_LOAD 0x04
+#define TRACE_STORE 0x08
+#define TRACE_WIDTH_SHIFT 4
+#define TRACE_WIDTH_MASK 0x30
+#define TRACE_LOAD_IN_REG 0x40
+#define TRACE_TRAP 0x80
+
+#define TRACE_MAX_ENTRY_SIZE 32
+#define TRACE_TRAP_SIZE 9
+
+/**
+ * Get the number of bytes needed to store a value, at least one.
+ * @param value The value.
+ * @return The number of bytes from 1 to 4.
+ */
+static inline uint32_t traceSize(uint32_t value) {
+    return (39 - __builtin_clz(value | 1)) >> 3;
+}
+
+/**
+ * Map a signed value to an unsigned one with small magnitude.
+ * @param value The signed value.
+ * @return The zigzag encoded value.
+ */
+static inline uint32_t traceZigzag(int32_t value) {
+    return ((uint32_t)value << 1) ^ (uint32_t)(value >> 31);
+}
+
+/**
+ * Reverse traceZigzag.
+ * @param value The zigzag encoded value.
+ * @return The signed value.
+ */
+static inline int32_t traceUnzigzag(uint32_t value) {
+    return (int32_t)(value >> 1) ^ -(int32_t)(value & 1);
+}
+
+/**
+ * Append a field. Always stores four bytes, the buffer needs that much slack.
+ * @param p The write position.
+ * @param value The value to store.
+ * @param size The size returned by traceSize.
+ * @return The position after the field.
+ */
+static inline uint8_t *tracePut(uint8_t *p, uint32_t value, uint32_t size) {
+    memcpy(p, &value, 4);
+    return p + size;
+}
+
+/**
+ * Read a field.
+ * @param p The read position, advanced past the field.
+ * @param end The end of the buffer.
+ * @param size The size of the field.
+ * @param value Set to the decoded value.
+ * @return false if the buffer ended inside the field.
+ */
+static inline bool traceGet(const uint8_t **p, const uint8_t *end, uint32_t size, uint32_t *value) {
+    if ((size_t)(end - *p) < size) return false;
+    uint32_t result = 0;
+    memcpy(&result, *p, size);
+    *p += size;
+    *value = result;
+    return true;
+}
+
+#endif
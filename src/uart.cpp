@@ -2,13 +2,28 @@
 
 uint32_t stdin_fcntl;
 /**
- * Construct a new UART device and initialize it.
+ * Construct a new UART device and initialize it. The terminal is only switched
+ * to raw input when stdin is one, so the console can also be driven by a pipe.
+ * @param cpu The CPU device.
+ * @param io The I/O thread serving stdin and stdout.
  * @param base The base address of the UART device.
  * @param size The size of the UART device.
  */
-Uart::Uart(uint32_t base, size_t size) {
+Uart::Uart(ICpuInterface *cpu, IoThread *io, uint32_t base, size_t size) : tx(UART_TX_RING_SIZE), rx(UART_RX_RING_SIZE) {
+    this->cpu = cpu;
+    this->io = io;
+    this->output = NULL;
+    this->output_context = NULL;
     this->base = base;
     this->size = size;
+    this->stamp_file = NULL;
+    rx_paused.store(false);
+
+    io->watch(tx_event.getFd(), EPOLLIN, this);
+    io->watch(rx_event.getFd(), EPOLLIN, this);
+    stdin_direct = !io->watch(fileno(stdin), EPOLLIN, this);  // Regular files cannot be polled, but never block either
+
+    if (!isatty(fileno(stdin))) return;
 
     struct termios term;
     tcgetattr(fileno(stdin), &term);
@@ -23,6 +38,41 @@ Uart::Uart(uint32_t base, size_t size) {
     });
 }
 
+/**
+ * Construct a new UART device whose console is not a host terminal. Output is
+ * passed to a callback on the CPU thread, input arrives through receive().
+ * @param cpu The CPU device.
+ * @param output Called for every byte the guest transmits.
+ * @param context Passed to the output callback.
+ * @param base The base address of the UART device.
+ * @param size The size of the UART device.
+ */
+Uart::Uart(ICpuInterface *cpu, UartOutput output, void *context, uint32_t base, size_t size) : tx(1), rx(UART_RX_RING_SIZE) {
+    this->cpu = cpu;
+    this->io = NULL;
+    this->output = output;
+    this->output_context = context;
+    this->base = base;
+    this->size = size;
+    this->stamp_file = NULL;
+    stdin_direct = false;
+    rx_paused.store(false);
+}
+
+/**
+ * Destroy the UART device after all pending output has been written.
+ */
+Uart::~Uart() {
+    if (io == NULL) return;
+    while (!tx.empty()) {
+        tx_event.signal();
+        usleep(100);
+    }
+    io->unwatch(rx_event.getFd());  // First, its handler may watch stdin again
+    io->unwatch(fileno(stdin));
+    io->unwatch(tx_event.getFd());
+}
+
 /**
  * Get the device information.
  * @return The device information.
@@ -40,7 +90,7 @@ DeviceInfo Uart::getDeviceInfo() {
  * @param addr The address to read from.
  * @return The word read from the UART device.
  */
-uint32_t Uart::read(uint32_t addr) {
+uint32_t Uart::read(uint64_t addr) {
     if (addr == base + 0x5) {
         return 0x60 | checkStdin();
     } else if (addr == base) {
@@ -55,27 +105,47 @@ uint32_t Uart::read(uint32_t addr) {
  * @param data The data to write.
  * @param width The width of the data to write.
  */
-void Uart::write(uint32_t addr, uint32_t data, uint8_t width) {
-    if (addr == base) {
-        printf("%c", data);
-        fflush(stdout);
+void Uart::write(uint64_t addr, uint32_t data, uint8_t width) {
+    if (addr == base && io == NULL) {
+        if (output) output(output_context, data & 0xff);
+    } else if (addr == base) {
+        uint64_t stamp = (stamp_file ? cpu->getInstructionCount() << 8 : 0) | (data & 0xff);
+        while (!tx.push(stamp)) {  // The host consumer is behind, wait for it like a real FIFO
+            tx_event.signal();
+            usleep(100);
+        }
+        tx_event.signal();
     }
 }
 
+/**
+ * Record every transmitted byte with the guest instruction count at which it
+ * was written, as a 64 bit little endian word (count << 8 | byte).
+ * @param file The file receiving the stamps, or NULL.
+ */
+void Uart::setStampFile(FILE *file) {
+    stamp_file = file;
+}
+
 /**
  * Read from the standart input if available.
  * @return The read character.
 */
 uint32_t Uart::readStdin() {
-    int bytes_available;
-    ioctl(0, FIONREAD, &bytes_available);
-    if (bytes_available > 0) {
-        char c;
-        ::read(fileno(stdin), &c, 1);
-        return c;
-    } else {
+    if (stdin_direct) {
+        int bytes_available;
+        ioctl(0, FIONREAD, &bytes_available);
+        if (bytes_available > 0) {
+            char c;
+            ::read(fileno(stdin), &c, 1);
+            return c;
+        }
         return 0;
     }
+    uint8_t c;
+    if (!rx.pop(c)) return 0;
+    if (rx_paused.load(std::memory_order_acquire)) rx_event.signal();  // Room again, resume reading
+    return c;
 }
 
 /**
@@ -83,7 +153,82 @@ uint32_t Uart::readStdin() {
  * @return 1 if there is data available, 0 otherwise.
  */
 bool Uart::checkStdin() {
-    int bytes_available;
-    ioctl(0, FIONREAD, &bytes_available);
-    return bytes_available > 0;
+    if (stdin_direct) {
+        int bytes_available;
+        ioctl(0, FIONREAD, &bytes_available);
+        return bytes_available > 0;
+    }
+    return !rx.empty();
+}
+
+/**
+ * Queue input for the guest when the console is attached to a callback. May be
+ * called from any single thread while the CPU runs.
+ * @param data The bytes to queue.
+ * @param len The number of bytes.
+ * @return The number of bytes queued, less than len if the receive ring is full.
+ */
+size_t Uart::receive(const uint8_t *data, size_t len) {
+    size_t queued = 0;
+    while (queued < len && rx.push(data[queued])) queued++;
+    return queued;
+}
+
+/**
+ * Handle a ready descriptor on the I/O thread.
+ * @param fd The descriptor.
+ * @param events The epoll events that occurred.
+ */
+void Uart::ioReady(int fd, uint32_t events) {
+    if (fd == tx_event.getFd()) {
+        tx_event.clear();
+        flushTx();
+    } else if (fd == rx_event.getFd()) {
+        rx_event.clear();
+        if (rx_paused.load() && rx.space()) {
+            rx_paused.store(false);
+            io->watch(fileno(stdin), EPOLLIN, this);
+        }
+    } else if (fd == fileno(stdin)) {
+        fillRx();
+    }
+}
+
+/**
+ * Write the pending output to stdout, and its stamps to the stamp file. Runs on the I/O thread.
+ */
+void Uart::flushTx() {
+    uint64_t stamps[UART_IO_CHUNK];
+    char bytes[UART_IO_CHUNK];
+    size_t count;
+    while ((count = tx.peek(stamps, UART_IO_CHUNK)) > 0) {
+        for (size_t i = 0; i < count; i++) bytes[i] = stamps[i] & 0xff;
+        if (stamp_file) {
+            fwrite(stamps, sizeof(uint64_t), count, stamp_file);
+            fflush(stamp_file);
+        }
+        fwrite(bytes, 1, count, stdout);
+        fflush(stdout);
+        tx.consume(count);
+    }
+}
+
+/**
+ * Move available input from stdin to the receive ring. Runs on the I/O thread.
+ */
+void Uart::fillRx() {
+    uint8_t bytes[UART_RX_RING_SIZE];
+    size_t space = rx.space();
+    if (space == 0) {  // Stop polling until the guest drained the ring
+        rx_paused.store(true, std::memory_order_release);
+        io->unwatch(fileno(stdin));
+        if (rx.space()) rx_event.signal();  // The guest raced us
+        return;
+    }
+    ssize_t n = ::read(fileno(stdin), bytes, space);
+    if (n == 0 || (n < 0 && errno != EINTR && errno != EAGAIN)) {  // End of input, nothing more will arrive
+        io->unwatch(fileno(stdin));
+        return;
+    }
+    for (ssize_t i = 0; i < n; i++) rx.push(bytes[i]);
 }
\ No newline at end of file
@@ -5,26 +5,60 @@
 #include <stdio.h>
 #include <vector>
 #include <stdlib.h>
+#include <errno.h>
 #include <unistd.h>
 #include <sys/ioctl.h>
 #include <termios.h>
 #include "bus.h"
+#include "cpu.h"
+#include "iothread.h"
 
 #define DEFAULT_UART_BASE 0x10000000
 #define DEFAULT_UART_SIZE 0x8
+#define UART_TX_RING_SIZE (128 * 1024)
+#define UART_RX_RING_SIZE 4096
+#define UART_IO_CHUNK 4096
 
-class Uart : public BusDevice {
+/**
+ * Receives a byte written by the guest when the console is not stdout.
+ */
+typedef void (*UartOutput)(void *context, uint8_t byte);
+
+/**
+ * 16550 style UART on stdin/stdout. The guest side only touches lock-free rings,
+ * the host side of both directions runs on the I/O thread. Embedders can
+ * instead attach the console to a callback and feed input with receive().
+ */
+class Uart : public BusDevice, public IoHandler {
     public:
-        Uart(uint32_t base = DEFAULT_UART_BASE, size_t size = DEFAULT_UART_SIZE);
+        Uart(ICpuInterface *cpu, IoThread *io, uint32_t base = DEFAULT_UART_BASE, size_t size = DEFAULT_UART_SIZE);
+        Uart(ICpuInterface *cpu, UartOutput output, void *context, uint32_t base = DEFAULT_UART_BASE, size_t size = DEFAULT_UART_SIZE);
+        ~Uart();
         DeviceInfo getDeviceInfo();
-        uint32_t read(uint32_t addr);
-        void write(uint32_t addr, uint32_t data, uint8_t width);
+        uint32_t read(uint64_t addr);
+        void write(uint64_t addr, uint32_t data, uint8_t width);
+        void setStampFile(FILE *file);
+        void ioReady(int fd, uint32_t events);
+        size_t receive(const uint8_t *data, size_t len);
 
     private:
         uint32_t base;
         size_t size;
+        ICpuInterface *cpu;
+        IoThread *io;  // NULL if the console is attached to a callback
+        UartOutput output;
+        void *output_context;
+        FILE *stamp_file;
+        SpscRing<uint64_t> tx;  // Stamp words, count << 8 | byte
+        SpscRing<uint8_t> rx;
+        IoEvent tx_event;
+        IoEvent rx_event;
+        bool stdin_direct;            // stdin cannot be polled and is read on the CPU thread
+        std::atomic<bool> rx_paused;  // The rx ring was full and stdin is no longer watched
         uint32_t readStdin();
         bool checkStdin();
+        void flushTx();
+        void fillRx();
 };
 
-#endif
\ No newline at end of file
+#endif
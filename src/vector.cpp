@@ -0,0 +1,1106 @@
+#include <type_traits>
+#include "cpu.h"
+#include "fpu.h"
+
+/**
+ * Zve32x and Zve32f subset of the vector extension, VLEN = 128 and ELEN = 32.
+ * Supported are the configuration instructions, unit-stride, strided, mask,
+ * fault-only-first and whole register loads and stores, single-width integer
+ * and single precision arithmetic, compares, merges, moves, slides, reductions
+ * and the mask instructions. Segment and indexed accesses, widening, narrowing
+ * and fixed-point instructions are illegal.
+ *
+ * The arithmetic kernels are templates over the element type and operate on
+ * the whole register group (vl elements, so LMUL only changes the loop count).
+ * They copy their operands to local arrays first, which lets the compiler
+ * vectorize the loops without overlap checks; the kernels are instantiated
+ * once for the baseline ISA and once for AVX2 hosts and picked at load time.
+ * Memory instructions copy straight from host memory if the accessed range is
+ * inside one memory device and only go through Bus::read and Bus::write per
+ * element for MMIO, faults and partial ranges. Vector memory accesses are not
+ * reported to plugins and traces.
+ *
+ * Like fpu.cpp this file is built without -Ofast for the floating point
+ * instructions, tail and inactive elements are left undisturbed.
+ */
+
+#define VECTOR_MAX_ELEMENTS (8 * VLEN_BYTES)  // SEW = 8, LMUL = 8
+
+#define OPIVV 0
+#define OPFVV 1
+#define OPMVV 2
+#define OPIVI 3
+#define OPIVX 4
+#define OPFVF 5
+#define OPMVX 6
+#define OPCFG 7
+
+#if defined(__x86_64__) && !defined(__clang__)
+#define VECTOR_KERNELS __attribute__((target_clones("arch=x86-64-v3", "default"), flatten))
+#else
+#define VECTOR_KERNELS __attribute__((flatten))
+#endif
+
+/**
+ * Decoded vtype.
+ */
+typedef struct {
+    bool valid;
+    uint32_t sew;        // Element width in bytes
+    uint32_t lmul_regs;  // Registers per group, 1 for fractional LMUL
+    uint32_t vlmax;
+} VectorConfig;
+
+/**
+ * Operands of an arithmetic instruction.
+ */
+typedef struct {
+    uint8_t *v;
+    VectorConfig config;
+    uint32_t vl;
+    uint32_t vd;
+    uint32_t vs1;  // Also the rs1 and immediate field
+    uint32_t vs2;
+    uint32_t scalar;  // x[rs1], the sign extended immediate or the single precision bits of f[rs1]
+    bool masked;
+    uint8_t mask[VLEN_BYTES];  // A copy of v0, the destination may overlap it
+} VectorOperands;
+
+/**
+ * Decode a vtype value.
+ * @param vtype The value.
+ * @return The configuration, not valid if vtype is not supported.
+ */
+static inline VectorConfig decodeVtype(uint32_t vtype) {
+    VectorConfig config = {false, 0, 0, 0};
+    uint32_t vsew = (vtype >> 3) & 0x7;
+    uint32_t vlmul = vtype & 0x7;
+    if ((vtype & VTYPE_VILL) || (vtype & 0x7fffff00) || vsew > 2 || vlmul == 4) return config;
+    config.sew = 1 << vsew;
+    if (vlmul < 4) {
+        config.lmul_regs = 1 << vlmul;
+        config.vlmax = (VLEN_BYTES / config.sew) << vlmul;
+    } else {
+        uint32_t shift = 8 - vlmul;
+        if (config.sew * 8 > (32u >> shift)) return config;  // SEW must not exceed LMUL * ELEN
+        config.lmul_regs = 1;
+        config.vlmax = (VLEN_BYTES / config.sew) >> shift;
+    }
+    config.valid = true;
+    return config;
+}
+
+static inline bool maskBit(const uint8_t *mask, uint32_t i) {
+    return (mask[i >> 3] >> (i & 7)) & 1;
+}
+
+static inline void setMaskBit(uint8_t *mask, uint32_t i, bool value) {
+    mask[i >> 3] = (mask[i >> 3] & ~(1 << (i & 7))) | (value << (i & 7));
+}
+
+static inline bool isActive(const VectorOperands &o, uint32_t i) {
+    return !o.masked || maskBit(o.mask, i);
+}
+
+static inline bool isAligned(const VectorOperands &o, uint32_t reg) {
+    return (reg & (o.config.lmul_regs - 1)) == 0;
+}
+
+/**
+ * Get the first element of a register.
+ */
+template <typename T>
+static inline T readElement(const uint8_t *v, uint32_t reg) {
+    T value;
+    memcpy(&value, v + reg * VLEN_BYTES, sizeof(T));
+    return value;
+}
+
+template <typename T>
+static inline void writeElement(uint8_t *v, uint32_t reg, T value) {
+    memcpy(v + reg * VLEN_BYTES, &value, sizeof(T));
+}
+
+/**
+ * Load the second source operand of a vector-vector or vector-scalar instruction.
+ */
+template <typename T>
+static inline void loadOperand(const VectorOperands &o, bool vector_b, T *b) {
+    if (vector_b) {
+        memcpy(b, o.v + o.vs1 * VLEN_BYTES, o.vl * sizeof(T));
+    } else {
+        for (uint32_t i = 0; i < o.vl; i++) b[i] = (T)o.scalar;
+    }
+}
+
+/**
+ * Apply op(vs2[i], vs1[i] or the scalar, vd[i]) to the active body elements.
+ * @return 0 or EXC_ILLEGAL_INSTRUCTION.
+ */
+template <typename T, typename Op>
+static inline uint32_t elementwise(VectorOperands &o, bool vector_b, Op op) {
+    if (!isAligned(o, o.vd) || !isAligned(o, o.vs2) || (vector_b && !isAligned(o, o.vs1))) return EXC_ILLEGAL_INSTRUCTION;
+    T a[VECTOR_MAX_ELEMENTS], b[VECTOR_MAX_ELEMENTS], d[VECTOR_MAX_ELEMENTS];
+    memcpy(a, o.v + o.vs2 * VLEN_BYTES, o.vl * sizeof(T));
+    memcpy(d, o.v + o.vd * VLEN_BYTES, o.vl * sizeof(T));
+    loadOperand(o, vector_b, b);
+    if (!o.masked) {
+        for (uint32_t i = 0; i < o.vl; i++) d[i] = op(a[i], b[i], d[i]);
+    } else {
+        for (uint32_t i = 0; i < o.vl; i++) d[i] = maskBit(o.mask, i) ? op(a[i], b[i], d[i]) : d[i];
+    }
+    memcpy(o.v + o.vd * VLEN_BYTES, d, o.vl * sizeof(T));
+    return 0;
+}
+
+/**
+ * Set the mask bits of the active body elements in vd to cmp(vs2[i], vs1[i] or the scalar).
+ * @return 0 or EXC_ILLEGAL_INSTRUCTION.
+ */
+template <typename T, typename Cmp>
+static inline uint32_t compare(VectorOperands &o, bool vector_b, Cmp cmp) {
+    if (!isAligned(o, o.vs2) || (vector_b && !isAligned(o, o.vs1))) return EXC_ILLEGAL_INSTRUCTION;
+    T a[VECTOR_MAX_ELEMENTS], b[VECTOR_MAX_ELEMENTS];
+    uint8_t d[VLEN_BYTES];
+    memcpy(a, o.v + o.vs2 * VLEN_BYTES, o.vl * sizeof(T));
+    memcpy(d, o.v + o.vd * VLEN_BYTES, VLEN_BYTES);
+    loadOperand(o, vector_b, b);
+    for (uint32_t i = 0; i < o.vl; i++) {
+        if (isActive(o, i)) setMaskBit(d, i, cmp(a[i], b[i]));
+    }
+    memcpy(o.v + o.vd * VLEN_BYTES, d, VLEN_BYTES);
+    return 0;
+}
+
+/**
+ * vmerge and vmv.v: vd[i] = v0[i] ? (vs1[i] or the scalar) : vs2[i], or vs1[i] or the scalar if unmasked.
+ * @return 0 or EXC_ILLEGAL_INSTRUCTION.
+ */
+template <typename T>
+static inline uint32_t merge(VectorOperands &o, bool vector_b) {
+    if (!isAligned(o, o.vd) || !isAligned(o, o.vs2) || (vector_b && !isAligned(o, o.vs1))) return EXC_ILLEGAL_INSTRUCTION;
+    if (!o.masked && o.vs2 != 0) return EXC_ILLEGAL_INSTRUCTION;
+    T a[VECTOR_MAX_ELEMENTS], b[VECTOR_MAX_ELEMENTS];
+    memcpy(a, o.v + o.vs2 * VLEN_BYTES, o.vl * sizeof(T));
+    loadOperand(o, vector_b, b);
+    for (uint32_t i = 0; i < o.vl; i++) {
+        if (!isActive(o, i)) b[i] = a[i];
+    }
+    memcpy(o.v + o.vd * VLEN_BYTES, b, o.vl * sizeof(T));
+    return 0;
+}
+
+/**
+ * Reduce the active elements of vs2 into vd[0], starting with vs1[0].
+ * @return 0 or EXC_ILLEGAL_INSTRUCTION.
+ */
+template <typename T, typename Op>
+static inline uint32_t reduce(VectorOperands &o, Op op) {
+    if (!isAligned(o, o.vs2)) return EXC_ILLEGAL_INSTRUCTION;
+    if (o.vl == 0) return 0;
+    T a[VECTOR_MAX_ELEMENTS];
+    memcpy(a, o.v + o.vs2 * VLEN_BYTES, o.vl * sizeof(T));
+    T result = readElement<T>(o.v, o.vs1);
+    for (uint32_t i = 0; i < o.vl; i++) {
+        if (isActive(o, i)) result = op(result, a[i]);
+    }
+    writeElement<T>(o.v, o.vd, result);
+    return 0;
+}
+
+/**
+ * vslideup, vslidedown, vslide1up and vslide1down.
+ * @param offset The number of elements to slide by.
+ * @param up true to slide towards higher indices.
+ * @param insert true for vslide1, which fills the free element with the scalar.
+ * @return 0 or EXC_ILLEGAL_INSTRUCTION.
+ */
+template <typename T>
+static inline uint32_t slide(VectorOperands &o, uint32_t offset, bool up, bool insert) {
+    if (!isAligned(o, o.vd) || !isAligned(o, o.vs2)) return EXC_ILLEGAL_INSTRUCTION;
+    T a[VECTOR_MAX_ELEMENTS], d[VECTOR_MAX_ELEMENTS];
+    memcpy(a, o.v + o.vs2 * VLEN_BYTES, o.config.vlmax * sizeof(T));
+    memcpy(d, o.v + o.vd * VLEN_BYTES, o.vl * sizeof(T));
+    for (uint32_t i = 0; i < o.vl; i++) {
+        if (!isActive(o, i)) continue;
+        if (up) {
+            if (insert && i == 0)
+                d[i] = (T)o.scalar;
+            else if (i >= offset)
+                d[i] = a[i - offset];
+        } else {
+            if (insert && i == o.vl - 1)
+                d[i] = (T)o.scalar;
+            else
+                d[i] = ((uint64_t)i + offset < o.config.vlmax) ? a[i + offset] : 0;
+        }
+    }
+    memcpy(o.v + o.vd * VLEN_BYTES, d, o.vl * sizeof(T));
+    return 0;
+}
+
+/**
+ * Execute an integer arithmetic instruction with SEW = 8 * sizeof(T).
+ * @param o The operands.
+ * @param funct3 The operand form, OPIVV, OPIVI, OPIVX, OPMVV or OPMVX.
+ * @param funct6 The operation.
+ * @param vxsat Set to 1 if a saturating instruction saturated.
+ * @return 0 or EXC_ILLEGAL_INSTRUCTION.
+ */
+template <typename T>
+static uint32_t integerOp(VectorOperands &o, uint32_t funct3, uint32_t funct6, uint32_t *vxsat) {
+    typedef typename std::make_signed<T>::type S;
+    const uint32_t bits = sizeof(T) * 8;
+    const T s_min = (T)1 << (bits - 1);
+    const T s_max = s_min - 1;
+    bool vv = (funct3 == OPIVV || funct3 == OPMVV);
+    bool vx = (funct3 == OPIVX || funct3 == OPMVX);
+    bool vi = (funct3 == OPIVI);
+    uint32_t saturated = 0;
+    uint32_t exception = 0;
+
+    if (funct3 == OPMVV || funct3 == OPMVX) {
+        switch (funct6) {
+            case 0x00:  // VREDSUM
+                if (!vv) return EXC_ILLEGAL_INSTRUCTION;
+                return reduce<T>(o, [](T acc, T a) { return (T)(acc + a); });
+            case 0x01:  // VREDAND
+                if (!vv) return EXC_ILLEGAL_INSTRUCTION;
+                return reduce<T>(o, [](T acc, T a) { return (T)(acc & a); });
+            case 0x02:  // VREDOR
+                if (!vv) return EXC_ILLEGAL_INSTRUCTION;
+                return reduce<T>(o, [](T acc, T a) { return (T)(acc | a); });
+            case 0x03:  // VREDXOR
+                if (!vv) return EXC_ILLEGAL_INSTRUCTION;
+                return reduce<T>(o, [](T acc, T a) { return (T)(acc ^ a); });
+            case 0x04:  // VREDMINU
+                if (!vv) return EXC_ILLEGAL_INSTRUCTION;
+                return reduce<T>(o, [](T acc, T a) { return (a < acc) ? a : acc; });
+            case 0x05:  // VREDMIN
+                if (!vv) return EXC_ILLEGAL_INSTRUCTION;
+                return reduce<T>(o, [](T acc, T a) { return ((S)a < (S)acc) ? a : acc; });
+            case 0x06:  // VREDMAXU
+                if (!vv) return EXC_ILLEGAL_INSTRUCTION;
+                return reduce<T>(o, [](T acc, T a) { return (a > acc) ? a : acc; });
+            case 0x07:  // VREDMAX
+                if (!vv) return EXC_ILLEGAL_INSTRUCTION;
+                return reduce<T>(o, [](T acc, T a) { return ((S)a > (S)acc) ? a : acc; });
+            case 0x0e:  // VSLIDE1UP
+            case 0x0f:  // VSLIDE1DOWN
+                if (!vx) return EXC_ILLEGAL_INSTRUCTION;
+                return slide<T>(o, 1, funct6 == 0x0e, true);
+            case 0x10:  // VMV.S.X
+                if (!vx || o.vs2 != 0 || o.masked) return EXC_ILLEGAL_INSTRUCTION;
+                if (o.vl) writeElement<T>(o.v, o.vd, (T)o.scalar);
+                return 0;
+            case 0x14: {  // VIOTA, VID
+                if (!vv || !isAligned(o, o.vd) || (o.vs1 != 0x10 && o.vs1 != 0x11)) return EXC_ILLEGAL_INSTRUCTION;
+                T d[VECTOR_MAX_ELEMENTS];
+                memcpy(d, o.v + o.vd * VLEN_BYTES, o.vl * sizeof(T));
+                const uint8_t *source = o.v + o.vs2 * VLEN_BYTES;
+                T count = 0;
+                for (uint32_t i = 0; i < o.vl; i++) {
+                    if (!isActive(o, i)) continue;
+                    d[i] = (o.vs1 == 0x11) ? (T)i : count;
+                    count += maskBit(source, i);
+                }
+                memcpy(o.v + o.vd * VLEN_BYTES, d, o.vl * sizeof(T));
+                return 0;
+            }
+            case 0x20:  // VDIVU
+                return elementwise<T>(o, vv, [](T a, T b, T) { return (b == 0) ? (T)~(T)0 : (T)(a / b); });
+            case 0x21:  // VDIV
+                return elementwise<T>(o, vv, [s_min](T a, T b, T) {
+                    if (b == 0) return (T)~(T)0;
+                    if (a == s_min && b == (T)~(T)0) return a;
+                    return (T)((S)a / (S)b);
+                });
+            case 0x22:  // VREMU
+                return elementwise<T>(o, vv, [](T a, T b, T) { return (b == 0) ? a : (T)(a % b); });
+            case 0x23:  // VREM
+                return elementwise<T>(o, vv, [s_min](T a, T b, T) {
+                    if (b == 0) return a;
+                    if (a == s_min && b == (T)~(T)0) return (T)0;
+                    return (T)((S)a % (S)b);
+                });
+            case 0x24:  // VMULHU
+                return elementwise<T>(o, vv, [bits](T a, T b, T) { return (T)(((uint64_t)a * b) >> bits); });
+            case 0x25:  // VMUL
+                return elementwise<T>(o, vv, [](T a, T b, T) { return (T)((uint32_t)a * b); });
+            case 0x26:  // VMULHSU
+                return elementwise<T>(o, vv, [bits](T a, T b, T) { return (T)(((int64_t)(S)a * (int64_t)b) >> bits); });
+            case 0x27:  // VMULH
+                return elementwise<T>(o, vv, [bits](T a, T b, T) { return (T)(((int64_t)(S)a * (S)b) >> bits); });
+            case 0x29:  // VMADD
+                return elementwise<T>(o, vv, [](T a, T b, T d) { return (T)((uint32_t)b * d + a); });
+            case 0x2b:  // VNMSUB
+                return elementwise<T>(o, vv, [](T a, T b, T d) { return (T)(a - (uint32_t)b * d); });
+            case 0x2d:  // VMACC
+                return elementwise<T>(o, vv, [](T a, T b, T d) { return (T)((uint32_t)b * a + d); });
+            case 0x2f:  // VNMSAC
+                return elementwise<T>(o, vv, [](T a, T b, T d) { return (T)(d - (uint32_t)b * a); });
+            default:
+                return EXC_ILLEGAL_INSTRUCTION;
+        }
+    }
+
+    switch (funct6) {
+        case 0x00:  // VADD
+            return elementwise<T>(o, vv, [](T a, T b, T) { return (T)(a + b); });
+        case 0x02:  // VSUB
+            if (vi) return EXC_ILLEGAL_INSTRUCTION;
+            return elementwise<T>(o, vv, [](T a, T b, T) { return (T)(a - b); });
+        case 0x03:  // VRSUB
+            if (vv) return EXC_ILLEGAL_INSTRUCTION;
+            return elementwise<T>(o, vv, [](T a, T b, T) { return (T)(b - a); });
+        case 0x04:  // VMINU
+            if (vi) return EXC_ILLEGAL_INSTRUCTION;
+            return elementwise<T>(o, vv, [](T a, T b, T) { return (a < b) ? a : b; });
+        case 0x05:  // VMIN
+            if (vi) return EXC_ILLEGAL_INSTRUCTION;
+            return elementwise<T>(o, vv, [](T a, T b, T) { return ((S)a < (S)b) ? a : b; });
+        case 0x06:  // VMAXU
+            if (vi) return EXC_ILLEGAL_INSTRUCTION;
+            return elementwise<T>(o, vv, [](T a, T b, T) { return (a > b) ? a : b; });
+        case 0x07:  // VMAX
+            if (vi) return EXC_ILLEGAL_INSTRUCTION;
+            return elementwise<T>(o, vv, [](T a, T b, T) { return ((S)a > (S)b) ? a : b; });
+        case 0x09:  // VAND
+            return elementwise<T>(o, vv, [](T a, T b, T) { return (T)(a & b); });
+        case 0x0a:  // VOR
+            return elementwise<T>(o, vv, [](T a, T b, T) { return (T)(a | b); });
+        case 0x0b:  // VXOR
+            return elementwise<T>(o, vv, [](T a, T b, T) { return (T)(a ^ b); });
+        case 0x0e:  // VSLIDEUP
+        case 0x0f:  // VSLIDEDOWN
+            if (vv) return EXC_ILLEGAL_INSTRUCTION;
+            return slide<T>(o, vi ? o.vs1 : o.scalar, funct6 == 0x0e, false);
+        case 0x17:  // VMERGE, VMV.V
+            return merge<T>(o, vv);
+        case 0x18:  // VMSEQ
+            return compare<T>(o, vv, [](T a, T b) { return a == b; });
+        case 0x19:  // VMSNE
+            return compare<T>(o, vv, [](T a, T b) { return a != b; });
+        case 0x1a:  // VMSLTU
+            if (vi) return EXC_ILLEGAL_INSTRUCTION;
+            return compare<T>(o, vv, [](T a, T b) { return a < b; });
+        case 0x1b:  // VMSLT
+            if (vi) return EXC_ILLEGAL_INSTRUCTION;
+            return compare<T>(o, vv, [](T a, T b) { return (S)a < (S)b; });
+        case 0x1c:  // VMSLEU
+            return compare<T>(o, vv, [](T a, T b) { return a <= b; });
+        case 0x1d:  // VMSLE
+            return compare<T>(o, vv, [](T a, T b) { return (S)a <= (S)b; });
+        case 0x1e:  // VMSGTU
+            if (vv) return EXC_ILLEGAL_INSTRUCTION;
+            return compare<T>(o, vv, [](T a, T b) { return a > b; });
+        case 0x1f:  // VMSGT
+            if (vv) return EXC_ILLEGAL_INSTRUCTION;
+            return compare<T>(o, vv, [](T a, T b) { return (S)a > (S)b; });
+        case 0x20:  // VSADDU
+            exception = elementwise<T>(o, vv, [&saturated](T a, T b, T) {
+                T result = a + b;
+                saturated |= (result < a);
+                return (result < a) ? (T)~(T)0 : result;
+            });
+            break;
+        case 0x21:  // VSADD
+            exception = elementwise<T>(o, vv, [&saturated, s_min, s_max](T a, T b, T) {
+                int64_t result = (int64_t)(S)a + (S)b;
+                bool overflow = result > (S)s_max || result < (S)s_min;
+                saturated |= overflow;
+                return overflow ? ((result < 0) ? s_min : s_max) : (T)result;
+            });
+            break;
+        case 0x22:  // VSSUBU
+            if (vi) return EXC_ILLEGAL_INSTRUCTION;
+            exception = elementwise<T>(o, vv, [&saturated](T a, T b, T) {
+                saturated |= (a < b);
+                return (a < b) ? (T)0 : (T)(a - b);
+            });
+            break;
+        case 0x23:  // VSSUB
+            if (vi) return EXC_ILLEGAL_INSTRUCTION;
+            exception = elementwise<T>(o, vv, [&saturated, s_min, s_max](T a, T b, T) {
+                int64_t result = (int64_t)(S)a - (S)b;
+                bool overflow = result > (S)s_max || result < (S)s_min;
+                saturated |= overflow;
+                return overflow ? ((result < 0) ? s_min : s_max) : (T)result;
+            });
+            break;
+        case 0x25:  // VSLL
+            return elementwise<T>(o, vv, [bits](T a, T b, T) { return (T)(a << (b & (bits - 1))); });
+        case 0x27: {  // VMV<NR>R
+            uint32_t nregs = o.vs1 + 1;
+            if (!vi || o.masked || (nregs & (nregs - 1)) || nregs > 8 || (o.vd & (nregs - 1)) || (o.vs2 & (nregs - 1))) return EXC_ILLEGAL_INSTRUCTION;
+            memmove(o.v + o.vd * VLEN_BYTES, o.v + o.vs2 * VLEN_BYTES, nregs * VLEN_BYTES);
+            return 0;
+        }
+        case 0x28:  // VSRL
+            return elementwise<T>(o, vv, [bits](T a, T b, T) { return (T)(a >> (b & (bits - 1))); });
+        case 0x29:  // VSRA
+            return elementwise<T>(o, vv, [bits](T a, T b, T) { return (T)((S)a >> (b & (bits - 1))); });
+        default:
+            return EXC_ILLEGAL_INSTRUCTION;
+    }
+    if (saturated) *vxsat = 1;
+    return exception;
+}
+
+/**
+ * Execute an integer or mask instruction of the OPIVV, OPIVI, OPIVX, OPMVV and OPMVX forms.
+ * @param o The operands.
+ * @param funct3 The operand form.
+ * @param funct6 The operation.
+ * @param vxsat Set to 1 if a saturating instruction saturated.
+ * @return 0 or EXC_ILLEGAL_INSTRUCTION.
+ */
+VECTOR_KERNELS
+static uint32_t integerArithmetic(VectorOperands &o, uint32_t funct3, uint32_t funct6, uint32_t *vxsat) {
+    if (funct3 == OPMVV && funct6 >= 0x18 && funct6 <= 0x1f) {  // VMANDN, VMAND, VMOR, VMXOR, VMORN, VMNAND, VMNOR, VMXNOR
+        if (o.masked) return EXC_ILLEGAL_INSTRUCTION;
+        uint8_t a[VLEN_BYTES], b[VLEN_BYTES], d[VLEN_BYTES];
+        memcpy(a, o.v + o.vs2 * VLEN_BYTES, VLEN_BYTES);
+        memcpy(b, o.v + o.vs1 * VLEN_BYTES, VLEN_BYTES);
+        memcpy(d, o.v + o.vd * VLEN_BYTES, VLEN_BYTES);
+        for (uint32_t i = 0; i * 8 < o.vl; i++) {
+            uint8_t result;
+            switch (funct6) {
+                case 0x18:
+                    result = a[i] & ~b[i];
+                    break;
+                case 0x19:
+                    result = a[i] & b[i];
+                    break;
+                case 0x1a:
+                    result = a[i] | b[i];
+                    break;
+                case 0x1b:
+                    result = a[i] ^ b[i];
+                    break;
+                case 0x1c:
+                    result = a[i] | ~b[i];
+                    break;
+                case 0x1d:
+                    result = ~(a[i] & b[i]);
+                    break;
+                case 0x1e:
+                    result = ~(a[i] | b[i]);
+                    break;
+                default:
+                    result = ~(a[i] ^ b[i]);
+                    break;
+            }
+            uint8_t body = (o.vl - i * 8 >= 8) ? 0xff : (1 << (o.vl - i * 8)) - 1;
+            d[i] = (d[i] & ~body) | (result & body);
+        }
+        memcpy(o.v + o.vd * VLEN_BYTES, d, VLEN_BYTES);
+        return 0;
+    }
+    if (funct3 == OPMVV && funct6 == 0x14 && o.vs1 >= 0x01 && o.vs1 <= 0x03) {  // VMSBF, VMSOF, VMSIF
+        uint8_t a[VLEN_BYTES], d[VLEN_BYTES];
+        memcpy(a, o.v + o.vs2 * VLEN_BYTES, VLEN_BYTES);
+        memcpy(d, o.v + o.vd * VLEN_BYTES, VLEN_BYTES);
+        bool found = false;
+        for (uint32_t i = 0; i < o.vl; i++) {
+            if (!isActive(o, i)) continue;
+            bool first = !found && maskBit(a, i);
+            setMaskBit(d, i, (o.vs1 == 0x01) ? (!found && !first) : (o.vs1 == 0x02) ? first : !found);
+            found |= first;
+        }
+        memcpy(o.v + o.vd * VLEN_BYTES, d, VLEN_BYTES);
+        return 0;
+    }
+    switch (o.config.sew) {
+        case 1:
+            return integerOp<uint8_t>(o, funct3, funct6, vxsat);
+        case 2:
+            return integerOp<uint16_t>(o, funct3, funct6, vxsat);
+        default:
+            return integerOp<uint32_t>(o, funct3, funct6, vxsat);
+    }
+}
+
+static inline float toFloat(uint32_t bits) {
+    float value;
+    memcpy(&value, &bits, sizeof(value));
+    return value;
+}
+
+static inline uint32_t toBits(float value) {
+    uint32_t bits;
+    memcpy(&bits, &value, sizeof(bits));
+    return bits;
+}
+
+/**
+ * Replace a NaN result by the canonical NaN. Results of arithmetic are never signaling.
+ */
+static inline float canonical(float value) {
+    return (value == value) ? value : toFloat(FpFormat<float>::canonical_nan);
+}
+
+static inline bool isSignalingBits(uint32_t bits) {
+    return isSignaling<float>(FpFormat<float>::box(bits));
+}
+
+/**
+ * FMIN and FMAX semantics, see fpu.cpp.
+ */
+static inline uint32_t minMax(uint32_t a_bits, uint32_t b_bits, bool is_max, uint32_t *flags) {
+    float a = toFloat(a_bits);
+    float b = toFloat(b_bits);
+    if (isSignalingBits(a_bits) || isSignalingBits(b_bits)) *flags |= FFLAG_NV;
+    float result;
+    if (isnan(a) || isnan(b))
+        result = isnan(a) ? b : a;
+    else if (a == b)
+        result = (signbit(a) == !is_max) ? a : b;
+    else
+        result = ((a < b) == !is_max) ? a : b;
+    return isnan(result) ? FpFormat<float>::canonical_nan : toBits(result);
+}
+
+/**
+ * Apply a rounding floating point op(vs2[i], vs1[i] or the scalar, vd[i]) to the active body elements.
+ * Runs in the guest environment, the host flags are collected by the caller.
+ * @return 0 or EXC_ILLEGAL_INSTRUCTION.
+ */
+template <typename Op>
+static inline uint32_t floatElementwise(VectorOperands &o, bool vector_b, Op op) {
+    if (!isAligned(o, o.vd) || !isAligned(o, o.vs2) || (vector_b && !isAligned(o, o.vs1))) return EXC_ILLEGAL_INSTRUCTION;
+    float a[VECTOR_MAX_ELEMENTS], b[VECTOR_MAX_ELEMENTS], d[VECTOR_MAX_ELEMENTS];
+    memcpy(a, o.v + o.vs2 * VLEN_BYTES, o.vl * sizeof(float));
+    memcpy(d, o.v + o.vd * VLEN_BYTES, o.vl * sizeof(float));
+    if (vector_b) {
+        memcpy(b, o.v + o.vs1 * VLEN_BYTES, o.vl * sizeof(float));
+    } else {
+        for (uint32_t i = 0; i < o.vl; i++) b[i] = toFloat(o.scalar);
+    }
+    fpBarrierArray(a);
+    fpBarrierArray(b);
+    fpBarrierArray(d);
+    if (!o.masked) {
+        for (uint32_t i = 0; i < o.vl; i++) d[i] = canonical(op(a[i], b[i], d[i]));
+    } else {
+        for (uint32_t i = 0; i < o.vl; i++) {  // Inactive elements must not raise flags
+            if (maskBit(o.mask, i)) d[i] = canonical(op(a[i], b[i], d[i]));
+        }
+    }
+    fpBarrierArray(d);
+    memcpy(o.v + o.vd * VLEN_BYTES, d, o.vl * sizeof(float));
+    return 0;
+}
+
+/**
+ * Raise the invalid flag for fused multiply-adds of infinity and zero, which
+ * the host does not do if the addend is a quiet NaN.
+ */
+static inline void checkInfTimesZero(VectorOperands &o, bool vector_b, bool with_vd, uint32_t *flags) {
+    for (uint32_t i = 0; i < o.vl; i++) {
+        if (!isActive(o, i)) continue;
+        float x = toFloat(vector_b ? readElement<uint32_t>(o.v + i * 4, o.vs1) : o.scalar);
+        float y = toFloat(readElement<uint32_t>(o.v + i * 4, with_vd ? o.vd : o.vs2));
+        if ((isinf(x) && y == 0) || (x == 0 && isinf(y))) *flags |= FFLAG_NV;
+    }
+}
+
+/**
+ * Execute a single precision instruction of the OPFVV and OPFVF forms.
+ * @param o The operands, SEW = 32.
+ * @param funct3 The operand form.
+ * @param funct6 The operation.
+ * @param rm A valid rounding mode.
+ * @param flags The raised flags are ORed into this.
+ * @return 0 or EXC_ILLEGAL_INSTRUCTION.
+ */
+VECTOR_KERNELS
+static uint32_t floatArithmetic(VectorOperands &o, uint32_t funct3, uint32_t funct6, uint32_t rm, uint32_t *flags) {
+    bool vv = (funct3 == OPFVV);
+    HostFpEnv env(rm);
+    uint32_t exception;
+    switch (funct6) {
+        case 0x00:  // VFADD
+            exception = floatElementwise(o, vv, [](float a, float b, float) { return a + b; });
+            break;
+        case 0x02:  // VFSUB
+            exception = floatElementwise(o, vv, [](float a, float b, float) { return a - b; });
+            break;
+        case 0x20:  // VFDIV
+            exception = floatElementwise(o, vv, [](float a, float b, float) { return a / b; });
+            break;
+        case 0x21:  // VFRDIV
+            if (vv) return EXC_ILLEGAL_INSTRUCTION;
+            exception = floatElementwise(o, vv, [](float a, float b, float) { return b / a; });
+            break;
+        case 0x24:  // VFMUL
+            exception = floatElementwise(o, vv, [](float a, float b, float) { return a * b; });
+            break;
+        case 0x27:  // VFRSUB
+            if (vv) return EXC_ILLEGAL_INSTRUCTION;
+            exception = floatElementwise(o, vv, [](float a, float b, float) { return b - a; });
+            break;
+        case 0x28:  // VFMADD
+            checkInfTimesZero(o, vv, true, flags);
+            exception = floatElementwise(o, vv, [](float a, float b, float d) { return fmaf(b, d, a); });
+            break;
+        case 0x29:  // VFNMADD
+            checkInfTimesZero(o, vv, true, flags);
+            exception = floatElementwise(o, vv, [](float a, float b, float d) { return fmaf(-b, d, -a); });
+            break;
+        case 0x2a:  // VFMSUB
+            checkInfTimesZero(o, vv, true, flags);
+            exception = floatElementwise(o, vv, [](float a, float b, float d) { return fmaf(b, d, -a); });
+            break;
+        case 0x2b:  // VFNMSUB
+            checkInfTimesZero(o, vv, true, flags);
+            exception = floatElementwise(o, vv, [](float a, float b, float d) { return fmaf(-b, d, a); });
+            break;
+        case 0x2c:  // VFMACC
+            checkInfTimesZero(o, vv, false, flags);
+            exception = floatElementwise(o, vv, [](float a, float b, float d) { return fmaf(b, a, d); });
+            break;
+        case 0x2d:  // VFNMACC
+            checkInfTimesZero(o, vv, false, flags);
+            exception = floatElementwise(o, vv, [](float a, float b, float d) { return fmaf(-b, a, -d); });
+            break;
+        case 0x2e:  // VFMSAC
+            checkInfTimesZero(o, vv, false, flags);
+            exception = floatElementwise(o, vv, [](float a, float b, float d) { return fmaf(b, a, -d); });
+            break;
+        case 0x2f:  // VFNMSAC
+            checkInfTimesZero(o, vv, false, flags);
+            exception = floatElementwise(o, vv, [](float a, float b, float d) { return fmaf(-b, a, d); });
+            break;
+        case 0x01:    // VFREDUSUM
+        case 0x03: {  // VFREDOSUM, the unordered sum is ordered too
+            if (!vv || !isAligned(o, o.vs2)) return EXC_ILLEGAL_INSTRUCTION;
+            if (o.vl == 0) return 0;
+            float a[VECTOR_MAX_ELEMENTS];
+            memcpy(a, o.v + o.vs2 * VLEN_BYTES, o.vl * sizeof(float));
+            float result = toFloat(readElement<uint32_t>(o.v, o.vs1));
+            fpBarrierArray(a);
+            fpBarrier(result);
+            for (uint32_t i = 0; i < o.vl; i++) {
+                if (isActive(o, i)) result = canonical(result + a[i]);
+            }
+            fpBarrier(result);
+            writeElement<uint32_t>(o.v, o.vd, toBits(result));
+            exception = 0;
+            break;
+        }
+        case 0x04:    // VFMIN
+        case 0x06:    // VFMAX
+        case 0x05:    // VFREDMIN
+        case 0x07: {  // VFREDMAX
+            bool is_max = (funct6 & 0x2);
+            if (funct6 & 0x1) {
+                if (!vv) return EXC_ILLEGAL_INSTRUCTION;
+                return reduce<uint32_t>(o, [is_max, flags](uint32_t acc, uint32_t a) { return minMax(acc, a, is_max, flags); });
+            }
+            return elementwise<uint32_t>(o, vv, [is_max, flags](uint32_t a, uint32_t b, uint32_t) { return minMax(a, b, is_max, flags); });
+        }
+        case 0x08:  // VFSGNJ
+            return elementwise<uint32_t>(o, vv, [](uint32_t a, uint32_t b, uint32_t) { return (a & 0x7fffffff) | (b & 0x80000000); });
+        case 0x09:  // VFSGNJN
+            return elementwise<uint32_t>(o, vv, [](uint32_t a, uint32_t b, uint32_t) { return (a & 0x7fffffff) | (~b & 0x80000000); });
+        case 0x0a:  // VFSGNJX
+            return elementwise<uint32_t>(o, vv, [](uint32_t a, uint32_t b, uint32_t) { return a ^ (b & 0x80000000); });
+        case 0x10:  // VFMV.S.F
+            if (vv || o.vs2 != 0 || o.masked) return EXC_ILLEGAL_INSTRUCTION;
+            if (o.vl) writeElement<uint32_t>(o.v, o.vd, o.scalar);
+            return 0;
+        case 0x12: {  // VFCVT
+            if (!vv) return EXC_ILLEGAL_INSTRUCTION;
+            switch (o.vs1) {
+                case 0x00:  // VFCVT.XU.F
+                case 0x01:  // VFCVT.X.F
+                case 0x06:  // VFCVT.RTZ.XU.F
+                case 0x07: {  // VFCVT.RTZ.X.F
+                    uint32_t mode = (o.vs1 & 0x4) ? RM_RTZ : rm;
+                    bool is_unsigned = !(o.vs1 & 0x1);
+                    return elementwise<uint32_t>(o, false, [mode, is_unsigned, flags](uint32_t a, uint32_t, uint32_t) {
+                        return toInteger(toFloat(a), mode, is_unsigned, flags);
+                    });
+                }
+                case 0x02:  // VFCVT.F.XU
+                    exception = floatElementwise(o, false, [](float a, float, float) { return (float)toBits(a); });
+                    break;
+                case 0x03:  // VFCVT.F.X
+                    exception = floatElementwise(o, false, [](float a, float, float) { return (float)(int32_t)toBits(a); });
+                    break;
+                default:
+                    return EXC_ILLEGAL_INSTRUCTION;
+            }
+            break;
+        }
+        case 0x13:  // VFSQRT, VFCLASS
+            if (!vv) return EXC_ILLEGAL_INSTRUCTION;
+            if (o.vs1 == 0x10) return elementwise<uint32_t>(o, false, [](uint32_t a, uint32_t, uint32_t) { return classify<float>(FpFormat<float>::box(a)); });
+            if (o.vs1 != 0x00) return EXC_ILLEGAL_INSTRUCTION;
+            exception = floatElementwise(o, false, [](float a, float, float) { return sqrtf(a); });
+            break;
+        case 0x17:  // VFMERGE, VFMV.V.F
+            if (vv) return EXC_ILLEGAL_INSTRUCTION;
+            return merge<uint32_t>(o, false);
+        case 0x18:  // VMFEQ
+        case 0x1c:  // VMFNE
+            return compare<uint32_t>(o, vv, [funct6, flags](uint32_t a, uint32_t b) {
+                if (isSignalingBits(a) || isSignalingBits(b)) *flags |= FFLAG_NV;
+                return (toFloat(a) == toFloat(b)) == (funct6 == 0x18);
+            });
+        case 0x19:  // VMFLE
+        case 0x1b:  // VMFLT
+        case 0x1d:  // VMFGT
+        case 0x1f:  // VMFGE
+            if (vv && funct6 >= 0x1d) return EXC_ILLEGAL_INSTRUCTION;
+            return compare<uint32_t>(o, vv, [funct6, flags](uint32_t a_bits, uint32_t b_bits) {
+                float a = toFloat(a_bits);
+                float b = toFloat(b_bits);
+                if (isnan(a) || isnan(b)) {
+                    *flags |= FFLAG_NV;
+                    return false;
+                }
+                switch (funct6) {
+                    case 0x19:
+                        return a <= b;
+                    case 0x1b:
+                        return a < b;
+                    case 0x1d:
+                        return a > b;
+                    default:
+                        return a >= b;
+                }
+            });
+        default:
+            return EXC_ILLEGAL_INSTRUCTION;
+    }
+    *flags |= env.flags();
+    return exception;
+}
+
+/**
+ * Transfer the elements of a vector load or store between a register group and memory.
+ * @param bus The bus.
+ * @param reg The first register of the group.
+ * @param mask v0 or NULL if unmasked.
+ * @param addr The address of element 0.
+ * @param stride The distance between elements in bytes.
+ * @param start The first element, vstart.
+ * @param evl The number of elements.
+ * @param store true to write to memory.
+ * @param fault_index Set to the element that faulted.
+ * @param fault_addr Set to the address that faulted.
+ * @return 0, EXC_LOAD_ACCESS_FAULT or EXC_STORE_ACCESS_FAULT.
+ */
+template <typename T>
+static uint32_t transfer(Bus *bus, uint8_t *reg, const uint8_t *mask, uint32_t addr, int32_t stride, uint32_t start, uint32_t evl, bool store, uint32_t *fault_index, uint32_t *fault_addr) {
+    int64_t first = (int64_t)addr + (int64_t)start * stride;
+    int64_t last = (int64_t)addr + (int64_t)(evl - 1) * stride;
+    int64_t low = (first < last) ? first : last;
+    int64_t high = ((first < last) ? last : first) + sizeof(T);
+    uint8_t *host = NULL;
+    if (low >= 0 && high <= 0x100000000LL) host = bus->getHostPointer(low, high - low, store);
+
+    if (host) {
+        if (stride == sizeof(T) && !mask) {
+            if (store)
+                memcpy(host, reg + start * sizeof(T), (evl - start) * sizeof(T));
+            else
+                memcpy(reg + start * sizeof(T), host, (evl - start) * sizeof(T));
+            return 0;
+        }
+        for (uint32_t i = start; i < evl; i++) {
+            if (mask && !maskBit(mask, i)) continue;
+            uint8_t *element = host + ((int64_t)addr + (int64_t)i * stride - low);
+            if (store)
+                memcpy(element, reg + i * sizeof(T), sizeof(T));
+            else
+                memcpy(reg + i * sizeof(T), element, sizeof(T));
+        }
+        return 0;
+    }
+
+    for (uint32_t i = start; i < evl; i++) {  // MMIO or not inside one device
+        if (mask && !maskBit(mask, i)) continue;
+        uint32_t element_addr = addr + i * stride;
+        uint32_t exception;
+        T value;
+        if (store) {
+            memcpy(&value, reg + i * sizeof(T), sizeof(T));
+            exception = bus->write(element_addr, value, sizeof(T));
+        } else {
+            value = bus->read(element_addr, &exception, sizeof(T));
+            if (!exception) memcpy(reg + i * sizeof(T), &value, sizeof(T));
+        }
+        if (exception) {
+            *fault_index = i;
+            *fault_addr = element_addr;
+            return exception;
+        }
+    }
+    return 0;
+}
+
+/**
+ * Execute a vector load or store.
+ * @param ir The instruction.
+ * @param rval Set to the faulting address on access faults.
+ * @return 0, EXC_ILLEGAL_INSTRUCTION or an access fault, vstart holds the faulting element.
+ */
+uint32_t Cpu::executeVectorMemory(uint32_t ir, uint32_t *rval) {
+    bool store = (ir & 0x7f) == 0x27;
+    uint32_t vd = (ir >> 7) & 0x1f;
+    uint32_t width = (ir >> 12) & 0x7;
+    uint32_t addr = x[(ir >> 15) & 0x1f];
+    uint32_t umop = (ir >> 20) & 0x1f;  // lumop, sumop or rs2
+    bool masked = !((ir >> 25) & 0x1);
+    uint32_t mop = (ir >> 26) & 0x3;
+    uint32_t nf = ir >> 29;
+    uint32_t eew = (width == 0) ? 1 : 1 << (width - 4);
+    if (((ir >> 28) & 0x1) || eew > 4) return EXC_ILLEGAL_INSTRUCTION;  // mew, 64 bit elements
+
+    int32_t stride = eew;
+    uint32_t evl;
+    bool fault_first = false;
+    if (mop == 0 && umop == 0x08) {  // Whole registers, independent of vtype and vl
+        uint32_t nregs = nf + 1;
+        if (masked || (nregs & (nregs - 1)) || (vd & (nregs - 1)) || (store && eew != 1)) return EXC_ILLEGAL_INSTRUCTION;
+        evl = nregs * VLEN_BYTES / eew;
+    } else {
+        VectorConfig config = decodeVtype(csr[CSR_VTYPE]);
+        if (!config.valid || nf != 0 || (mop & 0x1)) return EXC_ILLEGAL_INSTRUCTION;  // Segments, indexed
+        if (mop == 0 && umop == 0x0b) {  // VLM, VSM
+            if (masked || eew != 1) return EXC_ILLEGAL_INSTRUCTION;
+            evl = (csr[CSR_VL] + 7) / 8;
+        } else {
+            if (mop == 0 && umop != 0x00 && (umop != 0x10 || store)) return EXC_ILLEGAL_INSTRUCTION;
+            fault_first = (mop == 0 && umop == 0x10);
+            if (mop == 2) stride = x[umop];
+            uint32_t group_bytes = config.vlmax * eew;  // EMUL = EEW / SEW * LMUL must be 1/8 to 8
+            if (group_bytes > 8 * VLEN_BYTES || group_bytes * 8 < VLEN_BYTES) return EXC_ILLEGAL_INSTRUCTION;
+            uint32_t emul_regs = (group_bytes > VLEN_BYTES) ? group_bytes / VLEN_BYTES : 1;
+            if (vd & (emul_regs - 1)) return EXC_ILLEGAL_INSTRUCTION;
+            evl = csr[CSR_VL];
+        }
+    }
+
+    uint32_t start = csr[CSR_VSTART];
+    csr[CSR_VSTART] = 0;
+    if (start >= evl) return 0;
+    uint8_t mask[VLEN_BYTES];
+    if (masked) memcpy(mask, v, VLEN_BYTES);
+    uint8_t *reg = v + vd * VLEN_BYTES;
+    uint32_t fault_index = 0;
+    uint32_t fault_addr = 0;
+    uint32_t exception;
+    switch (eew) {
+        case 1:
+            exception = transfer<uint8_t>(bus, reg, masked ? mask : NULL, addr, stride, start, evl, store, &fault_index, &fault_addr);
+            break;
+        case 2:
+            exception = transfer<uint16_t>(bus, reg, masked ? mask : NULL, addr, stride, start, evl, store, &fault_index, &fault_addr);
+            break;
+        default:
+            exception = transfer<uint32_t>(bus, reg, masked ? mask : NULL, addr, stride, start, evl, store, &fault_index, &fault_addr);
+            break;
+    }
+    if (exception && fault_first && fault_index > 0) {
+        csr[CSR_VL] = fault_index;  // Only element 0 traps, the load is cut short instead
+        return 0;
+    }
+    if (exception) {
+        csr[CSR_VSTART] = fault_index;
+        *rval = fault_addr;
+    }
+    return exception;
+}
+
+/**
+ * Execute vsetvli, vsetivli or vsetvl.
+ * @param ir The instruction.
+ * @param rval Set to the new vl.
+ * @return 0 or EXC_ILLEGAL_INSTRUCTION.
+ */
+uint32_t Cpu::executeVectorConfig(uint32_t ir, uint32_t *rval) {
+    uint32_t rd = (ir >> 7) & 0x1f;
+    uint32_t rs1 = (ir >> 15) & 0x1f;
+    uint32_t vtype;
+    uint32_t avl = rs1;
+    bool keep_vl = false;
+    if (!(ir & 0x80000000)) {  // VSETVLI
+        vtype = (ir >> 20) & 0x7ff;
+    } else if ((ir >> 30) == 0x3) {  // VSETIVLI
+        vtype = (ir >> 20) & 0x3ff;
+    } else if ((ir >> 25) == 0x40) {  // VSETVL
+        vtype = x[(ir >> 20) & 0x1f];
+    } else {
+        return EXC_ILLEGAL_INSTRUCTION;
+    }
+    if ((ir >> 30) != 0x3) {
+        if (rs1 != 0)
+            avl = x[rs1];
+        else if (rd != 0)
+            avl = 0xffffffff;  // VLMAX
+        else
+            keep_vl = true;
+    }
+
+    VectorConfig config = decodeVtype(vtype);
+    if (!config.valid) {
+        csr[CSR_VTYPE] = VTYPE_VILL;
+        csr[CSR_VL] = 0;
+    } else {
+        if (keep_vl) avl = csr[CSR_VL];
+        csr[CSR_VTYPE] = vtype;
+        csr[CSR_VL] = (avl < config.vlmax) ? avl : config.vlmax;
+    }
+    csr[CSR_VSTART] = 0;
+    *rval = csr[CSR_VL];
+    return 0;
+}
+
+/**
+ * Execute an instruction of the OP-V major opcode or a vector load or store.
+ * @param ir The instruction.
+ * @param rval Set to the result for integer destinations or the faulting address.
+ * @param rd The destination register, cleared unless the result goes to an integer register.
+ * @return 0, EXC_ILLEGAL_INSTRUCTION or an access fault.
+ */
+uint32_t Cpu::executeVector(uint32_t ir, uint32_t *rval, uint32_t *rd) {
+    if (!(csr[MSTATUS] & MSTATUS_VS)) return EXC_ILLEGAL_INSTRUCTION;
+    csr[MSTATUS] |= MSTATUS_VS | MSTATUS_SD;
+    uint32_t funct3 = (ir >> 12) & 0x7;
+    if ((ir & 0x7f) != 0x57) {
+        *rd = 0;
+        return executeVectorMemory(ir, rval);
+    }
+    if (funct3 == OPCFG) return executeVectorConfig(ir, rval);
+
+    VectorOperands o;
+    o.config = decodeVtype(csr[CSR_VTYPE]);
+    if (!o.config.valid || csr[CSR_VSTART] != 0) return EXC_ILLEGAL_INSTRUCTION;
+    uint32_t funct6 = ir >> 26;
+    o.v = v;
+    o.vl = csr[CSR_VL];
+    o.vd = (ir >> 7) & 0x1f;
+    o.vs1 = (ir >> 15) & 0x1f;
+    o.vs2 = (ir >> 20) & 0x1f;
+    o.masked = !((ir >> 25) & 0x1);
+    if (o.masked) memcpy(o.mask, v, VLEN_BYTES);
+    switch (funct3) {
+        case OPIVX:
+        case OPMVX:
+            o.scalar = x[o.vs1];
+            break;
+        case OPIVI:
+            o.scalar = (o.vs1 & 0x10) ? (o.vs1 | 0xffffffe0) : o.vs1;
+            break;
+        case OPFVF:
+            o.scalar = FpFormat<float>::raw(f[o.vs1]);
+            break;
+        default:
+            o.scalar = 0;
+            break;
+    }
+
+    if (funct3 == OPFVV || funct3 == OPFVF) {
+        uint32_t rm = (csr[FCSR] >> 5) & 0x7;
+        if (!(csr[MSTATUS] & MSTATUS_FS) || o.config.sew != 4 || rm > RM_RMM) return EXC_ILLEGAL_INSTRUCTION;
+        csr[MSTATUS] |= MSTATUS_FS | MSTATUS_SD;
+        *rd = 0;
+        if (funct3 == OPFVV && funct6 == 0x10) {  // VFMV.F.S
+            if (o.vs1 != 0 || o.masked) return EXC_ILLEGAL_INSTRUCTION;
+            f[(ir >> 7) & 0x1f] = FpFormat<float>::box(readElement<uint32_t>(v, o.vs2));
+            return 0;
+        }
+        uint32_t flags = 0;
+        uint32_t exception = floatArithmetic(o, funct3, funct6, rm, &flags);
+        if (!exception) csr[FCSR] |= flags;
+        return exception;
+    }
+
+    if (funct3 == OPMVV && funct6 == 0x10) {  // VMV.X.S, VCPOP.M, VFIRST.M
+        const uint8_t *source = v + o.vs2 * VLEN_BYTES;
+        switch (o.vs1) {
+            case 0x00:
+                if (o.masked) return EXC_ILLEGAL_INSTRUCTION;
+                if (o.config.sew == 1)
+                    *rval = (int8_t)readElement<uint8_t>(v, o.vs2);
+                else if (o.config.sew == 2)
+                    *rval = (int16_t)readElement<uint16_t>(v, o.vs2);
+                else
+                    *rval = readElement<uint32_t>(v, o.vs2);
+                return 0;
+            case 0x10:
+                *rval = 0;
+                for (uint32_t i = 0; i < o.vl; i++) *rval += isActive(o, i) && maskBit(source, i);
+                return 0;
+            case 0x11:
+                *rval = 0xffffffff;
+                for (uint32_t i = 0; i < o.vl; i++) {
+                    if (isActive(o, i) && maskBit(source, i)) {
+                        *rval = i;
+                        break;
+                    }
+                }
+                return 0;
+            default:
+                return EXC_ILLEGAL_INSTRUCTION;
+        }
+    }
+
+    *rd = 0;
+    uint32_t vxsat = 0;
+    uint32_t exception = integerArithmetic(o, funct3, funct6, &vxsat);
+    if (vxsat) csr[CSR_VXSAT] = 1;
+    return exception;
+}
+
+/**
+ * Read a vector CSR. The caller has checked that mstatus.VS is not off.
+ * @param csr_num The CSR number.
+ * @return The value of the CSR.
+ */
+uint32_t Cpu::readVectorCsr(uint32_t csr_num) {
+    switch (csr_num) {
+        case CSR_VCSR:
+            return (csr[CSR_VXRM] << 1) | csr[CSR_VXSAT];
+        case CSR_VLENB:
+            return VLEN_BYTES;
+        case CSR_VSTART:
+        case CSR_VXSAT:
+        case CSR_VXRM:
+        case CSR_VL:
+        case CSR_VTYPE:
+            return csr[csr_num];
+        default:
+            return 0;  // Reserved numbers between vxrm and vcsr
+    }
+}
+
+/**
+ * Write a vector CSR, vl, vtype and vlenb are read-only. The caller has checked that mstatus.VS is not off.
+ * @param csr_num The CSR number.
+ * @param value The value to write.
+ */
+void Cpu::writeVectorCsr(uint32_t csr_num, uint32_t value) {
+    switch (csr_num) {
+        case CSR_VSTART:
+            csr[CSR_VSTART] = value & (8 * VLEN_BYTES - 1);
+            break;
+        case CSR_VXSAT:
+            csr[CSR_VXSAT] = value & 0x1;
+            break;
+        case CSR_VXRM:
+            csr[CSR_VXRM] = value & 0x3;
+            break;
+        case CSR_VCSR:
+            csr[CSR_VXSAT] = value & 0x1;
+            csr[CSR_VXRM] = (value >> 1) & 0x3;
+            break;
+        default:
+            return;
+    }
+    csr[MSTATUS] |= MSTATUS_VS | MSTATUS_SD;
+}
@@ -0,0 +1,383 @@
+#include "virtio.h"
+
+/**
+ * Construct a new virtio-mmio transport.
+ * @param bus The bus the virtqueues and buffers are accessed through.
+ * @param plic The interrupt controller.
+ * @param device_id The virtio device id, 0 for an empty slot.
+ * @param num_queues The number of virtqueues of the device.
+ * @param irq The PLIC interrupt source of the device.
+ * @param base The base address of the device.
+ * @param size The size of the device.
+ */
+VirtioMmio::VirtioMmio(Bus *bus, Plic *plic, uint32_t device_id, uint32_t num_queues, uint32_t irq, uint32_t base, size_t size) {
+    this->bus = bus;
+    this->plic = plic;
+    this->device_id = device_id;
+    this->num_queues = (num_queues > VIRTIO_MAX_QUEUES) ? VIRTIO_MAX_QUEUES : num_queues;
+    this->irq = irq;
+    this->base = base;
+    this->size = size;
+    chain.out.reserve(VIRTIO_QUEUE_NUM_MAX);
+    chain.in.reserve(VIRTIO_QUEUE_NUM_MAX);
+    config_generation = 0;
+    interrupt_status = 0;
+    config_change_async.store(false);
+    reset();
+}
+
+/**
+ * Get the device information.
+ * @return The device information.
+ */
+DeviceInfo VirtioMmio::getDeviceInfo() {
+    DeviceInfo info;
+    info.base = base;
+    info.size = size;
+    info.device = this;
+    return info;
+}
+
+/**
+ * Read a word from the virtio-mmio registers or the device configuration.
+ * @param addr The address to read from.
+ * @return The word read.
+ */
+uint32_t VirtioMmio::read(uint64_t addr) {
+    uint32_t offset = addr - base;
+    if (offset >= VIRTIO_MMIO_CONFIG) {
+        uint32_t data = 0;
+        for (int i = 0; i < 4; i++) data |= readConfig(offset - VIRTIO_MMIO_CONFIG + i) << (i * 8);
+        return data;
+    }
+
+    switch (offset) {
+        case VIRTIO_MMIO_MAGIC:
+            return VIRTIO_MAGIC;
+        case VIRTIO_MMIO_VERSION:
+            return 2;
+        case VIRTIO_MMIO_DEVICE_ID:
+            return device_id;
+        case VIRTIO_MMIO_VENDOR_ID:
+            return VIRTIO_VENDOR_ID;
+        case VIRTIO_MMIO_DEVICE_FEATURES:
+            return (device_features_sel < 2) ? getFeatures() >> (device_features_sel * 32) : 0;
+        case VIRTIO_MMIO_QUEUE_NUM_MAX:
+            return (queue_sel < num_queues) ? VIRTIO_QUEUE_NUM_MAX : 0;
+        case VIRTIO_MMIO_QUEUE_READY:
+            return (queue_sel < num_queues) ? queues[queue_sel].ready : 0;
+        case VIRTIO_MMIO_INTERRUPT_STATUS:
+            if (config_change_async.exchange(false)) {
+                config_generation++;
+                interrupt_status |= VIRTIO_INT_CONFIG_CHANGE;
+            }
+            return interrupt_status;
+        case VIRTIO_MMIO_STATUS:
+            return status;
+        case VIRTIO_MMIO_CONFIG_GENERATION:
+            return config_generation;
+    }
+    return 0;
+}
+
+/**
+ * Write a word to the virtio-mmio registers or the device configuration.
+ * @param addr The address to write to.
+ * @param data The data to write.
+ * @param width The width of the data to write.
+ */
+void VirtioMmio::write(uint64_t addr, uint32_t data, uint8_t width) {
+    uint32_t offset = addr - base;
+    if (offset >= VIRTIO_MMIO_CONFIG) {
+        for (int i = 0; i < width; i++) writeConfig(offset - VIRTIO_MMIO_CONFIG + i, data >> (i * 8));
+        return;
+    }
+
+    VirtQueue *vq = (queue_sel < num_queues) ? &queues[queue_sel] : NULL;
+    switch (offset) {
+        case VIRTIO_MMIO_DEVICE_FEATURES_SEL:
+            device_features_sel = data;
+            break;
+        case VIRTIO_MMIO_DRIVER_FEATURES:
+            if (driver_features_sel == 0)
+                driver_features = (driver_features & 0xffffffff00000000ULL) | data;
+            else if (driver_features_sel == 1)
+                driver_features = (driver_features & 0xffffffffULL) | ((uint64_t)data << 32);
+            break;
+        case VIRTIO_MMIO_DRIVER_FEATURES_SEL:
+            driver_features_sel = data;
+            break;
+        case VIRTIO_MMIO_QUEUE_SEL:
+            queue_sel = data;
+            break;
+        case VIRTIO_MMIO_QUEUE_NUM:
+            if (vq && data <= VIRTIO_QUEUE_NUM_MAX) vq->num = data;
+            break;
+        case VIRTIO_MMIO_QUEUE_READY:
+            if (vq) vq->ready = data & 1;
+            break;
+        case VIRTIO_MMIO_QUEUE_NOTIFY:
+            if (data < num_queues) processQueue(data);
+            break;
+        case VIRTIO_MMIO_INTERRUPT_ACK:
+            interrupt_status &= ~data;
+            if (!interrupt_status) plic->lower(irq);
+            break;
+        case VIRTIO_MMIO_STATUS:
+            status = data;
+            if (data == 0) reset();
+            break;
+        case VIRTIO_MMIO_QUEUE_DESC_LOW:
+            if (vq) vq->desc_addr = (vq->desc_addr & 0xffffffff00000000ULL) | data;
+            break;
+        case VIRTIO_MMIO_QUEUE_DESC_HIGH:
+            if (vq) vq->desc_addr = (vq->desc_addr & 0xffffffffULL) | ((uint64_t)data << 32);
+            break;
+        case VIRTIO_MMIO_QUEUE_DRIVER_LOW:
+            if (vq) vq->avail_addr = (vq->avail_addr & 0xffffffff00000000ULL) | data;
+            break;
+        case VIRTIO_MMIO_QUEUE_DRIVER_HIGH:
+            if (vq) vq->avail_addr = (vq->avail_addr & 0xffffffffULL) | ((uint64_t)data << 32);
+            break;
+        case VIRTIO_MMIO_QUEUE_DEVICE_LOW:
+            if (vq) vq->used_addr = (vq->used_addr & 0xffffffff00000000ULL) | data;
+            break;
+        case VIRTIO_MMIO_QUEUE_DEVICE_HIGH:
+            if (vq) vq->used_addr = (vq->used_addr & 0xffffffffULL) | ((uint64_t)data << 32);
+            break;
+    }
+}
+
+/**
+ * Get the features offered by the device.
+ * @return The feature bits.
+ */
+uint64_t VirtioMmio::getFeatures() {
+    return VIRTIO_F_VERSION_1;
+}
+
+/**
+ * Read a byte of the device configuration.
+ * @param offset The offset into the configuration space.
+ * @return The byte read.
+ */
+uint8_t VirtioMmio::readConfig(uint32_t offset) {
+    return 0;
+}
+
+/**
+ * Write a byte of the device configuration.
+ * @param offset The offset into the configuration space.
+ * @param data The byte to write.
+ */
+void VirtioMmio::writeConfig(uint32_t offset, uint8_t data) {
+}
+
+/**
+ * Handle a descriptor chain made available by the driver.
+ * @param queue The queue the chain was taken from.
+ * @param chain The chain mapped to host memory.
+ * @return The number of bytes written to the in buffers.
+ */
+uint32_t VirtioMmio::handleChain(uint32_t queue, VirtioChain &chain) {
+    return 0;
+}
+
+/**
+ * Reset the device specific state, called when the driver resets the device.
+ */
+void VirtioMmio::resetDevice() {
+}
+
+/**
+ * Tell the driver that the device configuration has changed.
+ */
+void VirtioMmio::notifyConfigChange() {
+    config_generation++;
+    raiseInterrupt(VIRTIO_INT_CONFIG_CHANGE);
+}
+
+/**
+ * Tell the driver that the device configuration has changed, from a thread
+ * other than the CPU thread. The interrupt is raised at the next Plic::sync.
+ */
+void VirtioMmio::notifyConfigChangeAsync() {
+    config_change_async.store(true);
+    plic->raiseAsync(irq);
+}
+
+/**
+ * Reset the transport and the device.
+ */
+void VirtioMmio::reset() {
+    if (plic && interrupt_status) plic->lower(irq);
+    device_features_sel = 0;
+    driver_features_sel = 0;
+    driver_features = 0;
+    queue_sel = 0;
+    interrupt_status = 0;
+    status = 0;
+    memset(queues, 0, sizeof(queues));
+    resetDevice();
+}
+
+/**
+ * Process all chains the driver has made available on a queue.
+ * @param queue The queue to process.
+ */
+void VirtioMmio::processQueue(uint32_t queue) {
+    VirtQueue &vq = queues[queue];
+    if (!vq.ready || !vq.num) return;
+
+    uint8_t *avail = bus->getHostPointer(vq.avail_addr, 6 + 2 * vq.num, false);
+    uint8_t *used = bus->getHostPointer(vq.used_addr, 6 + 8 * vq.num, true);
+    if (avail == NULL || used == NULL) return;
+
+    uint16_t *avail_idx = (uint16_t*)(avail + 2);
+    uint16_t *avail_ring = (uint16_t*)(avail + 4);
+    uint16_t *used_idx = (uint16_t*)(used + 2);
+    bool notify = false;
+
+    while (vq.last_avail != __atomic_load_n(avail_idx, __ATOMIC_ACQUIRE)) {
+        uint16_t head = avail_ring[vq.last_avail % vq.num];
+        vq.last_avail++;
+
+        uint32_t len = 0;
+        if (mapChain(vq, head, chain)) len = handleChain(queue, chain);
+
+        uint32_t *elem = (uint32_t*)(used + 4 + 8 * (*used_idx % vq.num));
+        elem[0] = head;
+        elem[1] = len;
+        __atomic_store_n(used_idx, *used_idx + 1, __ATOMIC_RELEASE);
+        notify = true;
+    }
+
+    if (notify && !(*(uint16_t*)avail & VIRTQ_AVAIL_F_NO_INTERRUPT)) raiseInterrupt(VIRTIO_INT_USED_BUFFER);
+}
+
+/**
+ * Map a descriptor chain to host memory.
+ * @param vq The queue of the chain.
+ * @param head The index of the first descriptor.
+ * @param chain The chain to fill.
+ * @return false if a descriptor is invalid.
+ */
+bool VirtioMmio::mapChain(VirtQueue &vq, uint16_t head, VirtioChain &chain) {
+    uint8_t *table = bus->getHostPointer(vq.desc_addr, 16 * vq.num, false);
+    if (table == NULL) return false;
+
+    chain.head = head;
+    chain.out.clear();
+    chain.in.clear();
+    chain.out_len = 0;
+    chain.in_len = 0;
+
+    uint16_t index = head;
+    for (uint32_t count = 0; count < vq.num; count++) {
+        if (index >= vq.num) return false;
+        uint8_t *desc = table + 16 * index;
+        uint64_t addr = *(uint64_t*)desc;
+        uint32_t len = *(uint32_t*)(desc + 8);
+        uint16_t flags = *(uint16_t*)(desc + 12);
+        uint16_t next = *(uint16_t*)(desc + 14);
+
+        if (flags & VIRTQ_DESC_F_WRITE) {
+            if (!bus->translate(addr, len, true, chain.in)) return false;
+            chain.in_len += len;
+        } else {
+            if (!bus->translate(addr, len, false, chain.out)) return false;
+            chain.out_len += len;
+        }
+
+        if (!(flags & VIRTQ_DESC_F_NEXT)) return true;
+        index = next;
+    }
+    return false;  // Loop in the chain
+}
+
+/**
+ * Raise the interrupt of the device.
+ * @param reason The bits to set in the interrupt status.
+ */
+void VirtioMmio::raiseInterrupt(uint32_t reason) {
+    interrupt_status |= reason;
+    plic->raise(irq);
+}
+
+/**
+ * Copy bytes out of a list of buffers.
+ * @param buffers The buffers to read from.
+ * @param offset The offset into the concatenated buffers.
+ * @param dst The destination.
+ * @param len The number of bytes to copy.
+ * @return The number of bytes copied.
+ */
+size_t VirtioMmio::chainRead(const std::vector<iovec> &buffers, size_t offset, void *dst, size_t len) {
+    size_t done = 0;
+    for (auto& buffer : buffers) {
+        if (done == len) break;
+        if (offset >= buffer.iov_len) {
+            offset -= buffer.iov_len;
+            continue;
+        }
+        size_t chunk = buffer.iov_len - offset;
+        if (chunk > len - done) chunk = len - done;
+        memcpy((uint8_t*)dst + done, (uint8_t*)buffer.iov_base + offset, chunk);
+        done += chunk;
+        offset = 0;
+    }
+    return done;
+}
+
+/**
+ * Copy bytes into a list of buffers.
+ * @param buffers The buffers to write to.
+ * @param offset The offset into the concatenated buffers.
+ * @param src The source.
+ * @param len The number of bytes to copy.
+ * @return The number of bytes copied.
+ */
+size_t VirtioMmio::chainWrite(const std::vector<iovec> &buffers, size_t offset, const void *src, size_t len) {
+    size_t done = 0;
+    for (auto& buffer : buffers) {
+        if (done == len) break;
+        if (offset >= buffer.iov_len) {
+            offset -= buffer.iov_len;
+            continue;
+        }
+        size_t chunk = buffer.iov_len - offset;
+        if (chunk > len - done) chunk = len - done;
+        memcpy((uint8_t*)buffer.iov_base + offset, (const uint8_t*)src + done, chunk);
+        done += chunk;
+        offset = 0;
+    }
+    return done;
+}
+
+/**
+ * Describe a byte range of a list of buffers as iovecs, e.g. for preadv/pwritev.
+ * @param buffers The buffers.
+ * @param offset The offset into the concatenated buffers.
+ * @param len The length of the range.
+ * @param slice The iovecs to fill.
+ * @param max_slices The capacity of slice.
+ * @return The number of iovecs filled.
+ */
+int VirtioMmio::chainSlice(const std::vector<iovec> &buffers, size_t offset, size_t len, iovec *slice, int max_slices) {
+    int count = 0;
+    for (auto& buffer : buffers) {
+        if (len == 0 || count == max_slices) break;
+        if (offset >= buffer.iov_len) {
+            offset -= buffer.iov_len;
+            continue;
+        }
+        size_t chunk = buffer.iov_len - offset;
+        if (chunk > len) chunk = len;
+        slice[count].iov_base = (uint8_t*)buffer.iov_base + offset;
+        slice[count].iov_len = chunk;
+        count++;
+        len -= chunk;
+        offset = 0;
+    }
+    return count;
+}
@@ -0,0 +1,130 @@
+#ifndef VIRTIO_H
+#define VIRTIO_H
+
+#include <stdint.h>
+#include <stdio.h>
+#include <string.h>
+#include <sys/uio.h>
+#include <vector>
+#include <atomic>
+#include "bus.h"
+#include "plic.h"
+
+#define DEFAULT_VIRTIO_BASE 0x10001000
+#define DEFAULT_VIRTIO_SIZE 0x1000
+#define DEFAULT_VIRTIO_IRQ 1
+
+#define VIRTIO_MAGIC 0x74726976
+#define VIRTIO_VENDOR_ID 0x65767279  // "yrve"
+#define VIRTIO_QUEUE_NUM_MAX 256
+#define VIRTIO_MAX_QUEUES 4
+
+#define VIRTIO_F_VERSION_1 (1ULL << 32)
+
+#define VIRTIO_MMIO_MAGIC 0x000
+#define VIRTIO_MMIO_VERSION 0x004
+#define VIRTIO_MMIO_DEVICE_ID 0x008
+#define VIRTIO_MMIO_VENDOR_ID 0x00c
+#define VIRTIO_MMIO_DEVICE_FEATURES 0x010
+#define VIRTIO_MMIO_DEVICE_FEATURES_SEL 0x014
+#define VIRTIO_MMIO_DRIVER_FEATURES 0x020
+#define VIRTIO_MMIO_DRIVER_FEATURES_SEL 0x024
+#define VIRTIO_MMIO_QUEUE_SEL 0x030
+#define VIRTIO_MMIO_QUEUE_NUM_MAX 0x034
+#define VIRTIO_MMIO_QUEUE_NUM 0x038
+#define VIRTIO_MMIO_QUEUE_READY 0x044
+#define VIRTIO_MMIO_QUEUE_NOTIFY 0x050
+#define VIRTIO_MMIO_INTERRUPT_STATUS 0x060
+#define VIRTIO_MMIO_INTERRUPT_ACK 0x064
+#define VIRTIO_MMIO_STATUS 0x070
+#define VIRTIO_MMIO_QUEUE_DESC_LOW 0x080
+#define VIRTIO_MMIO_QUEUE_DESC_HIGH 0x084
+#define VIRTIO_MMIO_QUEUE_DRIVER_LOW 0x090
+#define VIRTIO_MMIO_QUEUE_DRIVER_HIGH 0x094
+#define VIRTIO_MMIO_QUEUE_DEVICE_LOW 0x0a0
+#define VIRTIO_MMIO_QUEUE_DEVICE_HIGH 0x0a4
+#define VIRTIO_MMIO_CONFIG_GENERATION 0x0fc
+#define VIRTIO_MMIO_CONFIG 0x100
+
+#define VIRTIO_INT_USED_BUFFER 0x1
+#define VIRTIO_INT_CONFIG_CHANGE 0x2
+
+#define VIRTQ_DESC_F_NEXT 1
+#define VIRTQ_DESC_F_WRITE 2
+#define VIRTQ_AVAIL_F_NO_INTERRUPT 1
+
+typedef struct {
+    uint32_t num;
+    bool ready;
+    uint64_t desc_addr;
+    uint64_t avail_addr;
+    uint64_t used_addr;
+    uint16_t last_avail;
+} VirtQueue;
+
+/**
+ * A descriptor chain mapped to host memory. out holds the buffers the device
+ * reads, in the buffers it writes, both in chain order. A descriptor crossing
+ * memory devices takes one buffer per device.
+ */
+typedef struct {
+    uint16_t head;
+    std::vector<iovec> out;
+    std::vector<iovec> in;
+    size_t out_len;
+    size_t in_len;
+} VirtioChain;
+
+/**
+ * virtio-mmio (version 2) transport with split virtqueues. Devices derive
+ * from it and implement the device specific hooks. With device id 0 it is an
+ * empty slot the guest driver skips.
+ */
+class VirtioMmio : public BusDevice {
+    public:
+        VirtioMmio(Bus *bus, Plic *plic, uint32_t device_id = 0, uint32_t num_queues = 0, uint32_t irq = DEFAULT_VIRTIO_IRQ, uint32_t base = DEFAULT_VIRTIO_BASE, size_t size = DEFAULT_VIRTIO_SIZE);
+        virtual ~VirtioMmio() {}
+        DeviceInfo getDeviceInfo();
+        uint32_t read(uint64_t addr);
+        void write(uint64_t addr, uint32_t data, uint8_t width);
+
+    protected:
+        virtual uint64_t getFeatures();
+        virtual uint8_t readConfig(uint32_t offset);
+        virtual void writeConfig(uint32_t offset, uint8_t data);
+        virtual uint32_t handleChain(uint32_t queue, VirtioChain &chain);
+        virtual void resetDevice();
+
+        void notifyConfigChange();
+        void notifyConfigChangeAsync();
+        static size_t chainRead(const std::vector<iovec> &buffers, size_t offset, void *dst, size_t len);
+        static size_t chainWrite(const std::vector<iovec> &buffers, size_t offset, const void *src, size_t len);
+        static int chainSlice(const std::vector<iovec> &buffers, size_t offset, size_t len, iovec *slice, int max_slices);
+
+        Bus *bus;
+        uint64_t driver_features;
+
+    private:
+        void reset();
+        void processQueue(uint32_t queue);
+        bool mapChain(VirtQueue &vq, uint16_t head, VirtioChain &chain);
+        void raiseInterrupt(uint32_t reason);
+
+        uint32_t base;
+        size_t size;
+        Plic *plic;
+        uint32_t irq;
+        uint32_t device_id;
+        uint32_t num_queues;
+        uint32_t device_features_sel;
+        uint32_t driver_features_sel;
+        uint32_t queue_sel;
+        uint32_t interrupt_status;
+        uint32_t status;
+        uint32_t config_generation;
+        std::atomic<bool> config_change_async;  // Set by other threads, folded into the interrupt status
+        VirtQueue queues[VIRTIO_MAX_QUEUES];
+        VirtioChain chain;
+};
+
+#endif
@@ -0,0 +1,1014 @@
+#include <stdlib.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <limits.h>
+#include <unistd.h>
+#include <sys/statfs.h>
+#include <sys/sysmacros.h>
+#include "virtio9p.h"
+
+#define P9_TLERROR 6
+#define P9_RLERROR 7
+#define P9_TSTATFS 8
+#define P9_TLOPEN 12
+#define P9_TLCREATE 14
+#define P9_TSYMLINK 16
+#define P9_TMKNOD 18
+#define P9_TRENAME 20
+#define P9_TREADLINK 22
+#define P9_TGETATTR 24
+#define P9_TSETATTR 26
+#define P9_TXATTRWALK 30
+#define P9_TXATTRCREATE 32
+#define P9_TREADDIR 40
+#define P9_TFSYNC 50
+#define P9_TLOCK 52
+#define P9_TGETLOCK 54
+#define P9_TLINK 70
+#define P9_TMKDIR 72
+#define P9_TRENAMEAT 74
+#define P9_TUNLINKAT 76
+#define P9_TVERSION 100
+#define P9_TAUTH 102
+#define P9_TATTACH 104
+#define P9_TFLUSH 108
+#define P9_TWALK 110
+#define P9_TREAD 116
+#define P9_TWRITE 118
+#define P9_TCLUNK 120
+#define P9_TREMOVE 122
+
+#define P9_QTDIR 0x80
+#define P9_QTSYMLINK 0x02
+#define P9_QTFILE 0x00
+
+#define P9_GETATTR_BASIC 0x000007ff
+
+#define P9_SETATTR_MODE 0x001
+#define P9_SETATTR_UID 0x002
+#define P9_SETATTR_GID 0x004
+#define P9_SETATTR_SIZE 0x008
+#define P9_SETATTR_ATIME 0x010
+#define P9_SETATTR_MTIME 0x020
+#define P9_SETATTR_ATIME_SET 0x080
+#define P9_SETATTR_MTIME_SET 0x100
+
+#define P9_LOCK_SUCCESS 0
+#define P9_LOCK_TYPE_UNLCK 2
+#define P9_AT_REMOVEDIR 0x200
+
+// Open flags a guest may pass on to the host, 9P2000.L uses the Linux values
+#define P9_OPEN_FLAGS (O_ACCMODE | O_TRUNC | O_APPEND | O_NONBLOCK | O_DSYNC | O_DIRECTORY | O_SYNC)
+
+static uint8_t p9GetU8(P9Reader &in) {
+    if (in.end - in.p < 1) {
+        in.ok = false;
+        return 0;
+    }
+    return *in.p++;
+}
+
+static uint16_t p9GetU16(P9Reader &in) {
+    uint16_t value = 0;
+    if (in.end - in.p < 2) {
+        in.ok = false;
+        return 0;
+    }
+    memcpy(&value, in.p, 2);
+    in.p += 2;
+    return value;
+}
+
+static uint32_t p9GetU32(P9Reader &in) {
+    uint32_t value = 0;
+    if (in.end - in.p < 4) {
+        in.ok = false;
+        return 0;
+    }
+    memcpy(&value, in.p, 4);
+    in.p += 4;
+    return value;
+}
+
+static uint64_t p9GetU64(P9Reader &in) {
+    uint64_t value = 0;
+    if (in.end - in.p < 8) {
+        in.ok = false;
+        return 0;
+    }
+    memcpy(&value, in.p, 8);
+    in.p += 8;
+    return value;
+}
+
+/**
+ * Read a string field into a NUL terminated buffer.
+ * @param in The message reader.
+ * @param buffer The destination buffer.
+ * @param capacity The size of the buffer including the terminator.
+ * @return false if the field is truncated or does not fit.
+ */
+static bool p9GetString(P9Reader &in, char *buffer, size_t capacity) {
+    uint16_t len = p9GetU16(in);
+    if (!in.ok || in.end - in.p < len || len >= capacity) {
+        in.ok = false;
+        buffer[0] = 0;
+        return false;
+    }
+    memcpy(buffer, in.p, len);
+    buffer[len] = 0;
+    in.p += len;
+    return true;
+}
+
+static void p9PutU8(P9Writer &out, uint8_t value) {
+    if (out.end - out.p < 1) {
+        out.ok = false;
+        return;
+    }
+    *out.p++ = value;
+}
+
+static void p9PutU16(P9Writer &out, uint16_t value) {
+    if (out.end - out.p < 2) {
+        out.ok = false;
+        return;
+    }
+    memcpy(out.p, &value, 2);
+    out.p += 2;
+}
+
+static void p9PutU32(P9Writer &out, uint32_t value) {
+    if (out.end - out.p < 4) {
+        out.ok = false;
+        return;
+    }
+    memcpy(out.p, &value, 4);
+    out.p += 4;
+}
+
+static void p9PutU64(P9Writer &out, uint64_t value) {
+    if (out.end - out.p < 8) {
+        out.ok = false;
+        return;
+    }
+    memcpy(out.p, &value, 8);
+    out.p += 8;
+}
+
+static void p9PutString(P9Writer &out, const char *value) {
+    size_t len = strlen(value);
+    if (len > 0xffff || (size_t)(out.end - out.p) < 2 + len) {
+        out.ok = false;
+        return;
+    }
+    p9PutU16(out, len);
+    memcpy(out.p, value, len);
+    out.p += len;
+}
+
+static void p9PutQid(P9Writer &out, uint8_t type, uint64_t path) {
+    p9PutU8(out, type);
+    p9PutU32(out, 0);  // version
+    p9PutU64(out, path);
+}
+
+/**
+ * Check that a name refers to a single new directory entry.
+ * @param name The name to check.
+ * @return true if the name can be created in a directory.
+ */
+static bool p9ValidName(const char *name) {
+    return name[0] && !strchr(name, '/') && strcmp(name, ".") && strcmp(name, "..");
+}
+
+/**
+ * Construct a new virtio-9p device.
+ * @param bus The bus the virtqueues and buffers are accessed through.
+ * @param plic The interrupt controller.
+ * @param root The host directory to share.
+ * @param tag The mount tag the guest uses to find the share.
+ * @param irq The PLIC interrupt source of the device.
+ * @param base The base address of the device.
+ * @param size The size of the device.
+ */
+Virtio9p::Virtio9p(Bus *bus, Plic *plic, const char *root, const char *tag, uint32_t irq, uint32_t base, size_t size)
+    : VirtioMmio(bus, plic, VIRTIO_ID_9P, 1, irq, base, size) {
+    this->tag = tag;
+    root_fd = open(root, O_PATH | O_DIRECTORY | O_CLOEXEC);
+    struct stat st;
+    if (root_fd < 0 || fstat(root_fd, &st) < 0) {
+        fprintf(stderr, "Error: Could not open shared directory %s\n", root);
+        exit(1);
+    }
+    root_dev = st.st_dev;
+    root_ino = st.st_ino;
+    msize = P9_MAX_MSIZE;
+    fids.resize(64);
+    request = new uint8_t[P9_MAX_MSIZE];
+    response = new uint8_t[P9_MAX_MSIZE];
+}
+
+/**
+ * Destroy the device and close all host files.
+ */
+Virtio9p::~Virtio9p() {
+    releaseAllFids();
+    close(root_fd);
+    delete[] request;
+    delete[] response;
+}
+
+/**
+ * Get the features offered by the device.
+ * @return The feature bits.
+ */
+uint64_t Virtio9p::getFeatures() {
+    return VIRTIO_F_VERSION_1 | VIRTIO_9P_MOUNT_TAG;
+}
+
+/**
+ * Read a byte of the configuration, the length prefixed mount tag.
+ * @param offset The offset into the configuration space.
+ * @return The byte read.
+ */
+uint8_t Virtio9p::readConfig(uint32_t offset) {
+    if (offset == 0) return tag.size() & 0xff;
+    if (offset == 1) return tag.size() >> 8;
+    if (offset - 2 < tag.size()) return tag[offset - 2];
+    return 0;
+}
+
+/**
+ * Forget all fids when the driver resets the device.
+ */
+void Virtio9p::resetDevice() {
+    releaseAllFids();
+}
+
+/**
+ * Handle a 9P request.
+ * @param queue The queue the request was taken from.
+ * @param chain The request and response buffers.
+ * @return The size of the response.
+ */
+uint32_t Virtio9p::handleChain(uint32_t queue, VirtioChain &chain) {
+    uint8_t header[7];
+    if (chainRead(chain.out, 0, header, 7) < 7) return 0;
+    uint32_t size;
+    uint16_t tag;
+    memcpy(&size, header, 4);
+    memcpy(&tag, header + 5, 2);
+    uint8_t type = header[4];
+
+    if (type == P9_TREAD) return handleRead(chain, tag);
+    if (type == P9_TWRITE) return handleWrite(chain, tag);
+
+    size_t len = size;
+    if (len > chain.out_len) len = chain.out_len;
+    if (len > P9_MAX_MSIZE) len = P9_MAX_MSIZE;
+    chainRead(chain.out, 0, request, len);
+
+    size_t capacity = (chain.in_len < msize) ? chain.in_len : msize;
+    if (capacity < 7) return 0;
+    P9Reader in = {request + 7, request + len, true};
+    P9Writer out = {response + 7, response + capacity, true};
+    int error = dispatch(type, in, out);
+    if (!error && !in.ok) error = EPROTO;
+    if (!error && !out.ok) error = ENOBUFS;
+    return finish(chain, type, tag, error, out.p - (response + 7));
+}
+
+/**
+ * Write the response header, or an Rlerror, and copy the response to the guest.
+ * @param chain The request and response buffers.
+ * @param type The request type.
+ * @param tag The request tag.
+ * @param error The errno of the request, 0 on success.
+ * @param body_size The size of the response body already in the response buffer.
+ * @return The size of the response.
+ */
+uint32_t Virtio9p::finish(VirtioChain &chain, uint8_t type, uint16_t tag, int error, size_t body_size) {
+    uint32_t size = 7 + body_size;
+    if (error) {
+        size = 11;
+        type = P9_RLERROR;
+        memcpy(response + 7, &error, 4);
+    } else {
+        type++;
+    }
+    memcpy(response, &size, 4);
+    response[4] = type;
+    memcpy(response + 5, &tag, 2);
+    return chainWrite(chain.in, 0, response, size);
+}
+
+/**
+ * Handle Tread, the payload goes straight from the host file into the guest buffers.
+ * @param chain The request and response buffers.
+ * @param tag The request tag.
+ * @return The size of the response.
+ */
+uint32_t Virtio9p::handleRead(VirtioChain &chain, uint16_t tag) {
+    uint8_t header[P9_WRITE_HDR_SIZE];
+    size_t len = chainRead(chain.out, 0, header, P9_WRITE_HDR_SIZE);
+    P9Reader in = {header + 7, header + len, true};
+    uint32_t fid_num = p9GetU32(in);
+    uint64_t offset = p9GetU64(in);
+    uint32_t count = p9GetU32(in);
+    if (!in.ok || chain.in_len < P9_IOHDR_SIZE) return finish(chain, P9_TREAD, tag, EPROTO, 0);
+
+    P9Fid *fid = getFid(fid_num);
+    if (fid == NULL || fid->fd < 0) return finish(chain, P9_TREAD, tag, EBADF, 0);
+
+    if (count > msize - P9_IOHDR_SIZE) count = msize - P9_IOHDR_SIZE;
+    if (count > chain.in_len - P9_IOHDR_SIZE) count = chain.in_len - P9_IOHDR_SIZE;
+
+    iovec slices[P9_MAX_SLICES];
+    int num_slices = chainSlice(chain.in, P9_IOHDR_SIZE, count, slices, P9_MAX_SLICES);
+    ssize_t done = preadv(fid->fd, slices, num_slices, offset);
+    if (done < 0) return finish(chain, P9_TREAD, tag, errno, 0);
+
+    uint8_t reply[P9_IOHDR_SIZE];
+    uint32_t size = P9_IOHDR_SIZE + done;
+    uint32_t done32 = done;
+    memcpy(reply, &size, 4);
+    reply[4] = P9_TREAD + 1;
+    memcpy(reply + 5, &tag, 2);
+    memcpy(reply + 7, &done32, 4);
+    chainWrite(chain.in, 0, reply, P9_IOHDR_SIZE);
+    return size;
+}
+
+/**
+ * Handle Twrite, the payload goes straight from the guest buffers into the host file.
+ * @param chain The request and response buffers.
+ * @param tag The request tag.
+ * @return The size of the response.
+ */
+uint32_t Virtio9p::handleWrite(VirtioChain &chain, uint16_t tag) {
+    uint8_t header[P9_WRITE_HDR_SIZE];
+    size_t len = chainRead(chain.out, 0, header, P9_WRITE_HDR_SIZE);
+    P9Reader in = {header + 7, header + len, true};
+    uint32_t fid_num = p9GetU32(in);
+    uint64_t offset = p9GetU64(in);
+    uint32_t count = p9GetU32(in);
+    if (!in.ok || chain.in_len < 11) return finish(chain, P9_TWRITE, tag, EPROTO, 0);
+
+    P9Fid *fid = getFid(fid_num);
+    if (fid == NULL || fid->fd < 0) return finish(chain, P9_TWRITE, tag, EBADF, 0);
+
+    if (count > chain.out_len - P9_WRITE_HDR_SIZE) count = chain.out_len - P9_WRITE_HDR_SIZE;
+
+    iovec slices[P9_MAX_SLICES];
+    int num_slices = chainSlice(chain.out, P9_WRITE_HDR_SIZE, count, slices, P9_MAX_SLICES);
+    ssize_t done = pwritev(fid->fd, slices, num_slices, offset);
+    if (done < 0) return finish(chain, P9_TWRITE, tag, errno, 0);
+
+    uint32_t done32 = done;
+    memcpy(response + 7, &done32, 4);
+    return finish(chain, P9_TWRITE, tag, 0, 4);
+}
+
+/**
+ * Dispatch a request that is fully contained in the request buffer.
+ * @param type The request type.
+ * @param in The request body.
+ * @param out The response body.
+ * @return The errno of the request, 0 on success.
+ */
+int Virtio9p::dispatch(uint8_t type, P9Reader &in, P9Writer &out) {
+    switch (type) {
+        case P9_TVERSION:
+            return version(in, out);
+        case P9_TATTACH:
+            return attach(in, out);
+        case P9_TWALK:
+            return walk(in, out);
+        case P9_TGETATTR:
+            return getattr(in, out);
+        case P9_TSETATTR:
+            return setattr(in, out);
+        case P9_TLOPEN:
+            return lopen(in, out);
+        case P9_TLCREATE:
+            return lcreate(in, out);
+        case P9_TREADDIR:
+            return readdir(in, out);
+        case P9_TSTATFS:
+            return statfs(in, out);
+        case P9_TMKDIR:
+            return mkdir(in, out);
+        case P9_TSYMLINK:
+            return symlink(in, out);
+        case P9_TMKNOD:
+            return mknod(in, out);
+        case P9_TREADLINK:
+            return readlink(in, out);
+        case P9_TLINK:
+            return link(in, out);
+        case P9_TRENAMEAT:
+            return renameat(in, out);
+        case P9_TUNLINKAT:
+            return unlinkat(in, out);
+        case P9_TFSYNC:
+            return fsync(in, out);
+        case P9_TLOCK:
+            return lock(in, out);
+        case P9_TGETLOCK:
+            return getlock(in, out);
+        case P9_TCLUNK:
+            return clunk(in, out);
+        case P9_TREMOVE:
+            clunk(in, out);
+            return EOPNOTSUPP;  // Linux falls back to Tunlinkat
+        case P9_TFLUSH:
+            return 0;  // Requests complete synchronously, nothing to flush
+        default:
+            return EOPNOTSUPP;  // Tauth, Trename, xattrs
+    }
+}
+
+/**
+ * Tversion: negotiate the message size and protocol, resets the session.
+ */
+int Virtio9p::version(P9Reader &in, P9Writer &out) {
+    char name[32];
+    uint32_t requested = p9GetU32(in);
+    p9GetString(in, name, sizeof(name));
+    if (!in.ok) return EPROTO;
+
+    releaseAllFids();
+    msize = (requested < P9_MAX_MSIZE) ? requested : P9_MAX_MSIZE;
+    if (msize < 4096) msize = 4096;
+    p9PutU32(out, msize);
+    p9PutString(out, strcmp(name, "9P2000.L") ? "unknown" : "9P2000.L");
+    return 0;
+}
+
+/**
+ * Tattach: bind a fid to the shared directory.
+ */
+int Virtio9p::attach(P9Reader &in, P9Writer &out) {
+    uint32_t fid_num = p9GetU32(in);
+    if (!in.ok) return EPROTO;
+    if (getFid(fid_num)) return EEXIST;
+
+    P9Fid *fid = newFid(fid_num);
+    if (fid == NULL) return ENFILE;
+    fid->path_fd = fcntl(root_fd, F_DUPFD_CLOEXEC, 0);
+    if (fid->path_fd < 0) {
+        int error = errno;
+        releaseFid(fid);
+        return error;
+    }
+    return statQid(fid->path_fd, "", out);
+}
+
+/**
+ * Twalk: walk a fid by a sequence of names, never leaving the shared directory.
+ */
+int Virtio9p::walk(P9Reader &in, P9Writer &out) {
+    uint32_t fid_num = p9GetU32(in);
+    uint32_t newfid_num = p9GetU32(in);
+    uint16_t nwname = p9GetU16(in);
+    if (!in.ok) return EPROTO;
+
+    P9Fid *fid = getFid(fid_num);
+    if (fid == NULL) return EBADF;
+    if (newfid_num != fid_num && getFid(newfid_num)) return EEXIST;
+
+    uint8_t *count_field = out.p;
+    p9PutU16(out, 0);
+
+    int cur = fid->path_fd;
+    int error = 0;
+    uint16_t walked = 0;
+    for (; walked < nwname; walked++) {
+        char name[NAME_MAX + 1];
+        if (!p9GetString(in, name, sizeof(name))) {
+            error = EPROTO;
+            break;
+        }
+
+        int next;
+        struct stat st;
+        if (strcmp(name, "..") == 0) {
+            if (fstat(cur, &st) == 0 && st.st_dev == root_dev && st.st_ino == root_ino)
+                next = fcntl(cur, F_DUPFD_CLOEXEC, 0);
+            else
+                next = openat(cur, "..", O_PATH | O_CLOEXEC);
+        } else if (strcmp(name, ".") == 0) {
+            next = fcntl(cur, F_DUPFD_CLOEXEC, 0);
+        } else if (strchr(name, '/') || !name[0]) {
+            next = -1;
+            errno = ENOENT;
+        } else {
+            next = openat(cur, name, O_PATH | O_NOFOLLOW | O_CLOEXEC);
+        }
+        if (next < 0) {
+            error = errno;
+            break;
+        }
+        if (cur != fid->path_fd) close(cur);
+        cur = next;
+        statQid(cur, "", out);
+    }
+
+    if (walked == 0 && nwname > 0) return error;
+    memcpy(count_field, &walked, 2);
+    if (walked < nwname) {  // Partial walk, newfid stays unused
+        if (cur != fid->path_fd) close(cur);
+        return 0;
+    }
+
+    if (nwname == 0) cur = fcntl(fid->path_fd, F_DUPFD_CLOEXEC, 0);
+    if (cur < 0) return errno;
+    if (newfid_num == fid_num) {
+        if (fid->fd >= 0) {
+            close(cur);
+            return EBUSY;
+        }
+        close(fid->path_fd);
+        fid->path_fd = cur;
+    } else {
+        P9Fid *newfid = newFid(newfid_num);
+        if (newfid == NULL) {
+            close(cur);
+            return ENFILE;
+        }
+        newfid->path_fd = cur;
+    }
+    return 0;
+}
+
+/**
+ * Tgetattr: stat the file of a fid.
+ */
+int Virtio9p::getattr(P9Reader &in, P9Writer &out) {
+    uint32_t fid_num = p9GetU32(in);
+    if (!in.ok) return EPROTO;
+    P9Fid *fid = getFid(fid_num);
+    if (fid == NULL) return EBADF;
+
+    struct stat st;
+    p9PutU64(out, P9_GETATTR_BASIC);
+    int error = statQid(fid->path_fd, "", out, &st);
+    if (error) return error;
+    p9PutU32(out, st.st_mode);
+    p9PutU32(out, st.st_uid);
+    p9PutU32(out, st.st_gid);
+    p9PutU64(out, st.st_nlink);
+    p9PutU64(out, st.st_rdev);
+    p9PutU64(out, st.st_size);
+    p9PutU64(out, st.st_blksize);
+    p9PutU64(out, st.st_blocks);
+    p9PutU64(out, st.st_atim.tv_sec);
+    p9PutU64(out, st.st_atim.tv_nsec);
+    p9PutU64(out, st.st_mtim.tv_sec);
+    p9PutU64(out, st.st_mtim.tv_nsec);
+    p9PutU64(out, st.st_ctim.tv_sec);
+    p9PutU64(out, st.st_ctim.tv_nsec);
+    p9PutU64(out, 0);  // btime
+    p9PutU64(out, 0);
+    p9PutU64(out, 0);  // gen
+    p9PutU64(out, 0);  // data_version
+    return 0;
+}
+
+/**
+ * Tsetattr: change mode, owner, size or timestamps.
+ */
+int Virtio9p::setattr(P9Reader &in, P9Writer &out) {
+    uint32_t fid_num = p9GetU32(in);
+    uint32_t valid = p9GetU32(in);
+    uint32_t mode = p9GetU32(in);
+    uint32_t uid = p9GetU32(in);
+    uint32_t gid = p9GetU32(in);
+    uint64_t size = p9GetU64(in);
+    uint64_t atime_sec = p9GetU64(in);
+    uint64_t atime_nsec = p9GetU64(in);
+    uint64_t mtime_sec = p9GetU64(in);
+    uint64_t mtime_nsec = p9GetU64(in);
+    if (!in.ok) return EPROTO;
+    P9Fid *fid = getFid(fid_num);
+    if (fid == NULL) return EBADF;
+
+    char path[P9_PROC_PATH_SIZE];
+    procPath(fid->path_fd, path);
+
+    if ((valid & P9_SETATTR_MODE) && chmod(path, mode & 07777) < 0) return errno;
+    if (valid & (P9_SETATTR_UID | P9_SETATTR_GID)) {
+        uid_t new_uid = (valid & P9_SETATTR_UID) ? uid : (uid_t)-1;
+        gid_t new_gid = (valid & P9_SETATTR_GID) ? gid : (gid_t)-1;
+        if (fchownat(fid->path_fd, "", new_uid, new_gid, AT_EMPTY_PATH | AT_SYMLINK_NOFOLLOW) < 0) return errno;
+    }
+    if ((valid & P9_SETATTR_SIZE) && truncate(path, size) < 0) return errno;
+    if (valid & (P9_SETATTR_ATIME | P9_SETATTR_MTIME)) {
+        struct timespec times[2];
+        times[0].tv_sec = atime_sec;
+        times[0].tv_nsec = (valid & P9_SETATTR_ATIME) ? ((valid & P9_SETATTR_ATIME_SET) ? atime_nsec : UTIME_NOW) : UTIME_OMIT;
+        times[1].tv_sec = mtime_sec;
+        times[1].tv_nsec = (valid & P9_SETATTR_MTIME) ? ((valid & P9_SETATTR_MTIME_SET) ? mtime_nsec : UTIME_NOW) : UTIME_OMIT;
+        if (utimensat(AT_FDCWD, path, times, 0) < 0) return errno;
+    }
+    return 0;
+}
+
+/**
+ * Tlopen: open the file of a fid for I/O.
+ */
+int Virtio9p::lopen(P9Reader &in, P9Writer &out) {
+    uint32_t fid_num = p9GetU32(in);
+    uint32_t flags = p9GetU32(in);
+    if (!in.ok) return EPROTO;
+    P9Fid *fid = getFid(fid_num);
+    if (fid == NULL) return EBADF;
+    if (fid->fd >= 0) return EBUSY;
+
+    char path[P9_PROC_PATH_SIZE];
+    procPath(fid->path_fd, path);
+    int fd = open(path, (flags & P9_OPEN_FLAGS) | O_CLOEXEC);
+    if (fd < 0) return errno;
+    fid->fd = fd;
+
+    int error = statQid(fid->path_fd, "", out);
+    p9PutU32(out, msize - P9_IOHDR_SIZE);  // iounit
+    return error;
+}
+
+/**
+ * Tlcreate: create and open a file, the fid moves from the directory to the file.
+ */
+int Virtio9p::lcreate(P9Reader &in, P9Writer &out) {
+    char name[NAME_MAX + 1];
+    uint32_t fid_num = p9GetU32(in);
+    p9GetString(in, name, sizeof(name));
+    uint32_t flags = p9GetU32(in);
+    uint32_t mode = p9GetU32(in);
+    if (!in.ok) return EPROTO;
+    P9Fid *fid = getFid(fid_num);
+    if (fid == NULL) return EBADF;
+    if (fid->fd >= 0) return EBUSY;
+    if (!p9ValidName(name)) return EINVAL;
+
+    int fd = openat(fid->path_fd, name, (flags & (P9_OPEN_FLAGS | O_EXCL)) | O_CREAT | O_NOFOLLOW | O_CLOEXEC, mode & 07777);
+    if (fd < 0) return errno;
+    int path_fd = openat(fid->path_fd, name, O_PATH | O_NOFOLLOW | O_CLOEXEC);
+    if (path_fd < 0) {
+        int error = errno;
+        close(fd);
+        return error;
+    }
+
+    close(fid->path_fd);
+    fid->path_fd = path_fd;
+    fid->fd = fd;
+    int error = statQid(path_fd, "", out);
+    p9PutU32(out, msize - P9_IOHDR_SIZE);
+    return error;
+}
+
+/**
+ * Treaddir: read directory entries, offsets are telldir cookies.
+ */
+int Virtio9p::readdir(P9Reader &in, P9Writer &out) {
+    uint32_t fid_num = p9GetU32(in);
+    uint64_t offset = p9GetU64(in);
+    uint32_t count = p9GetU32(in);
+    if (!in.ok) return EPROTO;
+    P9Fid *fid = getFid(fid_num);
+    if (fid == NULL || fid->fd < 0) return EBADF;
+
+    if (fid->dir == NULL) {
+        int fd = fcntl(fid->fd, F_DUPFD_CLOEXEC, 0);
+        if (fd < 0) return errno;
+        fid->dir = fdopendir(fd);
+        if (fid->dir == NULL) {
+            int error = errno;
+            close(fd);
+            return error;
+        }
+    }
+    if (offset == 0)
+        rewinddir(fid->dir);
+    else
+        seekdir(fid->dir, offset);
+
+    uint8_t *count_field = out.p;
+    p9PutU32(out, 0);
+    if (!out.ok) return ENOBUFS;
+    uint8_t *data = out.p;
+    if ((size_t)(out.end - out.p) > count) out.end = out.p + count;
+
+    while (true) {
+        long pos = telldir(fid->dir);
+        struct dirent *entry = ::readdir(fid->dir);
+        if (entry == NULL) break;
+
+        uint8_t *entry_start = out.p;
+        uint8_t qid_type = (entry->d_type == DT_DIR) ? P9_QTDIR : (entry->d_type == DT_LNK) ? P9_QTSYMLINK : P9_QTFILE;
+        p9PutQid(out, qid_type, entry->d_ino);
+        p9PutU64(out, telldir(fid->dir));
+        p9PutU8(out, entry->d_type);
+        p9PutString(out, entry->d_name);
+        if (!out.ok) {  // Entry does not fit, return it with the next request
+            out.p = entry_start;
+            out.ok = true;
+            seekdir(fid->dir, pos);
+            break;
+        }
+    }
+
+    uint32_t size = out.p - data;
+    memcpy(count_field, &size, 4);
+    return 0;
+}
+
+/**
+ * Tstatfs: report file system statistics.
+ */
+int Virtio9p::statfs(P9Reader &in, P9Writer &out) {
+    uint32_t fid_num = p9GetU32(in);
+    if (!in.ok) return EPROTO;
+    P9Fid *fid = getFid(fid_num);
+    if (fid == NULL) return EBADF;
+
+    struct statfs st;
+    if (fstatfs(fid->path_fd, &st) < 0) return errno;
+    uint64_t fsid;
+    memcpy(&fsid, &st.f_fsid, sizeof(fsid));
+    p9PutU32(out, st.f_type);
+    p9PutU32(out, st.f_bsize);
+    p9PutU64(out, st.f_blocks);
+    p9PutU64(out, st.f_bfree);
+    p9PutU64(out, st.f_bavail);
+    p9PutU64(out, st.f_files);
+    p9PutU64(out, st.f_ffree);
+    p9PutU64(out, fsid);
+    p9PutU32(out, st.f_namelen);
+    return 0;
+}
+
+/**
+ * Tmkdir: create a directory.
+ */
+int Virtio9p::mkdir(P9Reader &in, P9Writer &out) {
+    char name[NAME_MAX + 1];
+    uint32_t fid_num = p9GetU32(in);
+    p9GetString(in, name, sizeof(name));
+    uint32_t mode = p9GetU32(in);
+    if (!in.ok) return EPROTO;
+    P9Fid *fid = getFid(fid_num);
+    if (fid == NULL) return EBADF;
+    if (!p9ValidName(name)) return EINVAL;
+
+    if (mkdirat(fid->path_fd, name, mode & 07777) < 0) return errno;
+    return statQid(fid->path_fd, name, out);
+}
+
+/**
+ * Tsymlink: create a symbolic link.
+ */
+int Virtio9p::symlink(P9Reader &in, P9Writer &out) {
+    char name[NAME_MAX + 1];
+    char target[PATH_MAX];
+    uint32_t fid_num = p9GetU32(in);
+    p9GetString(in, name, sizeof(name));
+    p9GetString(in, target, sizeof(target));
+    if (!in.ok) return EPROTO;
+    P9Fid *fid = getFid(fid_num);
+    if (fid == NULL) return EBADF;
+    if (!p9ValidName(name)) return EINVAL;
+
+    if (symlinkat(target, fid->path_fd, name) < 0) return errno;
+    return statQid(fid->path_fd, name, out);
+}
+
+/**
+ * Tmknod: create a device node, fifo or socket.
+ */
+int Virtio9p::mknod(P9Reader &in, P9Writer &out) {
+    char name[NAME_MAX + 1];
+    uint32_t fid_num = p9GetU32(in);
+    p9GetString(in, name, sizeof(name));
+    uint32_t mode = p9GetU32(in);
+    uint32_t major = p9GetU32(in);
+    uint32_t minor = p9GetU32(in);
+    if (!in.ok) return EPROTO;
+    P9Fid *fid = getFid(fid_num);
+    if (fid == NULL) return EBADF;
+    if (!p9ValidName(name)) return EINVAL;
+
+    if (mknodat(fid->path_fd, name, mode, makedev(major, minor)) < 0) return errno;
+    return statQid(fid->path_fd, name, out);
+}
+
+/**
+ * Treadlink: read the target of a symbolic link.
+ */
+int Virtio9p::readlink(P9Reader &in, P9Writer &out) {
+    uint32_t fid_num = p9GetU32(in);
+    if (!in.ok) return EPROTO;
+    P9Fid *fid = getFid(fid_num);
+    if (fid == NULL) return EBADF;
+
+    char target[PATH_MAX];
+    ssize_t len = readlinkat(fid->path_fd, "", target, sizeof(target) - 1);
+    if (len < 0) return errno;
+    target[len] = 0;
+    p9PutString(out, target);
+    return 0;
+}
+
+/**
+ * Tlink: create a hard link to the file of a fid.
+ */
+int Virtio9p::link(P9Reader &in, P9Writer &out) {
+    char name[NAME_MAX + 1];
+    uint32_t dfid_num = p9GetU32(in);
+    uint32_t fid_num = p9GetU32(in);
+    p9GetString(in, name, sizeof(name));
+    if (!in.ok) return EPROTO;
+    P9Fid *dfid = getFid(dfid_num);
+    P9Fid *fid = getFid(fid_num);
+    if (dfid == NULL || fid == NULL) return EBADF;
+    if (!p9ValidName(name)) return EINVAL;
+
+    char path[P9_PROC_PATH_SIZE];
+    procPath(fid->path_fd, path);
+    if (linkat(AT_FDCWD, path, dfid->path_fd, name, AT_SYMLINK_FOLLOW) < 0) return errno;
+    return 0;
+}
+
+/**
+ * Trenameat: rename a directory entry.
+ */
+int Virtio9p::renameat(P9Reader &in, P9Writer &out) {
+    char old_name[NAME_MAX + 1];
+    char new_name[NAME_MAX + 1];
+    uint32_t old_fid_num = p9GetU32(in);
+    p9GetString(in, old_name, sizeof(old_name));
+    uint32_t new_fid_num = p9GetU32(in);
+    p9GetString(in, new_name, sizeof(new_name));
+    if (!in.ok) return EPROTO;
+    P9Fid *old_fid = getFid(old_fid_num);
+    P9Fid *new_fid = getFid(new_fid_num);
+    if (old_fid == NULL || new_fid == NULL) return EBADF;
+    if (!p9ValidName(old_name) || !p9ValidName(new_name)) return EINVAL;
+
+    if (::renameat(old_fid->path_fd, old_name, new_fid->path_fd, new_name) < 0) return errno;
+    return 0;
+}
+
+/**
+ * Tunlinkat: remove a directory entry.
+ */
+int Virtio9p::unlinkat(P9Reader &in, P9Writer &out) {
+    char name[NAME_MAX + 1];
+    uint32_t fid_num = p9GetU32(in);
+    p9GetString(in, name, sizeof(name));
+    uint32_t flags = p9GetU32(in);
+    if (!in.ok) return EPROTO;
+    P9Fid *fid = getFid(fid_num);
+    if (fid == NULL) return EBADF;
+    if (!p9ValidName(name)) return EINVAL;
+
+    if (::unlinkat(fid->path_fd, name, (flags & P9_AT_REMOVEDIR) ? AT_REMOVEDIR : 0) < 0) return errno;
+    return 0;
+}
+
+/**
+ * Tfsync: flush an open file to the host disk.
+ */
+int Virtio9p::fsync(P9Reader &in, P9Writer &out) {
+    uint32_t fid_num = p9GetU32(in);
+    uint32_t datasync = p9GetU32(in);
+    if (!in.ok) return EPROTO;
+    P9Fid *fid = getFid(fid_num);
+    if (fid == NULL || fid->fd < 0) return EBADF;
+
+    if ((datasync ? fdatasync(fid->fd) : ::fsync(fid->fd)) < 0) return errno;
+    return 0;
+}
+
+/**
+ * Tlock: there is a single client, every lock succeeds.
+ */
+int Virtio9p::lock(P9Reader &in, P9Writer &out) {
+    p9PutU8(out, P9_LOCK_SUCCESS);
+    return 0;
+}
+
+/**
+ * Tgetlock: there is a single client, nothing is ever locked.
+ */
+int Virtio9p::getlock(P9Reader &in, P9Writer &out) {
+    char client_id[256];
+    p9GetU32(in);  // fid
+    p9GetU8(in);   // type
+    uint64_t start = p9GetU64(in);
+    uint64_t length = p9GetU64(in);
+    uint32_t proc_id = p9GetU32(in);
+    p9GetString(in, client_id, sizeof(client_id));
+    if (!in.ok) return EPROTO;
+
+    p9PutU8(out, P9_LOCK_TYPE_UNLCK);
+    p9PutU64(out, start);
+    p9PutU64(out, length);
+    p9PutU32(out, proc_id);
+    p9PutString(out, client_id);
+    return 0;
+}
+
+/**
+ * Tclunk: release a fid.
+ */
+int Virtio9p::clunk(P9Reader &in, P9Writer &out) {
+    uint32_t fid_num = p9GetU32(in);
+    if (!in.ok) return EPROTO;
+    P9Fid *fid = getFid(fid_num);
+    if (fid == NULL) return EBADF;
+    releaseFid(fid);
+    return 0;
+}
+
+/**
+ * Look up a fid.
+ * @param fid The fid number.
+ * @return The fid or NULL if it is not in use.
+ */
+P9Fid *Virtio9p::getFid(uint32_t fid) {
+    if (fid >= fids.size() || !fids[fid].used) return NULL;
+    return &fids[fid];
+}
+
+/**
+ * Allocate a fid. The table is indexed by fid number and only grows when the
+ * guest uses a number beyond its size, Linux hands them out densely from 0.
+ * @param fid The fid number.
+ * @return The fid or NULL if the number is out of range.
+ */
+P9Fid *Virtio9p::newFid(uint32_t fid) {
+    if (fid >= P9_MAX_FIDS) return NULL;
+    if (fid >= fids.size()) {
+        size_t size = fids.size() * 2;
+        while (size <= fid) size *= 2;
+        fids.resize(size);
+    }
+    P9Fid *entry = &fids[fid];
+    entry->used = true;
+    entry->path_fd = -1;
+    entry->fd = -1;
+    entry->dir = NULL;
+    return entry;
+}
+
+/**
+ * Release a fid and close its host descriptors.
+ * @param fid The fid.
+ */
+void Virtio9p::releaseFid(P9Fid *fid) {
+    if (fid->dir) closedir(fid->dir);
+    if (fid->fd >= 0) close(fid->fd);
+    if (fid->path_fd >= 0) close(fid->path_fd);
+    fid->used = false;
+    fid->dir = NULL;
+    fid->fd = -1;
+    fid->path_fd = -1;
+}
+
+/**
+ * Release all fids.
+ */
+void Virtio9p::releaseAllFids() {
+    for (auto& fid : fids) {
+        if (fid.used) releaseFid(&fid);
+    }
+}
+
+/**
+ * Stat a file and append its qid.
+ * @param fd The directory or, with an empty name, the file itself.
+ * @param name The name relative to fd or "".
+ * @param out The response body.
+ * @param st Optionally receives the stat result.
+ * @return The errno of the stat, 0 on success.
+ */
+int Virtio9p::statQid(int fd, const char *name, P9Writer &out, struct stat *st) {
+    struct stat local;
+    if (st == NULL) st = &local;
+    if (fstatat(fd, name, st, AT_EMPTY_PATH | AT_SYMLINK_NOFOLLOW) < 0) return errno;
+    uint8_t type = S_ISDIR(st->st_mode) ? P9_QTDIR : S_ISLNK(st->st_mode) ? P9_QTSYMLINK : P9_QTFILE;
+    p9PutQid(out, type, st->st_ino);
+    return 0;
+}
+
+/**
+ * Get a path that reopens an O_PATH descriptor.
+ * @param fd The descriptor.
+ * @param path Receives the path, P9_PROC_PATH_SIZE bytes.
+ */
+void Virtio9p::procPath(int fd, char *path) {
+    snprintf(path, P9_PROC_PATH_SIZE, "/proc/self/fd/%d", fd);
+}
@@ -0,0 +1,108 @@
+#ifndef VIRTIO_9P_H
+#define VIRTIO_9P_H
+
+#include <stdint.h>
+#include <stdio.h>
+#include <dirent.h>
+#include <sys/stat.h>
+#include <string>
+#include <vector>
+#include "virtio.h"
+
+#define VIRTIO_ID_9P 9
+#define VIRTIO_9P_MOUNT_TAG (1ULL << 0)
+
+#define P9_MAX_MSIZE (1024 * 1024)
+#define P9_MAX_FIDS (1 << 20)
+#define P9_NOFID 0xffffffff
+#define P9_IOHDR_SIZE 11  // size[4] type[1] tag[2] count[4]
+#define P9_WRITE_HDR_SIZE 23  // size[4] type[1] tag[2] fid[4] offset[8] count[4]
+#define P9_PROC_PATH_SIZE 32
+#define P9_MAX_SLICES 1024
+
+typedef struct {
+    bool used;
+    int path_fd;  // O_PATH descriptor naming the file
+    int fd;       // Opened by Tlopen/Tlcreate, -1 otherwise
+    DIR *dir;     // Directory stream for Treaddir
+} P9Fid;
+
+/**
+ * Reader for the little endian fields of a 9P message.
+ */
+typedef struct {
+    const uint8_t *p;
+    const uint8_t *end;
+    bool ok;
+} P9Reader;
+
+/**
+ * Writer for the little endian fields of a 9P message.
+ */
+typedef struct {
+    uint8_t *p;
+    uint8_t *end;
+    bool ok;
+} P9Writer;
+
+/**
+ * virtio-9p device serving a host directory with the 9P2000.L protocol.
+ * Files are tracked by O_PATH descriptors, so fids never hold path strings,
+ * and read/write payloads move directly between the host file and guest RAM.
+ */
+class Virtio9p : public VirtioMmio {
+    public:
+        Virtio9p(Bus *bus, Plic *plic, const char *root, const char *tag, uint32_t irq = DEFAULT_VIRTIO_IRQ, uint32_t base = DEFAULT_VIRTIO_BASE, size_t size = DEFAULT_VIRTIO_SIZE);
+        ~Virtio9p();
+
+    protected:
+        uint64_t getFeatures();
+        uint8_t readConfig(uint32_t offset);
+        uint32_t handleChain(uint32_t queue, VirtioChain &chain);
+        void resetDevice();
+
+    private:
+        int dispatch(uint8_t type, P9Reader &in, P9Writer &out);
+        uint32_t handleRead(VirtioChain &chain, uint16_t tag);
+        uint32_t handleWrite(VirtioChain &chain, uint16_t tag);
+        uint32_t finish(VirtioChain &chain, uint8_t type, uint16_t tag, int error, size_t body_size);
+
+        int version(P9Reader &in, P9Writer &out);
+        int attach(P9Reader &in, P9Writer &out);
+        int walk(P9Reader &in, P9Writer &out);
+        int getattr(P9Reader &in, P9Writer &out);
+        int setattr(P9Reader &in, P9Writer &out);
+        int lopen(P9Reader &in, P9Writer &out);
+        int lcreate(P9Reader &in, P9Writer &out);
+        int readdir(P9Reader &in, P9Writer &out);
+        int statfs(P9Reader &in, P9Writer &out);
+        int mkdir(P9Reader &in, P9Writer &out);
+        int symlink(P9Reader &in, P9Writer &out);
+        int mknod(P9Reader &in, P9Writer &out);
+        int readlink(P9Reader &in, P9Writer &out);
+        int link(P9Reader &in, P9Writer &out);
+        int renameat(P9Reader &in, P9Writer &out);
+        int unlinkat(P9Reader &in, P9Writer &out);
+        int fsync(P9Reader &in, P9Writer &out);
+        int lock(P9Reader &in, P9Writer &out);
+        int getlock(P9Reader &in, P9Writer &out);
+        int clunk(P9Reader &in, P9Writer &out);
+
+        P9Fid *getFid(uint32_t fid);
+        P9Fid *newFid(uint32_t fid);
+        void releaseFid(P9Fid *fid);
+        void releaseAllFids();
+        int statQid(int fd, const char *name, P9Writer &out, struct stat *st = NULL);
+        void procPath(int fd, char *path);
+
+        std::string tag;
+        int root_fd;
+        dev_t root_dev;
+        ino_t root_ino;
+        uint32_t msize;
+        std::vector<P9Fid> fids;
+        uint8_t *request;
+        uint8_t *response;
+};
+
+#endif
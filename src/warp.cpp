@@ -0,0 +1,52 @@
+#include "cpu.h"
+
+/**
+ * Time warp (--warp). Guest time normally follows the host clock, so a guest
+ * waiting for a timer sleeps in WFI or spins on mtime or a device register.
+ * With warp the time passed to each batch is stretched instead: a hart in WFI
+ * jumps straight to its mtimecmp deadline, however far ahead, and with the
+ * timer disarmed it waits for an interrupt in real time. After a batch that polled (see
+ * PollDetector) time advances by a stride that doubles with every further
+ * polling batch, never beyond the deadline. Once the stride reaches its maximum
+ * the loop most likely waits for the host, and the batch also yields the CPU.
+ */
+
+/**
+ * Enable or disable the time warp.
+ * @param enabled true to skip idle and polling time.
+ */
+void Cpu::setWarp(bool enabled) {
+    warp = enabled;
+    warp_stride = WARP_MIN_STRIDE;
+    polls.take();
+    bus->setPollDetector(enabled ? &polls : NULL);
+}
+
+/**
+ * Get the guest time to pass to the next batch.
+ * @param elapsed_micros The host time elapsed since the previous batch.
+ * @return The guest time to add, at least elapsed_micros.
+ */
+uint32_t Cpu::warpTime(uint32_t elapsed_micros) {
+    uint64_t now = (((uint64_t)timer_h << 32) | timer_l) + elapsed_micros;
+    uint64_t deadline = ((uint64_t)timer_trigger_h << 32) | timer_trigger_l;
+    uint64_t until_deadline = (deadline > now) ? deadline - now : 0;  // 0 if there is no deadline ahead
+    uint32_t repeats = polls.take();
+
+    if (wfi_bit) {  // A disarmed timer (all ones) leaves the hart waiting for another interrupt
+        if (deadline == UINT64_MAX) return elapsed_micros;
+        if (until_deadline > UINT32_MAX - elapsed_micros) return UINT32_MAX;  // The rest is skipped by the next batch
+        return elapsed_micros + until_deadline;
+    }
+    if (repeats < WARP_POLL_READS) {
+        warp_stride = WARP_MIN_STRIDE;
+        return elapsed_micros;
+    }
+    uint32_t skip = warp_stride;
+    if (until_deadline && until_deadline < skip) skip = until_deadline;
+    if (warp_stride < WARP_MAX_STRIDE)
+        warp_stride *= 2;
+    else
+        usleep(WARP_IDLE_SLEEP);
+    return elapsed_micros + skip;
+}
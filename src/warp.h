@@ -0,0 +1,73 @@
+#ifndef WARP_H
+#define WARP_H
+
+#include <stdint.h>
+
+#define WARP_POLL_SLOTS 4        // Registers a polling loop may alternate between, like the halves of mtime
+#define WARP_POLL_READS 32       // Repeated reads within one batch that make a polling loop
+#define WARP_MIN_STRIDE 16       // Microseconds skipped for the first polling batch, doubled for each further one
+#define WARP_MAX_STRIDE 10000
+#define WARP_IDLE_SLEEP 500      // Microseconds slept per batch once a polling loop reached the maximum stride
+
+/**
+ * Detects polling loops for --warp: device registers (or the time CSR) that
+ * are read again and again with the same value while nothing is stored. The
+ * bus reports device reads and all stores, the CPU takes the count per batch.
+ */
+class PollDetector {
+    public:
+        PollDetector() {
+            take();
+        }
+
+        /**
+         * Record a read of a device register.
+         * @param key The device address, or a CSR number for CSR reads. No device lives in the first page.
+         * @param value The value read.
+         */
+        inline void read(uint32_t key, uint32_t value) {
+            for (int i = 0; i < WARP_POLL_SLOTS; i++) {
+                if (valid[i] && keys[i] == key) {
+                    if (values[i] == value) {
+                        repeats++;
+                    } else {  // The register changed, the guest made progress
+                        values[i] = value;
+                        repeats = 0;
+                    }
+                    return;
+                }
+            }
+            keys[next] = key;
+            values[next] = value;
+            valid[next] = true;
+            next = (next + 1) % WARP_POLL_SLOTS;
+        }
+
+        /**
+         * Record a store, a loop that stores is not just waiting.
+         */
+        inline void write() {
+            repeats = 0;
+        }
+
+        /**
+         * Get the repeated reads since the last call and start over.
+         * @return The number of reads that returned an unchanged value.
+         */
+        uint32_t take() {
+            uint32_t count = repeats;
+            for (int i = 0; i < WARP_POLL_SLOTS; i++) valid[i] = false;
+            next = 0;
+            repeats = 0;
+            return count;
+        }
+
+    private:
+        uint32_t keys[WARP_POLL_SLOTS];
+        uint32_t values[WARP_POLL_SLOTS];
+        bool valid[WARP_POLL_SLOTS];
+        int next;
+        uint32_t repeats;
+};
+
+#endif
@@ -0,0 +1,250 @@
+#ifndef YARVE_H
+#define YARVE_H
+
+#include <stddef.h>
+#include <stdint.h>
+
+/**
+ * C API of libyarve, for embedding the emulator in test harnesses and other
+ * programs. A machine is the default yarve machine (RAM, UART, CLINT, syscon,
+ * PLIC, an empty virtio slot and the framebuffer) without a host terminal, I/O
+ * thread, plugins, traces or checkpoints. All functions of one machine must be
+ * called from the same thread, except yarve_stop, yarve_set_irq and
+ * yarve_console_input, which may be called from one other thread while it runs.
+ * The API is stable: functions and fields are only ever added. Structs the
+ * caller allocates start with a struct_size member set to their sizeof, so the library
+ * knows which fields a caller built against an older yarve.h provides.
+ */
+
+#if defined(__GNUC__)
+#define YARVE_API __attribute__((visibility("default")))
+#else
+#define YARVE_API
+#endif
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+// Events that end yarve_run
+#define YARVE_EVENT_LIMIT 0     // The instruction budget is used up
+#define YARVE_EVENT_POWEROFF 1  // The guest powered the machine off
+#define YARVE_EVENT_RESET 2     // The guest requested a reset, see yarve_reset
+#define YARVE_EVENT_STOP 3      // yarve_stop was called
+#define YARVE_EVENT_IDLE 4      // The hart waits for an interrupt and nothing is pending
+
+// Register numbers of yarve_get_reg and yarve_set_reg, 0-31 are x0-x31
+#define YARVE_REG_PC 32
+
+typedef struct yarve_machine yarve_machine;
+
+/**
+ * Configuration of a new machine. Set struct_size, then initialize it with yarve_default_config.
+ */
+typedef struct {
+    size_t struct_size;  // sizeof(yarve_config)
+    uint32_t ram_base;
+    uint32_t ram_size;
+    uint32_t entry;     // Initial PC
+    uint32_t dtb_base;  // Passed in a1
+    int sbi;            // Boot in S-mode with the builtin SBI, like --sbi
+} yarve_config;
+
+/**
+ * A memory mapped device implemented by the embedder. Addresses passed to the
+ * callbacks are offsets from base. read returns the little endian word at the
+ * offset, the CPU extracts narrower loads from it. Both run on the CPU thread.
+ */
+typedef struct {
+    size_t struct_size;  // sizeof(yarve_device)
+    uint32_t base;
+    uint32_t size;
+    void *context;
+    uint32_t (*read)(void *context, uint32_t offset);
+    void (*write)(void *context, uint32_t offset, uint32_t data, uint8_t width);
+} yarve_device;
+
+/**
+ * Receives the bytes the guest writes to the UART, on the CPU thread.
+ */
+typedef void (*yarve_console_output)(void *context, uint8_t byte);
+
+/**
+ * Fill a configuration with the defaults of the yarve binary.
+ * @param config The configuration, its struct_size has to be set, nothing is written if it is too small.
+ */
+YARVE_API void yarve_default_config(yarve_config *config);
+
+/**
+ * Create a machine and reset its hart to the entry point.
+ * @param config The configuration or NULL for the defaults.
+ * @return The machine or NULL if the configuration or its struct_size is invalid.
+ */
+YARVE_API yarve_machine *yarve_create(const yarve_config *config);
+
+/**
+ * Destroy a machine.
+ * @param machine The machine.
+ */
+YARVE_API void yarve_destroy(yarve_machine *machine);
+
+/**
+ * Reset the hart, RAM and devices keep their contents.
+ * @param machine The machine.
+ * @param entry The PC to start at.
+ * @param dtb_base The address passed in a1.
+ */
+YARVE_API void yarve_reset(yarve_machine *machine, uint32_t entry, uint32_t dtb_base);
+
+/**
+ * Copy an image from a buffer into guest memory.
+ * @param machine The machine.
+ * @param data The image.
+ * @param len The size of the image.
+ * @param addr The guest physical load address.
+ * @return 0 on success, -1 if the range is not RAM.
+ */
+YARVE_API int yarve_load_image(yarve_machine *machine, const void *data, size_t len, uint32_t addr);
+
+/**
+ * Copy an image from a file into guest memory.
+ * @param machine The machine.
+ * @param filename The file.
+ * @param addr The guest physical load address.
+ * @return 0 on success, -1 if the file cannot be read or does not fit into RAM.
+ */
+YARVE_API int yarve_load_file(yarve_machine *machine, const char *filename, uint32_t addr);
+
+/**
+ * Run until an event occurs or a number of instructions retired. Events are
+ * checked between batches of up to 1024 instructions, so the guest can retire
+ * that many more after yarve_stop or a device callback requested a stop.
+ * @param machine The machine.
+ * @param max_instructions The instruction budget.
+ * @param executed Set to the number of retired instructions, may be NULL.
+ * @return One of the YARVE_EVENT_* codes.
+ */
+YARVE_API int yarve_run(yarve_machine *machine, uint64_t max_instructions, uint64_t *executed);
+
+/**
+ * Make the current or next yarve_run return YARVE_EVENT_STOP.
+ * @param machine The machine.
+ */
+YARVE_API void yarve_stop(yarve_machine *machine);
+
+/**
+ * Get the number of instructions retired since the last reset.
+ * @param machine The machine.
+ * @return The instruction count.
+ */
+YARVE_API uint64_t yarve_instruction_count(yarve_machine *machine);
+
+/**
+ * Read an integer register or the PC.
+ * @param machine The machine.
+ * @param reg 0-31 or YARVE_REG_PC.
+ * @return The value, 0 for invalid numbers.
+ */
+YARVE_API uint32_t yarve_get_reg(yarve_machine *machine, int reg);
+
+/**
+ * Write an integer register or the PC, writes to x0 and invalid numbers are ignored.
+ * @param machine The machine.
+ * @param reg 0-31 or YARVE_REG_PC.
+ * @param value The value.
+ */
+YARVE_API void yarve_set_reg(yarve_machine *machine, int reg, uint32_t value);
+
+/**
+ * Read a floating point register, single precision values are NaN-boxed.
+ * @param machine The machine.
+ * @param reg 0-31.
+ * @return The raw 64 bit value, 0 for invalid numbers.
+ */
+YARVE_API uint64_t yarve_get_freg(yarve_machine *machine, int reg);
+
+/**
+ * Write a floating point register.
+ * @param machine The machine.
+ * @param reg 0-31.
+ * @param value The raw 64 bit value.
+ */
+YARVE_API void yarve_set_freg(yarve_machine *machine, int reg, uint64_t value);
+
+/**
+ * Read the raw storage of a CSR, without privilege checks or side effects.
+ * Counters are not kept in this storage, use yarve_instruction_count.
+ * @param machine The machine.
+ * @param csr The CSR number.
+ * @return The value, 0 for invalid numbers.
+ */
+YARVE_API uint32_t yarve_get_csr(yarve_machine *machine, uint32_t csr);
+
+/**
+ * Write the raw storage of a CSR, without privilege checks or side effects.
+ * @param machine The machine.
+ * @param csr The CSR number.
+ * @param value The value.
+ */
+YARVE_API void yarve_set_csr(yarve_machine *machine, uint32_t csr, uint32_t value);
+
+/**
+ * Copy guest memory to a buffer.
+ * @param machine The machine.
+ * @param addr The guest physical address.
+ * @param buffer The destination.
+ * @param len The number of bytes.
+ * @return 0 on success, -1 if part of the range is not RAM.
+ */
+YARVE_API int yarve_read_memory(yarve_machine *machine, uint32_t addr, void *buffer, size_t len);
+
+/**
+ * Copy a buffer to guest memory.
+ * @param machine The machine.
+ * @param addr The guest physical address.
+ * @param buffer The source.
+ * @param len The number of bytes.
+ * @return 0 on success, -1 if part of the range is not RAM.
+ */
+YARVE_API int yarve_write_memory(yarve_machine *machine, uint32_t addr, const void *buffer, size_t len);
+
+/**
+ * Attach a device implemented by callbacks. The builtin devices win where
+ * ranges overlap, so pick a free range such as 0x20000000.
+ * @param machine The machine.
+ * @param device The device, copied.
+ * @return 0 on success, -1 if its struct_size is invalid, a callback is missing or the range is empty.
+ */
+YARVE_API int yarve_attach_device(yarve_machine *machine, const yarve_device *device);
+
+/**
+ * Set the level of a PLIC interrupt source, for example from a device callback.
+ * It is sampled at the start of the next batch.
+ * @param machine The machine.
+ * @param irq The source, 1-31.
+ * @param level 1 to raise, 0 to lower.
+ */
+YARVE_API void yarve_set_irq(yarve_machine *machine, uint32_t irq, int level);
+
+/**
+ * Send the UART output to a callback. Without one the output is discarded.
+ * @param machine The machine.
+ * @param output The callback or NULL.
+ * @param context Passed to the callback.
+ */
+YARVE_API void yarve_set_console_output(yarve_machine *machine, yarve_console_output output, void *context);
+
+/**
+ * Queue UART input for the guest.
+ * @param machine The machine.
+ * @param data The bytes.
+ * @param len The number of bytes.
+ * @return The number of bytes queued, less than len if the receive buffer is full.
+ */
+YARVE_API size_t yarve_console_input(yarve_machine *machine, const void *data, size_t len);
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif
@@ -0,0 +1,496 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <poll.h>
+#include <signal.h>
+#include <time.h>
+#include <unistd.h>
+#include <sys/wait.h>
+#include <iostream>
+#include <fstream>
+#include <sstream>
+#include <string>
+#include <vector>
+
+#define DEFAULT_YARVE "build/yarve"
+#define DEFAULT_TIMEOUT 300
+#define STAMP_FD 3
+
+enum CommandType { CMD_EXPECT, CMD_SEND, CMD_MARK, CMD_TIMEOUT, CMD_WAIT };
+
+typedef struct {
+    CommandType type;
+    std::string arg;
+    int line;
+} Command;
+
+typedef struct {
+    std::string name;
+    double wall_seconds;
+    uint64_t instructions;
+    size_t console_offset;
+} Milestone;
+
+/**
+ * A running yarve instance with its console on pipes. Scripts match against
+ * the --console-stamps stream, which carries every byte the guest wrote to the
+ * UART with its instruction count; stdout also holds the emulator's own
+ * messages and is only echoed.
+ */
+typedef struct {
+    pid_t pid;
+    int in_fd;
+    int out_fd;
+    int stamp_fd;
+    bool exited;
+    int exit_status;
+    bool echo;
+    timespec start;
+    std::string console;
+    std::vector<uint64_t> counts;
+    uint8_t stamp_rest[8];
+    size_t stamp_rest_len;
+    double first_output;
+} Guest;
+
+void printHelp(std::string exec_name) {
+    std::cout << "Usage: " << exec_name << " [OPTION]... -s SCRIPT -- [YARVE OPTION]..." << std::endl;
+    std::cout << "Boots yarve headless, drives its console with a script and reports timings as JSON." << std::endl;
+    std::cout << std::endl;
+    std::cout << "  -h, --help        display this help and exit" << std::endl;
+    std::cout << "  -s, --script      the console script to run" << std::endl;
+    std::cout << "  -o, --output      write the JSON report to FILE instead of stdout" << std::endl;
+    std::cout << "  -y, --yarve       path of the emulator, default " DEFAULT_YARVE << std::endl;
+    std::cout << "  -l, --label       label stored in the report, default the git commit" << std::endl;
+    std::cout << "  -e, --echo        copy the guest console to stderr" << std::endl;
+    std::cout << std::endl;
+    std::cout << "Script commands, one per line, '#' starts a comment:" << std::endl;
+    std::cout << "  expect \"TEXT\"     wait until TEXT appears on the console after the previous match" << std::endl;
+    std::cout << "  send \"TEXT\"       type TEXT, \\n \\r \\t \\\\ and \\\" are escapes" << std::endl;
+    std::cout << "  mark NAME         record a milestone at the end of the previous match" << std::endl;
+    std::cout << "  timeout SECONDS   limit for the following expect and wait commands" << std::endl;
+    std::cout << "  wait              wait for the emulator to exit, e.g. after poweroff" << std::endl;
+    std::cout << std::endl << std::flush;
+}
+
+/**
+ * Get the seconds elapsed since a point in time.
+ * @param start The start time.
+ * @return The elapsed seconds.
+ */
+double elapsedSince(const timespec &start) {
+    timespec now;
+    clock_gettime(CLOCK_MONOTONIC, &now);
+    return (now.tv_sec - start.tv_sec) + (now.tv_nsec - start.tv_nsec) / 1e9;
+}
+
+/**
+ * Parse a quoted script argument and resolve its escapes.
+ * @param arg The argument including the quotes.
+ * @param text Set to the unescaped text.
+ * @return false if the argument is not a valid quoted string.
+ */
+bool parseQuoted(const std::string &arg, std::string &text) {
+    if (arg.size() < 2 || arg[0] != '"' || arg[arg.size() - 1] != '"') return false;
+    text = "";
+    for (size_t i = 1; i < arg.size() - 1; i++) {
+        char c = arg[i];
+        if (c == '\\') {
+            if (++i >= arg.size() - 1) return false;
+            switch (arg[i]) {
+                case 'n': c = '\n'; break;
+                case 'r': c = '\r'; break;
+                case 't': c = '\t'; break;
+                case '\\': c = '\\'; break;
+                case '"': c = '"'; break;
+                default: return false;
+            }
+        }
+        text += c;
+    }
+    return true;
+}
+
+/**
+ * Load a console script.
+ * @param filename The script file.
+ * @param commands Filled with the parsed commands.
+ * @return false if the file could not be read or has a syntax error.
+ */
+bool loadScript(const std::string &filename, std::vector<Command> &commands) {
+    std::ifstream file(filename);
+    if (!file) {
+        fprintf(stderr, "Error: Could not open script %s\n", filename.c_str());
+        return false;
+    }
+
+    std::string line;
+    for (int number = 1; std::getline(file, line); number++) {
+        size_t begin = line.find_first_not_of(" \t");
+        if (begin == std::string::npos || line[begin] == '#') continue;
+        size_t end = line.find_last_not_of(" \t\r");
+        line = line.substr(begin, end - begin + 1);
+
+        size_t space = line.find_first_of(" \t");
+        std::string word = line.substr(0, space);
+        std::string arg = (space == std::string::npos) ? "" : line.substr(line.find_first_not_of(" \t", space));
+
+        Command command;
+        command.line = number;
+        bool ok = true;
+        if (word == "expect" || word == "send") {
+            command.type = (word == "expect") ? CMD_EXPECT : CMD_SEND;
+            ok = parseQuoted(arg, command.arg) && command.arg != "";
+        } else if (word == "mark") {
+            command.type = CMD_MARK;
+            command.arg = arg;
+            ok = arg != "" && arg.find_first_of(" \t\"\\") == std::string::npos;
+        } else if (word == "timeout") {
+            command.type = CMD_TIMEOUT;
+            command.arg = arg;
+            ok = arg != "" && atof(arg.c_str()) > 0;
+        } else if (word == "wait") {
+            command.type = CMD_WAIT;
+            ok = arg == "";
+        } else {
+            ok = false;
+        }
+        if (!ok) {
+            fprintf(stderr, "Error: %s:%d: invalid command '%s'\n", filename.c_str(), number, line.c_str());
+            return false;
+        }
+        commands.push_back(command);
+    }
+    return true;
+}
+
+/**
+ * Start yarve with its console on pipes and its stamps on STAMP_FD.
+ * @param guest The guest to start.
+ * @param yarve The emulator binary.
+ * @param args The emulator arguments.
+ * @return false if the emulator could not be started.
+ */
+bool startGuest(Guest &guest, const std::string &yarve, const std::vector<std::string> &args) {
+    int in[2], out[2], stamp[2];
+    if (pipe2(in, O_CLOEXEC) || pipe2(out, O_CLOEXEC) || pipe2(stamp, O_CLOEXEC)) return false;
+
+    std::vector<std::string> argv_storage;
+    argv_storage.push_back(yarve);
+    argv_storage.insert(argv_storage.end(), args.begin(), args.end());
+    argv_storage.push_back("--console-stamps");
+    argv_storage.push_back("/dev/fd/" + std::to_string(STAMP_FD));
+    std::vector<char*> child_argv;
+    for (std::string &arg : argv_storage) child_argv.push_back(&arg[0]);
+    child_argv.push_back(NULL);
+
+    clock_gettime(CLOCK_MONOTONIC, &guest.start);
+    guest.pid = fork();
+    if (guest.pid < 0) return false;
+    if (guest.pid == 0) {
+        // Move the pipes above the target descriptors first, they may overlap them
+        int in_fd = fcntl(in[0], F_DUPFD_CLOEXEC, STAMP_FD + 1);
+        int out_fd = fcntl(out[1], F_DUPFD_CLOEXEC, STAMP_FD + 1);
+        int stamp_fd = fcntl(stamp[1], F_DUPFD_CLOEXEC, STAMP_FD + 1);
+        dup2(in_fd, 0);
+        dup2(out_fd, 1);
+        dup2(stamp_fd, STAMP_FD);
+        execv(yarve.c_str(), child_argv.data());
+        fprintf(stderr, "Error: Could not execute %s: %s\n", yarve.c_str(), strerror(errno));
+        _exit(127);
+    }
+
+    close(in[0]);
+    close(out[1]);
+    close(stamp[1]);
+    guest.in_fd = in[1];
+    guest.out_fd = out[0];
+    guest.stamp_fd = stamp[0];
+    guest.exited = false;
+    guest.exit_status = 0;
+    guest.stamp_rest_len = 0;
+    guest.first_output = -1;
+    return true;
+}
+
+/**
+ * Read the pending console bytes and their instruction counts.
+ * @param guest The guest.
+ * @return false at the end of the stream.
+ */
+bool readStamps(Guest &guest) {
+    uint8_t buffer[4096];
+    memcpy(buffer, guest.stamp_rest, guest.stamp_rest_len);
+    ssize_t n = read(guest.stamp_fd, buffer + guest.stamp_rest_len, sizeof(buffer) - guest.stamp_rest_len);
+    if (n <= 0) return n < 0 && errno == EINTR;
+    size_t len = guest.stamp_rest_len + n;
+    size_t count = len / 8;
+    for (size_t i = 0; i < count; i++) {
+        uint64_t stamp;
+        memcpy(&stamp, buffer + i * 8, 8);
+        guest.console += (char)(stamp & 0xff);
+        guest.counts.push_back(stamp >> 8);
+    }
+    if (guest.first_output < 0 && count) guest.first_output = elapsedSince(guest.start);
+    guest.stamp_rest_len = len - count * 8;
+    memcpy(guest.stamp_rest, buffer + count * 8, guest.stamp_rest_len);
+    return true;
+}
+
+/**
+ * Drain the emulator's stdout.
+ * @param guest The guest.
+ * @return false at the end of the stream.
+ */
+bool readOutput(Guest &guest) {
+    char buffer[4096];
+    ssize_t n = read(guest.out_fd, buffer, sizeof(buffer));
+    if (n <= 0) return n < 0 && errno == EINTR;
+    if (guest.echo) fwrite(buffer, 1, n, stderr);
+    return true;
+}
+
+/**
+ * Wait for output from the guest.
+ * @param guest The guest.
+ * @param deadline The deadline in seconds since the start.
+ * @return false if the deadline passed or the emulator exited.
+ */
+bool pump(Guest &guest, double deadline) {
+    if (guest.exited) return false;
+    pollfd fds[2];
+    int nfds = 0;
+    if (guest.out_fd >= 0) fds[nfds++] = {guest.out_fd, POLLIN, 0};
+    if (guest.stamp_fd >= 0) fds[nfds++] = {guest.stamp_fd, POLLIN, 0};
+    if (nfds == 0) {
+        int status;
+        if (waitpid(guest.pid, &status, 0) == guest.pid) {
+            guest.exited = true;
+            guest.exit_status = WIFEXITED(status) ? WEXITSTATUS(status) : 128 + WTERMSIG(status);
+        }
+        return false;
+    }
+
+    double remaining = deadline - elapsedSince(guest.start);
+    if (remaining <= 0) return false;
+    if (poll(fds, nfds, (int)(remaining * 1000) + 1) < 0 && errno != EINTR) return false;
+
+    for (int i = 0; i < nfds; i++) {
+        if (!(fds[i].revents & (POLLIN | POLLHUP | POLLERR))) continue;
+        if (fds[i].fd == guest.out_fd && !readOutput(guest)) {
+            close(guest.out_fd);
+            guest.out_fd = -1;
+        } else if (fds[i].fd == guest.stamp_fd && !readStamps(guest)) {
+            close(guest.stamp_fd);
+            guest.stamp_fd = -1;
+        }
+    }
+    return true;
+}
+
+/**
+ * Stop the emulator if it is still running.
+ * @param guest The guest.
+ */
+void stopGuest(Guest &guest) {
+    close(guest.in_fd);
+    if (!guest.exited) {
+        kill(guest.pid, SIGKILL);
+        int status;
+        waitpid(guest.pid, &status, 0);
+    }
+}
+
+/**
+ * Get the current git commit to label the report with.
+ * @return The abbreviated commit hash, or "unknown".
+ */
+std::string gitLabel() {
+    FILE *git = popen("git rev-parse --short HEAD 2>/dev/null", "r");
+    if (!git) return "unknown";
+    char buffer[64] = {0};
+    if (!fgets(buffer, sizeof(buffer), git)) buffer[0] = 0;
+    pclose(git);
+    std::string label = buffer;
+    while (!label.empty() && (label.back() == '\n' || label.back() == '\r')) label.pop_back();
+    return label.empty() ? "unknown" : label;
+}
+
+/**
+ * Escape a string for a JSON document.
+ * @param text The string.
+ * @return The quoted JSON string.
+ */
+std::string jsonString(const std::string &text) {
+    std::string result = "\"";
+    for (char c : text) {
+        if (c == '"' || c == '\\') {
+            result += '\\';
+            result += c;
+        } else if ((unsigned char)c < 0x20) {
+            char escape[8];
+            snprintf(escape, sizeof(escape), "\\u%04x", c);
+            result += escape;
+        } else {
+            result += c;
+        }
+    }
+    return result + "\"";
+}
+
+/**
+ * Write the JSON report.
+ * @param out The output stream.
+ * @param label The report label.
+ * @param script The script file.
+ * @param status "ok", "timeout" or "exited".
+ * @param failed_line The script line that failed, 0 if none.
+ * @param guest The guest.
+ * @param wall_seconds The total run time.
+ * @param milestones The recorded milestones.
+ */
+void writeReport(std::ostream &out, const std::string &label, const std::string &script, const std::string &status, int failed_line,
+                 Guest &guest, double wall_seconds, const std::vector<Milestone> &milestones) {
+    char buffer[256];
+    time_t now = time(NULL);
+    strftime(buffer, sizeof(buffer), "%Y-%m-%dT%H:%M:%SZ", gmtime(&now));
+
+    out << "{" << std::endl;
+    out << "  \"label\": " << jsonString(label) << "," << std::endl;
+    out << "  \"date\": \"" << buffer << "\"," << std::endl;
+    out << "  \"script\": " << jsonString(script) << "," << std::endl;
+    out << "  \"status\": \"" << status << "\"," << std::endl;
+    if (failed_line) out << "  \"failed_line\": " << failed_line << "," << std::endl;
+    if (guest.exited) out << "  \"exit_status\": " << guest.exit_status << "," << std::endl;
+    snprintf(buffer, sizeof(buffer), "%.6f", wall_seconds);
+    out << "  \"wall_seconds\": " << buffer << "," << std::endl;
+    out << "  \"instructions\": " << (guest.counts.empty() ? 0 : guest.counts.back()) << "," << std::endl;
+    out << "  \"console_bytes\": " << guest.console.size() << "," << std::endl;
+    out << "  \"milestones\": [";
+    for (size_t i = 0; i < milestones.size(); i++) {
+        const Milestone &m = milestones[i];
+        double mips = m.wall_seconds > 0 ? m.instructions / m.wall_seconds / 1e6 : 0;
+        snprintf(buffer, sizeof(buffer), "\"wall_seconds\": %.6f, \"instructions\": %llu, \"console_offset\": %zu, \"mips\": %.2f",
+                 m.wall_seconds, (unsigned long long)m.instructions, m.console_offset, mips);
+        out << (i ? "," : "") << std::endl << "    {\"name\": " << jsonString(m.name) << ", " << buffer << "}";
+    }
+    out << std::endl << "  ]" << std::endl << "}" << std::endl;
+}
+
+int main(int argc, char* argv[]) {
+    std::string script_file;
+    std::string output_file;
+    std::string yarve = DEFAULT_YARVE;
+    std::string label;
+    std::vector<std::string> yarve_args;
+    Guest guest;
+    guest.echo = false;
+
+    for (int i = 1; i < argc; i++) {
+        std::string arg = argv[i];
+        if ((arg == "-h") || (arg == "--help")) {
+            printHelp(argv[0]);
+            return 0;
+        } else if (((arg == "-s") || (arg == "--script")) && i + 1 < argc) {
+            script_file = argv[++i];
+        } else if (((arg == "-o") || (arg == "--output")) && i + 1 < argc) {
+            output_file = argv[++i];
+        } else if (((arg == "-y") || (arg == "--yarve")) && i + 1 < argc) {
+            yarve = argv[++i];
+        } else if (((arg == "-l") || (arg == "--label")) && i + 1 < argc) {
+            label = argv[++i];
+        } else if ((arg == "-e") || (arg == "--echo")) {
+            guest.echo = true;
+        } else if (arg == "--") {
+            yarve_args.assign(argv + i + 1, argv + argc);
+            break;
+        } else {
+            std::cout << "yarve-bench: unrecognized option '" << arg << "'" << std::endl;
+            std::cout << "Try 'yarve-bench --help' for more information." << std::endl << std::flush;
+            return 1;
+        }
+    }
+
+    if (script_file == "" || yarve_args.empty()) {
+        printHelp(argv[0]);
+        return 1;
+    }
+    if (label == "") label = gitLabel();
+
+    std::vector<Command> commands;
+    if (!loadScript(script_file, commands)) return 1;
+
+    signal(SIGPIPE, SIG_IGN);
+    if (!startGuest(guest, yarve, yarve_args)) {
+        fprintf(stderr, "Error: Could not start %s\n", yarve.c_str());
+        return 1;
+    }
+
+    std::vector<Milestone> milestones;
+    std::string status = "ok";
+    int failed_line = 0;
+    double timeout = DEFAULT_TIMEOUT;
+    size_t cursor = 0;
+    size_t match_end = 0;
+    double match_time = 0;
+
+    for (const Command &command : commands) {
+        if (command.type == CMD_EXPECT) {
+            double deadline = elapsedSince(guest.start) + timeout;
+            size_t found;
+            while ((found = guest.console.find(command.arg, cursor)) == std::string::npos) {
+                if (!pump(guest, deadline)) {
+                    if (guest.exited || guest.out_fd < 0) status = "exited";
+                    else if (elapsedSince(guest.start) >= deadline) status = "timeout";
+                    else continue;
+                    break;
+                }
+            }
+            if (found == std::string::npos) {
+                failed_line = command.line;
+                break;
+            }
+            cursor = match_end = found + command.arg.size();
+            match_time = elapsedSince(guest.start);
+        } else if (command.type == CMD_SEND) {
+            if (write(guest.in_fd, command.arg.data(), command.arg.size()) != (ssize_t)command.arg.size()) {
+                status = "exited";
+                failed_line = command.line;
+                break;
+            }
+        } else if (command.type == CMD_MARK) {
+            size_t offset = match_end ? match_end - 1 : 0;
+            milestones.push_back({command.arg, match_time, guest.counts.empty() ? 0 : guest.counts[offset], match_end});
+        } else if (command.type == CMD_TIMEOUT) {
+            timeout = atof(command.arg.c_str());
+        } else if (command.type == CMD_WAIT) {
+            double deadline = elapsedSince(guest.start) + timeout;
+            while (!guest.exited && elapsedSince(guest.start) < deadline) pump(guest, deadline);
+            if (!guest.exited) {
+                status = "timeout";
+                failed_line = command.line;
+                break;
+            }
+        }
+    }
+    // The first console byte is a milestone of every run
+    if (guest.first_output >= 0) milestones.insert(milestones.begin(), {"first_output", guest.first_output, guest.counts[0], 0});
+
+    double wall_seconds = elapsedSince(guest.start);
+    stopGuest(guest);
+
+    if (output_file != "") {
+        std::ofstream out(output_file);
+        if (!out) {
+            fprintf(stderr, "Error: Could not open file %s\n", output_file.c_str());
+            return 1;
+        }
+        writeReport(out, label, script_file, status, failed_line, guest, wall_seconds, milestones);
+    } else {
+        writeReport(std::cout, label, script_file, status, failed_line, guest, wall_seconds, milestones);
+    }
+    if (failed_line) fprintf(stderr, "yarve-bench: %s at %s:%d\n", status.c_str(), script_file.c_str(), failed_line);
+    return failed_line ? 1 : 0;
+}
@@ -0,0 +1,215 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/stat.h>
+#include <iostream>
+#include <string>
+#include <vector>
+#include "checkpointformat.h"
+
+void printHelp(std::string exec_name) {
+    std::cout << "Usage: " << exec_name << " [OPTION]... [DIR]" << std::endl;
+    std::cout << "Lists or collapses the checkpoint chain written by yarve --checkpoint-dir." << std::endl;
+    std::cout << std::endl;
+    std::cout << "  -h, --help        display this help and exit" << std::endl;
+    std::cout << "  -o, --output      collapse the newest checkpoint into the full checkpoint FILE" << std::endl;
+    std::cout << std::endl << std::flush;
+}
+
+/**
+ * The machine state accumulated while applying a chain. The memories are
+ * padded to whole pages.
+ */
+typedef struct {
+    CheckpointHeader header;
+    std::vector<uint8_t> cpu_state;
+    std::vector<uint8_t> plic_state;
+    std::vector<uint8_t> ram;
+    std::vector<uint8_t> framebuffer;
+} Machine;
+
+/**
+ * Get the size of a memory padded to whole pages.
+ * @param size The size of the memory.
+ * @param page_size The page size of the checkpoint.
+ * @return The padded size.
+ */
+uint64_t pagedSize(uint64_t size, uint32_t page_size) {
+    return (size + page_size - 1) / page_size * page_size;
+}
+
+/**
+ * Read page records into a memory.
+ * @param file The checkpoint file, positioned at the first record.
+ * @param memory The memory, padded to whole pages.
+ * @param num_pages The number of records.
+ * @param page_size The page size of the checkpoint.
+ * @return false if the file is truncated or a page is outside the memory.
+ */
+bool readPages(FILE *file, std::vector<uint8_t> &memory, uint32_t num_pages, uint32_t page_size) {
+    for (uint32_t i = 0; i < num_pages; i++) {
+        uint32_t page;
+        if (fread(&page, sizeof(page), 1, file) != 1) return false;
+        uint64_t offset = (uint64_t)page * page_size;
+        if (offset + page_size > memory.size() || fread(&memory[offset], page_size, 1, file) != 1) return false;
+    }
+    return true;
+}
+
+/**
+ * Apply a checkpoint file to the machine state.
+ * @param path The checkpoint file.
+ * @param machine The machine state.
+ * @param first true for the full checkpoint that starts the chain.
+ * @return false if the file is invalid or does not match the chain.
+ */
+bool applyFile(const std::string &path, Machine &machine, bool first) {
+    FILE *file = fopen(path.c_str(), "rb");
+    CheckpointHeader header;
+    if (file == NULL || !checkpointReadHeader(file, &header)) {
+        fprintf(stderr, "Error: %s is not a yarve checkpoint\n", path.c_str());
+        if (file) fclose(file);
+        return false;
+    }
+    if (first) {
+        machine.header = header;
+        machine.cpu_state.resize(header.cpu_state_size);
+        machine.plic_state.resize(header.plic_state_size);
+        machine.ram.assign(pagedSize(header.ram_size, header.page_size), 0);
+        machine.framebuffer.assign(pagedSize(header.fb_size, header.page_size), 0);
+    } else if (header.ram_base != machine.header.ram_base || header.ram_size != machine.header.ram_size ||
+               header.page_size != machine.header.page_size || header.cpu_state_size != machine.header.cpu_state_size ||
+               header.plic_state_size != machine.header.plic_state_size || header.fb_size != machine.header.fb_size) {
+        fprintf(stderr, "Error: %s does not belong to the chain\n", path.c_str());
+        fclose(file);
+        return false;
+    }
+    machine.header.sequence = header.sequence;
+
+    bool ok = fread(machine.cpu_state.data(), 1, header.cpu_state_size, file) == header.cpu_state_size;
+    ok = ok && fread(machine.plic_state.data(), 1, header.plic_state_size, file) == header.plic_state_size;
+    ok = ok && readPages(file, machine.ram, header.num_pages, header.page_size);
+    ok = ok && readPages(file, machine.framebuffer, header.num_fb_pages, header.page_size);
+    fclose(file);
+    if (!ok) fprintf(stderr, "Error: Checkpoint %s is truncated or corrupt\n", path.c_str());
+    return ok;
+}
+
+/**
+ * Find the pages of a memory that are not all zero.
+ * @param memory The memory, padded to whole pages.
+ * @param page_size The page size of the checkpoint.
+ * @return The page indices.
+ */
+std::vector<uint32_t> nonZeroPages(const std::vector<uint8_t> &memory, uint32_t page_size) {
+    std::vector<uint32_t> pages;
+    for (uint64_t offset = 0; offset < memory.size(); offset += page_size) {
+        for (uint64_t i = 0; i < page_size; i++) {
+            if (memory[offset + i]) {
+                pages.push_back(offset / page_size);
+                break;
+            }
+        }
+    }
+    return pages;
+}
+
+/**
+ * Write page records of a memory.
+ * @param file The output file.
+ * @param memory The memory, padded to whole pages.
+ * @param pages The pages to write.
+ * @param page_size The page size of the checkpoint.
+ * @return false if a write failed.
+ */
+bool writePages(FILE *file, const std::vector<uint8_t> &memory, const std::vector<uint32_t> &pages, uint32_t page_size) {
+    for (size_t i = 0; i < pages.size(); i++) {
+        if (fwrite(&pages[i], sizeof(uint32_t), 1, file) != 1) return false;
+        if (fwrite(&memory[(uint64_t)pages[i] * page_size], page_size, 1, file) != 1) return false;
+    }
+    return true;
+}
+
+/**
+ * Write the machine state as a single full checkpoint, leaving out zero pages.
+ * @param path The output file.
+ * @param machine The machine state.
+ * @return false if the file could not be written.
+ */
+bool writeFull(const std::string &path, Machine &machine) {
+    CheckpointHeader header = machine.header;
+    std::vector<uint32_t> pages = nonZeroPages(machine.ram, header.page_size);
+    std::vector<uint32_t> fb_pages = nonZeroPages(machine.framebuffer, header.page_size);
+    header.flags |= CHECKPOINT_FULL;
+    header.num_pages = pages.size();
+    header.num_fb_pages = fb_pages.size();
+
+    FILE *file = fopen(path.c_str(), "wb");
+    if (file == NULL) {
+        fprintf(stderr, "Error: Could not open file %s\n", path.c_str());
+        return false;
+    }
+    bool ok = fwrite(&header, sizeof(header), 1, file) == 1;
+    ok = ok && fwrite(machine.cpu_state.data(), 1, machine.cpu_state.size(), file) == machine.cpu_state.size();
+    ok = ok && fwrite(machine.plic_state.data(), 1, machine.plic_state.size(), file) == machine.plic_state.size();
+    ok = ok && writePages(file, machine.ram, pages, header.page_size);
+    ok = ok && writePages(file, machine.framebuffer, fb_pages, header.page_size);
+    ok = (fclose(file) == 0) && ok;
+    if (!ok) fprintf(stderr, "Error: Could not write %s\n", path.c_str());
+    return ok;
+}
+
+int main(int argc, char* argv[]) {
+    std::string dir;
+    std::string output;
+
+    for (int i = 1; i < argc; i++) {
+        std::string arg = argv[i];
+        if ((arg == "-h") || (arg == "--help")) {
+            printHelp(argv[0]);
+            return 0;
+        } else if (((arg == "-o") || (arg == "--output")) && i + 1 < argc) {
+            output = argv[++i];
+        } else if (arg[0] != '-' && dir == "") {
+            dir = arg;
+        } else {
+            std::cout << "yarve-ckpt: unrecognized option '" << arg << "'" << std::endl;
+            std::cout << "Try 'yarve-ckpt --help' for more information." << std::endl << std::flush;
+            return 1;
+        }
+    }
+
+    if (dir == "") {
+        printHelp(argv[0]);
+        return 1;
+    }
+
+    std::vector<std::string> chain = checkpointChain(dir);
+    if (chain.empty()) {
+        fprintf(stderr, "Error: No full checkpoint in %s\n", dir.c_str());
+        return 1;
+    }
+
+    if (output == "") {
+        for (auto& path : chain) {
+            FILE *file = fopen(path.c_str(), "rb");
+            CheckpointHeader header;
+            if (file == NULL || !checkpointReadHeader(file, &header)) {
+                fprintf(stderr, "Error: %s is not a yarve checkpoint\n", path.c_str());
+                return 1;
+            }
+            fseek(file, 0, SEEK_END);
+            long size = ftell(file);
+            fclose(file);
+            printf("%8llu  %-11s  %8u pages  %10ld bytes  %s\n", (unsigned long long)header.sequence,
+                   (header.flags & CHECKPOINT_FULL) ? "full" : "incremental", header.num_pages + header.num_fb_pages, size, path.c_str());
+        }
+        return 0;
+    }
+
+    Machine machine;
+    for (size_t i = 0; i < chain.size(); i++) {
+        if (!applyFile(chain[i], machine, i == 0)) return 1;
+    }
+    return writeFull(output, machine) ? 0 : 1;
+}
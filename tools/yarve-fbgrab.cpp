@@ -0,0 +1,104 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <time.h>
+#include <sys/mman.h>
+#include <iostream>
+#include <string>
+#include <vector>
+#include "framebufferformat.h"
+
+void printHelp(std::string exec_name) {
+    std::cout << "Usage: " << exec_name << " [OPTION]... NAME OUTPUT" << std::endl;
+    std::cout << "Saves the framebuffer exported by yarve --fb-shm NAME as a PPM image." << std::endl;
+    std::cout << std::endl;
+    std::cout << "  -h, --help        display this help and exit" << std::endl;
+    std::cout << "  -w, --wait        wait until the guest changes the framebuffer, at most SECONDS" << std::endl;
+    std::cout << std::endl << std::flush;
+}
+
+/**
+ * Get a monotonic timestamp.
+ * @return The time in seconds.
+ */
+double now() {
+    timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+int main(int argc, char* argv[]) {
+    std::string name;
+    std::string output;
+    double wait = -1;
+
+    for (int i = 1; i < argc; i++) {
+        std::string arg = argv[i];
+        if ((arg == "-h") || (arg == "--help")) {
+            printHelp(argv[0]);
+            return 0;
+        } else if (((arg == "-w") || (arg == "--wait")) && i + 1 < argc) {
+            wait = std::stod(argv[++i]);
+        } else if (arg[0] != '-' && name == "") {
+            name = arg;
+        } else if (arg[0] != '-' && output == "") {
+            output = arg;
+        } else {
+            std::cout << "yarve-fbgrab: unrecognized option '" << arg << "'" << std::endl;
+            std::cout << "Try 'yarve-fbgrab --help' for more information." << std::endl << std::flush;
+            return 1;
+        }
+    }
+
+    if (name == "" || output == "") {
+        printHelp(argv[0]);
+        return 1;
+    }
+    if (name[0] != '/') name = "/" + name;
+
+    int fd = shm_open(name.c_str(), O_RDONLY, 0);
+    if (fd < 0) {
+        fprintf(stderr, "Error: Could not open shared memory segment %s\n", name.c_str());
+        return 1;
+    }
+    off_t size = lseek(fd, 0, SEEK_END);
+    const uint8_t *map = (size >= (off_t)sizeof(FramebufferShmHeader)) ? (const uint8_t*)mmap(NULL, size, PROT_READ, MAP_SHARED, fd, 0) : (const uint8_t*)MAP_FAILED;
+    close(fd);
+    const FramebufferShmHeader *header = (const FramebufferShmHeader*)map;
+    if (map == MAP_FAILED || memcmp(header->magic, FB_SHM_MAGIC, FB_SHM_MAGIC_SIZE) != 0 ||
+        header->format != FB_FORMAT_X8R8G8B8 || header->data_offset + (uint64_t)header->stride * header->height > (uint64_t)size) {
+        fprintf(stderr, "Error: %s is not a yarve framebuffer\n", name.c_str());
+        return 1;
+    }
+    __atomic_thread_fence(__ATOMIC_ACQUIRE);
+
+    uint64_t start_sequence = __atomic_load_n(&header->sequence, __ATOMIC_ACQUIRE) & ~1ULL;
+    double deadline = now() + wait;
+    std::vector<uint8_t> frame((size_t)header->stride * header->height);
+    while (true) {
+        uint64_t sequence = __atomic_load_n(&header->sequence, __ATOMIC_ACQUIRE);
+        bool waiting = wait >= 0 && sequence <= start_sequence && now() < deadline;
+        if ((sequence & 1) || waiting) {
+            usleep(1000);
+            continue;
+        }
+        memcpy(frame.data(), map + header->data_offset, frame.size());
+        __atomic_thread_fence(__ATOMIC_ACQUIRE);
+        if (__atomic_load_n(&header->sequence, __ATOMIC_RELAXED) == sequence) break;  // Not updated while copying
+    }
+    if (wait >= 0 && __atomic_load_n(&header->sequence, __ATOMIC_ACQUIRE) <= start_sequence) {
+        fprintf(stderr, "Error: The framebuffer did not change within %g seconds\n", wait);
+        return 1;
+    }
+
+    FILE *file = fopen(output.c_str(), "wb");
+    bool ok = file && fbWritePpm(file, frame.data(), header->width, header->height, header->stride);
+    if (file) ok = (fclose(file) == 0) && ok;
+    if (!ok) {
+        fprintf(stderr, "Error: Could not write %s\n", output.c_str());
+        return 1;
+    }
+    return 0;
+}
@@ -0,0 +1,248 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <iostream>
+#include <string>
+#include <vector>
+#include <unordered_map>
+#include <algorithm>
+#include "traceformat.h"
+
+typedef struct {
+    uint32_t lo;
+    uint32_t hi;
+    bool enabled;
+} Range;
+
+typedef struct {
+    uint64_t instructions;
+    uint64_t jumps;
+    uint64_t reg_writes;
+    uint64_t loads;
+    uint64_t stores;
+    uint64_t amos;
+    uint64_t traps;
+    std::unordered_map<uint32_t, uint64_t> pc_hits;
+    std::unordered_map<uint32_t, uint64_t> trap_causes;
+} Summary;
+
+void printHelp(std::string exec_name) {
+    std::cout << "Usage: " << exec_name << " [OPTION]... [TRACE]" << std::endl;
+    std::cout << "Decodes a binary trace written by yarve --trace." << std::endl;
+    std::cout << "All addresses have to be specified in hexadecimal, starting with '0x'." << std::endl;
+    std::cout << std::endl;
+    std::cout << "  -h, --help        display this help and exit" << std::endl;
+    std::cout << "  -s, --summary     print statistics instead of the entries" << std::endl;
+    std::cout << "  -p, --pc          only show instructions in LO-HI" << std::endl;
+    std::cout << "  -a, --addr        only show instructions accessing memory in LO-HI" << std::endl;
+    std::cout << "  -n, --limit       stop after N shown entries" << std::endl;
+    std::cout << "  -S, --skip        skip the first N instructions" << std::endl;
+    std::cout << std::endl << std::flush;
+}
+
+/**
+ * Parse an address range of the form LO-HI or a single address.
+ * @param arg The argument to parse.
+ * @return The parsed range.
+ */
+Range parseRange(std::string arg) {
+    Range range;
+    size_t dash = arg.find('-');
+    range.lo = std::stoul(arg.substr(0, dash), nullptr, 16);
+    range.hi = (dash == std::string::npos) ? range.lo : std::stoul(arg.substr(dash + 1), nullptr, 16);
+    range.enabled = true;
+    return range;
+}
+
+/**
+ * Print the top entries of a histogram.
+ * @param title The title of the table.
+ * @param histogram The histogram to print.
+ * @param count The number of entries to print.
+ */
+void printTop(const char *title, std::unordered_map<uint32_t, uint64_t>& histogram, size_t count) {
+    std::vector<std::pair<uint32_t, uint64_t>> entries(histogram.begin(), histogram.end());
+    std::sort(entries.begin(), entries.end(), [](const std::pair<uint32_t, uint64_t>& a, const std::pair<uint32_t, uint64_t>& b) {
+        return a.second > b.second;
+    });
+    printf("%s\n", title);
+    for (size_t i = 0; i < entries.size() && i < count; i++) {
+        printf("  %08x %12lu\n", entries[i].first, entries[i].second);
+    }
+}
+
+int main(int argc, char* argv[]) {
+    std::string filename;
+    bool summary_mode = false;
+    Range pc_range = {0, 0, false};
+    Range addr_range = {0, 0, false};
+    uint64_t limit = UINT64_MAX;
+    uint64_t skip = 0;
+
+    for (int i = 1; i < argc; i++) {
+        std::string arg = argv[i];
+        if ((arg == "-h") || (arg == "--help")) {
+            printHelp(argv[0]);
+            return 0;
+        } else if ((arg == "-s") || (arg == "--summary")) {
+            summary_mode = true;
+        } else if (((arg == "-p") || (arg == "--pc")) && i + 1 < argc) {
+            pc_range = parseRange(argv[++i]);
+        } else if (((arg == "-a") || (arg == "--addr")) && i + 1 < argc) {
+            addr_range = parseRange(argv[++i]);
+        } else if (((arg == "-n") || (arg == "--limit")) && i + 1 < argc) {
+            limit = std::stoull(argv[++i]);
+        } else if (((arg == "-S") || (arg == "--skip")) && i + 1 < argc) {
+            skip = std::stoull(argv[++i]);
+        } else if (arg[0] != '-' && filename == "") {
+            filename = arg;
+        } else {
+            std::cout << "yarve-trace: unrecognized option '" << arg << "'" << std::endl;
+            std::cout << "Try 'yarve-trace --help' for more information." << std::endl << std::flush;
+            return 1;
+        }
+    }
+
+    if (filename == "") {
+        printHelp(argv[0]);
+        return 1;
+    }
+
+    int fd = open(filename.c_str(), O_RDONLY);
+    struct stat st;
+    if (fd < 0 || fstat(fd, &st) < 0) {
+        fprintf(stderr, "Error: Could not open file %s\n", filename.c_str());
+        return 1;
+    }
+    if (st.st_size < TRACE_MAGIC_SIZE) {
+        fprintf(stderr, "Error: %s is not a yarve trace\n", filename.c_str());
+        return 1;
+    }
+    const uint8_t *data = (const uint8_t*)mmap(NULL, st.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+    if (data == MAP_FAILED || memcmp(data, TRACE_MAGIC, TRACE_MAGIC_SIZE) != 0) {
+        fprintf(stderr, "Error: %s is not a yarve trace\n", filename.c_str());
+        return 1;
+    }
+    madvise((void*)data, st.st_size, MADV_SEQUENTIAL);
+
+    const uint8_t *p = data + TRACE_MAGIC_SIZE;
+    const uint8_t *end = data + st.st_size;
+    uint32_t next_pc = 0;
+    uint32_t regs[32] = {0};
+    uint32_t last_addr = 0;
+    uint64_t index = 0;
+    uint64_t shown = 0;
+    Summary summary = {};
+
+    while (p < end && shown < limit) {
+        uint8_t flags = *p++;
+        bool ok = true;
+
+        if (flags & TRACE_TRAP) {
+            uint32_t cause, tval;
+            ok = traceGet(&p, end, 4, &cause) && traceGet(&p, end, 4, &tval);
+            if (!ok) {
+                fprintf(stderr, "Warning: trace is truncated\n");
+                break;
+            }
+            summary.traps++;
+            summary.trap_causes[cause]++;
+            if (!summary_mode && index >= skip && !addr_range.enabled && (!pc_range.enabled || (next_pc - 4 >= pc_range.lo && next_pc - 4 <= pc_range.hi))) {
+                printf("%12lu trap cause=%08x tval=%08x\n", index, cause, tval);
+                shown++;
+            }
+            continue;
+        }
+
+        uint8_t sizes = 0;
+        if (flags & (TRACE_PC_JUMP | TRACE_LOAD | TRACE_STORE)) {
+            ok = p < end;
+            if (ok) sizes = *p++;
+        }
+
+        uint32_t rd = 0;
+        if (ok && (flags & TRACE_REG)) {
+            uint32_t delta;
+            ok = p < end;
+            if (ok) {
+                rd = *p & 0x1f;
+                ok = traceGet(&p, end, 1 + (*p++ >> 5), &delta);
+            }
+            if (ok) regs[rd] += traceUnzigzag(delta);
+            summary.reg_writes++;
+        }
+
+        uint32_t pc = next_pc;
+        if (ok && (flags & TRACE_PC_JUMP)) {
+            uint32_t delta;
+            ok = traceGet(&p, end, 1 + (sizes & 3), &delta);
+            if (ok) pc += traceUnzigzag(delta);
+            summary.jumps++;
+        }
+        next_pc = pc + 4;
+
+        uint32_t addr = 0, load_value = 0, store_value = 0;
+        uint32_t width = 1 << ((flags & TRACE_WIDTH_MASK) >> TRACE_WIDTH_SHIFT);
+        if (ok && (flags & (TRACE_LOAD | TRACE_STORE))) {
+            uint32_t delta;
+            ok = traceGet(&p, end, 1 + ((sizes >> 2) & 3), &delta);
+            if (ok) last_addr += traceUnzigzag(delta);
+            addr = last_addr;
+            if (ok && (flags & TRACE_LOAD)) {
+                if (flags & TRACE_LOAD_IN_REG)
+                    load_value = regs[rd];
+                else
+                    ok = traceGet(&p, end, 1 + ((sizes >> 4) & 3), &load_value);
+            }
+            if (ok && (flags & TRACE_STORE)) ok = traceGet(&p, end, 1 + (sizes >> 6), &store_value);
+            if ((flags & TRACE_LOAD) && (flags & TRACE_STORE))
+                summary.amos++;
+            else if (flags & TRACE_LOAD)
+                summary.loads++;
+            else
+                summary.stores++;
+        }
+        if (!ok) {
+            fprintf(stderr, "Warning: trace is truncated\n");
+            break;
+        }
+
+        index++;
+        if (summary_mode) {
+            summary.pc_hits[pc]++;
+            continue;
+        }
+        if (index <= skip) continue;
+        if (pc_range.enabled && (pc < pc_range.lo || pc > pc_range.hi)) continue;
+        if (addr_range.enabled && (!(flags & (TRACE_LOAD | TRACE_STORE)) || addr < addr_range.lo || addr > addr_range.hi)) continue;
+
+        printf("%12lu %08x", index - 1, pc);
+        if (rd) printf(" x%-2u=%08x", rd, regs[rd]);
+        if (flags & TRACE_LOAD) printf(" ld%u [%08x]=%08x", width, addr, load_value);
+        if (flags & TRACE_STORE) printf(" st%u [%08x]=%08x", width, addr, store_value);
+        printf("\n");
+        shown++;
+    }
+
+    if (summary_mode) {
+        size_t bytes = st.st_size - TRACE_MAGIC_SIZE;
+        printf("instructions   %12lu\n", summary.instructions = index);
+        printf("pc jumps       %12lu\n", summary.jumps);
+        printf("reg writes     %12lu\n", summary.reg_writes);
+        printf("loads          %12lu\n", summary.loads);
+        printf("stores         %12lu\n", summary.stores);
+        printf("amos           %12lu\n", summary.amos);
+        printf("traps          %12lu\n", summary.traps);
+        printf("bytes/insn     %12.2f\n", index ? (double)bytes / index : 0.0);
+        printTop("hottest pcs", summary.pc_hits, 16);
+        printTop("trap causes", summary.trap_causes, 16);
+    }
+
+    munmap((void*)data, st.st_size);
+    close(fd);
+    return 0;
+}